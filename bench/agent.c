@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Round trip a search through a socket pair, server side in a thread, with
+ * former fixed size frames, a PATH_MAX name and a whole struct kp_unsafe
+ * back, and with attribute frames, then with the safe stored encrypted.
+ * Report bytes on the wire per search and round trip latency.
+ *
+ * usage: bench-agent [count]
+ */
+
+#include <sys/socket.h>
+
+#include <pthread.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kickpass.h"
+
+#include "kpagent.h"
+
+struct server {
+	struct kp_agent agent;
+	bool fixed;   /* answer with former fixed size frames */
+	size_t bytes; /* received */
+};
+
+static const char *name = "web/mail";
+
+static double now(void);
+static void pair(struct kp_agent *, struct server *);
+static void *serve(void *);
+static void run(const char *, bool, size_t);
+
+int
+main(int argc, char **argv)
+{
+	size_t count = 100000;
+	struct kp_agent agent;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+
+	if (argc > 1) {
+		count = strtoul(argv[1], NULL, 10);
+	}
+
+	if (sodium_init() < 0) {
+		return 1;
+	}
+
+	/* Safe served by attribute frames server */
+	memset(&agent, 0, sizeof(struct kp_agent));
+	agent.sock = -1;
+	strlcpy(unsafe.name, name, PATH_MAX);
+	strlcpy(unsafe.password, "correct horse battery", KP_PASSWORD_MAX_LEN);
+	strlcpy(unsafe.metadata, "url: https://mail.example", KP_METADATA_MAX_LEN);
+	if (kp_agent_store(&agent, &unsafe) != KP_SUCCESS) {
+		return 1;
+	}
+
+	printf("%-10s %8s %10s %10s %10s\n", "frames", "count", "sent/op",
+	       "recv/op", "rtt us");
+	run("fixed", true, count);
+	run("attribute", false, count);
+
+	/* Stored again, encrypted, decrypted on each search */
+	if (kp_agent_encrypt(&agent) != KP_SUCCESS
+	    || kp_agent_store(&agent, &unsafe) != KP_SUCCESS) {
+		return 1;
+	}
+	run("encrypted", false, count);
+
+	return 0;
+}
+
+static void
+run(const char *label, bool fixed, size_t count)
+{
+	struct kp_agent client;
+	struct server server;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+	char request[PATH_MAX] = "";
+	struct imsg imsg;
+	pthread_t thread;
+	size_t i, received = 0;
+	double start, elapsed;
+	ssize_t n;
+
+	pair(&client, &server);
+	server.fixed = fixed;
+	if (pthread_create(&thread, NULL, serve, &server) != 0) {
+		exit(1);
+	}
+
+	strlcpy(request, name, PATH_MAX);
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		if (fixed) {
+			imsg_compose(&client.ibuf, KP_MSG_SEARCH, 1, 0, -1,
+			             request, PATH_MAX);
+			imsg_flush(&client.ibuf);
+		} else {
+			kp_agent_send(&client, KP_MSG_SEARCH, request,
+			              strlen(request) + 1);
+		}
+
+		while ((n = imsg_get(&client.ibuf, &imsg)) == 0) {
+			if (imsg_read(&client.ibuf) <= 0) {
+				exit(1);
+			}
+		}
+		if (n < 0) {
+			exit(1);
+		}
+		received += imsg.hdr.len;
+
+		if (fixed) {
+			memcpy(&unsafe, imsg.data, sizeof(struct kp_unsafe));
+		} else if (kp_agent_msg_unsafe(&imsg, &unsafe) != KP_SUCCESS) {
+			exit(1);
+		}
+		imsg_free(&imsg);
+	}
+	elapsed = now() - start;
+
+	kp_agent_close(&client);
+	pthread_join(thread, NULL);
+
+	printf("%-10s %8zu %10zu %10zu %10.2f\n", label, count,
+	       server.bytes / count, received / count, elapsed / count * 1e6);
+}
+
+static void *
+serve(void *_server)
+{
+	struct server *server = _server;
+	struct kp_agent *agent = &server->agent;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+	struct imsg imsg;
+	char *string;
+	ssize_t n;
+
+	strlcpy(unsafe.name, name, PATH_MAX);
+	strlcpy(unsafe.password, "correct horse battery", KP_PASSWORD_MAX_LEN);
+	strlcpy(unsafe.metadata, "url: https://mail.example", KP_METADATA_MAX_LEN);
+
+	for (;;) {
+		while ((n = imsg_get(&agent->ibuf, &imsg)) == 0) {
+			if (imsg_read(&agent->ibuf) <= 0) {
+				kp_agent_close(agent);
+				return NULL;
+			}
+		}
+		if (n < 0) {
+			break;
+		}
+		server->bytes += imsg.hdr.len;
+
+		if (server->fixed) {
+			imsg_compose(&agent->ibuf, KP_MSG_SEARCH, 1, 0, -1,
+			             &unsafe, sizeof(struct kp_unsafe));
+			imsg_flush(&agent->ibuf);
+		} else if (kp_agent_msg_string(&imsg, &string, PATH_MAX)
+		           == KP_SUCCESS) {
+			kp_agent_search(agent, string);
+		}
+		imsg_free(&imsg);
+	}
+
+	kp_agent_close(agent);
+
+	return NULL;
+}
+
+static void
+pair(struct kp_agent *client, struct server *server)
+{
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		exit(1);
+	}
+
+	memset(client, 0, sizeof(struct kp_agent));
+	memset(server, 0, sizeof(struct server));
+	client->sock = fds[0];
+	server->agent.sock = fds[1];
+	imsg_init(&client->ibuf, client->sock);
+	imsg_init(&server->agent.ibuf, server->agent.sock);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Search safes through a socket pair, server side in a thread, one search
+ * at a time and in batches. Report per safe latency for batches of 1, 10,
+ * 100 and 1000 safes.
+ *
+ * usage: bench-batch [safes]
+ */
+
+#include <sys/socket.h>
+
+#include <pthread.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kickpass.h"
+
+#include "kpagent.h"
+
+#define NAMES 1000
+
+static char names[NAMES][32];
+
+static double now(void);
+static void pair(struct kp_agent *, struct kp_agent *);
+static void *serve(void *);
+static double run(bool, size_t, size_t);
+
+int
+main(int argc, char **argv)
+{
+	size_t count = 100000, i;
+	size_t batches[] = { 1, 10, 100, 1000 };
+	struct kp_agent agent;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+
+	if (argc > 1) {
+		count = strtoul(argv[1], NULL, 10);
+	}
+
+	if (sodium_init() < 0) {
+		return 1;
+	}
+
+	memset(&agent, 0, sizeof(struct kp_agent));
+	agent.sock = -1;
+	strlcpy(unsafe.password, "correct horse battery", KP_PASSWORD_MAX_LEN);
+	strlcpy(unsafe.metadata, "url: https://mail.example", KP_METADATA_MAX_LEN);
+	for (i = 0; i < NAMES; i++) {
+		snprintf(names[i], sizeof(names[i]), "web/site%zu", i);
+		strlcpy(unsafe.name, names[i], PATH_MAX);
+		if (kp_agent_store(&agent, &unsafe) != KP_SUCCESS) {
+			return 1;
+		}
+	}
+
+	printf("%6s %8s %12s %12s %8s\n", "batch", "safes", "single us",
+	       "batch us", "speedup");
+	for (i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+		double single, batch;
+
+		single = run(false, batches[i], count);
+		batch = run(true, batches[i], count);
+		printf("%6zu %8zu %12.2f %12.2f %7.1fx\n", batches[i], count,
+		       single, batch, single / batch);
+	}
+
+	return 0;
+}
+
+/*
+ * Search count safes, batch at a time, return per safe latency in us.
+ */
+static double
+run(bool many, size_t batch, size_t count)
+{
+	struct kp_agent client, server;
+	struct kp_unsafe *results;
+	struct kp_msg_error *errors;
+	const char *batchnames[NAMES];
+	pthread_t thread;
+	size_t done, i;
+	double start, elapsed;
+
+	pair(&client, &server);
+	/* No hello over a bare socket pair */
+	client.caps = many ? KP_AGENT_CAPS : 0;
+	if (pthread_create(&thread, NULL, serve, &server) != 0) {
+		exit(1);
+	}
+
+	results = calloc(batch, sizeof(struct kp_unsafe));
+	errors = calloc(batch, sizeof(struct kp_msg_error));
+	if (results == NULL || errors == NULL) {
+		exit(1);
+	}
+
+	for (i = 0; i < batch; i++) {
+		batchnames[i] = names[i % NAMES];
+	}
+
+	start = now();
+	for (done = 0; done < count; done += batch) {
+		if (kp_agent_search_many(&client, batchnames, batch, results,
+		                         errors) != KP_SUCCESS) {
+			exit(1);
+		}
+		for (i = 0; i < batch; i++) {
+			if (errors[i].err != KP_SUCCESS) {
+				exit(1);
+			}
+		}
+	}
+	elapsed = now() - start;
+
+	kp_agent_close(&client);
+	pthread_join(thread, NULL);
+	sodium_memzero(results, batch * sizeof(struct kp_unsafe));
+	free(results);
+	free(errors);
+
+	return elapsed / done * 1e6;
+}
+
+static void *
+serve(void *_agent)
+{
+	struct kp_agent *agent = _agent;
+	struct imsg imsg;
+	char *string;
+	ssize_t n;
+
+	for (;;) {
+		while ((n = imsg_get(&agent->ibuf, &imsg)) == 0) {
+			if (imsg_read(&agent->ibuf) <= 0) {
+				kp_agent_close(agent);
+				return NULL;
+			}
+		}
+		if (n < 0) {
+			break;
+		}
+
+		if (imsg.hdr.type == KP_MSG_SEARCH_MANY) {
+			kp_agent_search_batch(agent, &imsg);
+		} else if (kp_agent_msg_string(&imsg, &string, PATH_MAX)
+		           == KP_SUCCESS) {
+			kp_agent_search(agent, string);
+		}
+		imsg_free(&imsg);
+	}
+
+	kp_agent_close(agent);
+
+	return NULL;
+}
+
+static void
+pair(struct kp_agent *client, struct kp_agent *server)
+{
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		exit(1);
+	}
+
+	memset(client, 0, sizeof(struct kp_agent));
+	memset(server, 0, sizeof(struct kp_agent));
+	client->sock = fds[0];
+	server->sock = fds[1];
+	imsg_init(&client->ibuf, client->sock);
+	imsg_init(&server->ibuf, server->sock);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
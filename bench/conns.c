@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Run an agent, connect many idle clients and a few active ones. Report
+ * agent resident memory per idle client and search latency of active
+ * clients, all of them searching at once.
+ *
+ * usage: bench-conns <kickpass> [idle] [active] [rounds]
+ */
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kickpass.h"
+
+#include "kpagent.h"
+
+static pid_t spawn(const char *, const char *, char *, size_t);
+static long rss(pid_t);
+static double now(void);
+static int cmp(const void *, const void *);
+
+int
+main(int argc, char **argv)
+{
+	size_t idle = 10000, active = 100, rounds = 1000, i, j;
+	char home[] = "/tmp/kickpass-bench-XXXXXX";
+	char ws[PATH_MAX], socket_path[PATH_MAX];
+	struct kp_agent *clients;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+	struct sockaddr_un sunaddr;
+	struct rlimit rl;
+	double *sent, *latencies;
+	long base, loaded;
+	int *socks;
+	pid_t pid;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <kickpass> [idle] [active] "
+		        "[rounds]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2) {
+		idle = strtoul(argv[2], NULL, 10);
+	}
+	if (argc > 3) {
+		active = strtoul(argv[3], NULL, 10);
+	}
+	if (argc > 4) {
+		rounds = strtoul(argv[4], NULL, 10);
+	}
+
+	if (sodium_init() < 0) {
+		return 1;
+	}
+
+	/* Agent inherits limit, both ends need a descriptor per client */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (mkdtemp(home) == NULL) {
+		return 1;
+	}
+	snprintf(ws, sizeof(ws), "%s/%s", home, KP_PATH);
+	if (mkdir(ws, 0700) < 0) {
+		return 1;
+	}
+
+	if ((pid = spawn(argv[1], home, socket_path, sizeof(socket_path)))
+	    < 0) {
+		return 1;
+	}
+	sleep(1);
+	base = rss(pid);
+
+	socks = calloc(idle, sizeof(int));
+	clients = calloc(active, sizeof(struct kp_agent));
+	sent = calloc(active, sizeof(double));
+	latencies = calloc(active * rounds, sizeof(double));
+	if (socks == NULL || clients == NULL || sent == NULL
+	    || latencies == NULL) {
+		return 1;
+	}
+
+	memset(&sunaddr, 0, sizeof(struct sockaddr_un));
+	sunaddr.sun_family = AF_UNIX;
+	strlcpy(sunaddr.sun_path, socket_path, sizeof(sunaddr.sun_path));
+	for (i = 0; i < idle; i++) {
+		if ((socks[i] = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+		    || connect(socks[i], (struct sockaddr *)&sunaddr,
+		               sizeof(struct sockaddr_un)) < 0) {
+			perror("idle client");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < active; i++) {
+		if (kp_agent_init(&clients[i], socket_path) != KP_SUCCESS
+		    || kp_agent_connect(&clients[i]) != KP_SUCCESS) {
+			perror("active client");
+			return 1;
+		}
+	}
+
+	strlcpy(unsafe.name, "web/mail", PATH_MAX);
+	strlcpy(unsafe.password, "correct horse battery", KP_PASSWORD_MAX_LEN);
+	if (kp_agent_send_unsafe(&clients[0], KP_MSG_STORE, &unsafe)
+	    != KP_SUCCESS) {
+		return 1;
+	}
+
+	/* Let agent accept every idle client */
+	sleep(1);
+	loaded = rss(pid);
+
+	for (j = 0; j < rounds; j++) {
+		for (i = 0; i < active; i++) {
+			sent[i] = now();
+			if (kp_agent_send(&clients[i], KP_MSG_SEARCH,
+			                  unsafe.name, strlen(unsafe.name) + 1)
+			    != KP_SUCCESS) {
+				return 1;
+			}
+		}
+		for (i = 0; i < active; i++) {
+			if (kp_agent_receive_unsafe(&clients[i], KP_MSG_SEARCH,
+			                            &unsafe) != KP_SUCCESS) {
+				return 1;
+			}
+			latencies[j * active + i] = now() - sent[i];
+		}
+	}
+	qsort(latencies, active * rounds, sizeof(double), cmp);
+
+	printf("%8s %8s %12s %12s %12s %10s %10s\n", "idle", "active",
+	       "base KiB", "loaded KiB", "per idle B", "p50 us", "p99 us");
+	printf("%8zu %8zu %12ld %12ld %12.0f %10.1f %10.1f\n", idle, active,
+	       base, loaded, idle ? (loaded - base) * 1024.0 / idle : 0,
+	       latencies[active * rounds / 2] * 1e6,
+	       latencies[active * rounds * 99 / 100] * 1e6);
+
+	for (i = 0; i < active; i++) {
+		kp_agent_close(&clients[i]);
+	}
+	for (i = 0; i < idle; i++) {
+		close(socks[i]);
+	}
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	rmdir(ws);
+	rmdir(home);
+
+	return 0;
+}
+
+/*
+ * Run agent in foreground and get its socket path from its output.
+ */
+static pid_t
+spawn(const char *kickpass, const char *home, char *socket_path, size_t size)
+{
+	char line[PATH_MAX + 64], *path, *end;
+	FILE *out;
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) < 0 || (pid = fork()) < 0) {
+		return -1;
+	}
+
+	if (pid == 0) {
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+		setenv("HOME", home, 1);
+		unsetenv(KP_AGENT_SOCKET_ENV);
+		execl(kickpass, kickpass, "agent", "-d", NULL);
+		_exit(127);
+	}
+
+	close(fds[1]);
+	if ((out = fdopen(fds[0], "r")) == NULL
+	    || fgets(line, sizeof(line), out) == NULL
+	    || (path = strchr(line, '=')) == NULL
+	    || (end = strchr(path, ';')) == NULL) {
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	*end = '\0';
+	strlcpy(socket_path, path + 1, size);
+
+	return pid;
+}
+
+static long
+rss(pid_t pid)
+{
+	char path[64];
+	FILE *statm;
+	long size, resident;
+
+	snprintf(path, sizeof(path), "/proc/%ld/statm", (long)pid);
+	if ((statm = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+
+	if (fscanf(statm, "%ld %ld", &size, &resident) != 2) {
+		resident = -1;
+	}
+
+	fclose(statm);
+
+	if (resident < 0) {
+		return -1;
+	}
+
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
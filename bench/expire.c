@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Soak agent storage: store count safes with random timeouts, spread over
+ * given duration, some of them replacing an already stored one. Once the
+ * longest timeout is over, as many safes expire as are stored and resident
+ * memory must stay flat.
+ *
+ * usage: bench-expire [count] [seconds] [max timeout]
+ */
+
+#include <limits.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kickpass.h"
+
+#include "kpagent.h"
+
+#define SLICES 100 /* per second */
+
+static double now(void);
+static long rss(void);
+
+int
+main(int argc, char **argv)
+{
+	size_t count = 1000000, seconds = 20, max_timeout = 4;
+	size_t i, stored = 0, per_slice, slice;
+	struct kp_agent agent;
+	struct kp_unsafe *unsafe;
+	struct timespec pause;
+	long warm = -1, last = -1, high = -1;
+	double start, wait;
+
+	if (argc > 1) {
+		count = strtoul(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		seconds = strtoul(argv[2], NULL, 10);
+	}
+	if (argc > 3) {
+		max_timeout = strtoul(argv[3], NULL, 10);
+	}
+	if (seconds <= max_timeout + 1 || max_timeout == 0) {
+		fprintf(stderr, "duration must exceed max timeout + 1\n");
+		return 1;
+	}
+
+	if (sodium_init() < 0) {
+		return 1;
+	}
+
+	if ((unsafe = malloc(sizeof(struct kp_unsafe))) == NULL) {
+		return 1;
+	}
+
+	memset(&agent, 0, sizeof(struct kp_agent));
+	agent.sock = -1;
+	srandom(0);
+
+	per_slice = count / (seconds * SLICES) + 1;
+	start = now();
+
+	printf("%4s %10s %10s %12s %10s\n", "sec", "stored", "pending",
+	       "locked", "rss KiB");
+	for (slice = 0; slice < seconds * SLICES && stored < count; slice++) {
+		for (i = 0; i < per_slice && stored < count; i++, stored++) {
+			/* a quarter of names are reused, replacing safes */
+			snprintf(unsafe->name, PATH_MAX, "safe-%ld",
+			         random() % (count / 4 + 1));
+			strlcpy(unsafe->password, "Watch out for turtles.",
+			        KP_PASSWORD_MAX_LEN);
+			strlcpy(unsafe->metadata, "url: http://turtles.example",
+			        KP_METADATA_MAX_LEN);
+			unsafe->timeout = 1 + random() % max_timeout;
+			unsafe->idle = random() % 2;
+
+			if (kp_agent_store(&agent, unsafe) != KP_SUCCESS) {
+				fprintf(stderr, "cannot store %s\n",
+				        unsafe->name);
+				return 1;
+			}
+		}
+
+		if ((slice + 1) % SLICES == 0) {
+			size_t pending = kp_agent_expire(&agent);
+
+			last = rss();
+			printf("%4zu %10zu %10zu %12zu %10ld\n",
+			       (slice + 1) / SLICES, stored, pending,
+			       kp_agent_locked(&agent), last);
+
+			/* Steady state once first safes could expire */
+			if ((slice + 1) / SLICES == max_timeout + 1) {
+				warm = last;
+			}
+			if (warm >= 0 && last > high) {
+				high = last;
+			}
+		}
+
+		wait = start + (slice + 1) / (double)SLICES - now();
+		if (wait > 0) {
+			pause.tv_sec = wait;
+			pause.tv_nsec = (wait - pause.tv_sec) * 1e9;
+			nanosleep(&pause, NULL);
+		}
+	}
+
+	free(unsafe);
+
+	if (warm < 0) {
+		printf("too short to reach steady state\n");
+		return 1;
+	}
+
+	printf("rss after warm up %ld KiB, highest %ld KiB, last %ld KiB\n",
+	       warm, high, last);
+
+	/* Allow allocator noise, a leak grows with stored safes */
+	if (high > warm + warm / 10) {
+		printf("rss is growing\n");
+		return 1;
+	}
+
+	printf("rss is flat\n");
+
+	return 0;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Resident memory of the process in KiB, -1 where unknown.
+ */
+static long
+rss(void)
+{
+	FILE *statm;
+	long size, resident;
+
+	if ((statm = fopen("/proc/self/statm", "r")) == NULL) {
+		return -1;
+	}
+
+	if (fscanf(statm, "%ld %ld", &size, &resident) != 2) {
+		resident = -1;
+	}
+
+	fclose(statm);
+
+	if (resident < 0) {
+		return -1;
+	}
+
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
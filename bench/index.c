@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compare agent store lookups: red-black tree of names compared with
+ * strncmp, searched through a PATH_MAX needle as agent used to, against
+ * keyed hash index. Tree nodes hold exact size names, not PATH_MAX ones as
+ * agent did, otherwise a million of them would not fit in memory.
+ *
+ * usage: bench-index [count ...]
+ */
+
+#include <sys/tree.h>
+
+#include <limits.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kickpass.h"
+
+#include "index.h"
+
+struct rb_entry {
+	RB_ENTRY(rb_entry) tree;
+	char *name;
+};
+
+struct rb_needle {
+	struct rb_entry entry;
+	char name[PATH_MAX];
+};
+
+static int rb_cmp(struct rb_entry *, struct rb_entry *);
+
+RB_HEAD(rb_tree, rb_entry);
+RB_PROTOTYPE_STATIC(rb_tree, rb_entry, tree, rb_cmp);
+
+static double now(void);
+static void bench_rb(char **, size_t *, size_t);
+static void bench_index(char **, size_t *, size_t);
+static void report(const char *, size_t, double, double, double);
+
+int
+main(int argc, char **argv)
+{
+	size_t counts[] = { 1000, 100000, 1000000 };
+	size_t ncounts = 3, count, i, j, *order, tmp;
+	char **names;
+	int c;
+
+	if (sodium_init() < 0) {
+		return 1;
+	}
+
+	printf("%-6s %8s %12s %12s %12s\n", "store", "count", "insert/s",
+	       "search/s", "remove/s");
+	for (c = 0; c < (argc > 1 ? argc - 1 : (int)ncounts); c++) {
+		count = argc > 1 ? strtoul(argv[c + 1], NULL, 10) : counts[c];
+
+		names = calloc(count, sizeof(char *));
+		order = calloc(count, sizeof(size_t));
+		if (names == NULL || order == NULL) {
+			return 1;
+		}
+
+		for (i = 0; i < count; i++) {
+			if (asprintf(&names[i], "group%zu/safe%zu", i % 100, i)
+			    < 0) {
+				return 1;
+			}
+			order[i] = i;
+		}
+
+		/* Search in random order, thwarting caches */
+		for (i = count - 1; i > 0; i--) {
+			j = randombytes_uniform(i + 1);
+			tmp = order[i];
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+
+		bench_rb(names, order, count);
+		bench_index(names, order, count);
+
+		for (i = 0; i < count; i++) {
+			free(names[i]);
+		}
+		free(names);
+		free(order);
+	}
+
+	return 0;
+}
+
+static void
+bench_rb(char **names, size_t *order, size_t count)
+{
+	struct rb_tree tree = RB_INITIALIZER(&tree);
+	struct rb_entry *entries, *entry;
+	struct rb_needle needle;
+	double start, insert, search, remove;
+	size_t i, found = 0;
+
+	if ((entries = calloc(count, sizeof(struct rb_entry))) == NULL) {
+		exit(1);
+	}
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		entries[order[i]].name = names[order[i]];
+		RB_INSERT(rb_tree, &tree, &entries[order[i]]);
+	}
+	insert = now() - start;
+
+	needle.entry.name = needle.name;
+	start = now();
+	for (i = 0; i < count; i++) {
+		strlcpy(needle.name, names[order[i]], PATH_MAX);
+		entry = RB_FIND(rb_tree, &tree, &needle.entry);
+		found += entry != NULL;
+	}
+	search = now() - start;
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		RB_REMOVE(rb_tree, &tree, &entries[order[i]]);
+	}
+	remove = now() - start;
+
+	if (found != count) {
+		fprintf(stderr, "rb: found %zu of %zu\n", found, count);
+	}
+	report("rb", count, insert, search, remove);
+
+	free(entries);
+}
+
+static void
+bench_index(char **names, size_t *order, size_t count)
+{
+	struct kp_index index;
+	struct kp_index_entry *entries;
+	double start, insert, search, remove;
+	size_t i, found = 0;
+
+	if ((entries = calloc(count, sizeof(struct kp_index_entry))) == NULL) {
+		exit(1);
+	}
+
+	kp_index_init(&index);
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		entries[order[i]].name = names[order[i]];
+		if (kp_index_insert(&index, &entries[order[i]]) != KP_SUCCESS) {
+			exit(1);
+		}
+	}
+	insert = now() - start;
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		found += kp_index_find(&index, names[order[i]]) != NULL;
+	}
+	search = now() - start;
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		kp_index_remove(&index, &entries[order[i]]);
+	}
+	remove = now() - start;
+
+	if (found != count) {
+		fprintf(stderr, "index: found %zu of %zu\n", found, count);
+	}
+	report("index", count, insert, search, remove);
+
+	kp_index_fini(&index);
+	free(entries);
+}
+
+static void
+report(const char *name, size_t count, double insert, double search,
+       double remove)
+{
+	printf("%-6s %8zu %12.0f %12.0f %12.0f\n", name, count, count / insert,
+	       count / search, count / remove);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+rb_cmp(struct rb_entry *a, struct rb_entry *b)
+{
+	return strncmp(a->name, b->name, PATH_MAX);
+}
+
+RB_GENERATE_STATIC(rb_tree, rb_entry, tree, rb_cmp);
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Run an unlocked agent with 1 up to max workers, clients opening safes
+ * from disk all at once. Report opened safes per second for each number of
+ * workers.
+ *
+ * usage: bench-jobs <kickpass> [max jobs] [safes] [clients] [rounds]
+ */
+
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kickpass.h"
+
+#include "config.h"
+#include "kpagent.h"
+#include "safe.h"
+
+#define MASTER "bench master password"
+
+static kp_error_t workspace(const char *, size_t);
+static pid_t spawn(const char *, unsigned int, char *, size_t);
+static double run(const char *, size_t, size_t, size_t);
+static double now(void);
+
+int
+main(int argc, char **argv)
+{
+	unsigned int max = sysconf(_SC_NPROCESSORS_ONLN), jobs;
+	size_t safes = 256, clients = 32, rounds = 100;
+	char home[] = "/tmp/kickpass-bench-XXXXXX";
+	char socket_path[PATH_MAX], command[PATH_MAX + 16];
+	double base = 0, rate;
+	pid_t pid;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <kickpass> [max jobs] [safes] "
+		        "[clients] [rounds]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2) {
+		max = strtoul(argv[2], NULL, 10);
+	}
+	if (argc > 3) {
+		safes = strtoul(argv[3], NULL, 10);
+	}
+	if (argc > 4) {
+		clients = strtoul(argv[4], NULL, 10);
+	}
+	if (argc > 5) {
+		rounds = strtoul(argv[5], NULL, 10);
+	}
+
+	if (mkdtemp(home) == NULL || setenv("HOME", home, 1) < 0) {
+		return 1;
+	}
+	unsetenv(KP_AGENT_SOCKET_ENV);
+
+	if (workspace(home, safes) != KP_SUCCESS) {
+		fprintf(stderr, "cannot create workspace\n");
+		return 1;
+	}
+
+	printf("%6s %8s %12s %8s\n", "jobs", "clients", "opens/s", "scaling");
+	for (jobs = 1; jobs <= max; jobs *= 2) {
+		if ((pid = spawn(argv[1], jobs, socket_path,
+		                 sizeof(socket_path))) < 0) {
+			return 1;
+		}
+
+		rate = run(socket_path, safes, clients, rounds);
+		if (base == 0) {
+			base = rate;
+		}
+		printf("%6u %8zu %12.0f %7.2fx\n", jobs, clients, rate,
+		       rate / base);
+
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+
+	snprintf(command, sizeof(command), "rm -rf %s", home);
+	if (system(command) != 0) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Workspace with light kdf parameters and safes named safe<n>.
+ */
+static kp_error_t
+workspace(const char *home, size_t safes)
+{
+	kp_error_t ret;
+	struct kp_ctx ctx;
+	struct kp_safe safe;
+	char name[32];
+	size_t i;
+
+	memset(&ctx, 0, sizeof(struct kp_ctx));
+	if ((ret = kp_init(&ctx)) != KP_SUCCESS) {
+		return ret;
+	}
+	strlcpy((char *)ctx.password, MASTER, KP_PASSWORD_MAX_LEN);
+	ctx.cfg.memlimit = 16 * 1024 * 1024;
+	ctx.cfg.opslimit = 32768;
+
+	if ((ret = kp_init_workspace(&ctx, "")) != KP_SUCCESS
+	    || (ret = kp_cfg_create(&ctx, "")) != KP_SUCCESS) {
+		return ret;
+	}
+
+	for (i = 0; i < safes; i++) {
+		snprintf(name, sizeof(name), "safe%zu", i);
+		if ((ret = kp_safe_init(&ctx, &safe, name)) != KP_SUCCESS
+		    || (ret = kp_safe_open(&ctx, &safe, KP_CREATE))
+		       != KP_SUCCESS
+		    || (ret = kp_safe_set(&safe, "correct horse battery",
+		                          "url: https://mail.example"))
+		       != KP_SUCCESS
+		    || (ret = kp_safe_save(&ctx, &safe)) != KP_SUCCESS) {
+			return ret;
+		}
+		kp_safe_close(&ctx, &safe);
+	}
+
+	kp_fini(&ctx);
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Every client keeps one open in flight, return opened safes per second.
+ */
+static double
+run(const char *socket_path, size_t safes, size_t clients, size_t rounds)
+{
+	struct kp_agent *agents;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+	char name[32];
+	double start, elapsed;
+	size_t i, j;
+
+	if ((agents = calloc(clients, sizeof(struct kp_agent))) == NULL) {
+		exit(1);
+	}
+
+	for (i = 0; i < clients; i++) {
+		if (kp_agent_init(&agents[i], socket_path) != KP_SUCCESS
+		    || kp_agent_connect(&agents[i]) != KP_SUCCESS) {
+			exit(1);
+		}
+	}
+
+	/* Unlocking derives master key, opens reuse it */
+	if (kp_agent_unlock(&agents[0], MASTER) != KP_SUCCESS) {
+		fprintf(stderr, "cannot unlock agent\n");
+		exit(1);
+	}
+
+	start = now();
+	for (j = 0; j < rounds; j++) {
+		for (i = 0; i < clients; i++) {
+			snprintf(name, sizeof(name), "safe%zu",
+			         (j * clients + i) % safes);
+			if (kp_agent_send(&agents[i], KP_MSG_OPEN, name,
+			                  strlen(name) + 1) != KP_SUCCESS) {
+				exit(1);
+			}
+		}
+		for (i = 0; i < clients; i++) {
+			if (kp_agent_receive_unsafe(&agents[i], KP_MSG_OPEN,
+			                            &unsafe) != KP_SUCCESS) {
+				fprintf(stderr, "cannot open safe\n");
+				exit(1);
+			}
+		}
+	}
+	elapsed = now() - start;
+	sodium_memzero(&unsafe, sizeof(struct kp_unsafe));
+
+	for (i = 0; i < clients; i++) {
+		kp_agent_close(&agents[i]);
+	}
+	free(agents);
+
+	return rounds * clients / elapsed;
+}
+
+/*
+ * Run agent in foreground and get its socket path from its output.
+ */
+static pid_t
+spawn(const char *kickpass, unsigned int jobs, char *socket_path,
+      size_t size)
+{
+	char line[PATH_MAX + 64], arg[16], *path, *end;
+	FILE *out;
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) < 0 || (pid = fork()) < 0) {
+		return -1;
+	}
+
+	if (pid == 0) {
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+		snprintf(arg, sizeof(arg), "%u", jobs);
+		execl(kickpass, kickpass, "agent", "-d", "-j", arg, NULL);
+		_exit(127);
+	}
+
+	close(fds[1]);
+	if ((out = fdopen(fds[0], "r")) == NULL
+	    || fgets(line, sizeof(line), out) == NULL
+	    || (path = strchr(line, '=')) == NULL
+	    || (end = strchr(path, ';')) == NULL) {
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	*end = '\0';
+	strlcpy(socket_path, path + 1, size);
+	fclose(out);
+
+	return pid;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
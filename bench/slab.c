@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Allocate and free many small guarded buffers, as the agent does for its
+ * safes, with sodium_malloc and with the slab allocator. Report throughput
+ * and how many mappings the process holds once everything is allocated.
+ *
+ * usage: bench-slab [count] [size]
+ */
+
+#include <errno.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "slab.h"
+
+struct allocator {
+	const char *name;
+	void *(*alloc)(size_t);
+	void (*free)(void *);
+};
+
+static double now(void);
+static long mappings(void);
+static void run(const struct allocator *, void **, size_t, size_t);
+
+static const struct allocator allocators[] = {
+	{ "sodium", sodium_malloc, sodium_free },
+	{ "slab",   kp_slab_alloc, kp_slab_free },
+};
+
+int
+main(int argc, char **argv)
+{
+	size_t count = 20000, size = 100, i;
+	void **ptrs;
+
+	if (argc > 1) {
+		count = strtoul(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		size = strtoul(argv[2], NULL, 10);
+	}
+
+	if (sodium_init() < 0) {
+		return 1;
+	}
+
+	if ((ptrs = calloc(count, sizeof(void *))) == NULL) {
+		return 1;
+	}
+
+	printf("%-8s %8s %6s %8s %12s %12s %9s\n", "alloc", "count", "size",
+	       "failed", "alloc/s", "free/s", "mappings");
+	for (i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+		run(&allocators[i], ptrs, count, size);
+	}
+
+	free(ptrs);
+
+	return 0;
+}
+
+static void
+run(const struct allocator *allocator, void **ptrs, size_t count, size_t size)
+{
+	size_t i, done, failed = 0;
+	long before, after;
+	double start, alloc_time, free_time;
+
+	before = mappings();
+
+	start = now();
+	for (done = 0; done < count; done++) {
+		if ((ptrs[done] = allocator->alloc(size)) == NULL) {
+			/* most likely vm.max_map_count */
+			failed = count - done;
+			break;
+		}
+		memset(ptrs[done], 0x42, size);
+	}
+	alloc_time = now() - start;
+
+	after = mappings();
+
+	start = now();
+	for (i = 0; i < done; i++) {
+		allocator->free(ptrs[i]);
+	}
+	free_time = now() - start;
+
+	printf("%-8s %8zu %6zu %8zu %12.0f %12.0f %9ld\n", allocator->name,
+	       count, size, failed, done / alloc_time, done / free_time,
+	       after >= 0 && before >= 0 ? after - before : -1);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Number of mappings of the process, -1 where unknown.
+ */
+static long
+mappings(void)
+{
+	FILE *maps;
+	long lines = 0;
+	int c;
+
+	if ((maps = fopen("/proc/self/maps", "r")) == NULL) {
+		return -1;
+	}
+
+	while ((c = fgetc(maps)) != EOF) {
+		if (c == '\n') {
+			lines++;
+		}
+	}
+
+	fclose(maps);
+
+	return lines;
+}
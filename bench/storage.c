@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Create safes in a fresh workspace under each sync policy, one by one then
+ * in batches, and report safes written per second. Workspace goes under
+ * dir, default to /tmp, which should be on the disk to measure.
+ *
+ * usage: bench-storage [count] [dir]
+ */
+
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kickpass.h"
+
+#include "config.h"
+#include "kpagent.h"
+#include "safe.h"
+
+#define MASTER "bench master password"
+
+static kp_error_t run(struct kp_ctx *, const char *, size_t, bool);
+static double now(void);
+
+int
+main(int argc, char **argv)
+{
+	const enum kp_sync policies[] = {
+		KP_SYNC_NONE, KP_SYNC_FILE, KP_SYNC_DIR
+	};
+	const char *labels[] = { "none", "file", "file+dir" };
+	size_t count = 10000, i;
+	char home[PATH_MAX], command[PATH_MAX + 16];
+	struct kp_ctx ctx;
+	double start, elapsed;
+	int batch;
+
+	if (argc > 1) {
+		count = strtoul(argv[1], NULL, 10);
+	}
+	snprintf(home, sizeof(home), "%s/kickpass-bench-XXXXXX",
+	         argc > 2 ? argv[2] : "/tmp");
+
+	if (mkdtemp(home) == NULL || setenv("HOME", home, 1) < 0) {
+		return 1;
+	}
+	unsetenv(KP_AGENT_SOCKET_ENV);
+	unsetenv(KP_SYNC_ENV);
+
+	memset(&ctx, 0, sizeof(struct kp_ctx));
+	if (kp_init(&ctx) != KP_SUCCESS) {
+		return 1;
+	}
+	strlcpy((char *)ctx.password, MASTER, KP_PASSWORD_MAX_LEN);
+	ctx.cfg.memlimit = 16 * 1024 * 1024;
+	ctx.cfg.opslimit = 32768;
+
+	if (kp_init_workspace(&ctx, "") != KP_SUCCESS
+	    || kp_cfg_create(&ctx, "") != KP_SUCCESS) {
+		fprintf(stderr, "cannot create workspace\n");
+		return 1;
+	}
+
+	printf("%-10s %6s %8s %12s\n", "sync", "batch", "safes", "writes/s");
+	for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+		for (batch = 0; batch < 2; batch++) {
+			char dir[32];
+
+			/* Batching changes nothing without sync */
+			if (batch && policies[i] == KP_SYNC_NONE) {
+				continue;
+			}
+
+			ctx.sync = policies[i];
+			snprintf(dir, sizeof(dir), "%s%s", labels[i],
+			         batch ? "-batch" : "");
+
+			start = now();
+			if (run(&ctx, dir, count, batch) != KP_SUCCESS) {
+				fprintf(stderr, "cannot write safes\n");
+				return 1;
+			}
+			elapsed = now() - start;
+
+			printf("%-10s %6s %8zu %12.0f\n", labels[i],
+			       batch ? "yes" : "no", count, count / elapsed);
+		}
+	}
+
+	kp_fini(&ctx);
+
+	snprintf(command, sizeof(command), "rm -rf %s", home);
+	if (system(command) != 0) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Create count safes under dir.
+ */
+static kp_error_t
+run(struct kp_ctx *ctx, const char *dir, size_t count, bool batch)
+{
+	kp_error_t ret;
+	struct kp_storage_batch pending;
+	struct kp_safe safe;
+	char name[PATH_MAX];
+	size_t i;
+
+	if (batch && (ret = kp_storage_batch_begin(ctx, &pending, NULL, NULL))
+	    != KP_SUCCESS) {
+		return ret;
+	}
+
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "%s/safe%zu", dir, i);
+		if ((ret = kp_safe_init(ctx, &safe, name)) != KP_SUCCESS
+		    || (ret = kp_safe_open(ctx, &safe, KP_CREATE))
+		       != KP_SUCCESS
+		    || (ret = kp_safe_set(&safe, "correct horse battery",
+		                          "url: https://mail.example"))
+		       != KP_SUCCESS
+		    || (ret = kp_safe_save(ctx, &safe)) != KP_SUCCESS) {
+			return ret;
+		}
+		kp_safe_close(ctx, &safe);
+	}
+
+	if (batch) {
+		return kp_storage_batch_commit(ctx);
+	}
+
+	return KP_SUCCESS;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Run an agent holding many safes, then replace it with a new agent taking
+ * it over while clients keep searching, each with its own connection as
+ * command line does. Report handoff time and failed requests.
+ *
+ * usage: bench-takeover <kickpass> [safes] [clients]
+ */
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kickpass.h"
+
+#include "kpagent.h"
+
+struct client {
+	pthread_t thread;
+	const char *socket_path;
+	size_t safes;
+	size_t requests;
+	size_t failed;
+};
+
+static volatile bool stop = false;
+
+static pid_t spawn(const char *, const char *, bool, char *, size_t);
+static void *search(void *);
+static double now(void);
+
+int
+main(int argc, char **argv)
+{
+	size_t safes = 100000, nclients = 4, i, n;
+	char home[] = "/tmp/kickpass-bench-XXXXXX";
+	char ws[PATH_MAX], socket_path[PATH_MAX], new_path[PATH_MAX];
+	struct kp_agent agent;
+	struct kp_unsafe *unsafes;
+	struct kp_msg_error *errors;
+	struct client *clients;
+	size_t requests = 0, failed = 0;
+	double start, handed, exited;
+	pid_t old, new;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <kickpass> [safes] [clients]\n",
+		        argv[0]);
+		return 1;
+	}
+	if (argc > 2) {
+		safes = strtoul(argv[2], NULL, 10);
+	}
+	if (argc > 3) {
+		nclients = strtoul(argv[3], NULL, 10);
+	}
+
+	if (sodium_init() < 0 || safes == 0) {
+		return 1;
+	}
+
+	if (mkdtemp(home) == NULL) {
+		return 1;
+	}
+	snprintf(ws, sizeof(ws), "%s/%s", home, KP_PATH);
+	if (mkdir(ws, 0700) < 0) {
+		return 1;
+	}
+
+	if ((old = spawn(argv[1], home, false, socket_path,
+	                 sizeof(socket_path))) < 0) {
+		return 1;
+	}
+
+	unsafes = calloc(KP_AGENT_BATCH_MAX, sizeof(struct kp_unsafe));
+	errors = calloc(KP_AGENT_BATCH_MAX, sizeof(struct kp_msg_error));
+	clients = calloc(nclients, sizeof(struct client));
+	if (unsafes == NULL || errors == NULL || clients == NULL) {
+		return 1;
+	}
+
+	if (kp_agent_init(&agent, socket_path) != KP_SUCCESS
+	    || kp_agent_connect(&agent) != KP_SUCCESS) {
+		perror("connect");
+		return 1;
+	}
+
+	for (i = 0; i < safes; i += n) {
+		for (n = 0; n < KP_AGENT_BATCH_MAX && i + n < safes; n++) {
+			unsafes[n] = (struct kp_unsafe)KP_UNSAFE_INIT;
+			snprintf(unsafes[n].name, PATH_MAX, "site/%zu", i + n);
+			snprintf(unsafes[n].password, KP_PASSWORD_MAX_LEN,
+			         "password of %zu", i + n);
+			strlcpy(unsafes[n].metadata, "url: https://example.com",
+			        KP_METADATA_MAX_LEN);
+			unsafes[n].timeout = 3600;
+		}
+		if (kp_agent_store_many(&agent, unsafes, n, errors)
+		    != KP_SUCCESS) {
+			perror("store");
+			return 1;
+		}
+	}
+	kp_agent_close(&agent);
+
+	for (i = 0; i < nclients; i++) {
+		clients[i].socket_path = socket_path;
+		clients[i].safes = safes;
+		if (pthread_create(&clients[i].thread, NULL, search,
+		                   &clients[i]) != 0) {
+			return 1;
+		}
+	}
+	usleep(200000);
+
+	start = now();
+	setenv(KP_AGENT_SOCKET_ENV, socket_path, 1);
+	if ((new = spawn(argv[1], home, true, new_path,
+	                 sizeof(new_path))) < 0) {
+		fprintf(stderr, "takeover failed\n");
+		return 1;
+	}
+	handed = now();
+	waitpid(old, NULL, 0);
+	exited = now();
+	usleep(200000);
+
+	stop = true;
+	for (i = 0; i < nclients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		requests += clients[i].requests;
+		failed += clients[i].failed;
+	}
+
+	printf("%8s %14s %14s %10s %8s\n", "safes", "handoff ms",
+	       "old exit ms", "requests", "failed");
+	printf("%8zu %14.1f %14.1f %10zu %8zu\n", safes,
+	       (handed - start) * 1e3, (exited - start) * 1e3, requests,
+	       failed);
+
+	kill(new, SIGTERM);
+	waitpid(new, NULL, 0);
+	rmdir(ws);
+	rmdir(home);
+
+	return strcmp(socket_path, new_path) != 0;
+}
+
+/*
+ * Run agent in foreground and get its socket path from its output.
+ */
+static pid_t
+spawn(const char *kickpass, const char *home, bool takeover,
+      char *socket_path, size_t size)
+{
+	char line[PATH_MAX + 64], *path, *end;
+	FILE *out;
+	int fds[2], fd;
+	pid_t pid;
+
+	if (pipe(fds) < 0 || (pid = fork()) < 0) {
+		return -1;
+	}
+
+	if (pid == 0) {
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+		/* Connections of searching clients must not outlive them */
+		for (fd = STDERR_FILENO + 1; fd < sysconf(_SC_OPEN_MAX); fd++) {
+			close(fd);
+		}
+		setenv("HOME", home, 1);
+		if (takeover) {
+			execl(kickpass, kickpass, "agent", "-d", "--takeover",
+			      NULL);
+		} else {
+			unsetenv(KP_AGENT_SOCKET_ENV);
+			execl(kickpass, kickpass, "agent", "-d", NULL);
+		}
+		_exit(127);
+	}
+
+	close(fds[1]);
+	if ((out = fdopen(fds[0], "r")) == NULL
+	    || fgets(line, sizeof(line), out) == NULL
+	    || (path = strchr(line, '=')) == NULL
+	    || (end = strchr(path, ';')) == NULL) {
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	*end = '\0';
+	strlcpy(socket_path, path + 1, size);
+
+	return pid;
+}
+
+/*
+ * Search random safes, one connection per request.
+ */
+static void *
+search(void *_client)
+{
+	struct client *client = _client;
+	struct kp_agent agent;
+	struct kp_unsafe unsafe;
+	char name[PATH_MAX];
+
+	while (!stop) {
+		snprintf(name, sizeof(name), "site/%u",
+		         randombytes_uniform(client->safes));
+		client->requests++;
+
+		if (kp_agent_init(&agent, client->socket_path) != KP_SUCCESS) {
+			client->failed++;
+			continue;
+		}
+
+		if (kp_agent_connect(&agent) != KP_SUCCESS
+		    || kp_agent_send(&agent, KP_MSG_SEARCH, name,
+		                     strlen(name) + 1) != KP_SUCCESS
+		    || kp_agent_receive_unsafe(&agent, KP_MSG_SEARCH, &unsafe)
+		       != KP_SUCCESS
+		    || strcmp(unsafe.name, name) != 0) {
+			client->failed++;
+		}
+		kp_agent_close(&agent);
+	}
+
+	return NULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
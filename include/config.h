@@ -21,6 +21,8 @@
 
 #include "kickpass.h"
 
+#define KP_CONFIG_SAFE_NAME ".config"
+
 kp_error_t kp_cfg_create(struct kp_ctx *, const char *);
 kp_error_t kp_cfg_load(struct kp_ctx *, const char *);
 kp_error_t kp_cfg_save(struct kp_ctx *, const char *);
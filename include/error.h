@@ -31,6 +31,8 @@
 #define KP_INVALID_MSG      9
 #define KP_EXIT             10
 #define KP_NOPROMPT         11
+#define KP_LOCKED           12
+#define KP_ENOAES           13
 
 typedef int kp_error_t;
 
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef KP_KDF_H
+#define KP_KDF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "error.h"
+
+#define KP_KDF_MAX_PARALLELISM 64
+#define KP_KDF_SALT_SIZE       32
+
+/* Values are stored in safe header, never change them */
+enum kp_kdf {
+	KP_KDF_SCRYPT   = 1, /* scryptsalsa208sha256 */
+	KP_KDF_ARGON2ID = 2, /* argon2id13 */
+};
+
+/*
+ * Parameters a master key is derived with.
+ */
+struct kp_kdf_params {
+	enum kp_kdf kdf;
+	long long unsigned opslimit;
+	size_t memlimit;
+	unsigned int parallelism;
+	unsigned char salt[KP_KDF_SALT_SIZE];
+};
+
+struct kp_ctx;
+struct kp_key;
+
+kp_error_t kp_kdf_derive(enum kp_kdf, unsigned char *, size_t, const char *,
+                         const unsigned char *, long long unsigned, size_t,
+                         unsigned int);
+kp_error_t kp_kdf_defaults(struct kp_ctx *, enum kp_kdf);
+kp_error_t kp_kdf_calibrate(struct kp_ctx *, unsigned int, size_t,
+                            unsigned int *);
+size_t kp_kdf_mem(enum kp_kdf, size_t, unsigned int);
+size_t kp_kdf_default_max_mem(void);
+kp_error_t kp_kdf_cache_init(struct kp_ctx *);
+kp_error_t kp_kdf_cache_fini(struct kp_ctx *);
+kp_error_t kp_kdf_cache_derive(struct kp_ctx *, enum kp_kdf,
+                               const unsigned char *, long long unsigned,
+                               size_t, unsigned int, unsigned char *);
+void kp_kdf_cache_add(struct kp_ctx *, enum kp_kdf, const unsigned char *,
+                      long long unsigned, size_t, unsigned int,
+                      const unsigned char *);
+bool kp_kdf_cache_lookup(struct kp_ctx *, enum kp_kdf, const unsigned char *,
+                         long long unsigned, size_t, unsigned int,
+                         unsigned char *);
+size_t kp_kdf_cache_export(struct kp_ctx *, struct kp_key *);
+void kp_kdf_cache_forget(struct kp_ctx *, enum kp_kdf, const unsigned char *,
+                         long long unsigned, size_t, unsigned int);
+void kp_kdf_cache_clear(struct kp_ctx *);
+bool kp_kdf_key_match(const struct kp_key *, enum kp_kdf,
+                      const unsigned char *, long long unsigned, size_t,
+                      unsigned int);
+const char *kp_kdf_name(enum kp_kdf);
+kp_error_t kp_kdf_from_name(const char *, enum kp_kdf *);
+
+#endif /* KP_KDF_H */
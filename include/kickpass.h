@@ -23,23 +23,85 @@
 #include <sys/un.h>
 
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdarg.h>
 
 #include "kickpass_config.h"
 
 #include "error.h"
 #include "imsg.h"
+#include "kdf.h"
 
-#define KP_PASSWORD_MAX_LEN 4096
-#define KP_METADATA_MAX_LEN 4096
+#define KP_PASSWORD_MAX_LEN 4096 /* typed passwords and agent messages */
+#define KP_METADATA_MAX_LEN 4096 /* agent messages only, safes have no limit */
+#define KP_PLAIN_MAX_SIZE   (1024 * 1024) /* default safe size limit */
+#define KP_PLAIN_MAX_SIZE_ENV "KP_SAFE_MAX_SIZE"
+#define KP_SYNC_ENV         "KP_SYNC"
+#define KP_MASTER_KEY_SIZE  32
+#define KP_KEY_CACHE_SIZE   8
+
+/*
+ * How far a written safe reaches the disk before the write returns. Safes
+ * always replace their previous version at once, syncing tells whether the
+ * new version survives a crash.
+ */
+enum kp_sync {
+	KP_SYNC_NONE, /* left to the kernel */
+	KP_SYNC_FILE, /* safe content, before it replaces previous version */
+	KP_SYNC_DIR,  /* and the replacement, in its directory */
+};
+
+/*
+ * Safes written while a batch is set in ctx are synced and replace their
+ * previous version together, on commit or once KP_STORAGE_BATCH_MAX are
+ * pending. Files are synced before any replacement, directories once each
+ * after. A write or rewrap succeeding while batched is only done once its
+ * outcome is given to the batch callback.
+ */
+#define KP_STORAGE_BATCH_MAX 64
+#define KP_STORAGE_SUFFIX_SIZE 9 /* random part of temporary names */
+
+struct kp_storage_pending {
+	int fd;
+	char *name;
+	char suffix[KP_STORAGE_SUFFIX_SIZE]; /* of temporary name written file
+	                                      * is linked to, empty if none */
+};
+
+struct kp_storage_batch {
+	struct kp_storage_pending pending[KP_STORAGE_BATCH_MAX];
+	size_t npending;
+	kp_error_t ret; /* first error of an early commit */
+	int err_no;
+	void (*cb)(const char *, kp_error_t, void *); /* outcome of each safe */
+	void *arg;
+	pthread_mutex_t lock;
+};
 
 struct kp_agent {
 	int sock;
 	struct imsgbuf ibuf;
 	struct sockaddr_un sunaddr;
 	bool connected;
+	bool unlocked; /* agent holds master password */
+	uint32_t caps; /* capabilities shared with peer */
+	bool nonblock; /* replies the socket cannot take are left queued */
+};
+
+/*
+ * A key derived from master password, along with its kdf parameters.
+ */
+struct kp_key {
+	bool used;
+	enum kp_kdf kdf;
+	long long unsigned opslimit;
+	size_t memlimit;
+	unsigned int parallelism;
+	unsigned char salt[KP_KDF_SALT_SIZE];
+	unsigned char key[KP_MASTER_KEY_SIZE];
 };
 
 struct kp_ctx {
@@ -48,16 +110,33 @@ struct kp_ctx {
 	struct kp_agent agent;
 	kp_error_t (*password_prompt)(struct kp_ctx *, bool, char *, const char *, va_list ap);
 	char * const password;
+	size_t plain_max_size; /* largest safe plain text read or written */
+	enum kp_sync sync;
+	struct kp_storage_batch *batch; /* writes to sync together, or NULL */
 	struct {
+		enum kp_kdf kdf;
 		long long unsigned opslimit;
 		size_t memlimit;
+		unsigned int parallelism;
+		unsigned char salt[KP_KDF_SALT_SIZE]; /* workspace kdf salt */
 	} cfg;
+	struct {
+		struct kp_key * const keys; /* in guarded memory */
+		unsigned int next;          /* next entry to evict */
+		pthread_mutex_t lock;
+	} cache;
 };
 
 kp_error_t kp_init(struct kp_ctx *);
 kp_error_t kp_open(struct kp_ctx *);
 kp_error_t kp_fini(struct kp_ctx *);
 kp_error_t kp_init_workspace(struct kp_ctx *, const char *);
+kp_error_t kp_workspace_walk(struct kp_ctx *, const char *, bool,
+                             kp_error_t (*)(const char *, void *), void *);
+kp_error_t kp_storage_batch_begin(struct kp_ctx *, struct kp_storage_batch *,
+                                  void (*)(const char *, kp_error_t, void *),
+                                  void *);
+kp_error_t kp_storage_batch_commit(struct kp_ctx *);
 const char *kp_version_string(void);
 int kp_version_major(void);
 kp_error_t kp_password_prompt(struct kp_ctx *, bool, char *, const char *, ...) __attribute__((format(printf, 4, 5)));
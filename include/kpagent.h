@@ -20,14 +20,48 @@
 #include <limits.h>
 
 #include "kickpass.h"
+#include "safe.h"
 
 #define KP_AGENT_SOCKET_ENV "KP_AGENT_SOCK"
 
+/*
+ * Client and agent must speak the same protocol version. Capabilities are
+ * optional features, only the ones both ends have are used.
+ */
+#define KP_AGENT_PROTOCOL_VERSION 1
+#define KP_AGENT_CAP_IDLE         (1 << 0) /* timeout restarts on access */
+#define KP_AGENT_CAP_BATCH        (1 << 1) /* *_MANY messages */
+#define KP_AGENT_CAP_TAKEOVER     (1 << 2) /* state handoff to a new agent */
+#define KP_AGENT_CAP_SEALED       (1 << 3) /* large metadata as sealed fd */
+#define KP_AGENT_CAP_LIST         (1 << 4) /* list message */
+
+/* Without memory files, large metadata is read by clients themselves */
+#ifdef HAS_MEMFD_CREATE
+#define KP_AGENT_CAPS_SEALED      KP_AGENT_CAP_SEALED
+#else
+#define KP_AGENT_CAPS_SEALED      0
+#endif
+
+#define KP_AGENT_CAPS             (KP_AGENT_CAP_IDLE | KP_AGENT_CAP_BATCH \
+                                   | KP_AGENT_CAP_TAKEOVER \
+                                   | KP_AGENT_CAPS_SEALED | KP_AGENT_CAP_LIST)
+
+#define KP_AGENT_BATCH_MAX 1024 /* items per batch message */
+#define KP_AGENT_LIST_MAX  4096 /* names per list page */
+
 enum kp_agent_msg_type {
 	KP_MSG_STORE,
 	KP_MSG_SEARCH,
 	KP_MSG_DISCARD,
+	KP_MSG_UNLOCK,
+	KP_MSG_OPEN,
+	KP_MSG_SAVE,
 	KP_MSG_ERROR,
+	KP_MSG_HELLO,
+	KP_MSG_SEARCH_MANY,
+	KP_MSG_STORE_MANY,
+	KP_MSG_TAKEOVER,
+	KP_MSG_LIST,
 };
 
 struct kp_msg_error {
@@ -35,14 +69,24 @@ struct kp_msg_error {
 	int err_no;
 };
 
+/*
+ * Metadata too large for a message travels as a sealed memory file, mapped
+ * read only by the receiver. Use kp_agent_unsafe_metadata to read metadata
+ * and kp_agent_unsafe_clear once done.
+ */
 struct kp_unsafe {
 	time_t timeout; /* timeout of the safe */
+	bool idle; /* timeout restarts on each access */
 	char name[PATH_MAX]; /* name of the safe */
 	char password[KP_PASSWORD_MAX_LEN]; /* plain text password (null terminated) */
 	char metadata[KP_METADATA_MAX_LEN]; /* plain text metadata (null terminated) */
+	const char *large; /* metadata too large for the above, or NULL */
+	size_t large_size; /* size of mapping holding large, 0 if borrowed */
+	int large_fd;      /* sealed memory file holding large, or -1 */
+	struct kp_safe_id id; /* file the safe was read from, if known */
 };
 
-#define KP_UNSAFE_INIT { .timeout = ((time_t) -1), .name = "", .password = "", .metadata = "" }
+#define KP_UNSAFE_INIT { .timeout = ((time_t) -1), .idle = false, .name = "", .password = "", .metadata = "", .large = NULL, .large_size = 0, .large_fd = -1, .id = { 0 } }
 
 /* Client side */
 kp_error_t kp_agent_init(struct kp_agent *, const char *);
@@ -50,13 +94,46 @@ kp_error_t kp_agent_connect(struct kp_agent *);
 kp_error_t kp_agent_listen(struct kp_agent *);
 kp_error_t kp_agent_accept(struct kp_agent *, struct kp_agent *);
 kp_error_t kp_agent_send(struct kp_agent *, enum kp_agent_msg_type, void *, size_t);
+kp_error_t kp_agent_send_unsafe(struct kp_agent *, enum kp_agent_msg_type, const struct kp_unsafe *);
 kp_error_t kp_agent_error(struct kp_agent *, kp_error_t);
 kp_error_t kp_agent_receive(struct kp_agent *, enum kp_agent_msg_type, void *, size_t);
+kp_error_t kp_agent_receive_saved(struct kp_agent *, struct kp_safe_id *);
+kp_error_t kp_agent_receive_unsafe(struct kp_agent *, enum kp_agent_msg_type, struct kp_unsafe *);
+kp_error_t kp_agent_search_many(struct kp_agent *, const char **, size_t, struct kp_unsafe *, struct kp_msg_error *);
+kp_error_t kp_agent_store_many(struct kp_agent *, const struct kp_unsafe *, size_t, struct kp_msg_error *);
+kp_error_t kp_agent_unlock(struct kp_agent *, const char *);
+bool kp_agent_moved(struct kp_agent *, kp_error_t);
+kp_error_t kp_agent_takeover(struct kp_agent *, struct kp_ctx *, int *);
+kp_error_t kp_agent_list(struct kp_agent *, const char *, kp_error_t (*)(const char *, void *), void *);
 kp_error_t kp_agent_close(struct kp_agent *);
 
+/* Both sides */
+void kp_agent_unsafe_set_metadata(struct kp_unsafe *, const char *);
+kp_error_t kp_agent_unsafe_seal(struct kp_unsafe *, const char *);
+const char *kp_agent_unsafe_metadata(const struct kp_unsafe *);
+void kp_agent_unsafe_clear(struct kp_unsafe *);
+
 /* Server side */
+kp_error_t kp_agent_welcome(struct kp_agent *, struct imsg *);
+kp_error_t kp_agent_msg_data(struct imsg *, void **, size_t *);
+kp_error_t kp_agent_msg_string(struct imsg *, char **, size_t);
+kp_error_t kp_agent_msg_unsafe(struct imsg *, struct kp_unsafe *);
+kp_error_t kp_agent_msg_next_unsafe(struct imsg *, size_t *, struct kp_unsafe *);
 kp_error_t kp_agent_store(struct kp_agent *, struct kp_unsafe *);
+bool kp_agent_stored(struct kp_agent *, struct kp_unsafe *);
+kp_error_t kp_agent_send_saved(struct kp_agent *, const struct kp_safe_id *);
 kp_error_t kp_agent_search(struct kp_agent *, const char *);
+kp_error_t kp_agent_search_batch(struct kp_agent *, struct imsg *);
+kp_error_t kp_agent_send_errors(struct kp_agent *, enum kp_agent_msg_type, const struct kp_msg_error *, size_t);
+kp_error_t kp_agent_handoff(struct kp_agent *, struct kp_ctx *, int);
+kp_error_t kp_agent_watch(struct kp_agent *, const char *, int *);
+kp_error_t kp_agent_watch_read(struct kp_agent *);
+void kp_agent_unwatch(struct kp_agent *);
+kp_error_t kp_agent_list_names(struct kp_agent *, struct imsg *);
 kp_error_t kp_agent_discard(struct kp_agent *, const char *, bool);
+void kp_agent_budget(struct kp_agent *, size_t);
+kp_error_t kp_agent_encrypt(struct kp_agent *);
+size_t kp_agent_locked(struct kp_agent *);
+size_t kp_agent_expire(struct kp_agent *);
 
 #endif /* KP_KPAGENT_H */
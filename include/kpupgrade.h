@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef KP_KPUPGRADE_H
+#define KP_KPUPGRADE_H
+
+#include <stddef.h>
+
+#include "kickpass.h"
+
+/*
+ * Progress of an upgrade, reported after each safe.
+ */
+struct kp_upgrade_progress {
+	size_t total;   /* safes to upgrade */
+	size_t done;    /* safes upgraded */
+	size_t failed;  /* safes left untouched because of an error */
+	double elapsed; /* seconds since upgrade started */
+};
+
+kp_error_t kp_upgrade(struct kp_ctx *, char * const *, size_t, unsigned int,
+                      size_t,
+                      void (*)(const struct kp_upgrade_progress *,
+                               const char *, kp_error_t, void *),
+                      void *);
+
+#endif /* KP_KPUPGRADE_H */
@@ -18,8 +18,11 @@
 #define KP_SAFE_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "kickpass.h"
+#include "kdf.h"
 
 #ifndef KP_METADATA_TEMPLATE
 #define KP_METADATA_TEMPLATE "url: \n"                                         \
@@ -27,21 +30,50 @@
                              "comment: \n"
 #endif
 
-#define KP_PLAIN_MAX_SIZE (KP_PASSWORD_MAX_LEN + KP_METADATA_MAX_LEN)
-
 #define KP_CREATE 1
 #define KP_FORCE  2
 
+#define KP_SAFE_ID_NONCE_SIZE 24
+
+/*
+ * What tells a safe file apart from any other version of it. Header nonce is
+ * renewed on each save, thus a safe restored with its old size and mtime
+ * still differs. All zero when unknown.
+ */
+struct kp_safe_id {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;  /* nanoseconds */
+	unsigned char nonce[KP_SAFE_ID_NONCE_SIZE];
+};
+
 /*
  * A safe is either open or close.
  * Plain data are stored in memory.
  * Cipher data are stored in file.
+ * Password and metadata share a single allocation of the exact size, use
+ * kp_safe_set to change them.
  */
 struct kp_safe {
 	bool open;           /* whether the safe is open or not */
 	char name[PATH_MAX]; /* name of the safe */
 	char * const password;      /* plain text password (null terminated) */
 	char * const metadata;      /* plain text metadata (null terminated) */
+	struct kp_safe_id id;       /* file it was read from or saved to */
+};
+
+/*
+ * What a safe header tells, known without the master password.
+ */
+struct kp_safe_stat {
+	unsigned int version;         /* storage version */
+	enum kp_kdf kdf;              /* kdf of the master key */
+	long long unsigned opslimit;
+	size_t memlimit;
+	unsigned int parallelism;
+	size_t size;                  /* size of the encrypted payload */
+	time_t mtime;                 /* last modification time */
 };
 
 kp_error_t kp_safe_init(struct kp_ctx *, struct kp_safe *, const char *);
@@ -49,8 +81,16 @@ kp_error_t kp_safe_open(struct kp_ctx *, struct kp_safe *, int);
 kp_error_t kp_safe_save(struct kp_ctx *, struct kp_safe *);
 kp_error_t kp_safe_close(struct kp_ctx *, struct kp_safe *);
 kp_error_t kp_safe_delete(struct kp_ctx *, struct kp_safe *);
+kp_error_t kp_safe_set(struct kp_safe *, const char *, const char *);
+kp_error_t kp_safe_set_password(struct kp_safe *, const char *);
+kp_error_t kp_safe_set_metadata(struct kp_safe *, const char *);
 kp_error_t kp_safe_rename(struct kp_ctx *, struct kp_safe *, const char *);
-kp_error_t kp_safe_store(struct kp_ctx *, struct kp_safe *, int);
+kp_error_t kp_safe_store(struct kp_ctx *, struct kp_safe *, int, bool);
+kp_error_t kp_safe_rewrap(struct kp_ctx *, struct kp_safe *, const char *,
+                          struct kp_key *);
+kp_error_t kp_safe_stat(struct kp_ctx *, struct kp_safe *,
+                        struct kp_safe_stat *);
+bool       kp_safe_id_known(const struct kp_safe_id *);
 
 
 #endif /* KP_SAFE_H */
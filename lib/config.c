@@ -16,6 +16,7 @@
 
 #include <sys/stat.h>
 
+#include <sodium.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,15 +24,12 @@
 #include "kickpass.h"
 
 #include "config.h"
+#include "kdf.h"
 #include "safe.h"
 
-#define KP_CONFIG_SAFE_NAME ".config"
-#define KP_CONFIG_TEMPLATE \
-	"memlimit: %lu\n" \
-	"opslimit: %llu\n" \
-
 #define CONFIG(name, type) { .key = #name, \
                              .offset = (size_t)((const volatile void *)&((struct kp_ctx *)0)->cfg.name), \
+                             .size = sizeof(((struct kp_ctx *)0)->cfg.name), \
                              .getter = type ## _config_getter, \
                              .setter = type ## _config_setter }
 #define CONFIG_GET(config, ctx, type) ((type *)(&((char *)ctx)[config->offset]))
@@ -42,19 +40,31 @@ struct config;
 
 static int config_sort(const void *, const void *);
 static int config_search(const void *, const void *);
+static kp_error_t kp_cfg_dump(struct kp_ctx *, char *, size_t);
+static bool kp_cfg_has_salt(struct kp_ctx *);
 static kp_error_t size_t_config_getter(struct config *, struct kp_ctx *, char **);
 static kp_error_t size_t_config_setter(struct config *, struct kp_ctx *, char *);
+static kp_error_t uint_config_getter(struct config *, struct kp_ctx *, char **);
+static kp_error_t uint_config_setter(struct config *, struct kp_ctx *, char *);
 static kp_error_t llu_config_getter(struct config *, struct kp_ctx *, char **);
 static kp_error_t llu_config_setter(struct config *, struct kp_ctx *, char *);
+static kp_error_t hex_config_getter(struct config *, struct kp_ctx *, char **);
+static kp_error_t hex_config_setter(struct config *, struct kp_ctx *, char *);
+static kp_error_t kdf_config_getter(struct config *, struct kp_ctx *, char **);
+static kp_error_t kdf_config_setter(struct config *, struct kp_ctx *, char *);
 
 struct config {
 	char *key;
 	size_t offset;
+	size_t size;
 	kp_error_t (*getter)(struct config *, struct kp_ctx *, char **);
 	kp_error_t (*setter)(struct config *, struct kp_ctx *, char *);
 } configs[] = {
+	CONFIG(kdf, kdf),
 	CONFIG(memlimit, size_t),
 	CONFIG(opslimit, llu),
+	CONFIG(parallelism, uint),
+	CONFIG(salt, hex),
 };
 
 kp_error_t
@@ -63,6 +73,7 @@ kp_cfg_create(struct kp_ctx *ctx, const char *sub)
 	kp_error_t ret;
 	char path[PATH_MAX] = "";
 	struct kp_safe cfg_safe;
+	char metadata[KP_METADATA_MAX_LEN];
 
 	if (snprintf(path, PATH_MAX, "%s%s" KP_CONFIG_SAFE_NAME,
 	    sub, strlen(sub) == 0 ? "": "/") >= PATH_MAX) {
@@ -78,9 +89,17 @@ kp_cfg_create(struct kp_ctx *ctx, const char *sub)
 		return ret;
 	}
 
-	snprintf(cfg_safe.password, KP_PASSWORD_MAX_LEN, "%s", "");
-	snprintf(cfg_safe.metadata, KP_METADATA_MAX_LEN, KP_CONFIG_TEMPLATE,
-	         ctx->cfg.memlimit, ctx->cfg.opslimit);
+	/* New workspace, new master key salt */
+	randombytes_buf(ctx->cfg.salt, KP_KDF_SALT_SIZE);
+
+	if ((ret = kp_cfg_dump(ctx, metadata, KP_METADATA_MAX_LEN))
+	    != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = kp_safe_set(&cfg_safe, "", metadata)) != KP_SUCCESS) {
+		return ret;
+	}
 
 	if ((ret = kp_safe_save(ctx, &cfg_safe)) != KP_SUCCESS) {
 		return ret;
@@ -100,6 +119,7 @@ kp_cfg_load(struct kp_ctx *ctx, const char *sub)
 	kp_error_t ret;
 	char path[PATH_MAX] = "";
 	struct kp_safe cfg_safe;
+	char metadata[KP_METADATA_MAX_LEN];
 	char *line = NULL, *save_line = NULL;
 
 	if (snprintf(path, PATH_MAX, "%s%s" KP_CONFIG_SAFE_NAME,
@@ -116,8 +136,14 @@ kp_cfg_load(struct kp_ctx *ctx, const char *sub)
 		return ret;
 	}
 
+	/* Start from defaults, ctx might have loaded another workspace */
+	if ((ret = kp_kdf_defaults(ctx, KP_KDF_SCRYPT)) != KP_SUCCESS) {
+		return ret;
+	}
+	memset(ctx->cfg.salt, 0, KP_KDF_SALT_SIZE);
+
 	if (ctx->agent.connected) {
-		if ((ret = kp_safe_store(ctx, &cfg_safe, 3600)) != KP_SUCCESS) {
+		if ((ret = kp_safe_store(ctx, &cfg_safe, 3600, false)) != KP_SUCCESS) {
 			return ret;
 		}
 	}
@@ -133,13 +159,32 @@ kp_cfg_load(struct kp_ctx *ctx, const char *sub)
 		value = strtok(NULL, ":");
 
 		config = bsearch(key, configs, N_CONFIG, sizeof(struct config), config_search);
-		if (config != NULL) {
+		if (config != NULL && value != NULL) {
 			config->setter(config, ctx, value);
 		}
 
 		line = strtok_r(NULL, "\n", &save_line);
 	}
 
+	/* Workspace created before master key got a salt, upgrade its config */
+	if (!kp_cfg_has_salt(ctx)) {
+		randombytes_buf(ctx->cfg.salt, KP_KDF_SALT_SIZE);
+
+		if ((ret = kp_cfg_dump(ctx, metadata, KP_METADATA_MAX_LEN))
+		    != KP_SUCCESS) {
+			return ret;
+		}
+
+		if ((ret = kp_safe_set_metadata(&cfg_safe, metadata))
+		    != KP_SUCCESS) {
+			return ret;
+		}
+
+		if ((ret = kp_safe_save(ctx, &cfg_safe)) != KP_SUCCESS) {
+			return ret;
+		}
+	}
+
 	if ((ret = kp_safe_close(ctx, &cfg_safe)) != KP_SUCCESS) {
 		return ret;
 	}
@@ -150,8 +195,42 @@ kp_cfg_load(struct kp_ctx *ctx, const char *sub)
 kp_error_t
 kp_cfg_save(struct kp_ctx *ctx, const char *sub)
 {
-	/* Nothing to do for now */
-	return KP_SUCCESS;
+	kp_error_t ret;
+	char path[PATH_MAX] = "";
+	struct kp_safe cfg_safe;
+	char metadata[KP_METADATA_MAX_LEN];
+
+	if (snprintf(path, PATH_MAX, "%s%s" KP_CONFIG_SAFE_NAME,
+	    sub, strlen(sub) == 0 ? "": "/") >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return KP_ERRNO;
+	}
+
+	if ((ret = kp_safe_init(ctx, &cfg_safe, path)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = kp_safe_open(ctx, &cfg_safe, KP_FORCE)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = kp_cfg_dump(ctx, metadata, KP_METADATA_MAX_LEN))
+	    != KP_SUCCESS) {
+		goto out;
+	}
+
+	if ((ret = kp_safe_set_metadata(&cfg_safe, metadata)) != KP_SUCCESS) {
+		goto out;
+	}
+
+	if ((ret = kp_safe_save(ctx, &cfg_safe)) != KP_SUCCESS) {
+		goto out;
+	}
+
+out:
+	kp_safe_close(ctx, &cfg_safe);
+
+	return ret;
 }
 
 kp_error_t
@@ -195,6 +274,46 @@ kp_cfg_find(struct kp_ctx *ctx, const char *path, char *cfg_path, size_t size)
 	return KP_SUCCESS;
 }
 
+static kp_error_t
+kp_cfg_dump(struct kp_ctx *ctx, char *dump, size_t size)
+{
+	kp_error_t ret;
+	size_t i, len = 0;
+
+	dump[0] = '\0';
+
+	for (i = 0; i < N_CONFIG; i++) {
+		struct config *config = &configs[i];
+		char *value = NULL;
+		int written;
+
+		if ((ret = config->getter(config, ctx, &value)) != KP_SUCCESS) {
+			return ret;
+		}
+
+		written = snprintf(dump + len, size - len, "%s: %s\n",
+		                   config->key, value);
+		free(value);
+
+		if (written < 0 || (size_t)written >= size - len) {
+			errno = ENOMEM;
+			return KP_ERRNO;
+		}
+
+		len += written;
+	}
+
+	return KP_SUCCESS;
+}
+
+static bool
+kp_cfg_has_salt(struct kp_ctx *ctx)
+{
+	static const unsigned char zero[KP_KDF_SALT_SIZE] = { 0 };
+
+	return sodium_memcmp(ctx->cfg.salt, zero, KP_KDF_SALT_SIZE) != 0;
+}
+
 static int
 config_sort(const void *a, const void *b)
 {
@@ -231,6 +350,30 @@ size_t_config_getter(struct config *config, struct kp_ctx *ctx, char **str_value
 	return KP_SUCCESS;
 }
 
+static kp_error_t
+uint_config_setter(struct config *config, struct kp_ctx *ctx, char *str_value)
+{
+	unsigned int *value = NULL;
+	value = CONFIG_GET(config, ctx, unsigned int);
+
+	*value = strtoul(str_value, NULL, 10);
+
+	return KP_SUCCESS;
+}
+
+static kp_error_t
+uint_config_getter(struct config *config, struct kp_ctx *ctx, char **str_value)
+{
+	unsigned int *value = NULL;
+	value = CONFIG_GET(config, ctx, unsigned int);
+	if (asprintf(str_value, "%u", *value) < 0) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	return KP_SUCCESS;
+}
+
 static kp_error_t
 llu_config_setter(struct config *config, struct kp_ctx *ctx, char *str_value)
 {
@@ -254,3 +397,65 @@ llu_config_getter(struct config *config, struct kp_ctx *ctx, char **str_value)
 
 	return KP_SUCCESS;
 }
+
+static kp_error_t
+hex_config_setter(struct config *config, struct kp_ctx *ctx, char *str_value)
+{
+	unsigned char *value = NULL;
+	size_t len;
+	value = CONFIG_GET(config, ctx, unsigned char);
+
+	if (sodium_hex2bin(value, config->size, str_value, strlen(str_value),
+	                   " ", &len, NULL) != 0 || len != config->size) {
+		memset(value, 0, config->size);
+		return KP_EINPUT;
+	}
+
+	return KP_SUCCESS;
+}
+
+static kp_error_t
+hex_config_getter(struct config *config, struct kp_ctx *ctx, char **str_value)
+{
+	unsigned char *value = NULL;
+	value = CONFIG_GET(config, ctx, unsigned char);
+
+	if ((*str_value = malloc(config->size * 2 + 1)) == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	sodium_bin2hex(*str_value, config->size * 2 + 1, value, config->size);
+
+	return KP_SUCCESS;
+}
+
+static kp_error_t
+kdf_config_setter(struct config *config, struct kp_ctx *ctx, char *str_value)
+{
+	enum kp_kdf *value = NULL;
+	value = CONFIG_GET(config, ctx, enum kp_kdf);
+
+	str_value += strspn(str_value, " ");
+
+	return kp_kdf_from_name(str_value, value);
+}
+
+static kp_error_t
+kdf_config_getter(struct config *config, struct kp_ctx *ctx, char **str_value)
+{
+	enum kp_kdf *value = NULL;
+	const char *name;
+	value = CONFIG_GET(config, ctx, enum kp_kdf);
+
+	if ((name = kp_kdf_name(*value)) == NULL) {
+		return KP_EINPUT;
+	}
+
+	if ((*str_value = strdup(name)) == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	return KP_SUCCESS;
+}
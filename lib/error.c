@@ -29,6 +29,8 @@ static const char *errstr[] = {
 	"invalid message",
 	"",
 	"no prompt set in ctx",
+	"agent is locked",
+	"safe is encrypted with AES-256-GCM, this cpu lacks AES instructions",
 };
 
 const char *
@@ -0,0 +1,491 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/tree.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <sodium.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "index.h"
+
+#define KP_INDEX_MIN_CAPACITY 16
+
+/*
+ * Prefix tree node, one per path component. Name is not null terminated,
+ * so that a component can be looked up in place.
+ */
+struct kp_index_node {
+	RB_ENTRY(kp_index_node) tree;
+	RB_HEAD(kp_index_nodes, kp_index_node) children;
+	struct kp_index_node *parent;
+	struct kp_index_entry *entry;
+	const char *name;
+	size_t len;
+	char buf[];
+};
+
+static int node_cmp(struct kp_index_node *, struct kp_index_node *);
+
+RB_PROTOTYPE_STATIC(kp_index_nodes, kp_index_node, tree, node_cmp);
+
+static uint64_t kp_index_hash(struct kp_index *, const char *);
+static struct kp_index_entry *kp_index_lookup(struct kp_index *, const char *,
+                                              uint64_t);
+static kp_error_t kp_index_resize(struct kp_index *, size_t);
+static const char *kp_index_component(const char *, size_t *);
+static struct kp_index_node *kp_index_node_new(struct kp_index_node *,
+                                               const char *, size_t);
+static void kp_index_prune(struct kp_index *, struct kp_index_node *);
+static void kp_index_node_free(struct kp_index_node *);
+static int kp_index_visit(struct kp_index_node *, const char *, const char *,
+                          size_t, int (*)(struct kp_index_entry *, void *),
+                          void *);
+
+void
+kp_index_init(struct kp_index *index)
+{
+	assert(index);
+
+	index->slots = NULL;
+	index->capacity = 0;
+	index->count = 0;
+	index->root = NULL;
+	randombytes_buf(index->key, KP_INDEX_KEY_SIZE);
+}
+
+/*
+ * Release index memory. Entries themselves belong to the caller.
+ */
+void
+kp_index_fini(struct kp_index *index)
+{
+	assert(index);
+
+	if (index->root != NULL) {
+		kp_index_node_free(index->root);
+		index->root = NULL;
+	}
+
+	free(index->slots);
+	index->slots = NULL;
+	index->capacity = 0;
+	index->count = 0;
+	sodium_memzero(index->key, KP_INDEX_KEY_SIZE);
+}
+
+kp_error_t
+kp_index_insert(struct kp_index *index, struct kp_index_entry *entry)
+{
+	kp_error_t ret;
+	struct kp_index_node *node, *child, needle;
+	const char *component;
+	uint64_t hash;
+	size_t i, mask;
+
+	assert(index);
+	assert(entry);
+	assert(entry->name);
+
+	hash = kp_index_hash(index, entry->name);
+	if (kp_index_lookup(index, entry->name, hash) != NULL) {
+		errno = EEXIST;
+		return KP_ERRNO;
+	}
+
+	/* Keep load factor under 3/4 */
+	if ((index->count + 1) * 4 > index->capacity * 3) {
+		if ((ret = kp_index_resize(index, index->capacity
+		                           ? index->capacity * 2
+		                           : KP_INDEX_MIN_CAPACITY))
+		    != KP_SUCCESS) {
+			return ret;
+		}
+	}
+
+	if (index->root == NULL) {
+		if ((index->root = kp_index_node_new(NULL, "", 0)) == NULL) {
+			errno = ENOMEM;
+			return KP_ERRNO;
+		}
+	}
+
+	node = index->root;
+	component = entry->name;
+	while ((component = kp_index_component(component, &needle.len))
+	       != NULL) {
+		needle.name = component;
+		if ((child = RB_FIND(kp_index_nodes, &node->children, &needle))
+		    == NULL) {
+			child = kp_index_node_new(node, component, needle.len);
+			if (child == NULL) {
+				kp_index_prune(index, node);
+				errno = ENOMEM;
+				return KP_ERRNO;
+			}
+		}
+		node = child;
+		component += needle.len;
+	}
+
+	/* Name made of separators only, or already indexed with another
+	 * spelling such as a trailing '/' */
+	if (node == index->root || node->entry != NULL) {
+		kp_index_prune(index, node);
+		errno = EINVAL;
+		return KP_ERRNO;
+	}
+
+	node->entry = entry;
+	entry->node = node;
+	entry->hash = hash;
+
+	mask = index->capacity - 1;
+	for (i = entry->hash & mask; index->slots[i] != NULL;
+	     i = (i + 1) & mask);
+	index->slots[i] = entry;
+	index->count++;
+
+	return KP_SUCCESS;
+}
+
+struct kp_index_entry *
+kp_index_find(struct kp_index *index, const char *name)
+{
+	assert(index);
+	assert(name);
+
+	if (index->count == 0) {
+		return NULL;
+	}
+
+	return kp_index_lookup(index, name, kp_index_hash(index, name));
+}
+
+void
+kp_index_remove(struct kp_index *index, struct kp_index_entry *entry)
+{
+	size_t i, j, home, mask;
+
+	assert(index);
+	assert(entry);
+
+	mask = index->capacity - 1;
+	for (i = entry->hash & mask; index->slots[i] != entry;
+	     i = (i + 1) & mask);
+
+	/* Shift following entries back instead of leaving a tombstone, an
+	 * entry moves unless its home slot lies cyclically in (i, j] */
+	for (j = (i + 1) & mask; index->slots[j] != NULL; j = (j + 1) & mask) {
+		home = index->slots[j]->hash & mask;
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+			continue;
+		}
+		index->slots[i] = index->slots[j];
+		i = j;
+	}
+	index->slots[i] = NULL;
+	index->count--;
+
+	entry->node->entry = NULL;
+	kp_index_prune(index, entry->node);
+	entry->node = NULL;
+
+	/* Failing to shrink is harmless */
+	if (index->capacity > KP_INDEX_MIN_CAPACITY
+	    && index->count * 8 < index->capacity) {
+		kp_index_resize(index, index->capacity / 2);
+	}
+}
+
+/*
+ * Call cb on every entry whose name starts with prefix, in component order,
+ * starting past after if not NULL. A prefix ending with '/' matches whole
+ * components only. Walk stops as soon as cb returns non zero. cb must not
+ * modify index.
+ */
+void
+kp_index_walk(struct kp_index *index, const char *prefix, const char *after,
+              int (*cb)(struct kp_index_entry *, void *), void *arg)
+{
+	struct kp_index_node *node, needle, bound;
+	const char *component, *partial = NULL;
+	size_t partial_len = 0;
+	int cmp;
+
+	assert(index);
+	assert(prefix);
+	assert(cb);
+
+	if ((node = index->root) == NULL) {
+		return;
+	}
+
+	component = prefix;
+	while ((component = kp_index_component(component, &needle.len))
+	       != NULL) {
+		/* Last component matches partially, unless followed by '/' */
+		if (component[needle.len] == '\0') {
+			partial = component;
+			partial_len = needle.len;
+			break;
+		}
+
+		needle.name = component;
+		if ((node = RB_FIND(kp_index_nodes, &node->children, &needle))
+		    == NULL) {
+			return;
+		}
+		component += needle.len;
+
+		/* Keep after relative to node */
+		if (after == NULL) {
+			continue;
+		}
+		if ((bound.name = kp_index_component(after, &bound.len))
+		    == NULL) {
+			/* Node lies below after, so does its whole subtree */
+			after = NULL;
+		} else if ((cmp = node_cmp(&bound, &needle)) < 0) {
+			after = NULL;
+		} else if (cmp > 0) {
+			return;
+		} else {
+			after = bound.name + bound.len;
+		}
+	}
+
+	kp_index_visit(node, after, partial, partial_len, cb, arg);
+}
+
+static uint64_t
+kp_index_hash(struct kp_index *index, const char *name)
+{
+	unsigned char out[crypto_shorthash_BYTES];
+	uint64_t hash;
+
+	crypto_shorthash(out, (const unsigned char *)name, strlen(name),
+	                 index->key);
+	memcpy(&hash, out, sizeof(hash));
+
+	return hash;
+}
+
+static struct kp_index_entry *
+kp_index_lookup(struct kp_index *index, const char *name, uint64_t hash)
+{
+	struct kp_index_entry *entry;
+	size_t i, mask;
+
+	if (index->capacity == 0) {
+		return NULL;
+	}
+
+	mask = index->capacity - 1;
+	for (i = hash & mask; (entry = index->slots[i]) != NULL;
+	     i = (i + 1) & mask) {
+		if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static kp_error_t
+kp_index_resize(struct kp_index *index, size_t capacity)
+{
+	struct kp_index_entry **slots;
+	size_t i, j, mask = capacity - 1;
+
+	if ((slots = calloc(capacity, sizeof(struct kp_index_entry *)))
+	    == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	for (i = 0; i < index->capacity; i++) {
+		if (index->slots[i] == NULL) {
+			continue;
+		}
+		for (j = index->slots[i]->hash & mask; slots[j] != NULL;
+		     j = (j + 1) & mask);
+		slots[j] = index->slots[i];
+	}
+
+	free(index->slots);
+	index->slots = slots;
+	index->capacity = capacity;
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Skip separators and return next component of path, NULL at end of path.
+ */
+static const char *
+kp_index_component(const char *path, size_t *len)
+{
+	while (*path == '/') {
+		path++;
+	}
+
+	if (*path == '\0') {
+		return NULL;
+	}
+
+	*len = strcspn(path, "/");
+
+	return path;
+}
+
+static struct kp_index_node *
+kp_index_node_new(struct kp_index_node *parent, const char *name, size_t len)
+{
+	struct kp_index_node *node;
+
+	if ((node = malloc(sizeof(struct kp_index_node) + len)) == NULL) {
+		return NULL;
+	}
+
+	RB_INIT(&node->children);
+	node->parent = parent;
+	node->entry = NULL;
+	memcpy(node->buf, name, len);
+	node->name = node->buf;
+	node->len = len;
+
+	if (parent != NULL) {
+		RB_INSERT(kp_index_nodes, &parent->children, node);
+	}
+
+	return node;
+}
+
+/*
+ * Free node and its ancestors as long as they lead to no entry.
+ */
+static void
+kp_index_prune(struct kp_index *index, struct kp_index_node *node)
+{
+	struct kp_index_node *parent;
+
+	while (node != NULL && node->entry == NULL
+	       && RB_EMPTY(&node->children)) {
+		parent = node->parent;
+		if (parent != NULL) {
+			RB_REMOVE(kp_index_nodes, &parent->children, node);
+		} else {
+			index->root = NULL;
+		}
+		free(node);
+		node = parent;
+	}
+}
+
+static void
+kp_index_node_free(struct kp_index_node *node)
+{
+	struct kp_index_node *child, *next;
+
+	RB_FOREACH_SAFE(child, kp_index_nodes, &node->children, next) {
+		RB_REMOVE(kp_index_nodes, &node->children, child);
+		kp_index_node_free(child);
+	}
+
+	if (node->entry != NULL) {
+		node->entry->node = NULL;
+	}
+	free(node);
+}
+
+/*
+ * Visit node and its subtree, or only children starting with partial if not
+ * NULL. After, relative to node, skips everything up to it: children before
+ * it are not even looked at.
+ */
+static int
+kp_index_visit(struct kp_index_node *node, const char *after,
+               const char *partial, size_t partial_len,
+               int (*cb)(struct kp_index_entry *, void *), void *arg)
+{
+	struct kp_index_node *child, *from, bound, filter;
+	int stop;
+
+	bound.name = NULL;
+	if (after != NULL) {
+		bound.name = kp_index_component(after, &bound.len);
+	}
+
+	/* Node comes before its subtree, after is node itself or below it */
+	if (after == NULL && partial == NULL && node->entry != NULL
+	    && (stop = cb(node->entry, arg)) != 0) {
+		return stop;
+	}
+
+	if (bound.name != NULL) {
+		child = RB_NFIND(kp_index_nodes, &node->children, &bound);
+	} else {
+		child = RB_MIN(kp_index_nodes, &node->children);
+	}
+
+	if (partial != NULL && child != NULL) {
+		filter.name = partial;
+		filter.len = partial_len;
+		from = RB_NFIND(kp_index_nodes, &node->children, &filter);
+		if (from == NULL || node_cmp(from, child) > 0) {
+			child = from;
+		}
+	}
+
+	for (; child != NULL;
+	     child = RB_NEXT(kp_index_nodes, &node->children, child)) {
+		if (partial != NULL && (child->len < partial_len
+		    || memcmp(child->name, partial, partial_len) != 0)) {
+			break;
+		}
+
+		/* Only the child on the path to after is partly skipped */
+		if ((stop = kp_index_visit(child, bound.name != NULL
+		                           && node_cmp(child, &bound) == 0
+		                           ? bound.name + bound.len : NULL,
+		                           NULL, 0, cb, arg)) != 0) {
+			return stop;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Components compare as strcmp would, without null termination.
+ */
+static int
+node_cmp(struct kp_index_node *a, struct kp_index_node *b)
+{
+	int cmp;
+
+	if ((cmp = memcmp(a->name, b->name, a->len < b->len ? a->len : b->len))
+	    != 0) {
+		return cmp;
+	}
+
+	return (a->len > b->len) - (a->len < b->len);
+}
+
+RB_GENERATE_STATIC(kp_index_nodes, kp_index_node, tree, node_cmp);
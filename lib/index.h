@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef KP_INDEX_H
+#define KP_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kickpass.h"
+
+#define KP_INDEX_KEY_SIZE 16
+
+struct kp_index_node;
+
+/*
+ * Entry to embed in whatever is indexed by name. Name must stay valid as
+ * long as entry is indexed.
+ */
+struct kp_index_entry {
+	const char *name;
+	uint64_t hash;
+	struct kp_index_node *node; /* prefix tree leaf */
+	void *data;
+};
+
+/*
+ * Names are both hashed, for exact lookups, and split on '/' into a prefix
+ * tree ordered by component, for subtree walks. Hash is keyed since names
+ * may come from clients.
+ */
+struct kp_index {
+	struct kp_index_entry **slots; /* open addressing, linear probing */
+	size_t capacity;
+	size_t count;
+	unsigned char key[KP_INDEX_KEY_SIZE];
+	struct kp_index_node *root;
+};
+
+void kp_index_init(struct kp_index *);
+void kp_index_fini(struct kp_index *);
+kp_error_t kp_index_insert(struct kp_index *, struct kp_index_entry *);
+struct kp_index_entry *kp_index_find(struct kp_index *, const char *);
+void kp_index_remove(struct kp_index *, struct kp_index_entry *);
+void kp_index_walk(struct kp_index *, const char *, const char *,
+                   int (*)(struct kp_index_entry *, void *), void *);
+
+#endif /* KP_INDEX_H */
@@ -0,0 +1,676 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sodium.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kickpass.h"
+
+#include "kdf.h"
+
+#define KP_KDF_LANE_KEY_SIZE 32
+#define KP_KDF_CALIBRATION_MIN_MEM (8 * 1024 * 1024)
+
+/*
+ * libsodium argon2id only compute a single lane. Parallelism is thus
+ * achieved by running independent lanes, each with its own salt and the whole
+ * memlimit, and by hashing their outputs together. This is what scrypt does
+ * with its p parameter. Memlimit is thus the memory hardness of every lane,
+ * a derivation holds parallelism times memlimit at once, see kp_kdf_mem.
+ */
+struct kp_kdf_lane {
+	pthread_t thread;
+	bool threaded;
+	int ret;
+	const char *password;
+	unsigned char salt[crypto_pwhash_argon2id_SALTBYTES];
+	long long unsigned opslimit;
+	size_t memlimit;
+	unsigned char *key;
+};
+
+static kp_error_t kp_kdf_argon2id(unsigned char *, size_t, const char *,
+                                  const unsigned char *, long long unsigned,
+                                  size_t, unsigned int);
+static void *kp_kdf_argon2id_lane(void *);
+static struct kp_key *kp_kdf_cache_find(struct kp_ctx *, enum kp_kdf,
+                                        const unsigned char *,
+                                        long long unsigned, size_t,
+                                        unsigned int);
+static size_t kp_kdf_min_memlimit(enum kp_kdf, unsigned int);
+static long long unsigned kp_kdf_base_opslimit(enum kp_kdf, size_t);
+static kp_error_t kp_kdf_time(enum kp_kdf, long long unsigned, size_t,
+                              unsigned int, uint64_t *);
+
+static const char *kp_kdf_names[] = {
+	[KP_KDF_SCRYPT]   = "scrypt",
+	[KP_KDF_ARGON2ID] = "argon2id",
+};
+
+kp_error_t
+kp_kdf_derive(enum kp_kdf kdf, unsigned char *key, size_t key_size,
+              const char *password, const unsigned char *salt,
+              long long unsigned opslimit, size_t memlimit,
+              unsigned int parallelism)
+{
+	assert(key);
+	assert(password);
+	assert(salt);
+
+	switch (kdf) {
+	case KP_KDF_SCRYPT:
+		if (parallelism != 1) {
+			return KP_EINPUT;
+		}
+
+		if (crypto_pwhash_scryptsalsa208sha256(key, key_size,
+		                                       password,
+		                                       strlen(password),
+		                                       salt, opslimit,
+		                                       memlimit) != 0) {
+			errno = ENOMEM;
+			return KP_ERRNO;
+		}
+		break;
+	case KP_KDF_ARGON2ID:
+		return kp_kdf_argon2id(key, key_size, password, salt,
+		                       opslimit, memlimit, parallelism);
+	default:
+		return KP_EINPUT;
+	}
+
+	return KP_SUCCESS;
+}
+
+kp_error_t
+kp_kdf_defaults(struct kp_ctx *ctx, enum kp_kdf kdf)
+{
+	assert(ctx);
+
+	switch (kdf) {
+	case KP_KDF_SCRYPT:
+		ctx->cfg.memlimit = crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_SENSITIVE/5;
+		ctx->cfg.opslimit = crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_SENSITIVE/5;
+		ctx->cfg.parallelism = 1;
+		break;
+	case KP_KDF_ARGON2ID:
+		/* 4 lanes of 64 MiB each */
+		ctx->cfg.memlimit = crypto_pwhash_argon2id_MEMLIMIT_SENSITIVE/16;
+		ctx->cfg.opslimit = crypto_pwhash_argon2id_OPSLIMIT_SENSITIVE;
+		ctx->cfg.parallelism = 4;
+		break;
+	default:
+		return KP_EINPUT;
+	}
+
+	ctx->cfg.kdf = kdf;
+
+	return KP_SUCCESS;
+}
+
+kp_error_t
+kp_kdf_cache_init(struct kp_ctx *ctx)
+{
+	struct kp_key **keys;
+
+	assert(ctx);
+
+	keys = (struct kp_key **)&ctx->cache.keys;
+
+	*keys = sodium_allocarray(KP_KEY_CACHE_SIZE, sizeof(struct kp_key));
+	if (!ctx->cache.keys) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	if ((errno = pthread_mutex_init(&ctx->cache.lock, NULL)) != 0) {
+		sodium_free(ctx->cache.keys);
+		*keys = NULL;
+		return KP_ERRNO;
+	}
+
+	kp_kdf_cache_clear(ctx);
+
+	return KP_SUCCESS;
+}
+
+kp_error_t
+kp_kdf_cache_fini(struct kp_ctx *ctx)
+{
+	struct kp_key **keys;
+
+	assert(ctx);
+
+	keys = (struct kp_key **)&ctx->cache.keys;
+
+	if (ctx->cache.keys == NULL) {
+		return KP_SUCCESS;
+	}
+
+	pthread_mutex_destroy(&ctx->cache.lock);
+	sodium_free(ctx->cache.keys);
+	*keys = NULL;
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Derive a key from master password into key, unless one was already derived
+ * with the same parameters by this ctx.
+ * Cache is shared by threads, but derivation is done without holding the
+ * lock, so that threads can derive different keys concurrently.
+ */
+kp_error_t
+kp_kdf_cache_derive(struct kp_ctx *ctx, enum kp_kdf kdf,
+                    const unsigned char *salt, long long unsigned opslimit,
+                    size_t memlimit, unsigned int parallelism,
+                    unsigned char *key)
+{
+	kp_error_t ret;
+	struct kp_key *entry;
+
+	assert(ctx);
+	assert(salt);
+	assert(key);
+
+	pthread_mutex_lock(&ctx->cache.lock);
+	entry = kp_kdf_cache_find(ctx, kdf, salt, opslimit, memlimit,
+	                          parallelism);
+	if (entry != NULL) {
+		memcpy(key, entry->key, KP_MASTER_KEY_SIZE);
+		pthread_mutex_unlock(&ctx->cache.lock);
+		return KP_SUCCESS;
+	}
+	pthread_mutex_unlock(&ctx->cache.lock);
+
+	if ((ret = kp_kdf_derive(kdf, key, KP_MASTER_KEY_SIZE,
+	                         ctx->password, salt, opslimit, memlimit,
+	                         parallelism)) != KP_SUCCESS) {
+		sodium_memzero(key, KP_MASTER_KEY_SIZE);
+		return ret;
+	}
+
+	kp_kdf_cache_add(ctx, kdf, salt, opslimit, memlimit, parallelism, key);
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Copy a key already derived with given parameters, without deriving it on a
+ * miss. Return whether it was found.
+ */
+bool
+kp_kdf_cache_lookup(struct kp_ctx *ctx, enum kp_kdf kdf,
+                    const unsigned char *salt, long long unsigned opslimit,
+                    size_t memlimit, unsigned int parallelism,
+                    unsigned char *key)
+{
+	struct kp_key *entry;
+
+	assert(ctx);
+	assert(salt);
+	assert(key);
+
+	pthread_mutex_lock(&ctx->cache.lock);
+	entry = kp_kdf_cache_find(ctx, kdf, salt, opslimit, memlimit,
+	                          parallelism);
+	if (entry != NULL) {
+		memcpy(key, entry->key, KP_MASTER_KEY_SIZE);
+	}
+	pthread_mutex_unlock(&ctx->cache.lock);
+
+	return entry != NULL;
+}
+
+/*
+ * Cache a key derived with given parameters, evicting the oldest one.
+ */
+void
+kp_kdf_cache_add(struct kp_ctx *ctx, enum kp_kdf kdf,
+                 const unsigned char *salt, long long unsigned opslimit,
+                 size_t memlimit, unsigned int parallelism,
+                 const unsigned char *key)
+{
+	struct kp_key *entry;
+
+	assert(ctx);
+	assert(salt);
+	assert(key);
+
+	pthread_mutex_lock(&ctx->cache.lock);
+	entry = &ctx->cache.keys[ctx->cache.next];
+	ctx->cache.next = (ctx->cache.next + 1) % KP_KEY_CACHE_SIZE;
+
+	entry->kdf = kdf;
+	entry->opslimit = opslimit;
+	entry->memlimit = memlimit;
+	entry->parallelism = parallelism;
+	memcpy(entry->salt, salt, KP_KDF_SALT_SIZE);
+	memcpy(entry->key, key, KP_MASTER_KEY_SIZE);
+	entry->used = true;
+	pthread_mutex_unlock(&ctx->cache.lock);
+}
+
+/*
+ * Copy cached keys, oldest first, into keys which holds KP_KEY_CACHE_SIZE
+ * of them. Return how many were copied.
+ */
+size_t
+kp_kdf_cache_export(struct kp_ctx *ctx, struct kp_key *keys)
+{
+	struct kp_key *entry;
+	size_t i, n = 0;
+
+	assert(ctx);
+	assert(keys);
+
+	pthread_mutex_lock(&ctx->cache.lock);
+	for (i = 0; i < KP_KEY_CACHE_SIZE; i++) {
+		entry = &ctx->cache.keys[(ctx->cache.next + i)
+		                         % KP_KEY_CACHE_SIZE];
+		if (entry->used) {
+			memcpy(&keys[n++], entry, sizeof(struct kp_key));
+		}
+	}
+	pthread_mutex_unlock(&ctx->cache.lock);
+
+	return n;
+}
+
+/*
+ * Drop a cached key, it might come from a wrong password.
+ */
+void
+kp_kdf_cache_forget(struct kp_ctx *ctx, enum kp_kdf kdf,
+                    const unsigned char *salt, long long unsigned opslimit,
+                    size_t memlimit, unsigned int parallelism)
+{
+	struct kp_key *entry;
+
+	pthread_mutex_lock(&ctx->cache.lock);
+	entry = kp_kdf_cache_find(ctx, kdf, salt, opslimit, memlimit,
+	                          parallelism);
+	if (entry != NULL) {
+		sodium_memzero(entry, sizeof(struct kp_key));
+	}
+	pthread_mutex_unlock(&ctx->cache.lock);
+}
+
+/*
+ * Whether key was derived with given parameters.
+ */
+bool
+kp_kdf_key_match(const struct kp_key *key, enum kp_kdf kdf,
+                 const unsigned char *salt, long long unsigned opslimit,
+                 size_t memlimit, unsigned int parallelism)
+{
+	assert(key);
+	assert(salt);
+
+	return key->used
+	    && key->kdf == kdf
+	    && key->opslimit == opslimit
+	    && key->memlimit == memlimit
+	    && key->parallelism == parallelism
+	    && sodium_memcmp(key->salt, salt, KP_KDF_SALT_SIZE) == 0;
+}
+
+void
+kp_kdf_cache_clear(struct kp_ctx *ctx)
+{
+	assert(ctx);
+
+	pthread_mutex_lock(&ctx->cache.lock);
+	sodium_memzero(ctx->cache.keys,
+	               KP_KEY_CACHE_SIZE * sizeof(struct kp_key));
+	ctx->cache.next = 0;
+	pthread_mutex_unlock(&ctx->cache.lock);
+}
+
+/*
+ * Find the strongest opslimit and memlimit meeting target_ms on this host.
+ * Memory is doubled up to max_mem, then for each memory the largest opslimit
+ * under target is searched, as the time is roughly linear in opslimit.
+ * Following argon2 recommendations, the largest memory wins.
+ * Result is stored in ctx cfg, elapsed is the measured derivation time.
+ */
+kp_error_t
+kp_kdf_calibrate(struct kp_ctx *ctx, unsigned int target_ms, size_t max_mem,
+                 unsigned int *elapsed_ms)
+{
+	kp_error_t ret;
+	enum kp_kdf kdf = ctx->cfg.kdf;
+	unsigned int parallelism = ctx->cfg.parallelism;
+	uint64_t target = (uint64_t)target_ms * 1000, base_us, us;
+	long long unsigned base, opslimit, best_ops = 0;
+	size_t memlimit, best_mem = 0;
+	uint64_t best_us = 0;
+
+	assert(ctx);
+	assert(elapsed_ms);
+
+	if (max_mem == 0) {
+		max_mem = kp_kdf_default_max_mem();
+	}
+
+	memlimit = kp_kdf_min_memlimit(kdf, parallelism);
+	if (memlimit == 0 || target == 0) {
+		return KP_EINPUT;
+	}
+
+	/* Ceiling is for the whole derivation, memlimit for one lane */
+	max_mem /= kp_kdf_mem(kdf, 1, parallelism);
+	if (max_mem < memlimit) {
+		return KP_EINPUT;
+	}
+
+	for (;;) {
+		base = kp_kdf_base_opslimit(kdf, memlimit);
+
+		if ((ret = kp_kdf_time(kdf, base, memlimit, parallelism,
+		                       &base_us)) != KP_SUCCESS) {
+			return ret;
+		}
+
+		if (base_us > target) {
+			/* Even the cheapest setting is too slow, keep it */
+			if (best_ops == 0) {
+				best_mem = memlimit;
+				best_ops = base;
+				best_us = base_us;
+			}
+			break;
+		}
+
+		opslimit = base * (target / (base_us ? base_us : 1));
+		us = base_us;
+		while (opslimit > base) {
+			if ((ret = kp_kdf_time(kdf, opslimit, memlimit,
+			                       parallelism, &us)) != KP_SUCCESS) {
+				return ret;
+			}
+
+			if (us <= target) {
+				break;
+			}
+
+			opslimit = opslimit * target / us;
+			if (opslimit <= base) {
+				opslimit = base;
+				us = base_us;
+			}
+		}
+
+		best_mem = memlimit;
+		best_ops = opslimit;
+		best_us = us;
+
+		if (memlimit >= max_mem) {
+			break;
+		}
+
+		memlimit = memlimit > max_mem / 2 ? max_mem : memlimit * 2;
+	}
+
+	ctx->cfg.memlimit = best_mem;
+	ctx->cfg.opslimit = best_ops;
+	*elapsed_ms = best_us / 1000;
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Memory a derivation holds at once, argon2id lanes each use memlimit.
+ */
+size_t
+kp_kdf_mem(enum kp_kdf kdf, size_t memlimit, unsigned int parallelism)
+{
+	if (kdf == KP_KDF_ARGON2ID && parallelism > 1) {
+		if (memlimit > SIZE_MAX / parallelism) {
+			return SIZE_MAX;
+		}
+		return memlimit * parallelism;
+	}
+
+	return memlimit;
+}
+
+/*
+ * A quarter of physical memory, within kdf sensitive limit.
+ */
+size_t
+kp_kdf_default_max_mem(void)
+{
+	long pages, page_size;
+	size_t max_mem = crypto_pwhash_argon2id_MEMLIMIT_SENSITIVE;
+
+	pages = sysconf(_SC_PHYS_PAGES);
+	page_size = sysconf(_SC_PAGESIZE);
+	if (pages > 0 && page_size > 0
+	    && (size_t)pages / 4 < max_mem / (size_t)page_size) {
+		max_mem = (size_t)pages / 4 * (size_t)page_size;
+	}
+
+	return max_mem;
+}
+
+const char *
+kp_kdf_name(enum kp_kdf kdf)
+{
+	if (kdf <= 0 || (size_t)kdf >= sizeof(kp_kdf_names)/sizeof(kp_kdf_names[0])) {
+		return NULL;
+	}
+
+	return kp_kdf_names[kdf];
+}
+
+kp_error_t
+kp_kdf_from_name(const char *name, enum kp_kdf *kdf)
+{
+	size_t i;
+
+	assert(name);
+	assert(kdf);
+
+	for (i = 1; i < sizeof(kp_kdf_names)/sizeof(kp_kdf_names[0]); i++) {
+		if (kp_kdf_names[i] != NULL && strcmp(name, kp_kdf_names[i]) == 0) {
+			*kdf = i;
+			return KP_SUCCESS;
+		}
+	}
+
+	return KP_EINPUT;
+}
+
+static kp_error_t
+kp_kdf_argon2id(unsigned char *key, size_t key_size, const char *password,
+                const unsigned char *salt, long long unsigned opslimit,
+                size_t memlimit, unsigned int parallelism)
+{
+	kp_error_t ret = KP_SUCCESS;
+	struct kp_kdf_lane lanes[KP_KDF_MAX_PARALLELISM];
+	unsigned char *keys = NULL;
+	unsigned int i;
+
+	assert(key_size >= crypto_generichash_BYTES_MIN);
+	assert(key_size <= crypto_generichash_BYTES_MAX);
+
+	if (parallelism < 1 || parallelism > KP_KDF_MAX_PARALLELISM
+	    || opslimit < crypto_pwhash_argon2id_OPSLIMIT_MIN
+	    || memlimit < crypto_pwhash_argon2id_MEMLIMIT_MIN) {
+		return KP_EINPUT;
+	}
+
+	keys = sodium_malloc(parallelism * KP_KDF_LANE_KEY_SIZE);
+	if (!keys) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	for (i = 0; i < parallelism; i++) {
+		struct kp_kdf_lane *lane = &lanes[i];
+		crypto_generichash_state state;
+		unsigned char index[4];
+
+		index[0] = i >> 24;
+		index[1] = i >> 16;
+		index[2] = i >> 8;
+		index[3] = i;
+
+		/* lane salt is H(salt || lane index) */
+		crypto_generichash_init(&state, NULL, 0, sizeof(lane->salt));
+		crypto_generichash_update(&state, salt, KP_KDF_SALT_SIZE);
+		crypto_generichash_update(&state, index, sizeof(index));
+		crypto_generichash_final(&state, lane->salt, sizeof(lane->salt));
+
+		lane->password = password;
+		lane->opslimit = opslimit;
+		lane->memlimit = memlimit;
+		lane->key = &keys[i * KP_KDF_LANE_KEY_SIZE];
+		lane->ret = -1;
+
+		/* First lane is run by the calling thread */
+		lane->threaded = i > 0 && pthread_create(&lane->thread, NULL,
+		                                         kp_kdf_argon2id_lane,
+		                                         lane) == 0;
+	}
+
+	for (i = 0; i < parallelism; i++) {
+		if (!lanes[i].threaded) {
+			kp_kdf_argon2id_lane(&lanes[i]);
+		}
+	}
+
+	for (i = 0; i < parallelism; i++) {
+		if (lanes[i].threaded) {
+			pthread_join(lanes[i].thread, NULL);
+		}
+	}
+
+	for (i = 0; i < parallelism; i++) {
+		if (lanes[i].ret != 0) {
+			errno = ENOMEM;
+			ret = KP_ERRNO;
+			goto out;
+		}
+	}
+
+	if (crypto_generichash(key, key_size,
+	                       keys, parallelism * KP_KDF_LANE_KEY_SIZE,
+	                       NULL, 0) != 0) {
+		ret = KP_EINTERNAL;
+		goto out;
+	}
+
+out:
+	sodium_free(keys);
+
+	return ret;
+}
+
+static void *
+kp_kdf_argon2id_lane(void *arg)
+{
+	struct kp_kdf_lane *lane = arg;
+
+	lane->ret = crypto_pwhash_argon2id(lane->key, KP_KDF_LANE_KEY_SIZE,
+	                                   lane->password,
+	                                   strlen(lane->password),
+	                                   lane->salt, lane->opslimit,
+	                                   lane->memlimit,
+	                                   crypto_pwhash_argon2id_ALG_ARGON2ID13);
+
+	return NULL;
+}
+
+static struct kp_key *
+kp_kdf_cache_find(struct kp_ctx *ctx, enum kp_kdf kdf,
+                  const unsigned char *salt, long long unsigned opslimit,
+                  size_t memlimit, unsigned int parallelism)
+{
+	size_t i;
+
+	for (i = 0; i < KP_KEY_CACHE_SIZE; i++) {
+		struct kp_key *entry = &ctx->cache.keys[i];
+
+		if (kp_kdf_key_match(entry, kdf, salt, opslimit, memlimit,
+		                     parallelism)) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static size_t
+kp_kdf_min_memlimit(enum kp_kdf kdf, unsigned int parallelism)
+{
+	switch (kdf) {
+	case KP_KDF_SCRYPT:
+		return crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_MIN;
+	case KP_KDF_ARGON2ID:
+		if (parallelism < 1 || parallelism > KP_KDF_MAX_PARALLELISM) {
+			return 0;
+		}
+		return KP_KDF_CALIBRATION_MIN_MEM;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Cheapest opslimit making use of the whole memlimit.
+ */
+static long long unsigned
+kp_kdf_base_opslimit(enum kp_kdf kdf, size_t memlimit)
+{
+	switch (kdf) {
+	case KP_KDF_SCRYPT:
+		/* below memlimit/32, libsodium scrypt reduces N */
+		return memlimit / 32;
+	default:
+		return crypto_pwhash_argon2id_OPSLIMIT_MIN;
+	}
+}
+
+static kp_error_t
+kp_kdf_time(enum kp_kdf kdf, long long unsigned opslimit, size_t memlimit,
+            unsigned int parallelism, uint64_t *us)
+{
+	kp_error_t ret;
+	struct timespec start, end;
+	unsigned char salt[KP_KDF_SALT_SIZE];
+	unsigned char key[KP_MASTER_KEY_SIZE];
+
+	randombytes_buf(salt, sizeof(salt));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = kp_kdf_derive(kdf, key, sizeof(key), "kickpass calibration",
+	                    salt, opslimit, memlimit, parallelism);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*us = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000
+	    + (end.tv_nsec - start.tv_nsec) / 1000;
+
+	return ret;
+}
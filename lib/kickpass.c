@@ -19,22 +19,27 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <readpassphrase.h>
 #include <sodium.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "kickpass.h"
 
 #include "config.h"
+#include "kdf.h"
 
 kp_error_t
 kp_init(struct kp_ctx *ctx)
 {
-	const char *home;
+	kp_error_t ret;
+	const char *home, *max_size, *sync;
 	char **password;
 
 	assert(ctx);
@@ -68,8 +73,44 @@ kp_init(struct kp_ctx *ctx)
 
 	ctx->password[0] = '\0';
 
-	ctx->cfg.memlimit = crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_SENSITIVE/5;
-	ctx->cfg.opslimit = crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_SENSITIVE/5;
+	if ((ret = kp_kdf_cache_init(ctx)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = kp_kdf_defaults(ctx, KP_KDF_SCRYPT)) != KP_SUCCESS) {
+		return ret;
+	}
+	memset(ctx->cfg.salt, 0, KP_KDF_SALT_SIZE);
+
+	ctx->plain_max_size = KP_PLAIN_MAX_SIZE;
+	if ((max_size = getenv(KP_PLAIN_MAX_SIZE_ENV)) != NULL) {
+		char *end;
+		unsigned long long size;
+
+		errno = 0;
+		size = strtoull(max_size, &end, 10);
+		if (errno != 0 || *max_size == '\0' || *end != '\0'
+		    || size == 0 || size > UINT32_MAX) {
+			errno = EINVAL;
+			return KP_ERRNO;
+		}
+		ctx->plain_max_size = size;
+	}
+
+	ctx->sync = KP_SYNC_DIR;
+	if ((sync = getenv(KP_SYNC_ENV)) != NULL) {
+		if (strcmp(sync, "none") == 0) {
+			ctx->sync = KP_SYNC_NONE;
+		} else if (strcmp(sync, "file") == 0) {
+			ctx->sync = KP_SYNC_FILE;
+		} else if (strcmp(sync, "file+dir") == 0) {
+			ctx->sync = KP_SYNC_DIR;
+		} else {
+			errno = EINVAL;
+			return KP_ERRNO;
+		}
+	}
+	ctx->batch = NULL;
 
 	ctx->agent.connected = false;
 
@@ -92,6 +133,7 @@ kp_fini(struct kp_ctx *ctx)
 	assert(ctx);
 
 	sodium_free(ctx->password);
+	kp_kdf_cache_fini(ctx);
 
 	return KP_SUCCESS;
 }
@@ -142,6 +184,109 @@ out:
 	return ret;
 }
 
+/*
+ * Call cb with the path of every safe of the workspace rooted at dir, its
+ * config included. Sub directories holding their own config are other
+ * workspaces, walked only if nested. Walk stops on first error, cb ones
+ * included.
+ */
+kp_error_t
+kp_workspace_walk(struct kp_ctx *ctx, const char *dir, bool nested,
+                  kp_error_t (*cb)(const char *, void *), void *arg)
+{
+	kp_error_t ret = KP_SUCCESS;
+	DIR *dirp;
+	struct dirent *dirent;
+	struct stat stats;
+	int fd, err_no;
+
+	assert(ctx);
+	assert(dir);
+	assert(cb);
+
+	fd = openat(ctx->ws_fd, strlen(dir) == 0 ? "." : dir,
+	            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		return KP_ERRNO;
+	}
+
+	if ((dirp = fdopendir(fd)) == NULL) {
+		err_no = errno;
+		close(fd);
+		errno = err_no;
+		return KP_ERRNO;
+	}
+
+	while ((dirent = readdir(dirp)) != NULL) {
+		char path[PATH_MAX], cfg[PATH_MAX];
+		unsigned char type = dirent->d_type;
+
+		if (dirent->d_name[0] == '.'
+		    && strcmp(dirent->d_name, KP_CONFIG_SAFE_NAME) != 0) {
+			continue;
+		}
+
+		/* Some file systems do not tell entry types */
+		if (type == DT_UNKNOWN) {
+			if (fstatat(dirfd(dirp), dirent->d_name, &stats,
+			            AT_SYMLINK_NOFOLLOW) < 0) {
+				if (errno == ENOENT) {
+					continue;
+				}
+				ret = KP_ERRNO;
+				goto out;
+			}
+			type = S_ISDIR(stats.st_mode) ? DT_DIR
+			     : S_ISREG(stats.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type != DT_REG
+		    && (type != DT_DIR || dirent->d_name[0] == '.')) {
+			continue;
+		}
+
+		if (snprintf(path, PATH_MAX, "%s%s%s", dir,
+		             strlen(dir) == 0 ? "" : "/", dirent->d_name)
+		    >= PATH_MAX) {
+			errno = ENAMETOOLONG;
+			ret = KP_ERRNO;
+			goto out;
+		}
+
+		if (type == DT_REG) {
+			if ((ret = cb(path, arg)) != KP_SUCCESS) {
+				goto out;
+			}
+			continue;
+		}
+
+		if (!nested) {
+			if (snprintf(cfg, PATH_MAX, "%s/" KP_CONFIG_SAFE_NAME,
+			             path) >= PATH_MAX) {
+				errno = ENAMETOOLONG;
+				ret = KP_ERRNO;
+				goto out;
+			}
+
+			if (fstatat(ctx->ws_fd, cfg, &stats, 0) == 0) {
+				continue;
+			}
+		}
+
+		if ((ret = kp_workspace_walk(ctx, path, nested, cb, arg))
+		    != KP_SUCCESS) {
+			goto out;
+		}
+	}
+
+out:
+	err_no = errno;
+	closedir(dirp);
+	errno = err_no;
+
+	return ret;
+}
+
 const char *
 kp_version_string(void)
 {
@@ -14,50 +14,280 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
-#include <sys/tree.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/un.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sodium.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "kickpass.h"
 
 #include "error.h"
 #include "imsg.h"
+#include "index.h"
+#include "kdf.h"
 #include "kpagent.h"
+#include "slab.h"
+#include "storage.h"
+#include "watch.h"
+#include "wheel.h"
 
 #define SOCKET_BACKLOG 128
 
+#define KP_AGENT_HELLO_TIMEOUT 1 /* seconds */
+
+/*
+ * Batches are split in messages of at most KP_AGENT_BATCH_MAX items. Client
+ * keeps no more requests in flight than socket buffers surely hold, so
+ * that it never blocks writing while agent blocks writing replies.
+ */
+#define KP_AGENT_PAYLOAD_MAX  (MAX_IMSGSIZE - IMSG_HEADER_SIZE)
+#define KP_AGENT_INFLIGHT_MAX (64 * 1024)
+
+/*
+ * State handed over to a new agent is written to a sealed memory file as
+ * frames encrypted under a one time key. A frame holds whole attributes:
+ * master password, cached keys, then stored safes from least to most
+ * recently used. Each frame is its length, whether it is the last one, then
+ * cipher text, so that a truncated state is not taken for a whole one.
+ */
+#define KP_AGENT_FRAME_SIZE   (64 * 1024)
+#define KP_AGENT_FRAME_ABYTES crypto_aead_xchacha20poly1305_ietf_ABYTES
+#define KP_AGENT_STATE_KEY    crypto_aead_xchacha20poly1305_ietf_KEYBYTES
+
+#ifndef EPROTO
+#define EPROTO ENOPROTOOPT
+#endif
+
 /* on some system stat.h uses a variable named __unused */
 #ifndef __unused
 #define __unused __attribute__((unused))
 #endif
 
-struct kp_agent_safe {
-	char name[PATH_MAX]; /* name of the safe */
-	char * const password;      /* plain text password (null terminated) */
-	char * const metadata;      /* plain text metadata (null terminated) */
+/*
+ * Stored safe. Password and metadata share a single slab allocation of the
+ * exact size, since agent keeps many safes unlocked.
+ */
+struct kp_store {
+	struct kp_index_entry index;
+	TAILQ_ENTRY(kp_store) lru;
+	struct kp_timer timer;
+	char *password; /* plain text password (null terminated), or NULL */
+	char *metadata; /* plain text metadata (null terminated), or NULL */
+	unsigned char *cipher; /* nonce and encrypted plain text, or NULL */
+	size_t plain;   /* password and metadata, terminators included */
+	size_t size;    /* locked memory held by safe */
+	time_t timeout;
+	bool idle;      /* timeout restarts on each access */
+	struct kp_safe_id id; /* file it was read from, if known */
+	char name[];    /* name of the safe */
 };
 
-struct kp_store {
-	RB_ENTRY(kp_store) tree;
-	struct kp_agent_safe *safe;
+/*
+ * Stored safes, least recently used first. Locked memory they hold is kept
+ * within budget by evicting the least recently used ones.
+ */
+static TAILQ_HEAD(lru, kp_store) lru = TAILQ_HEAD_INITIALIZER(lru);
+static size_t locked = 0;
+static size_t budget = SIZE_MAX;
+
+/*
+ * Once set, safes are stored encrypted with this random key in ordinary
+ * memory rather than as plain text in locked memory.
+ */
+static unsigned char *cache_key = NULL;
+
+/*
+ * Stored safes by name, and their expiry, one tick per second of monotonic
+ * clock.
+ */
+static struct kp_index stores;
+static struct kp_wheel wheel;
+static bool ready = false;
+
+/*
+ * Safes found in workspace, kept up to date by watching it. Lists are only
+ * answered from them as long as watch did not fail. While watching, stored
+ * safes are dropped as soon as their file changes, and workspace is the
+ * directory watched.
+ */
+struct kp_known {
+	struct kp_index_entry index;
+	char name[];
+};
+
+static struct kp_index known;
+static struct kp_watch watch = { .fd = -1 };
+static int workspace = -1;
+static bool watching = false;
+static int watch_errno = 0; /* why watch failed */
+
+/*
+ * Message payload is a list of attributes, each a header followed by len
+ * bytes of value. Strings go without their null terminator.
+ */
+enum kp_agent_attr_type {
+	KP_ATTR_DATA,     /* raw data */
+	KP_ATTR_NAME,
+	KP_ATTR_PASSWORD,
+	KP_ATTR_METADATA,
+	KP_ATTR_TIMEOUT,  /* int64_t seconds */
+	KP_ATTR_IDLE,     /* uint8_t */
+	KP_ATTR_VERSION,  /* uint16_t */
+	KP_ATTR_CAPS,     /* uint32_t */
+	KP_ATTR_ERROR,    /* struct kp_msg_error */
+	KP_ATTR_EXPIRE,   /* int64_t seconds left before timeout */
+	KP_ATTR_MASTER,   /* master password */
+	KP_ATTR_KEY,      /* struct kp_agent_key */
+	KP_ATTR_SEALED,   /* uint64_t metadata length, in passed memory file */
+	KP_ATTR_AFTER,    /* name list resumes past */
+	KP_ATTR_MORE,     /* uint8_t, ends a list page, whether names are left */
+	KP_ATTR_ID,       /* struct kp_safe_id, only sent when known */
+};
+
+struct kp_agent_attr {
+	uint16_t type;
+	uint16_t len;
+};
+
+/*
+ * Cached key as handed over, with fixed size fields.
+ */
+struct kp_agent_key {
+	uint32_t kdf;
+	uint32_t parallelism;
+	uint64_t opslimit;
+	uint64_t memlimit;
+	unsigned char salt[KP_KDF_SALT_SIZE];
+	unsigned char key[KP_MASTER_KEY_SIZE];
+};
+
+struct kp_agent_state {
+	int fd;
+	uint64_t frame;      /* frame number, nonce of its encryption */
+	unsigned char *key;  /* in guarded memory, as plain */
+	unsigned char *plain;
+	size_t len;
+	unsigned char *cipher; /* length, last frame flag and cipher text */
 };
 
-static int store_cmp(struct kp_store *, struct kp_store *);
+/*
+ * List page being queued. Names are packed in as few messages as possible.
+ */
+struct kp_agent_page {
+	struct kp_agent *agent;
+	struct ibuf *wbuf; /* message being filled */
+	size_t len;        /* of message being filled */
+	size_t count;
+	size_t size;       /* of whole page */
+	bool more;
+	kp_error_t ret;
+};
 
-RB_HEAD(storage, kp_store) storage = RB_INITIALIZER(&storage);
-RB_PROTOTYPE_STATIC(storage, kp_store, tree, store_cmp);
+/*
+ * Safe being restored. Its metadata spans as many attributes as needed.
+ */
+struct kp_agent_pending {
+	struct kp_unsafe unsafe;
+	int64_t expire;
+	char *metadata; /* guarded, null terminated */
+	size_t len;
+	size_t size;
+};
 
-static kp_error_t kp_agent_safe_create(struct kp_agent *, struct kp_agent_safe **);
-static kp_error_t kp_agent_safe_free(struct kp_agent *, struct kp_agent_safe *);
+static kp_error_t kp_agent_hello(struct kp_agent *);
+static kp_error_t kp_agent_msg_hello(struct imsg *, uint16_t *, uint32_t *);
+static int kp_agent_attr(struct iovec *, struct kp_agent_attr *, uint16_t,
+                         const void *, size_t);
+static int kp_agent_attr_parse(const void *, size_t, size_t *,
+                               struct kp_agent_attr *, void **);
+static int kp_agent_attr_next(struct imsg *, size_t *, struct kp_agent_attr *,
+                              void **);
+static int kp_agent_attr_string(char *, size_t, const void *, size_t);
+static int kp_agent_attr_unsafe(struct kp_unsafe *, struct kp_agent_attr *,
+                                void *);
+static int kp_agent_add(struct ibuf *, uint16_t, const void *, size_t);
+static int kp_agent_add_safe(struct ibuf *, const struct kp_unsafe *);
+static size_t kp_agent_safe_size(const struct kp_unsafe *);
+static kp_error_t kp_agent_queue_safe(struct kp_agent *, enum kp_agent_msg_type,
+                                      const char *, const char *,
+                                      const char *, size_t, int, time_t,
+                                      bool, const struct kp_safe_id *);
+static kp_error_t kp_agent_queue_error(struct kp_agent *, kp_error_t);
+static kp_error_t kp_agent_queue_fd(struct kp_agent *, enum kp_agent_msg_type,
+                                    int, struct iovec *, int);
+static kp_error_t kp_agent_queue(struct kp_agent *, enum kp_agent_msg_type,
+                                 struct iovec *, int);
+static kp_error_t kp_agent_flush(struct kp_agent *);
+static kp_error_t kp_agent_sendv(struct kp_agent *, enum kp_agent_msg_type,
+                                 struct iovec *, int);
+static kp_error_t kp_agent_next(struct kp_agent *, struct imsg *);
+static kp_error_t kp_agent_reconnect(struct kp_agent *);
+static kp_error_t kp_agent_get(struct kp_agent *, enum kp_agent_msg_type,
+                               struct imsg *);
+static kp_error_t kp_agent_collect(struct kp_agent *, enum kp_agent_msg_type,
+                                   struct kp_unsafe *, struct kp_msg_error *);
+static kp_error_t kp_agent_msg_error(struct imsg *, struct kp_msg_error *);
+static kp_error_t kp_agent_search_reply(struct kp_agent *, const char *);
+static void kp_agent_ready(void);
+static kp_error_t kp_agent_store_create(struct kp_agent *, struct kp_store **,
+                                        const char *, const char *,
+                                        const char *);
+static void kp_agent_store_free(struct kp_agent *, struct kp_store *);
+static kp_error_t kp_agent_store_seal(struct kp_store *, const char *,
+                                      const char *);
+static char *kp_agent_store_open(struct kp_store *);
+static void kp_agent_store_close(struct kp_store *, char *);
+static struct kp_store *kp_agent_find(const char *);
+static void kp_agent_remove(struct kp_agent *, struct kp_store *);
+static kp_error_t kp_agent_evict(struct kp_agent *, size_t);
+static uint64_t kp_agent_now(void);
+static int kp_agent_memfd(void);
+static int kp_agent_tmpfile(void);
+static kp_error_t kp_agent_write(int, const void *, size_t);
+static int kp_agent_seal(const char *, size_t);
+static kp_error_t kp_agent_unseal(struct kp_unsafe *, int, uint64_t);
+static void kp_agent_unsafe_release(struct kp_unsafe *);
+static kp_error_t kp_agent_state_open(struct kp_agent_state *);
+static void kp_agent_state_close(struct kp_agent_state *);
+static kp_error_t kp_agent_state_add(struct kp_agent_state *, uint16_t,
+                                     const void *, size_t);
+static kp_error_t kp_agent_state_flush(struct kp_agent_state *, bool);
+static kp_error_t kp_agent_state_store(struct kp_agent_state *,
+                                       struct kp_store *, int64_t);
+static kp_error_t kp_agent_state_dump(struct kp_agent_state *,
+                                      struct kp_ctx *);
+static kp_error_t kp_agent_state_restore(struct kp_agent *, struct kp_ctx *,
+                                         int, const unsigned char *);
+static kp_error_t kp_agent_state_frame(struct kp_agent *, struct kp_ctx *,
+                                       const unsigned char *, size_t,
+                                       struct kp_agent_pending *);
+static kp_error_t kp_agent_pending_append(struct kp_agent_pending *,
+                                          const void *, size_t);
+static kp_error_t kp_agent_restore(struct kp_agent *,
+                                   struct kp_agent_pending *);
+static void kp_agent_expired(struct kp_timer *, void *);
+static kp_error_t kp_agent_known(enum kp_watch_event, const char *, void *);
+static void kp_agent_known_remove(const char *);
+static int kp_agent_first(struct kp_index_entry *, void *);
+static void kp_agent_sync(struct kp_agent *);
+static bool kp_agent_current(const char *, const struct kp_safe_id *);
+static void kp_agent_forget(struct kp_agent *, const char *);
+static void kp_agent_verify(struct kp_agent *);
+static int kp_agent_page_add(struct kp_index_entry *, void *);
 
 kp_error_t
 kp_agent_init(struct kp_agent *agent, const char *socket_path)
@@ -66,6 +296,9 @@ kp_agent_init(struct kp_agent *agent, const char *socket_path)
 
 	agent->sock = -1;
 	agent->connected = false;
+	agent->unlocked = false;
+	agent->caps = 0;
+	agent->nonblock = false;
 
 	memset(&agent->sunaddr, 0, sizeof(struct sockaddr_un));
 	agent->sunaddr.sun_family = AF_UNIX;
@@ -87,12 +320,18 @@ kp_agent_init(struct kp_agent *agent, const char *socket_path)
 kp_error_t
 kp_agent_connect(struct kp_agent *agent)
 {
+	kp_error_t ret;
+
 	assert(agent);
 
 	if (connect(agent->sock, (struct sockaddr *)&agent->sunaddr,
 				sizeof(struct sockaddr_un)) < 0) {
 		return KP_ERRNO;
 	}
+
+	if ((ret = kp_agent_hello(agent)) != KP_SUCCESS) {
+		return ret;
+	}
 	agent->connected = true;
 
 	return KP_SUCCESS;
@@ -125,7 +364,9 @@ kp_agent_accept(struct kp_agent *agent, struct kp_agent *out)
 
 	out->sock = -1;
 	out->connected = false;
-
+	out->unlocked = false;
+	out->caps = 0;
+	out->nonblock = false;
 
 	if ((out->sock = accept(agent->sock, (struct sockaddr *)&out->sunaddr, &addrlen)) < 0) {
 		return KP_ERRNO;
@@ -137,286 +378,3014 @@ kp_agent_accept(struct kp_agent *agent, struct kp_agent *out)
 	return KP_SUCCESS;
 }
 
+/*
+ * Agree on protocol version and capabilities. An agent not answering in
+ * time most likely speaks an older protocol, ignoring unknown messages.
+ */
+static kp_error_t
+kp_agent_hello(struct kp_agent *agent)
+{
+	kp_error_t ret;
+	struct imsg imsg;
+	struct kp_agent_attr attrs[2];
+	struct iovec iov[4];
+	struct timeval timeout = { KP_AGENT_HELLO_TIMEOUT, 0 };
+	uint16_t version = KP_AGENT_PROTOCOL_VERSION;
+	uint32_t caps = KP_AGENT_CAPS;
+	int iovcnt = 0;
+
+	iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[0], KP_ATTR_VERSION,
+	                        &version, sizeof(version));
+	iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[1], KP_ATTR_CAPS,
+	                        &caps, sizeof(caps));
+	if ((ret = kp_agent_sendv(agent, KP_MSG_HELLO, iov, iovcnt))
+	    != KP_SUCCESS) {
+		return ret;
+	}
+
+	setsockopt(agent->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+	           sizeof(timeout));
+	ret = kp_agent_get(agent, KP_MSG_HELLO, &imsg);
+	timeout.tv_sec = 0;
+	setsockopt(agent->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+	           sizeof(timeout));
+	if (ret == KP_ERRNO && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		errno = EPROTONOSUPPORT;
+	}
+	if (ret != KP_SUCCESS) {
+		return ret;
+	}
+
+	ret = kp_agent_msg_hello(&imsg, &version, &caps);
+	imsg_free(&imsg);
+	if (ret != KP_SUCCESS) {
+		return ret;
+	}
+
+	agent->caps = caps & KP_AGENT_CAPS;
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Answer client hello, server side.
+ */
+kp_error_t
+kp_agent_welcome(struct kp_agent *agent, struct imsg *imsg)
+{
+	kp_error_t ret;
+	struct kp_agent_attr attrs[2];
+	struct iovec iov[4];
+	uint16_t version;
+	uint32_t caps;
+	int iovcnt = 0;
+
+	if ((ret = kp_agent_msg_hello(imsg, &version, &caps)) != KP_SUCCESS) {
+		kp_agent_error(agent, ret);
+		return ret;
+	}
+
+	agent->caps = caps & KP_AGENT_CAPS;
+
+	version = KP_AGENT_PROTOCOL_VERSION;
+	caps = KP_AGENT_CAPS;
+	iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[0], KP_ATTR_VERSION,
+	                        &version, sizeof(version));
+	iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[1], KP_ATTR_CAPS,
+	                        &caps, sizeof(caps));
+
+	return kp_agent_sendv(agent, KP_MSG_HELLO, iov, iovcnt);
+}
+
+/*
+ * Send raw data as a message of a single attribute.
+ */
 kp_error_t
 kp_agent_send(struct kp_agent *agent, enum kp_agent_msg_type type, void *data,
               size_t size)
 {
+	struct kp_agent_attr attr;
+	struct iovec iov[2];
+	int iovcnt;
+
 	assert(agent);
 
-	if (imsg_compose(&agent->ibuf, type, 1, 0, -1, data, size) < 0) {
+	if (size > UINT16_MAX) {
+		errno = EMSGSIZE;
 		return KP_ERRNO;
 	}
-	if (imsg_flush(&agent->ibuf) < 0) {
+
+	iovcnt = kp_agent_attr(iov, &attr, KP_ATTR_DATA, data, size);
+
+	if (kp_agent_queue(agent, type, iov, iovcnt) != KP_SUCCESS) {
 		return KP_ERRNO;
 	}
 
-	return KP_SUCCESS;
+	return kp_agent_flush(agent);
 }
 
+/*
+ * Send safe, only its actual content goes on the wire.
+ */
 kp_error_t
-kp_agent_error(struct kp_agent *agent, kp_error_t err)
+kp_agent_send_unsafe(struct kp_agent *agent, enum kp_agent_msg_type type,
+                     const struct kp_unsafe *unsafe)
 {
-	struct kp_msg_error error;
+	assert(agent);
+	assert(unsafe);
+
+	if (kp_agent_queue_safe(agent, type, unsafe->name, unsafe->password,
+	                        kp_agent_unsafe_metadata(unsafe),
+	                        unsafe->large != NULL
+	                        ? strlen(unsafe->large)
+	                        : strnlen(unsafe->metadata,
+	                                  KP_METADATA_MAX_LEN - 1),
+	                        unsafe->large_fd, unsafe->timeout,
+	                        unsafe->idle, &unsafe->id) != KP_SUCCESS) {
+		return KP_ERRNO;
+	}
 
-	error.err = err;
-	error.err_no = 0;
-	if (err == KP_ERRNO) {
-		error.err_no = errno;
+	return kp_agent_flush(agent);
+}
+
+kp_error_t
+kp_agent_error(struct kp_agent *agent, kp_error_t err)
+{
+	if (kp_agent_queue_error(agent, err) != KP_SUCCESS) {
+		return KP_ERRNO;
 	}
 
-	return kp_agent_send(agent, KP_MSG_ERROR, &error,
-	                     sizeof(struct kp_msg_error));
+	return kp_agent_flush(agent);
 }
 
+/*
+ * Send one error per item of a batch, in a single message.
+ */
 kp_error_t
-kp_agent_receive(struct kp_agent *agent, enum kp_agent_msg_type type, void *data,
-                 size_t size)
+kp_agent_send_errors(struct kp_agent *agent, enum kp_agent_msg_type type,
+                     const struct kp_msg_error *errors, size_t n)
 {
-	kp_error_t ret;
-	struct imsg imsg;
-	ssize_t ssize = 0;
+	struct ibuf *wbuf;
+	size_t i;
 
 	assert(agent);
+	assert(errors || n == 0);
 
-	do {
-		/* Try to get one from ibuf */
-		if ((ssize = imsg_get(&agent->ibuf, &imsg)) > 0) {
-			continue;
-		}
+	if ((wbuf = imsg_create(&agent->ibuf, type, 1, 0,
+	                        n * (sizeof(struct kp_agent_attr)
+	                             + sizeof(struct kp_msg_error)))) == NULL) {
+		return KP_ERRNO;
+	}
 
-		/* Nothing in buf try to read from conn */
-		if (imsg_read(&agent->ibuf) <= 0) {
-			imsg_clear(&agent->ibuf);
-			/* XXX clean conn */
+	for (i = 0; i < n; i++) {
+		if (kp_agent_add(wbuf, KP_ATTR_ERROR, &errors[i],
+		                 sizeof(struct kp_msg_error)) < 0) {
 			return KP_ERRNO;
 		}
+	}
+	imsg_close(&agent->ibuf, wbuf);
 
-		/* Try to get one from ibuf */
-		if ((ssize = imsg_get(&agent->ibuf, &imsg)) < 0) {
-			return KP_ERRNO;
-		}
-	} while (ssize <= 0);
+	return kp_agent_flush(agent);
+}
 
-	if (imsg.hdr.type > KP_MSG_ERROR) {
-		/* XXX report real error */
-		ret = KP_INVALID_MSG;
-		goto out;
-	}
+/*
+ * Search many safes at once. Names are packed in as few messages as
+ * possible, several of them in flight before reading replies. Each result
+ * gets its own error, KP_SUCCESS when found. Return an error only if
+ * agent cannot be talked to.
+ */
+kp_error_t
+kp_agent_search_many(struct kp_agent *agent, const char **names, size_t n,
+                     struct kp_unsafe *results, struct kp_msg_error *errors)
+{
+	kp_error_t ret;
+	struct ibuf *wbuf;
+	size_t sent = 0, received = 0, count, size, inflight, len, i;
 
-	if (imsg.hdr.type != type) {
-		if (imsg.hdr.type == KP_MSG_ERROR) {
-			struct kp_msg_error *error = (struct kp_msg_error *)imsg.data;
-			if (error->err == KP_ERRNO) {
-				errno = error->err_no;
+	assert(agent);
+	assert(names || n == 0);
+	assert(results || n == 0);
+	assert(errors || n == 0);
+
+	/* One at a time with an agent unaware of batches */
+	if (!(agent->caps & KP_AGENT_CAP_BATCH)) {
+		for (i = 0; i < n; i++) {
+			if ((ret = kp_agent_send(agent, KP_MSG_SEARCH,
+			                         (void *)names[i],
+			                         strnlen(names[i], PATH_MAX - 1)
+			                         + 1)) != KP_SUCCESS) {
+				return ret;
+			}
+			if ((ret = kp_agent_collect(agent, KP_MSG_SEARCH,
+			                            &results[i], &errors[i]))
+			    != KP_SUCCESS) {
+				return ret;
 			}
-			ret = error->err;
-			goto out;
-		} else {
-			ret = KP_INVALID_MSG;
-			goto out;
 		}
+		return KP_SUCCESS;
 	}
 
-	if (imsg.hdr.len - IMSG_HEADER_SIZE != size) {
-		errno = EMSGSIZE;
-		ret = KP_ERRNO;
-		goto out;
-	}
-
-	ret = KP_SUCCESS;
-
-	if (data) {
-		memcpy(data, imsg.data, size);
-	}
+	while (received < n) {
+		for (inflight = 0; sent < n && inflight < KP_AGENT_INFLIGHT_MAX;
+		     sent += count, inflight += size) {
+			size = 0;
+			for (count = 0; sent + count < n
+			     && count < KP_AGENT_BATCH_MAX; count++) {
+				len = sizeof(struct kp_agent_attr)
+				    + strnlen(names[sent + count], PATH_MAX - 1);
+				if (size + len > KP_AGENT_PAYLOAD_MAX) {
+					break;
+				}
+				size += len;
+			}
 
-out:
-	imsg_free(&imsg);
-	return ret;
-}
+			if ((wbuf = imsg_create(&agent->ibuf,
+			                        KP_MSG_SEARCH_MANY, 1, 0, size))
+			    == NULL) {
+				return KP_ERRNO;
+			}
+			for (i = sent; i < sent + count; i++) {
+				if (kp_agent_add(wbuf, KP_ATTR_NAME, names[i],
+				                 strnlen(names[i], PATH_MAX - 1))
+				    < 0) {
+					return KP_ERRNO;
+				}
+			}
+			imsg_close(&agent->ibuf, wbuf);
+		}
 
-kp_error_t
-kp_agent_close(struct kp_agent *agent)
-{
-	imsg_clear(&agent->ibuf);
+		if ((ret = kp_agent_flush(agent)) != KP_SUCCESS) {
+			return ret;
+		}
 
-	if (agent->sock >= 0) {
-		close(agent->sock);
+		/* Agent answers each name in order */
+		for (; received < sent; received++) {
+			if ((ret = kp_agent_collect(agent, KP_MSG_SEARCH,
+			                            &results[received],
+			                            &errors[received]))
+			    != KP_SUCCESS) {
+				return ret;
+			}
+		}
 	}
 
 	return KP_SUCCESS;
 }
 
-static kp_error_t
-kp_agent_safe_create(struct kp_agent *agent, struct kp_agent_safe **_safe)
+/*
+ * Store many safes at once, packed and pipelined like searches. Each safe
+ * gets its own error.
+ */
+kp_error_t
+kp_agent_store_many(struct kp_agent *agent, const struct kp_unsafe *unsafes,
+                    size_t n, struct kp_msg_error *errors)
 {
-	struct kp_agent_safe *safe;
-	char **password;
-	char **metadata;
+	kp_error_t ret;
+	struct ibuf *wbuf;
+	struct imsg imsg;
+	struct kp_agent_attr attr;
+	size_t sent = 0, received = 0, count, size, inflight, len, off, i;
+	size_t messages;
+	void *value;
+	int next;
 
-	if ((safe = malloc(sizeof(struct kp_agent_safe))) == NULL) {
-		errno = ENOMEM;
-		return KP_ERRNO;
+	assert(agent);
+	assert(unsafes || n == 0);
+	assert(errors || n == 0);
+
+	/* Agent unaware of batches does not answer stores, and batches do not
+	 * carry memory files */
+	for (i = 0; i < n && unsafes[i].large == NULL; i++);
+	if (!(agent->caps & KP_AGENT_CAP_BATCH) || i < n) {
+		for (i = 0; i < n; i++) {
+			if ((ret = kp_agent_send_unsafe(agent, KP_MSG_STORE,
+			                                &unsafes[i]))
+			    != KP_SUCCESS) {
+				return ret;
+			}
+			errors[i].err = KP_SUCCESS;
+			errors[i].err_no = 0;
+		}
+		return KP_SUCCESS;
 	}
 
-	/* Store is the only able to set password and metadata memory */
-	password = (char **)&safe->password;
-	metadata = (char **)&safe->metadata;
+	while (received < n) {
+		for (inflight = 0, messages = 0; sent < n
+		     && inflight < KP_AGENT_INFLIGHT_MAX;
+		     sent += count, inflight += size, messages++) {
+			size = 0;
+			for (count = 0; sent + count < n
+			     && count < KP_AGENT_BATCH_MAX; count++) {
+				len = kp_agent_safe_size(&unsafes[sent + count]);
+				if (size + len > KP_AGENT_PAYLOAD_MAX) {
+					break;
+				}
+				size += len;
+			}
 
-	*password = sodium_malloc(KP_PASSWORD_MAX_LEN);
-	*metadata = sodium_malloc(KP_METADATA_MAX_LEN);
+			if ((wbuf = imsg_create(&agent->ibuf,
+			                        KP_MSG_STORE_MANY, 1, 0, size))
+			    == NULL) {
+				return KP_ERRNO;
+			}
+			for (i = sent; i < sent + count; i++) {
+				if (kp_agent_add_safe(wbuf, &unsafes[i]) < 0) {
+					return KP_ERRNO;
+				}
+			}
+			imsg_close(&agent->ibuf, wbuf);
+		}
 
-	*_safe = safe;
+		if ((ret = kp_agent_flush(agent)) != KP_SUCCESS) {
+			return ret;
+		}
 
-	return KP_SUCCESS;
-}
+		/* One reply per message, one error per safe */
+		for (; messages > 0; messages--) {
+			if ((ret = kp_agent_get(agent, KP_MSG_STORE_MANY,
+			                        &imsg)) != KP_SUCCESS) {
+				return ret;
+			}
 
-static kp_error_t
-kp_agent_safe_free(struct kp_agent *agent, struct kp_agent_safe *safe)
-{
-	assert(safe);
+			off = 0;
+			while ((next = kp_agent_attr_next(&imsg, &off, &attr,
+			                                  &value)) > 0
+			       && received < sent) {
+				if (attr.type != KP_ATTR_ERROR
+				    || attr.len != sizeof(struct kp_msg_error)) {
+					continue;
+				}
+				memcpy(&errors[received++], value,
+				       sizeof(struct kp_msg_error));
+			}
+			imsg_free(&imsg);
+
+			if (next < 0) {
+				errno = EPROTO;
+				return KP_ERRNO;
+			}
+		}
 
-	sodium_free(safe->password);
-	sodium_free(safe->metadata);
+		if (received != sent) {
+			errno = EPROTO;
+			return KP_ERRNO;
+		}
+	}
 
 	return KP_SUCCESS;
 }
 
+/*
+ * Receive raw data of a single attribute message, of exactly size bytes.
+ */
 kp_error_t
-kp_agent_store(struct kp_agent *agent, struct kp_unsafe *unsafe)
+kp_agent_receive(struct kp_agent *agent, enum kp_agent_msg_type type, void *data,
+                 size_t size)
 {
 	kp_error_t ret;
-	struct kp_store *store, *existing;
-	struct kp_agent_safe *safe;
+	struct imsg imsg;
+	void *value;
+	size_t len;
+
+	assert(agent);
 
-	if ((ret = kp_agent_safe_create(agent, &safe)) != KP_SUCCESS) {
+	if ((ret = kp_agent_get(agent, type, &imsg)) != KP_SUCCESS) {
 		return ret;
 	}
 
-	if (strlcpy(safe->name, unsafe->name, PATH_MAX) >= PATH_MAX) {
-		errno = ENOMEM;
-		ret = KP_ERRNO;
-		goto out;
-	}
-	if (strlcpy(safe->password, unsafe->password, KP_PASSWORD_MAX_LEN)
-	    >= KP_PASSWORD_MAX_LEN) {
-		errno = ENOMEM;
-		ret = KP_ERRNO;
-		goto out;
-	}
-	if (strlcpy(safe->metadata, unsafe->metadata, KP_METADATA_MAX_LEN)
-	    >= KP_METADATA_MAX_LEN) {
-		errno = ENOMEM;
-		ret = KP_ERRNO;
+	if ((ret = kp_agent_msg_data(&imsg, &value, &len)) != KP_SUCCESS) {
 		goto out;
 	}
 
-	if ((store = malloc(sizeof(struct kp_store))) == NULL) {
-		errno = ENOMEM;
+	if (len != size) {
+		errno = EMSGSIZE;
 		ret = KP_ERRNO;
 		goto out;
 	}
 
-	store->safe = safe;
-
-	existing = RB_INSERT(storage, &storage, store);
-	if (existing != NULL) {
-		kp_agent_safe_free(agent, existing->safe);
-		existing->safe = safe;
+	if (data) {
+		memcpy(data, value, size);
 	}
 
-	ret = KP_SUCCESS;
-
 out:
+	imsg_free(&imsg);
 	return ret;
 }
 
+/*
+ * Wait for a save to be done, and learn which file safe was saved to if
+ * agent tells.
+ */
 kp_error_t
-kp_agent_discard(struct kp_agent *agent, const char *name, bool silent)
+kp_agent_receive_saved(struct kp_agent *agent, struct kp_safe_id *id)
 {
 	kp_error_t ret;
-	struct kp_store needle, *store;
-	struct kp_agent_safe safe;
-	bool result = true;
+	struct imsg imsg;
+	struct kp_agent_attr attr;
+	size_t off = 0;
+	void *value;
+	int n;
 
-	if (strlcpy(safe.name, name, PATH_MAX) > PATH_MAX) {
-		errno = ENAMETOOLONG;
-		ret = KP_ERRNO;
-		goto failure;
-	}
-	needle.safe = &safe;
+	assert(agent);
+	assert(id);
 
-	store = RB_FIND(storage, &storage, &needle);
-	if (store == NULL) {
-		errno = ENOENT;
-		ret = KP_ERRNO;
-		goto failure;
+	if ((ret = kp_agent_get(agent, KP_MSG_SAVE, &imsg)) != KP_SUCCESS) {
+		return ret;
 	}
 
-	kp_agent_safe_free(agent, store->safe);
-	RB_REMOVE(storage, &storage, store);
+	while ((n = kp_agent_attr_next(&imsg, &off, &attr, &value)) > 0) {
+		if (attr.type == KP_ATTR_ID
+		    && attr.len == sizeof(struct kp_safe_id)) {
+			memcpy(id, value, sizeof(struct kp_safe_id));
+		}
+	}
 
-	if (silent) {
-		return KP_SUCCESS;
-	} else {
-		return kp_agent_send(agent, KP_MSG_DISCARD, &result, sizeof(bool));
+	if (n < 0) {
+		errno = EPROTO;
+		ret = KP_ERRNO;
 	}
 
-failure:
-	kp_agent_error(agent, ret);
+	imsg_free(&imsg);
 	return ret;
 }
 
 kp_error_t
-kp_agent_search(struct kp_agent *agent, const char *name)
+kp_agent_receive_unsafe(struct kp_agent *agent, enum kp_agent_msg_type type,
+                        struct kp_unsafe *unsafe)
 {
 	kp_error_t ret;
-	struct kp_store needle, *store;
-	struct kp_agent_safe safe;
-	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+	struct imsg imsg;
 
-	if (strlcpy(safe.name, name, PATH_MAX) > PATH_MAX) {
-		errno = ENAMETOOLONG;
-		return KP_ERRNO;
+	assert(agent);
+	assert(unsafe);
+
+	if ((ret = kp_agent_get(agent, type, &imsg)) != KP_SUCCESS) {
+		return ret;
 	}
-	needle.safe = &safe;
 
-	store = RB_FIND(storage, &storage, &needle);
-	if (store == NULL) {
+	ret = kp_agent_msg_unsafe(&imsg, unsafe);
+	sodium_memzero(imsg.data, imsg.hdr.len - IMSG_HEADER_SIZE);
+	if (imsg.fd >= 0) {
+		close(imsg.fd);
+	}
+	imsg_free(&imsg);
+
+	return ret;
+}
+
+/*
+ * Hand master password over to agent.
+ */
+kp_error_t
+kp_agent_unlock(struct kp_agent *agent, const char *password)
+{
+	kp_error_t ret;
+	bool result;
+	int tries = 0;
+
+	assert(agent);
+	assert(password);
+
+	/* Agent handing over refuses it, successor is asked instead */
+	do {
+		if ((ret = kp_agent_send(agent, KP_MSG_UNLOCK, (void *)password,
+		                         strnlen(password,
+		                                 KP_PASSWORD_MAX_LEN - 1) + 1))
+		    == KP_SUCCESS) {
+			ret = kp_agent_receive(agent, KP_MSG_UNLOCK, &result,
+			                       sizeof(bool));
+		}
+	} while (kp_agent_moved(agent, ret) && tries++ == 0);
+
+	if (ret != KP_SUCCESS) {
+		return ret;
+	}
+
+	agent->unlocked = true;
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Take over the agent connected to: get its stored safes, master password
+ * and cached keys into this process and ctx, then its listening socket.
+ * Agent stops accepting clients as soon as it hands state over, and exits
+ * once told it was taken over. Until then, it resumes if anything fails.
+ */
+kp_error_t
+kp_agent_takeover(struct kp_agent *agent, struct kp_ctx *ctx, int *listener)
+{
+	kp_error_t ret;
+	struct imsg imsg;
+	unsigned char *key = NULL;
+	void *data;
+	size_t size;
+	int state = -1;
+	bool result = true;
+
+	assert(agent);
+	assert(ctx);
+	assert(listener);
+
+	*listener = -1;
+
+	if ((agent->caps & KP_AGENT_CAP_TAKEOVER) == 0) {
+		errno = EPROTONOSUPPORT;
+		return KP_ERRNO;
+	}
+
+	if ((ret = kp_agent_send(agent, KP_MSG_TAKEOVER, &result,
+	                         sizeof(bool))) != KP_SUCCESS) {
+		return ret;
+	}
+
+	/* State comes first, key as data and memory file as fd */
+	if ((ret = kp_agent_get(agent, KP_MSG_TAKEOVER, &imsg)) != KP_SUCCESS) {
+		return ret;
+	}
+	state = imsg.fd;
+	if ((key = sodium_malloc(KP_AGENT_STATE_KEY)) == NULL) {
+		errno = ENOMEM;
+		ret = KP_ERRNO;
+	} else if ((ret = kp_agent_msg_data(&imsg, &data, &size))
+	           == KP_SUCCESS
+	           && (size != KP_AGENT_STATE_KEY || state < 0)) {
+		errno = EPROTO;
+		ret = KP_ERRNO;
+	} else if (ret == KP_SUCCESS) {
+		memcpy(key, data, KP_AGENT_STATE_KEY);
+	}
+	sodium_memzero(imsg.data, imsg.hdr.len - IMSG_HEADER_SIZE);
+	imsg_free(&imsg);
+	if (ret != KP_SUCCESS) {
+		goto out;
+	}
+
+	/* Then listening socket */
+	if ((ret = kp_agent_get(agent, KP_MSG_TAKEOVER, &imsg)) != KP_SUCCESS) {
+		goto out;
+	}
+	*listener = imsg.fd;
+	imsg_free(&imsg);
+	if (*listener < 0) {
+		errno = EPROTO;
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	if ((ret = kp_agent_state_restore(agent, ctx, state, key))
+	    != KP_SUCCESS) {
+		goto out;
+	}
+
+	/* Agent may exit now */
+	ret = kp_agent_send(agent, KP_MSG_TAKEOVER, &result, sizeof(bool));
+
+out:
+	if (ret != KP_SUCCESS && *listener >= 0) {
+		close(*listener);
+		*listener = -1;
+	}
+	if (state >= 0) {
+		close(state);
+	}
+	if (key != NULL) {
+		sodium_free(key);
+	}
+
+	return ret;
+}
+
+/*
+ * List safes whose name starts with prefix, as agent knows them from
+ * watching workspace. Names are handed to cb in component order, page after
+ * page until agent has none left. A cb error stops listing once current page
+ * is read.
+ */
+kp_error_t
+kp_agent_list(struct kp_agent *agent, const char *prefix,
+              kp_error_t (*cb)(const char *, void *), void *arg)
+{
+	kp_error_t ret = KP_SUCCESS, err;
+	struct imsg imsg;
+	struct kp_agent_attr attrs[2], attr;
+	struct iovec iov[4];
+	char after[PATH_MAX] = "", name[PATH_MAX];
+	bool more = true, last;
+	size_t off, count;
+	uint8_t flag;
+	void *value;
+	int iovcnt, n;
+
+	assert(agent);
+	assert(prefix);
+	assert(cb);
+
+	if (!(agent->caps & KP_AGENT_CAP_LIST)) {
+		errno = ENOTSUP;
+		return KP_ERRNO;
+	}
+
+	while (more && ret == KP_SUCCESS) {
+		iovcnt = kp_agent_attr(iov, &attrs[0], KP_ATTR_NAME, prefix,
+		                       strnlen(prefix, PATH_MAX - 1));
+		if (after[0] != '\0') {
+			iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[1],
+			                        KP_ATTR_AFTER, after,
+			                        strlen(after));
+		}
+		if ((err = kp_agent_sendv(agent, KP_MSG_LIST, iov, iovcnt))
+		    != KP_SUCCESS) {
+			return err;
+		}
+
+		/* Page spans messages up to the one telling what is left */
+		for (last = false, count = 0; !last;) {
+			if ((err = kp_agent_get(agent, KP_MSG_LIST, &imsg))
+			    != KP_SUCCESS) {
+				return err;
+			}
+
+			off = 0;
+			while ((n = kp_agent_attr_next(&imsg, &off, &attr,
+			                               &value)) > 0) {
+				if (attr.type == KP_ATTR_MORE
+				    && attr.len == sizeof(flag)) {
+					memcpy(&flag, value, sizeof(flag));
+					more = flag != 0;
+					last = true;
+					continue;
+				}
+				if (attr.type != KP_ATTR_NAME) {
+					continue;
+				}
+				if (kp_agent_attr_string(name, PATH_MAX, value,
+				                         attr.len) < 0) {
+					n = -1;
+					break;
+				}
+				if (ret == KP_SUCCESS) {
+					ret = cb(name, arg);
+				}
+				memcpy(after, name, attr.len + 1);
+				count++;
+			}
+			imsg_free(&imsg);
+
+			/* A page always moves listing forward */
+			if (n < 0 || (last && more && count == 0)) {
+				errno = EPROTO;
+				return KP_ERRNO;
+			}
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Value of the single attribute of a raw data message.
+ */
+kp_error_t
+kp_agent_msg_data(struct imsg *imsg, void **data, size_t *size)
+{
+	struct kp_agent_attr attr;
+	size_t off = 0;
+	void *value;
+	int n;
+
+	while ((n = kp_agent_attr_next(imsg, &off, &attr, &value)) > 0) {
+		if (attr.type == KP_ATTR_DATA) {
+			*data = value;
+			*size = attr.len;
+			return KP_SUCCESS;
+		}
+	}
+
+	errno = EPROTO;
+	return KP_ERRNO;
+}
+
+/*
+ * Null terminated string of at most max bytes, terminator included, sent
+ * as raw data.
+ */
+kp_error_t
+kp_agent_msg_string(struct imsg *imsg, char **string, size_t max)
+{
+	kp_error_t ret;
+	void *data;
+	size_t size;
+
+	if ((ret = kp_agent_msg_data(imsg, &data, &size)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if (size == 0 || size > max || ((char *)data)[size - 1] != '\0') {
+		errno = EPROTO;
+		return KP_ERRNO;
+	}
+
+	*string = data;
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Fill unsafe with attributes of message. Missing ones are left untouched,
+ * unknown ones are ignored. Sealed metadata is mapped from the memory file
+ * passed along, caller releases it with kp_agent_unsafe_clear.
+ */
+kp_error_t
+kp_agent_msg_unsafe(struct imsg *imsg, struct kp_unsafe *unsafe)
+{
+	kp_error_t ret;
+	struct kp_agent_attr attr;
+	size_t off = 0;
+	uint64_t len;
+	void *value;
+	int n;
+
+	while ((n = kp_agent_attr_next(imsg, &off, &attr, &value)) > 0) {
+		if (attr.type != KP_ATTR_SEALED) {
+			if (kp_agent_attr_unsafe(unsafe, &attr, value) < 0) {
+				n = -1;
+				break;
+			}
+			continue;
+		}
+
+		if (attr.len != sizeof(len) || imsg->fd < 0) {
+			n = -1;
+			break;
+		}
+		memcpy(&len, value, sizeof(len));
+
+		kp_agent_unsafe_release(unsafe);
+		ret = kp_agent_unseal(unsafe, imsg->fd, len);
+		imsg->fd = -1;
+		if (ret != KP_SUCCESS) {
+			return ret;
+		}
+
+		/* Mapping is all that is needed */
+		close(unsafe->large_fd);
+		unsafe->large_fd = -1;
+	}
+
+	if (n < 0) {
+		kp_agent_unsafe_release(unsafe);
+		errno = EPROTO;
+		return KP_ERRNO;
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Next safe of a batch starting at off, each safe starts with its name.
+ * Fail with ENOENT once all safes are read.
+ */
+kp_error_t
+kp_agent_msg_next_unsafe(struct imsg *imsg, size_t *off,
+                         struct kp_unsafe *unsafe)
+{
+	struct kp_agent_attr attr;
+	size_t start;
+	void *value;
+	bool named = false;
+	int n;
+
+	*unsafe = (struct kp_unsafe)KP_UNSAFE_INIT;
+
+	for (start = *off; (n = kp_agent_attr_next(imsg, off, &attr, &value))
+	     > 0; start = *off) {
+		if (attr.type == KP_ATTR_NAME) {
+			if (named) {
+				/* Next safe */
+				*off = start;
+				break;
+			}
+			named = true;
+		} else if (!named) {
+			n = -1;
+			break;
+		}
+
+		if (kp_agent_attr_unsafe(unsafe, &attr, value) < 0) {
+			n = -1;
+			break;
+		}
+	}
+
+	if (n < 0) {
+		errno = EPROTO;
+		return KP_ERRNO;
+	}
+
+	if (!named) {
+		errno = ENOENT;
+		return KP_ERRNO;
+	}
+
+	return KP_SUCCESS;
+}
+
+static kp_error_t
+kp_agent_msg_hello(struct imsg *imsg, uint16_t *version, uint32_t *caps)
+{
+	struct kp_agent_attr attr;
+	size_t off = 0;
+	void *value;
+	int n;
+
+	*version = 0;
+	*caps = 0;
+
+	while ((n = kp_agent_attr_next(imsg, &off, &attr, &value)) > 0) {
+		if (attr.type == KP_ATTR_VERSION && attr.len == sizeof(*version)) {
+			memcpy(version, value, sizeof(*version));
+		} else if (attr.type == KP_ATTR_CAPS
+		           && attr.len == sizeof(*caps)) {
+			memcpy(caps, value, sizeof(*caps));
+		}
+	}
+
+	if (n < 0) {
+		errno = EPROTO;
+		return KP_ERRNO;
+	}
+
+	if (*version != KP_AGENT_PROTOCOL_VERSION) {
+		errno = EPROTONOSUPPORT;
+		return KP_ERRNO;
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Describe an attribute with two io vectors, header and value, so that
+ * value is not copied before being composed into a message.
+ */
+static int
+kp_agent_attr(struct iovec *iov, struct kp_agent_attr *attr, uint16_t type,
+              const void *value, size_t len)
+{
+	attr->type = type;
+	attr->len = len;
+
+	iov[0].iov_base = attr;
+	iov[0].iov_len = sizeof(struct kp_agent_attr);
+	iov[1].iov_base = (void *)value;
+	iov[1].iov_len = len;
+
+	return 2;
+}
+
+/*
+ * Iterate over message attributes. Return 1 and fill attr and value with
+ * next attribute, 0 at end of message, -1 on truncated message.
+ */
+static int
+kp_agent_attr_next(struct imsg *imsg, size_t *off, struct kp_agent_attr *attr,
+                   void **value)
+{
+	return kp_agent_attr_parse(imsg->data, imsg->hdr.len - IMSG_HEADER_SIZE,
+	                           off, attr, value);
+}
+
+/*
+ * Same as kp_agent_attr_next, over size bytes of attributes at data.
+ */
+static int
+kp_agent_attr_parse(const void *data, size_t size, size_t *off,
+                    struct kp_agent_attr *attr, void **value)
+{
+	if (*off == size) {
+		return 0;
+	}
+
+	if (size - *off < sizeof(struct kp_agent_attr)) {
+		return -1;
+	}
+
+	/* Attributes are not aligned */
+	memcpy(attr, (const char *)data + *off, sizeof(struct kp_agent_attr));
+	*off += sizeof(struct kp_agent_attr);
+
+	if (size - *off < attr->len) {
+		return -1;
+	}
+
+	*value = (char *)data + *off;
+	*off += attr->len;
+
+	return 1;
+}
+
+static int
+kp_agent_attr_string(char *dst, size_t dstsize, const void *value,
+                     size_t len)
+{
+	if (len >= dstsize || memchr(value, '\0', len) != NULL) {
+		return -1;
+	}
+
+	memcpy(dst, value, len);
+	dst[len] = '\0';
+
+	return 0;
+}
+
+/*
+ * Attribute for a message being built with imsg_create.
+ */
+static int
+kp_agent_add(struct ibuf *wbuf, uint16_t type, const void *value, size_t len)
+{
+	struct kp_agent_attr attr = { .type = type, .len = len };
+
+	if (imsg_add(wbuf, &attr, sizeof(struct kp_agent_attr)) < 0) {
+		return -1;
+	}
+
+	if (imsg_add(wbuf, value, len) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+kp_agent_add_safe(struct ibuf *wbuf, const struct kp_unsafe *unsafe)
+{
+	int64_t timeout = unsafe->timeout;
+	uint8_t idle = unsafe->idle;
+
+	/* Name comes first, it starts a safe within a batch */
+	if (kp_agent_add(wbuf, KP_ATTR_NAME, unsafe->name,
+	                 strnlen(unsafe->name, PATH_MAX - 1)) < 0
+	    || kp_agent_add(wbuf, KP_ATTR_PASSWORD, unsafe->password,
+	                    strnlen(unsafe->password,
+	                            KP_PASSWORD_MAX_LEN - 1)) < 0
+	    || kp_agent_add(wbuf, KP_ATTR_METADATA, unsafe->metadata,
+	                    strnlen(unsafe->metadata,
+	                            KP_METADATA_MAX_LEN - 1)) < 0
+	    || kp_agent_add(wbuf, KP_ATTR_TIMEOUT, &timeout,
+	                    sizeof(timeout)) < 0
+	    || kp_agent_add(wbuf, KP_ATTR_IDLE, &idle, sizeof(idle)) < 0) {
+		return -1;
+	}
+
+	if (kp_safe_id_known(&unsafe->id)
+	    && kp_agent_add(wbuf, KP_ATTR_ID, &unsafe->id,
+	                    sizeof(struct kp_safe_id)) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Size of a safe once encoded as attributes.
+ */
+static size_t
+kp_agent_safe_size(const struct kp_unsafe *unsafe)
+{
+	return 5 * sizeof(struct kp_agent_attr)
+	     + strnlen(unsafe->name, PATH_MAX - 1)
+	     + strnlen(unsafe->password, KP_PASSWORD_MAX_LEN - 1)
+	     + strnlen(unsafe->metadata, KP_METADATA_MAX_LEN - 1)
+	     + sizeof(int64_t) + sizeof(uint8_t)
+	     + (kp_safe_id_known(&unsafe->id)
+	        ? sizeof(struct kp_agent_attr) + sizeof(struct kp_safe_id)
+	        : 0);
+}
+
+/*
+ * Queue a safe, values are not copied before being composed into message.
+ * Metadata too large for a message goes in a sealed memory file, fd if it
+ * already is in one.
+ */
+static kp_error_t
+kp_agent_queue_safe(struct kp_agent *agent, enum kp_agent_msg_type type,
+                    const char *name, const char *password,
+                    const char *metadata, size_t len, int fd,
+                    time_t timeout, bool idle, const struct kp_safe_id *id)
+{
+	kp_error_t ret;
+	struct kp_agent_attr attrs[6];
+	struct iovec iov[12];
+	int64_t _timeout = timeout;
+	uint64_t sealed = len;
+	uint8_t _idle = idle;
+	int iovcnt = 0;
+
+	iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[0], KP_ATTR_NAME,
+	                        name, strnlen(name, PATH_MAX - 1));
+	iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[1], KP_ATTR_PASSWORD,
+	                        password,
+	                        strnlen(password, KP_PASSWORD_MAX_LEN - 1));
+
+	if (len < KP_METADATA_MAX_LEN) {
+		fd = -1;
+		iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[2],
+		                        KP_ATTR_METADATA, metadata, len);
+	} else {
+		if (!(agent->caps & KP_AGENT_CAP_SEALED)) {
+			errno = EMSGSIZE;
+			return KP_ERRNO;
+		}
+		fd = fd >= 0 ? dup(fd) : kp_agent_seal(metadata, len);
+		if (fd < 0) {
+			return KP_ERRNO;
+		}
+		iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[2],
+		                        KP_ATTR_SEALED, &sealed, sizeof(sealed));
+	}
+
+	iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[3], KP_ATTR_TIMEOUT,
+	                        &_timeout, sizeof(_timeout));
+	iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[4], KP_ATTR_IDLE,
+	                        &_idle, sizeof(_idle));
+	if (kp_safe_id_known(id)) {
+		iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[5], KP_ATTR_ID,
+		                        id, sizeof(struct kp_safe_id));
+	}
+
+	if ((ret = kp_agent_queue_fd(agent, type, fd, iov, iovcnt))
+	    != KP_SUCCESS && fd >= 0) {
+		close(fd);
+	}
+
+	return ret;
+}
+
+static kp_error_t
+kp_agent_queue_error(struct kp_agent *agent, kp_error_t err)
+{
+	struct kp_msg_error error;
+	struct kp_agent_attr attr;
+	struct iovec iov[2];
+	int iovcnt;
+
+	error.err = err;
+	error.err_no = 0;
+	if (err == KP_ERRNO) {
+		error.err_no = errno;
+	}
+
+	iovcnt = kp_agent_attr(iov, &attr, KP_ATTR_DATA, &error,
+	                       sizeof(struct kp_msg_error));
+
+	return kp_agent_queue(agent, KP_MSG_ERROR, iov, iovcnt);
+}
+
+/*
+ * Compose a message, to be sent along with others on next flush.
+ */
+static kp_error_t
+kp_agent_queue(struct kp_agent *agent, enum kp_agent_msg_type type,
+               struct iovec *iov, int iovcnt)
+{
+	return kp_agent_queue_fd(agent, type, -1, iov, iovcnt);
+}
+
+/*
+ * Same as kp_agent_queue, passing fd along. Fd is closed once sent.
+ */
+static kp_error_t
+kp_agent_queue_fd(struct kp_agent *agent, enum kp_agent_msg_type type, int fd,
+                  struct iovec *iov, int iovcnt)
+{
+	if (imsg_composev(&agent->ibuf, type, 1, 0, fd, iov, iovcnt) < 0) {
+		return KP_ERRNO;
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Write queued messages. A non blocking agent writes what the socket takes
+ * at once, its caller drains the rest.
+ */
+static kp_error_t
+kp_agent_flush(struct kp_agent *agent)
+{
+	int n;
+
+	if (agent->nonblock) {
+		if (agent->ibuf.w.queued == 0) {
+			return KP_SUCCESS;
+		}
+		if ((n = msgbuf_write(&agent->ibuf.w)) == 0) {
+			errno = EPIPE;
+			return KP_ERRNO;
+		}
+		if (n < 0 && errno != EAGAIN) {
+			return KP_ERRNO;
+		}
+		return KP_SUCCESS;
+	}
+
+	if (imsg_flush(&agent->ibuf) < 0) {
+		return KP_ERRNO;
+	}
+
+	return KP_SUCCESS;
+}
+
+static int
+kp_agent_attr_unsafe(struct kp_unsafe *unsafe, struct kp_agent_attr *attr,
+                     void *value)
+{
+	int64_t timeout;
+
+	switch (attr->type) {
+	case KP_ATTR_NAME:
+		return kp_agent_attr_string(unsafe->name, PATH_MAX,
+		                            value, attr->len);
+	case KP_ATTR_PASSWORD:
+		return kp_agent_attr_string(unsafe->password,
+		                            KP_PASSWORD_MAX_LEN,
+		                            value, attr->len);
+	case KP_ATTR_METADATA:
+		return kp_agent_attr_string(unsafe->metadata,
+		                            KP_METADATA_MAX_LEN,
+		                            value, attr->len);
+	case KP_ATTR_TIMEOUT:
+		if (attr->len != sizeof(timeout)) {
+			return -1;
+		}
+		memcpy(&timeout, value, sizeof(timeout));
+		unsafe->timeout = timeout;
+		return 0;
+	case KP_ATTR_IDLE:
+		if (attr->len != sizeof(uint8_t)) {
+			return -1;
+		}
+		unsafe->idle = *(uint8_t *)value != 0;
+		return 0;
+	case KP_ATTR_SEALED:
+		/* Only valid along with a memory file, see kp_agent_msg_unsafe */
+		return -1;
+	case KP_ATTR_ID:
+		if (attr->len != sizeof(struct kp_safe_id)) {
+			return -1;
+		}
+		memcpy(&unsafe->id, value, sizeof(struct kp_safe_id));
+		return 0;
+	}
+
+	return 0;
+}
+
+static kp_error_t
+kp_agent_sendv(struct kp_agent *agent, enum kp_agent_msg_type type,
+               struct iovec *iov, int iovcnt)
+{
+	if (kp_agent_queue(agent, type, iov, iovcnt) != KP_SUCCESS) {
+		return KP_ERRNO;
+	}
+
+	return kp_agent_flush(agent);
+}
+
+/*
+ * Wait for next message, whatever its type. Caller frees imsg on success.
+ */
+static kp_error_t
+kp_agent_next(struct kp_agent *agent, struct imsg *imsg)
+{
+	ssize_t ssize = 0;
+
+	do {
+		/* Try to get one from ibuf */
+		if ((ssize = imsg_get(&agent->ibuf, imsg)) > 0) {
+			continue;
+		}
+
+		/* Nothing in buf try to read from conn */
+		if (imsg_read(&agent->ibuf) <= 0) {
+			imsg_clear(&agent->ibuf);
+			/* XXX clean conn */
+			return KP_ERRNO;
+		}
+
+		/* Try to get one from ibuf */
+		if ((ssize = imsg_get(&agent->ibuf, imsg)) < 0) {
+			return KP_ERRNO;
+		}
+	} while (ssize <= 0);
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Wait for next message, which must be of given type. An error message is
+ * turned into its error. Caller frees imsg on success.
+ */
+static kp_error_t
+kp_agent_get(struct kp_agent *agent, enum kp_agent_msg_type type,
+             struct imsg *imsg)
+{
+	kp_error_t ret;
+	struct kp_msg_error error;
+
+	if ((ret = kp_agent_next(agent, imsg)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if (imsg->hdr.type == type) {
+		return KP_SUCCESS;
+	}
+
+	if (imsg->hdr.type == KP_MSG_ERROR
+	    && kp_agent_msg_error(imsg, &error) == KP_SUCCESS) {
+		ret = error.err;
+		if (error.err == KP_ERRNO) {
+			errno = error.err_no;
+		}
+	} else {
+		/* XXX report real error */
+		ret = KP_INVALID_MSG;
+	}
+
+	imsg_free(imsg);
+
+	/* Agent handed over to a successor, which gets next requests */
+	if (ret == KP_ERRNO && errno == ESHUTDOWN) {
+		kp_agent_reconnect(agent);
+		errno = ESHUTDOWN;
+	}
+
+	return ret;
+}
+
+/*
+ * Tell whether a request was refused by an agent handing over, and is worth
+ * sending again to its successor.
+ */
+bool
+kp_agent_moved(struct kp_agent *agent, kp_error_t ret)
+{
+	return ret == KP_ERRNO && errno == ESHUTDOWN && agent->connected;
+}
+
+/*
+ * Connect again to agent socket, replies not read yet are dropped. Agent is
+ * left disconnected on failure.
+ */
+static kp_error_t
+kp_agent_reconnect(struct kp_agent *agent)
+{
+	kp_error_t ret;
+
+	kp_agent_close(agent);
+	agent->sock = -1;
+	agent->connected = false;
+	agent->caps = 0;
+
+	if ((agent->sock = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return KP_ERRNO;
+	}
+	imsg_init(&agent->ibuf, agent->sock);
+
+	if ((ret = kp_agent_connect(agent)) != KP_SUCCESS) {
+		kp_agent_close(agent);
+		agent->sock = -1;
+		return ret;
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Read the answer to one item of a batch, either a safe or an error.
+ */
+static kp_error_t
+kp_agent_collect(struct kp_agent *agent, enum kp_agent_msg_type type,
+                 struct kp_unsafe *unsafe, struct kp_msg_error *error)
+{
+	kp_error_t ret;
+	struct imsg imsg;
+
+	if ((ret = kp_agent_next(agent, &imsg)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	error->err = KP_SUCCESS;
+	error->err_no = 0;
+
+	if (imsg.hdr.type == type) {
+		*unsafe = (struct kp_unsafe)KP_UNSAFE_INIT;
+		ret = kp_agent_msg_unsafe(&imsg, unsafe);
+		sodium_memzero(imsg.data, imsg.hdr.len - IMSG_HEADER_SIZE);
+	} else if (imsg.hdr.type == KP_MSG_ERROR) {
+		ret = kp_agent_msg_error(&imsg, error);
+	} else {
+		ret = KP_INVALID_MSG;
+	}
+
+	if (imsg.fd >= 0) {
+		close(imsg.fd);
+	}
+	imsg_free(&imsg);
+	return ret;
+}
+
+static kp_error_t
+kp_agent_msg_error(struct imsg *imsg, struct kp_msg_error *error)
+{
+	kp_error_t ret;
+	void *data;
+	size_t size;
+
+	if ((ret = kp_agent_msg_data(imsg, &data, &size)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if (size != sizeof(struct kp_msg_error)) {
+		errno = EPROTO;
+		return KP_ERRNO;
+	}
+
+	memcpy(error, data, sizeof(struct kp_msg_error));
+
+	return KP_SUCCESS;
+}
+
+kp_error_t
+kp_agent_close(struct kp_agent *agent)
+{
+	imsg_clear(&agent->ibuf);
+
+	if (agent->sock >= 0) {
+		close(agent->sock);
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Set unsafe metadata. Metadata too large for unsafe is borrowed, it must
+ * outlive unsafe.
+ */
+void
+kp_agent_unsafe_set_metadata(struct kp_unsafe *unsafe, const char *metadata)
+{
+	assert(unsafe);
+	assert(metadata);
+
+	kp_agent_unsafe_release(unsafe);
+
+	if (strlcpy(unsafe->metadata, metadata, KP_METADATA_MAX_LEN)
+	    >= KP_METADATA_MAX_LEN) {
+		sodium_memzero(unsafe->metadata, KP_METADATA_MAX_LEN);
+		unsafe->large = metadata;
+	}
+}
+
+/*
+ * Copy metadata into a sealed memory file mapped by unsafe, so that it can
+ * be sent many times without copy.
+ */
+kp_error_t
+kp_agent_unsafe_seal(struct kp_unsafe *unsafe, const char *metadata)
+{
+	size_t len;
+	int fd;
+
+	assert(unsafe);
+	assert(metadata);
+
+	kp_agent_unsafe_release(unsafe);
+	unsafe->metadata[0] = '\0';
+
+	len = strlen(metadata);
+	if ((fd = kp_agent_seal(metadata, len)) < 0) {
+		return KP_ERRNO;
+	}
+
+	return kp_agent_unseal(unsafe, fd, len);
+}
+
+const char *
+kp_agent_unsafe_metadata(const struct kp_unsafe *unsafe)
+{
+	assert(unsafe);
+
+	return unsafe->large != NULL ? unsafe->large : unsafe->metadata;
+}
+
+/*
+ * Wipe unsafe and release its sealed metadata, if any.
+ */
+void
+kp_agent_unsafe_clear(struct kp_unsafe *unsafe)
+{
+	assert(unsafe);
+
+	kp_agent_unsafe_release(unsafe);
+	sodium_memzero(unsafe, sizeof(struct kp_unsafe));
+	unsafe->timeout = -1;
+	unsafe->large_fd = -1;
+}
+
+static void
+kp_agent_ready(void)
+{
+	if (ready) {
+		return;
+	}
+
+	kp_index_init(&stores);
+	kp_index_init(&known);
+	kp_wheel_init(&wheel, kp_agent_now());
+	ready = true;
+}
+
+static kp_error_t
+kp_agent_store_create(struct kp_agent *agent, struct kp_store **_store,
+                      const char *name, const char *password,
+                      const char *metadata)
+{
+	kp_error_t ret;
+	struct kp_store *store;
+	size_t name_len, password_len, metadata_len;
+
+	name_len = strlen(name);
+	password_len = strlen(password);
+	metadata_len = strlen(metadata);
+
+	if ((store = malloc(sizeof(struct kp_store) + name_len + 1)) == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	memcpy(store->name, name, name_len + 1);
+	store->password = NULL;
+	store->metadata = NULL;
+	store->cipher = NULL;
+	store->plain = password_len + metadata_len + 2;
+	store->size = 0;
+
+	if (cache_key != NULL) {
+		if ((ret = kp_agent_store_seal(store, password, metadata))
+		    != KP_SUCCESS) {
+			free(store);
+			return ret;
+		}
+	} else {
+		store->password = kp_slab_alloc(store->plain);
+		if (store->password == NULL) {
+			free(store);
+			errno = ENOMEM;
+			return KP_ERRNO;
+		}
+		store->metadata = &store->password[password_len + 1];
+		memcpy(store->password, password, password_len + 1);
+		memcpy(store->metadata, metadata, metadata_len + 1);
+		store->size = kp_slab_size(store->plain);
+	}
+
+	store->index.name = store->name;
+	store->index.data = store;
+	store->timer.armed = false;
+	store->timer.data = store;
+	store->timeout = -1;
+	store->idle = false;
+	memset(&store->id, 0, sizeof(struct kp_safe_id));
+
+	*_store = store;
+
+	return KP_SUCCESS;
+}
+
+static void
+kp_agent_store_free(struct kp_agent *agent, struct kp_store *store)
+{
+	assert(store);
+
+	if (store->cipher != NULL) {
+		free(store->cipher);
+	} else {
+		/* metadata lives in password allocation */
+		kp_slab_free(store->password);
+	}
+	free(store);
+}
+
+/*
+ * Encrypt password and metadata into ordinary memory. Plain text only goes
+ * through locked memory, name is authenticated along so that ciphertext
+ * cannot be swapped between safes.
+ */
+static kp_error_t
+kp_agent_store_seal(struct kp_store *store, const char *password,
+                    const char *metadata)
+{
+	char *plain;
+	size_t password_len;
+
+	password_len = strlen(password);
+
+	store->cipher = malloc(crypto_aead_xchacha20poly1305_ietf_NPUBBYTES
+	                       + store->plain
+	                       + crypto_aead_xchacha20poly1305_ietf_ABYTES);
+	if (store->cipher == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	if ((plain = kp_slab_alloc(store->plain)) == NULL) {
+		free(store->cipher);
+		store->cipher = NULL;
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	memcpy(plain, password, password_len + 1);
+	memcpy(&plain[password_len + 1], metadata,
+	       store->plain - password_len - 1);
+
+	randombytes_buf(store->cipher,
+	                crypto_aead_xchacha20poly1305_ietf_NPUBBYTES);
+	crypto_aead_xchacha20poly1305_ietf_encrypt(
+	    store->cipher + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES, NULL,
+	    (unsigned char *)plain, store->plain,
+	    (unsigned char *)store->name, strlen(store->name), NULL,
+	    store->cipher, cache_key);
+
+	kp_slab_free(plain);
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Plain text of stored safe, password then metadata, in locked memory. Give
+ * it back with kp_agent_store_close.
+ */
+static char *
+kp_agent_store_open(struct kp_store *store)
+{
+	char *plain;
+
+	if (store->cipher == NULL) {
+		return store->password;
+	}
+
+	if ((plain = kp_slab_alloc(store->plain)) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (crypto_aead_xchacha20poly1305_ietf_decrypt(
+	        (unsigned char *)plain, NULL, NULL,
+	        store->cipher + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES,
+	        store->plain + crypto_aead_xchacha20poly1305_ietf_ABYTES,
+	        (unsigned char *)store->name, strlen(store->name),
+	        store->cipher, cache_key) != 0) {
+		kp_slab_free(plain);
+		errno = EBADMSG;
+		return NULL;
+	}
+
+	return plain;
+}
+
+static void
+kp_agent_store_close(struct kp_store *store, char *plain)
+{
+	if (store->cipher != NULL) {
+		kp_slab_free(plain);
+	}
+}
+
+static struct kp_store *
+kp_agent_find(const char *name)
+{
+	struct kp_index_entry *entry;
+
+	if ((entry = kp_index_find(&stores, name)) == NULL) {
+		return NULL;
+	}
+
+	return entry->data;
+}
+
+/*
+ * Remove safe from storage and give its memory back.
+ */
+static void
+kp_agent_remove(struct kp_agent *agent, struct kp_store *store)
+{
+	kp_index_remove(&stores, &store->index);
+	TAILQ_REMOVE(&lru, store, lru);
+	kp_wheel_cancel(&wheel, &store->timer);
+	locked -= store->size;
+	kp_agent_store_free(agent, store);
+}
+
+/*
+ * Evict least recently used safes until size more bytes fit in budget.
+ */
+static kp_error_t
+kp_agent_evict(struct kp_agent *agent, size_t size)
+{
+	if (size > budget) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	while (locked > budget - size) {
+		kp_agent_remove(agent, TAILQ_FIRST(&lru));
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Set the most locked memory stored safes may hold, evicting least recently
+ * used ones if they already hold more.
+ */
+void
+kp_agent_budget(struct kp_agent *agent, size_t size)
+{
+	budget = size;
+	kp_agent_evict(agent, 0);
+}
+
+/*
+ * Store safes from now on encrypted with a random key of the agent, in
+ * ordinary memory, decrypting them on each search. Only the key, and the
+ * safe being answered, are held in locked memory, whatever the number of
+ * stored safes.
+ */
+kp_error_t
+kp_agent_encrypt(struct kp_agent *agent)
+{
+	if (cache_key != NULL) {
+		return KP_SUCCESS;
+	}
+
+	cache_key = sodium_malloc(crypto_aead_xchacha20poly1305_ietf_KEYBYTES);
+	if (cache_key == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	randombytes_buf(cache_key, crypto_aead_xchacha20poly1305_ietf_KEYBYTES);
+	sodium_mprotect_readonly(cache_key);
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Locked memory held by stored safes.
+ */
+size_t
+kp_agent_locked(struct kp_agent *agent)
+{
+	return locked;
+}
+
+static uint64_t
+kp_agent_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec;
+}
+
+static void
+kp_agent_expired(struct kp_timer *timer, void *agent)
+{
+	kp_agent_remove(agent, timer->data);
+}
+
+/*
+ * Discard safes whose timeout is over. Return how many safes are still
+ * waiting for their timeout.
+ */
+size_t
+kp_agent_expire(struct kp_agent *agent)
+{
+	kp_agent_ready();
+
+	kp_wheel_advance(&wheel, kp_agent_now(), kp_agent_expired, agent);
+
+	return wheel.count;
+}
+
+kp_error_t
+kp_agent_store(struct kp_agent *agent, struct kp_unsafe *unsafe)
+{
+	kp_error_t ret;
+	struct kp_store *store, *existing;
+
+	/* unsafe comes from the wire, ensure null termination */
+	unsafe->name[PATH_MAX-1] = '\0';
+	unsafe->password[KP_PASSWORD_MAX_LEN-1] = '\0';
+	unsafe->metadata[KP_METADATA_MAX_LEN-1] = '\0';
+
+	kp_agent_expire(agent);
+
+	/* Previous version of the safe is stale whether store succeed or not */
+	if ((existing = kp_agent_find(unsafe->name)) != NULL) {
+		kp_agent_remove(agent, existing);
+	}
+
+	/* Workspace already holds another version of the safe */
+	if (watching && kp_safe_id_known(&unsafe->id)
+	    && !kp_agent_current(unsafe->name, &unsafe->id)) {
+		errno = ESTALE;
+		return KP_ERRNO;
+	}
+
+	if ((ret = kp_agent_store_create(agent, &store, unsafe->name,
+	                                 unsafe->password,
+	                                 kp_agent_unsafe_metadata(unsafe)))
+	    != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = kp_agent_evict(agent, store->size)) != KP_SUCCESS) {
+		goto out;
+	}
+
+	if ((ret = kp_index_insert(&stores, &store->index)) != KP_SUCCESS) {
+		goto out;
+	}
+
+	TAILQ_INSERT_TAIL(&lru, store, lru);
+	locked += store->size;
+
+	store->timeout = unsafe->timeout;
+	store->idle = unsafe->idle;
+	store->id = unsafe->id;
+	if (store->timeout > 0) {
+		kp_wheel_arm(&wheel, &store->timer,
+		             kp_agent_now() + store->timeout);
+	}
+
+	return KP_SUCCESS;
+
+out:
+	kp_agent_store_free(agent, store);
+	return ret;
+}
+
+/*
+ * Tell timeout of the stored copy of safe, if any, so that it can be stored
+ * again once saved.
+ */
+bool
+kp_agent_stored(struct kp_agent *agent, struct kp_unsafe *unsafe)
+{
+	struct kp_store *store;
+
+	kp_agent_expire(agent);
+
+	if ((store = kp_agent_find(unsafe->name)) == NULL) {
+		return false;
+	}
+
+	unsafe->timeout = store->timeout;
+	unsafe->idle = store->idle;
+
+	return true;
+}
+
+kp_error_t
+kp_agent_discard(struct kp_agent *agent, const char *name, bool silent)
+{
+	kp_error_t ret;
+	struct kp_store *store;
+	bool result = true;
+
+	kp_agent_expire(agent);
+
+	if ((store = kp_agent_find(name)) == NULL) {
+		errno = ENOENT;
+		ret = KP_ERRNO;
+		goto failure;
+	}
+
+	kp_agent_remove(agent, store);
+
+	if (silent) {
+		return KP_SUCCESS;
+	} else {
+		return kp_agent_send(agent, KP_MSG_DISCARD, &result, sizeof(bool));
+	}
+
+failure:
+	if (!silent) {
+		kp_agent_error(agent, ret);
+	}
+	return ret;
+}
+
+kp_error_t
+kp_agent_search(struct kp_agent *agent, const char *name)
+{
+	kp_error_t ret;
+
+	kp_agent_expire(agent);
+	kp_agent_sync(agent);
+
+	if ((ret = kp_agent_search_reply(agent, name)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	return kp_agent_flush(agent);
+}
+
+/*
+ * Answer a save, telling which file safe was saved to. Clients unaware of
+ * it only read the result.
+ */
+kp_error_t
+kp_agent_send_saved(struct kp_agent *agent, const struct kp_safe_id *id)
+{
+	struct kp_agent_attr attrs[2];
+	struct iovec iov[4];
+	bool result = true;
+	int iovcnt = 0;
+
+	assert(agent);
+	assert(id);
+
+	iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[0], KP_ATTR_DATA, &result,
+	                        sizeof(bool));
+	if (kp_safe_id_known(id)) {
+		iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[1], KP_ATTR_ID,
+		                        id, sizeof(struct kp_safe_id));
+	}
+
+	return kp_agent_sendv(agent, KP_MSG_SAVE, iov, iovcnt);
+}
+
+/*
+ * Answer every name of a batch in order, with a safe or an error, all in
+ * a single write.
+ */
+kp_error_t
+kp_agent_search_batch(struct kp_agent *agent, struct imsg *imsg)
+{
+	kp_error_t ret;
+	struct kp_agent_attr attr;
+	char name[PATH_MAX];
+	size_t off = 0;
+	void *value;
+	int n;
+
+	kp_agent_expire(agent);
+	kp_agent_sync(agent);
+
+	while ((n = kp_agent_attr_next(imsg, &off, &attr, &value)) > 0) {
+		if (attr.type != KP_ATTR_NAME) {
+			continue;
+		}
+
+		if (kp_agent_attr_string(name, PATH_MAX, value, attr.len) < 0) {
+			errno = ENAMETOOLONG;
+			ret = kp_agent_queue_error(agent, KP_ERRNO);
+		} else {
+			ret = kp_agent_search_reply(agent, name);
+		}
+
+		if (ret != KP_SUCCESS) {
+			return ret;
+		}
+	}
+
+	if (n < 0) {
+		errno = EPROTO;
+		kp_agent_queue_error(agent, KP_ERRNO);
+	}
+
+	return kp_agent_flush(agent);
+}
+
+/*
+ * Queue found safe, or error. Only fails if reply cannot be queued.
+ */
+static kp_error_t
+kp_agent_search_reply(struct kp_agent *agent, const char *name)
+{
+	kp_error_t ret;
+	struct kp_store *store;
+	char *plain, *metadata;
+
+	if ((store = kp_agent_find(name)) == NULL) {
 		errno = ENOENT;
+		return kp_agent_queue_error(agent, KP_ERRNO);
+	}
+
+	/* Most recently used is evicted last */
+	TAILQ_REMOVE(&lru, store, lru);
+	TAILQ_INSERT_TAIL(&lru, store, lru);
+
+	if (store->idle && store->timer.armed) {
+		kp_wheel_arm(&wheel, &store->timer,
+		             kp_agent_now() + store->timeout);
+	}
+
+	if ((plain = kp_agent_store_open(store)) == NULL) {
+		return kp_agent_queue_error(agent, KP_ERRNO);
+	}
+
+	metadata = plain + strlen(plain) + 1;
+	ret = kp_agent_queue_safe(agent, KP_MSG_SEARCH, store->name, plain,
+	                          metadata, strlen(metadata), -1,
+	                          store->timeout, store->idle, &store->id);
+	if (ret != KP_SUCCESS && errno == EMSGSIZE) {
+		/* Client cannot receive such a large safe */
+		ret = kp_agent_queue_error(agent, KP_ERRNO);
+	}
+	kp_agent_store_close(store, plain);
+
+	return ret;
+}
+
+/*
+ * Index safes of workspace at root, then keep index up to date. Fd is to be
+ * polled for reading, kp_agent_watch_read handles what it tells.
+ */
+kp_error_t
+kp_agent_watch(struct kp_agent *agent, const char *root, int *fd)
+{
+	kp_error_t ret;
+
+	assert(root);
+	assert(fd);
+
+	kp_agent_ready();
+	kp_agent_unwatch(agent);
+
+	if ((workspace = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		watch_errno = errno;
+		return KP_ERRNO;
+	}
+
+	if ((ret = kp_watch_init(&watch, root, kp_agent_known, agent))
+	    != KP_SUCCESS) {
+		watch_errno = errno;
+		kp_agent_unwatch(agent);
+		errno = watch_errno;
+		return ret;
+	}
+
+	watching = true;
+	*fd = watch.fd;
+
+	/* Safes stored before, handed over for instance, may be stale */
+	kp_agent_verify(agent);
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Catch up with workspace changes. Once it failed, known and stored safes
+ * are dropped, since nothing tells anymore whether stored ones are fresh,
+ * and it keeps failing with the same error until unwatched.
+ */
+kp_error_t
+kp_agent_watch_read(struct kp_agent *agent)
+{
+	kp_error_t ret;
+
+	if (!watching) {
+		errno = watch_errno;
+		return KP_ERRNO;
+	}
+
+	if ((ret = kp_watch_read(&watch)) != KP_SUCCESS) {
+		watch_errno = errno;
+		watching = false;
+		kp_agent_known_remove("");
+		kp_agent_forget(agent, "");
+		errno = watch_errno;
+	}
+
+	return ret;
+}
+
+void
+kp_agent_unwatch(struct kp_agent *agent)
+{
+	kp_watch_fini(&watch);
+	if (workspace >= 0) {
+		close(workspace);
+		workspace = -1;
+	}
+	watching = false;
+	kp_agent_known_remove("");
+}
+
+/*
+ * Answer one page of known safes whose name starts with prefix, past after
+ * if given. Prefix last component matches partially unless followed by a
+ * '/'. Names go in component order, in as many messages as needed, the last
+ * one telling whether another page is left. A page is bounded both in names
+ * and in size, so that a single request cannot fill replies queue.
+ */
+kp_error_t
+kp_agent_list_names(struct kp_agent *agent, struct imsg *imsg)
+{
+	struct kp_agent_page page = { .agent = agent, .ret = KP_SUCCESS };
+	struct kp_agent_attr attr;
+	char prefix[PATH_MAX] = "", after[PATH_MAX];
+	const char *cursor = NULL;
+	size_t off = 0;
+	uint8_t more;
+	void *value;
+	int n;
+
+	assert(agent);
+	assert(imsg);
+
+	while ((n = kp_agent_attr_next(imsg, &off, &attr, &value)) > 0) {
+		if (attr.type == KP_ATTR_NAME) {
+			if (kp_agent_attr_string(prefix, PATH_MAX, value,
+			                         attr.len) < 0) {
+				n = -1;
+				break;
+			}
+		} else if (attr.type == KP_ATTR_AFTER) {
+			if (kp_agent_attr_string(after, PATH_MAX, value,
+			                         attr.len) < 0) {
+				n = -1;
+				break;
+			}
+			cursor = after;
+		}
+	}
+
+	if (n < 0) {
+		errno = EPROTO;
+		return kp_agent_error(agent, KP_ERRNO);
+	}
+
+	/* Changes client made before asking must show */
+	kp_agent_sync(agent);
+
+	if (!watching) {
+		errno = ENOTSUP;
+		return kp_agent_error(agent, KP_ERRNO);
+	}
+
+	kp_index_walk(&known, prefix, cursor, kp_agent_page_add, &page);
+	if (page.ret != KP_SUCCESS) {
+		goto fail;
+	}
+
+	if (page.wbuf == NULL
+	    && (page.wbuf = imsg_create(&agent->ibuf, KP_MSG_LIST, 1, 0,
+	                                sizeof(struct kp_agent_attr)
+	                                + sizeof(more))) == NULL) {
+		goto fail;
+	}
+
+	more = page.more;
+	if (kp_agent_add(page.wbuf, KP_ATTR_MORE, &more, sizeof(more)) < 0) {
+		goto fail;
+	}
+	imsg_close(&agent->ibuf, page.wbuf);
+
+	return kp_agent_flush(agent);
+
+fail:
+	/* Client gets the messages already queued, then error */
+	return kp_agent_error(agent, KP_ERRNO);
+}
+
+/*
+ * Keep known and stored safes in line with workspace.
+ */
+static kp_error_t
+kp_agent_known(enum kp_watch_event event, const char *name, void *agent)
+{
+	kp_error_t ret;
+	struct kp_known *safe;
+	struct kp_store *store;
+	size_t len;
+
+	switch (event) {
+	case KP_WATCH_ADD:
+		/* Stored copy is stale unless it is the version just written */
+		if ((store = kp_agent_find(name)) != NULL
+		    && !kp_agent_current(name, &store->id)) {
+			kp_agent_remove(agent, store);
+		}
+
+		/* Safe written again */
+		if (kp_index_find(&known, name) != NULL) {
+			break;
+		}
+
+		len = strlen(name);
+		if ((safe = malloc(sizeof(struct kp_known) + len + 1))
+		    == NULL) {
+			errno = ENOMEM;
+			return KP_ERRNO;
+		}
+		memcpy(safe->name, name, len + 1);
+		safe->index.name = safe->name;
+		safe->index.data = safe;
+
+		if ((ret = kp_index_insert(&known, &safe->index))
+		    != KP_SUCCESS) {
+			free(safe);
+			return ret;
+		}
+		break;
+	case KP_WATCH_REMOVE:
+		kp_agent_known_remove(name);
+		kp_agent_forget(agent, name);
+		break;
+	case KP_WATCH_RESET:
+		/* Changes were lost, workspace is scanned again */
+		kp_agent_known_remove("");
+		kp_agent_verify(agent);
+		break;
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Forget safe name and every safe below it, every safe if name is empty.
+ */
+static void
+kp_agent_known_remove(const char *name)
+{
+	struct kp_index_entry *entry;
+	char prefix[PATH_MAX];
+
+	if ((entry = kp_index_find(&known, name)) != NULL) {
+		kp_index_remove(&known, entry);
+		free(entry->data);
+	}
+
+	if (snprintf(prefix, PATH_MAX, "%s/", name) >= PATH_MAX) {
+		return;
+	}
+
+	/* Index cannot change during a walk, remove one safe per walk */
+	for (;;) {
+		entry = NULL;
+		kp_index_walk(&known, prefix, NULL, kp_agent_first,
+		              &entry);
+		if (entry == NULL) {
+			break;
+		}
+		kp_index_remove(&known, entry);
+		free(entry->data);
+	}
+}
+
+static int
+kp_agent_first(struct kp_index_entry *entry, void *first)
+{
+	*(struct kp_index_entry **)first = entry;
+
+	return 1;
+}
+
+/*
+ * Catch up with workspace changes before answering from stored or known
+ * safes, so that a change made before a request always shows.
+ */
+static void
+kp_agent_sync(struct kp_agent *agent)
+{
+	if (watching) {
+		kp_agent_watch_read(agent);
+	}
+}
+
+/*
+ * Whether workspace still holds safe name as id tells.
+ */
+static bool
+kp_agent_current(const char *name, const struct kp_safe_id *id)
+{
+	struct kp_safe_id current;
+
+	if (!kp_safe_id_known(id)
+	    || kp_storage_id(workspace, name, &current) != KP_SUCCESS) {
+		return false;
+	}
+
+	return memcmp(&current, id, sizeof(struct kp_safe_id)) == 0;
+}
+
+/*
+ * Drop stored safe name and every stored safe below it, every stored safe
+ * if name is empty.
+ */
+static void
+kp_agent_forget(struct kp_agent *agent, const char *name)
+{
+	struct kp_index_entry *entry;
+	char prefix[PATH_MAX];
+
+	if ((entry = kp_index_find(&stores, name)) != NULL) {
+		kp_agent_remove(agent, entry->data);
+	}
+
+	if (snprintf(prefix, PATH_MAX, "%s/", name) >= PATH_MAX) {
+		return;
+	}
+
+	/* Index cannot change during a walk, remove one safe per walk */
+	for (;;) {
+		entry = NULL;
+		kp_index_walk(&stores, prefix, NULL, kp_agent_first, &entry);
+		if (entry == NULL) {
+			break;
+		}
+		kp_agent_remove(agent, entry->data);
+	}
+}
+
+/*
+ * Drop stored safes workspace does not hold anymore, or which cannot be
+ * told apart from another version.
+ */
+static void
+kp_agent_verify(struct kp_agent *agent)
+{
+	struct kp_store *store, *next;
+
+	for (store = TAILQ_FIRST(&lru); store != NULL; store = next) {
+		next = TAILQ_NEXT(store, lru);
+		if (!kp_agent_current(store->name, &store->id)) {
+			kp_agent_remove(agent, store);
+		}
+	}
+}
+
+/*
+ * Queue name in current page, stop walking once page is full. A name is
+ * always left room for the attribute ending page.
+ */
+static int
+kp_agent_page_add(struct kp_index_entry *entry, void *_page)
+{
+	struct kp_agent_page *page = _page;
+	struct imsgbuf *ibuf = &page->agent->ibuf;
+	size_t len, name_len;
+
+	if (page->count == KP_AGENT_LIST_MAX
+	    || page->size >= KP_AGENT_INFLIGHT_MAX) {
+		page->more = true;
+		return 1;
+	}
+
+	name_len = strlen(entry->name);
+	len = sizeof(struct kp_agent_attr) + name_len;
+
+	if (page->wbuf != NULL && page->len + len + sizeof(struct kp_agent_attr)
+	    + sizeof(uint8_t) > KP_AGENT_PAYLOAD_MAX) {
+		imsg_close(ibuf, page->wbuf);
+		page->wbuf = NULL;
+	}
+
+	if (page->wbuf == NULL) {
+		if ((page->wbuf = imsg_create(ibuf, KP_MSG_LIST, 1, 0,
+		                              KP_AGENT_PAYLOAD_MAX)) == NULL) {
+			page->ret = KP_ERRNO;
+			return 1;
+		}
+		page->len = 0;
+	}
+
+	if (kp_agent_add(page->wbuf, KP_ATTR_NAME, entry->name, name_len) < 0) {
+		/* Message is freed along */
+		page->wbuf = NULL;
+		page->ret = KP_ERRNO;
+		return 1;
+	}
+
+	page->len += len;
+	page->size += len;
+	page->count++;
+
+	return 0;
+}
+
+/*
+ * Hand state over to the new agent connected as peer, along with a copy of
+ * listener. Nothing is sent unless the whole state could be written.
+ */
+kp_error_t
+kp_agent_handoff(struct kp_agent *peer, struct kp_ctx *ctx, int listener)
+{
+	kp_error_t ret;
+	struct kp_agent_state state;
+	struct kp_agent_attr attr;
+	struct iovec iov[2];
+	int iovcnt, fd = -1;
+
+	assert(peer);
+	assert(ctx);
+
+	if ((ret = kp_agent_state_open(&state)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	kp_agent_expire(peer);
+	if ((ret = kp_agent_state_dump(&state, ctx)) != KP_SUCCESS) {
+		goto out;
+	}
+
+	if ((fd = dup(listener)) < 0) {
 		ret = KP_ERRNO;
+		goto out;
+	}
+
+	iovcnt = kp_agent_attr(iov, &attr, KP_ATTR_DATA, state.key,
+	                       KP_AGENT_STATE_KEY);
+	if ((ret = kp_agent_queue_fd(peer, KP_MSG_TAKEOVER, state.fd, iov,
+	                             iovcnt)) != KP_SUCCESS) {
+		goto out;
+	}
+	/* Queued message owns it now */
+	state.fd = -1;
+
+	if ((ret = kp_agent_queue_fd(peer, KP_MSG_TAKEOVER, fd, NULL, 0))
+	    != KP_SUCCESS) {
+		goto out;
+	}
+	fd = -1;
+
+	ret = kp_agent_flush(peer);
+
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+	kp_agent_state_close(&state);
+
+	return ret;
+}
+
+/*
+ * Anonymous memory file, which can be sealed. There is no fallback: large
+ * metadata must neither reach the disk nor be handed out unsealed, it is too
+ * large for a message instead.
+ */
+static int
+kp_agent_memfd(void)
+{
+#ifdef HAS_MEMFD_CREATE
+	int fd;
+
+	if ((fd = memfd_create("kickpass-agent",
+	                       MFD_CLOEXEC | MFD_ALLOW_SEALING)) >= 0
+	    || errno != ENOSYS) {
+		return fd;
+	}
+#endif
+
+	errno = EMSGSIZE;
+	return -1;
+}
+
+/*
+ * Unlinked temp file, for data encrypted with a key it never holds.
+ */
+static int
+kp_agent_tmpfile(void)
+{
+	char path[] = "/tmp/kickpass-XXXXXX";
+	int fd;
+
+	if ((fd = mkstemp(path)) < 0) {
+		return -1;
+	}
+	unlink(path);
+
+	return fd;
+}
+
+static kp_error_t
+kp_agent_write(int fd, const void *buf, size_t size)
+{
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < size; off += n) {
+		if ((n = write(fd, (const char *)buf + off, size - off)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return KP_ERRNO;
+		}
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Memory file holding len bytes of data and a null terminator, sealed so
+ * that it cannot change once mapped by its receiver.
+ */
+static int
+kp_agent_seal(const char *data, size_t len)
+{
+	int fd;
+
+	if ((fd = kp_agent_memfd()) < 0) {
+		return -1;
+	}
+
+	if (kp_agent_write(fd, data, len + 1) != KP_SUCCESS) {
 		goto failure;
 	}
 
-	if (strlcpy(unsafe.name, store->safe->name, PATH_MAX) >= PATH_MAX) {
-		errno = ENOMEM;
-		ret = KP_ERRNO;
+#ifdef F_ADD_SEALS
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE
+	          | F_SEAL_SEAL) < 0) {
 		goto failure;
 	}
-	if (strlcpy(unsafe.password, store->safe->password, KP_PASSWORD_MAX_LEN)
-	    >= KP_PASSWORD_MAX_LEN) {
-		errno = ENOMEM;
-		ret = KP_ERRNO;
+#else
+	errno = EMSGSIZE;
+	goto failure;
+#endif
+
+	return fd;
+
+failure:
+	close(fd);
+	return -1;
+}
+
+/*
+ * Map len bytes of metadata of memory file fd read only into unsafe, which
+ * then owns fd. Fd is closed on failure.
+ */
+static kp_error_t
+kp_agent_unseal(struct kp_unsafe *unsafe, int fd, uint64_t len)
+{
+	struct stat sb;
+	char *map;
+#ifdef F_GET_SEALS
+	int seals;
+#endif
+
+	/* Sender must not be able to change what we read, a file that cannot
+	 * be sealed could be truncated under our mapping */
+#ifdef F_GET_SEALS
+	if ((seals = fcntl(fd, F_GET_SEALS)) < 0
+	    || (seals & (F_SEAL_SHRINK | F_SEAL_WRITE))
+	       != (F_SEAL_SHRINK | F_SEAL_WRITE)) {
+		errno = EPERM;
 		goto failure;
 	}
-	if (strlcpy(unsafe.metadata, store->safe->metadata, KP_METADATA_MAX_LEN)
-	    >= KP_METADATA_MAX_LEN) {
-		errno = ENOMEM;
-		ret = KP_ERRNO;
+#else
+	errno = EPERM;
+	goto failure;
+#endif
+
+	if (fstat(fd, &sb) < 0) {
+		goto failure;
+	}
+
+	if (len >= SIZE_MAX || sb.st_size < 0
+	    || (uint64_t)sb.st_size != len + 1) {
+		errno = EPROTO;
+		goto failure;
+	}
+
+	if ((map = mmap(NULL, len + 1, PROT_READ, MAP_SHARED, fd, 0))
+	    == MAP_FAILED) {
 		goto failure;
 	}
 
-	return kp_agent_send(agent, KP_MSG_SEARCH, &unsafe,
-	                         sizeof(struct kp_unsafe));
+	if (map[len] != '\0') {
+		munmap(map, len + 1);
+		errno = EPROTO;
+		goto failure;
+	}
+
+	unsafe->large = map;
+	unsafe->large_size = len + 1;
+	unsafe->large_fd = fd;
+
+	return KP_SUCCESS;
 
 failure:
-	kp_agent_error(agent, ret);
+	close(fd);
+	return KP_ERRNO;
+}
+
+static void
+kp_agent_unsafe_release(struct kp_unsafe *unsafe)
+{
+	if (unsafe->large_size > 0) {
+		munmap((void *)unsafe->large, unsafe->large_size);
+	}
+	if (unsafe->large_fd >= 0) {
+		close(unsafe->large_fd);
+	}
+
+	unsafe->large = NULL;
+	unsafe->large_size = 0;
+	unsafe->large_fd = -1;
+}
+
+/*
+ * Create state memory file, and key it is encrypted with.
+ */
+static kp_error_t
+kp_agent_state_open(struct kp_agent_state *state)
+{
+	state->frame = 0;
+	state->len = 0;
+	state->key = NULL;
+	state->cipher = NULL;
+
+	/* State is encrypted, its key goes through the socket only */
+	if ((state->fd = kp_agent_memfd()) < 0
+	    && (state->fd = kp_agent_tmpfile()) < 0) {
+		return KP_ERRNO;
+	}
+
+	/* Key and plain text share a guarded allocation */
+	state->key = sodium_malloc(KP_AGENT_STATE_KEY + KP_AGENT_FRAME_SIZE);
+	state->cipher = malloc(sizeof(uint32_t) + 1 + KP_AGENT_FRAME_SIZE
+	                       + KP_AGENT_FRAME_ABYTES);
+	if (state->key == NULL || state->cipher == NULL) {
+		kp_agent_state_close(state);
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+	state->plain = state->key + KP_AGENT_STATE_KEY;
+	randombytes_buf(state->key, KP_AGENT_STATE_KEY);
+
+	return KP_SUCCESS;
+}
+
+static void
+kp_agent_state_close(struct kp_agent_state *state)
+{
+	if (state->fd >= 0) {
+		close(state->fd);
+		state->fd = -1;
+	}
+	if (state->key != NULL) {
+		sodium_free(state->key);
+		state->key = NULL;
+	}
+	free(state->cipher);
+	state->cipher = NULL;
+}
+
+/*
+ * Append an attribute to current frame, or to the next one if it does not
+ * fit.
+ */
+static kp_error_t
+kp_agent_state_add(struct kp_agent_state *state, uint16_t type,
+                   const void *value, size_t len)
+{
+	kp_error_t ret;
+	struct kp_agent_attr attr = { .type = type, .len = len };
+
+	if (KP_AGENT_FRAME_SIZE - state->len < sizeof(attr) + len) {
+		if ((ret = kp_agent_state_flush(state, false)) != KP_SUCCESS) {
+			return ret;
+		}
+	}
+
+	memcpy(state->plain + state->len, &attr, sizeof(attr));
+	memcpy(state->plain + state->len + sizeof(attr), value, len);
+	state->len += sizeof(attr) + len;
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Encrypt current frame and write it to state file.
+ */
+static kp_error_t
+kp_agent_state_flush(struct kp_agent_state *state, bool last)
+{
+	unsigned char nonce[crypto_aead_xchacha20poly1305_ietf_NPUBBYTES];
+	unsigned char *flag = state->cipher + sizeof(uint32_t);
+	unsigned long long cipher_len;
+	uint32_t len;
+
+	memset(nonce, 0, sizeof(nonce));
+	memcpy(nonce, &state->frame, sizeof(state->frame));
+	*flag = last;
+
+	crypto_aead_xchacha20poly1305_ietf_encrypt(flag + 1, &cipher_len,
+	                                           state->plain, state->len,
+	                                           flag, 1, NULL, nonce,
+	                                           state->key);
+	sodium_memzero(state->plain, state->len);
+	state->len = 0;
+	state->frame++;
+
+	len = cipher_len;
+	memcpy(state->cipher, &len, sizeof(len));
+
+	return kp_agent_write(state->fd, state->cipher,
+	                      sizeof(len) + 1 + cipher_len);
+}
+
+/*
+ * Write whole state and seal its file, so that it cannot change under the
+ * new agent mapping it.
+ */
+static kp_error_t
+kp_agent_state_dump(struct kp_agent_state *state, struct kp_ctx *ctx)
+{
+	kp_error_t ret = KP_SUCCESS;
+	struct kp_key *keys;
+	struct kp_agent_key *handed;
+	struct kp_store *store;
+	uint64_t now;
+	int64_t expire;
+	size_t i, n;
+
+	/* Keys are copied from guarded memory to guarded memory only */
+	keys = sodium_allocarray(KP_KEY_CACHE_SIZE + 1, sizeof(struct kp_key));
+	if (keys == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+	handed = (struct kp_agent_key *)&keys[KP_KEY_CACHE_SIZE];
+
+	if (ctx->password[0] != '\0') {
+		ret = kp_agent_state_add(state, KP_ATTR_MASTER, ctx->password,
+		                         strnlen(ctx->password,
+		                                 KP_PASSWORD_MAX_LEN - 1));
+	}
+
+	n = kp_kdf_cache_export(ctx, keys);
+	for (i = 0; ret == KP_SUCCESS && i < n; i++) {
+		handed->kdf = keys[i].kdf;
+		handed->parallelism = keys[i].parallelism;
+		handed->opslimit = keys[i].opslimit;
+		handed->memlimit = keys[i].memlimit;
+		memcpy(handed->salt, keys[i].salt, KP_KDF_SALT_SIZE);
+		memcpy(handed->key, keys[i].key, KP_MASTER_KEY_SIZE);
+		ret = kp_agent_state_add(state, KP_ATTR_KEY, handed,
+		                         sizeof(struct kp_agent_key));
+	}
+	sodium_free(keys);
+	if (ret != KP_SUCCESS) {
+		return ret;
+	}
+
+	now = kp_agent_now();
+
+	TAILQ_FOREACH(store, &lru, lru) {
+		/* Expiry is kept as time left, monotonic clock is per boot */
+		expire = -1;
+		if (store->timer.armed) {
+			if (store->timer.expire <= now) {
+				continue;
+			}
+			expire = store->timer.expire - now;
+		}
+		if ((ret = kp_agent_state_store(state, store, expire))
+		    != KP_SUCCESS) {
+			return ret;
+		}
+	}
+
+	if ((ret = kp_agent_state_flush(state, true)) != KP_SUCCESS) {
+		return ret;
+	}
+
+#ifdef F_ADD_SEALS
+	/* Fallback file cannot be sealed */
+	if (fcntl(state->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+	          | F_SEAL_WRITE | F_SEAL_SEAL) < 0 && errno != EINVAL) {
+		return KP_ERRNO;
+	}
+#endif
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Add stored safe to state, decrypted in locked memory if need be.
+ */
+static kp_error_t
+kp_agent_state_store(struct kp_agent_state *state, struct kp_store *store,
+                     int64_t expire)
+{
+	kp_error_t ret;
+	char *plain, *metadata;
+	int64_t timeout;
+	uint8_t idle;
+	size_t i, len, chunk;
+
+	if ((plain = kp_agent_store_open(store)) == NULL) {
+		return KP_ERRNO;
+	}
+	metadata = plain + strlen(plain) + 1;
+	timeout = store->timeout;
+	idle = store->idle;
+
+	if ((ret = kp_agent_state_add(state, KP_ATTR_NAME, store->name,
+	                              strlen(store->name))) != KP_SUCCESS
+	    || (ret = kp_agent_state_add(state, KP_ATTR_PASSWORD, plain,
+	                                 strlen(plain))) != KP_SUCCESS
+	    || (ret = kp_agent_state_add(state, KP_ATTR_TIMEOUT, &timeout,
+	                                 sizeof(timeout))) != KP_SUCCESS
+	    || (ret = kp_agent_state_add(state, KP_ATTR_IDLE, &idle,
+	                                 sizeof(idle))) != KP_SUCCESS
+	    || (ret = kp_agent_state_add(state, KP_ATTR_EXPIRE, &expire,
+	                                 sizeof(expire))) != KP_SUCCESS) {
+		goto out;
+	}
+
+	if (kp_safe_id_known(&store->id)
+	    && (ret = kp_agent_state_add(state, KP_ATTR_ID, &store->id,
+	                                 sizeof(struct kp_safe_id)))
+	       != KP_SUCCESS) {
+		goto out;
+	}
+
+	/* Metadata has no size limit, it goes in pieces */
+	len = strlen(metadata);
+	for (i = 0; i < len; i += chunk) {
+		chunk = len - i < KP_METADATA_MAX_LEN - 1
+		      ? len - i : KP_METADATA_MAX_LEN - 1;
+		if ((ret = kp_agent_state_add(state, KP_ATTR_METADATA,
+		                              metadata + i, chunk))
+		    != KP_SUCCESS) {
+			goto out;
+		}
+	}
+
+out:
+	kp_agent_store_close(store, plain);
 	return ret;
 }
 
-static int
-store_cmp(struct kp_store *a, struct kp_store *b)
+/*
+ * Decrypt and restore state written by kp_agent_state_dump.
+ */
+static kp_error_t
+kp_agent_state_restore(struct kp_agent *agent, struct kp_ctx *ctx, int fd,
+                       const unsigned char *key)
+{
+	kp_error_t ret = KP_SUCCESS;
+	unsigned char nonce[crypto_aead_xchacha20poly1305_ietf_NPUBBYTES];
+	unsigned char *map, *plain = NULL;
+	unsigned long long plain_len;
+	struct kp_agent_pending pending;
+	struct stat sb;
+	uint64_t frame;
+	uint32_t len;
+	size_t off;
+	bool last = false;
+
+	if (fstat(fd, &sb) < 0) {
+		return KP_ERRNO;
+	}
+
+	if (sb.st_size == 0) {
+		errno = EPROTO;
+		return KP_ERRNO;
+	}
+
+	if ((map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+	    == MAP_FAILED) {
+		return KP_ERRNO;
+	}
+
+	pending.unsafe = (struct kp_unsafe)KP_UNSAFE_INIT;
+	pending.expire = -1;
+	pending.metadata = NULL;
+	pending.len = 0;
+	pending.size = 0;
+
+	if ((plain = sodium_malloc(KP_AGENT_FRAME_SIZE)) == NULL) {
+		errno = ENOMEM;
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	kp_agent_ready();
+
+	for (off = 0, frame = 0; !last; frame++) {
+		if ((size_t)sb.st_size - off < sizeof(len) + 1) {
+			errno = EPROTO;
+			ret = KP_ERRNO;
+			goto out;
+		}
+		memcpy(&len, map + off, sizeof(len));
+		off += sizeof(len);
+
+		if (len < KP_AGENT_FRAME_ABYTES
+		    || len > KP_AGENT_FRAME_SIZE + KP_AGENT_FRAME_ABYTES
+		    || (size_t)sb.st_size - off - 1 < len) {
+			errno = EPROTO;
+			ret = KP_ERRNO;
+			goto out;
+		}
+
+		memset(nonce, 0, sizeof(nonce));
+		memcpy(nonce, &frame, sizeof(frame));
+		if (crypto_aead_xchacha20poly1305_ietf_decrypt(
+		    plain, &plain_len, NULL, map + off + 1, len, map + off, 1,
+		    nonce, key) != 0) {
+			errno = EPROTO;
+			ret = KP_ERRNO;
+			goto out;
+		}
+		last = map[off] != 0;
+		off += 1 + len;
+
+		ret = kp_agent_state_frame(agent, ctx, plain, plain_len,
+		                           &pending);
+		sodium_memzero(plain, plain_len);
+		if (ret != KP_SUCCESS) {
+			goto out;
+		}
+	}
+
+	/* Last safe */
+	if (pending.unsafe.name[0] != '\0') {
+		ret = kp_agent_restore(agent, &pending);
+	}
+
+out:
+	kp_agent_unsafe_clear(&pending.unsafe);
+	if (pending.metadata != NULL) {
+		sodium_free(pending.metadata);
+	}
+	if (plain != NULL) {
+		sodium_free(plain);
+	}
+	munmap(map, sb.st_size);
+
+	return ret;
+}
+
+/*
+ * Restore attributes of a frame. A safe spans until next name, possibly
+ * over next frames.
+ */
+static kp_error_t
+kp_agent_state_frame(struct kp_agent *agent, struct kp_ctx *ctx,
+                     const unsigned char *plain, size_t size,
+                     struct kp_agent_pending *pending)
+{
+	kp_error_t ret;
+	struct kp_agent_attr attr;
+	struct kp_agent_key handed;
+	size_t off = 0;
+	void *value;
+	int n;
+
+	while ((n = kp_agent_attr_parse(plain, size, &off, &attr, &value))
+	       > 0) {
+		switch (attr.type) {
+		case KP_ATTR_MASTER:
+			if (kp_agent_attr_string(ctx->password,
+			                         KP_PASSWORD_MAX_LEN, value,
+			                         attr.len) < 0) {
+				n = -1;
+			}
+			break;
+		case KP_ATTR_KEY:
+			if (attr.len != sizeof(struct kp_agent_key)) {
+				n = -1;
+				break;
+			}
+			memcpy(&handed, value, sizeof(struct kp_agent_key));
+			kp_kdf_cache_add(ctx, handed.kdf, handed.salt,
+			                 handed.opslimit, handed.memlimit,
+			                 handed.parallelism, handed.key);
+			sodium_memzero(&handed, sizeof(struct kp_agent_key));
+			break;
+		case KP_ATTR_EXPIRE:
+			if (attr.len != sizeof(pending->expire)) {
+				n = -1;
+				break;
+			}
+			memcpy(&pending->expire, value,
+			       sizeof(pending->expire));
+			break;
+		case KP_ATTR_METADATA:
+			if (memchr(value, '\0', attr.len) != NULL) {
+				n = -1;
+				break;
+			}
+			if ((ret = kp_agent_pending_append(pending, value,
+			                                   attr.len))
+			    != KP_SUCCESS) {
+				return ret;
+			}
+			break;
+		case KP_ATTR_NAME:
+			if (pending->unsafe.name[0] != '\0') {
+				if ((ret = kp_agent_restore(agent, pending))
+				    != KP_SUCCESS) {
+					return ret;
+				}
+			}
+			/* FALLTHROUGH */
+		default:
+			if (kp_agent_attr_unsafe(&pending->unsafe, &attr,
+			                         value) < 0) {
+				n = -1;
+			}
+			break;
+		}
+
+		if (n < 0) {
+			break;
+		}
+	}
+
+	if (n < 0) {
+		errno = EPROTO;
+		return KP_ERRNO;
+	}
+
+	return KP_SUCCESS;
+}
+
+static kp_error_t
+kp_agent_pending_append(struct kp_agent_pending *pending, const void *value,
+                        size_t len)
 {
-	return strncmp(a->safe->name, b->safe->name, PATH_MAX);
+	char *metadata;
+	size_t size;
+
+	if (pending->size - pending->len <= len) {
+		size = pending->size ? pending->size : KP_METADATA_MAX_LEN;
+		while (size - pending->len <= len) {
+			size *= 2;
+		}
+
+		if ((metadata = sodium_malloc(size)) == NULL) {
+			errno = ENOMEM;
+			return KP_ERRNO;
+		}
+		if (pending->metadata != NULL) {
+			memcpy(metadata, pending->metadata, pending->len);
+			sodium_free(pending->metadata);
+		}
+		pending->metadata = metadata;
+		pending->size = size;
+	}
+
+	memcpy(pending->metadata + pending->len, value, len);
+	pending->len += len;
+	pending->metadata[pending->len] = '\0';
+
+	return KP_SUCCESS;
 }
 
-RB_GENERATE_STATIC(storage, kp_store, tree, store_cmp);
+/*
+ * Store a handed over safe, with the time it had left, and make room for
+ * the next one.
+ */
+static kp_error_t
+kp_agent_restore(struct kp_agent *agent, struct kp_agent_pending *pending)
+{
+	kp_error_t ret;
+	struct kp_store *store;
+
+	kp_agent_unsafe_set_metadata(&pending->unsafe,
+	                             pending->len > 0 ? pending->metadata : "");
+
+	if ((ret = kp_agent_store(agent, &pending->unsafe)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if (pending->expire > 0
+	    && (store = kp_agent_find(pending->unsafe.name)) != NULL
+	    && store->timer.armed) {
+		kp_wheel_arm(&wheel, &store->timer,
+		             kp_agent_now() + pending->expire);
+	}
+
+	kp_agent_unsafe_clear(&pending->unsafe);
+	pending->expire = -1;
+	if (pending->len > 0) {
+		sodium_memzero(pending->metadata, pending->len);
+		pending->len = 0;
+	}
+
+	return KP_SUCCESS;
+}
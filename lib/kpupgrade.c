@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sodium.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kickpass.h"
+
+#include "kdf.h"
+#include "storage.h"
+#include "kpupgrade.h"
+
+/*
+ * Safes sharing kdf parameters and salt need a single derivation, they are
+ * upgraded together by one worker. Version 1 safes all have their own salt,
+ * thus their own group.
+ */
+struct kp_upgrade_group {
+	struct kp_kdf_params params;
+	size_t mem;        /* memory held by its derivation */
+	char const **names;
+	size_t nnames;
+};
+
+/*
+ * Workers pick groups in order, as long as the summed memory of running
+ * derivations stays within budget. A derivation larger than the whole budget
+ * still runs, alone. Keys are held by the upgrade and its workers rather than
+ * ctx cache, which could evict them and derive again outside of the budget.
+ */
+struct kp_upgrade {
+	struct kp_ctx *ctx;
+	struct kp_key *target; /* current master key, read only by workers */
+	struct kp_upgrade_group *groups;
+	size_t ngroups;
+	size_t next;       /* next group to upgrade */
+	size_t mem_budget;
+	size_t mem_used;   /* summed memory of running derivations */
+	kp_error_t ret;    /* first error */
+	struct timespec start;
+	struct kp_upgrade_progress progress;
+	void (*cb)(const struct kp_upgrade_progress *, const char *,
+	           kp_error_t, void *);
+	void *arg;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static kp_error_t kp_upgrade_group(struct kp_upgrade *, const char *,
+                                   const struct kp_kdf_params *);
+static bool kp_upgrade_params_eq(const struct kp_kdf_params *,
+                                 const struct kp_kdf_params *);
+static int kp_upgrade_group_sort(const void *, const void *);
+static void kp_upgrade_report(struct kp_upgrade *, const char *, kp_error_t);
+static void kp_upgrade_done(const char *, kp_error_t, void *);
+static void *kp_upgrade_worker(void *);
+static kp_error_t kp_upgrade_derive(struct kp_upgrade *,
+                                    const struct kp_kdf_params *,
+                                    struct kp_key *);
+
+/*
+ * Rewrap every given safe not matching current workspace config, using up to
+ * threads workers. Safes are atomically replaced and synced in batches, an
+ * interrupted upgrade can be run again.
+ */
+kp_error_t
+kp_upgrade(struct kp_ctx *ctx, char * const *names, size_t nnames,
+           unsigned int threads, size_t mem_budget,
+           void (*cb)(const struct kp_upgrade_progress *, const char *,
+                      kp_error_t, void *),
+           void *arg)
+{
+	kp_error_t ret = KP_SUCCESS;
+	struct kp_upgrade upgrade;
+	struct kp_storage_batch batch;
+	struct kp_kdf_params current;
+	pthread_t *workers = NULL;
+	unsigned int i, nworkers = 0;
+	size_t n;
+
+	assert(ctx);
+	assert(names || nnames == 0);
+
+	memset(&upgrade, 0, sizeof(upgrade));
+	upgrade.ctx = ctx;
+	upgrade.mem_budget = mem_budget;
+	upgrade.cb = cb;
+	upgrade.arg = arg;
+	clock_gettime(CLOCK_MONOTONIC, &upgrade.start);
+
+	if ((errno = pthread_mutex_init(&upgrade.lock, NULL)) != 0) {
+		return KP_ERRNO;
+	}
+
+	if ((errno = pthread_cond_init(&upgrade.cond, NULL)) != 0) {
+		pthread_mutex_destroy(&upgrade.lock);
+		return KP_ERRNO;
+	}
+
+	for (n = 0; n < nnames; n++) {
+		struct kp_kdf_params params;
+		bool current;
+
+		if ((ret = kp_storage_peek(ctx, names[n], &params, &current))
+		    != KP_SUCCESS) {
+			upgrade.progress.total++;
+			kp_upgrade_report(&upgrade, names[n], ret);
+			continue;
+		}
+
+		if (current) {
+			continue;
+		}
+
+		if ((ret = kp_upgrade_group(&upgrade, names[n], &params))
+		    != KP_SUCCESS) {
+			goto out;
+		}
+		upgrade.progress.total++;
+	}
+
+	if (upgrade.ngroups == 0) {
+		goto out;
+	}
+
+	/* Largest derivations first, smaller ones fill the remaining budget */
+	qsort(upgrade.groups, upgrade.ngroups, sizeof(struct kp_upgrade_group),
+	      kp_upgrade_group_sort);
+
+	/* Every worker wraps with the current master key, derive it once */
+	if ((upgrade.target = sodium_malloc(sizeof(struct kp_key))) == NULL) {
+		errno = ENOMEM;
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	current.kdf = ctx->cfg.kdf;
+	current.opslimit = ctx->cfg.opslimit;
+	current.memlimit = ctx->cfg.memlimit;
+	current.parallelism = ctx->cfg.parallelism;
+	memcpy(current.salt, ctx->cfg.salt, KP_KDF_SALT_SIZE);
+	if ((ret = kp_upgrade_derive(&upgrade, &current, upgrade.target))
+	    != KP_SUCCESS) {
+		goto out;
+	}
+	sodium_mprotect_readonly(upgrade.target);
+
+	if (threads == 0) {
+		threads = 1;
+	}
+	if (threads > upgrade.ngroups) {
+		threads = upgrade.ngroups;
+	}
+
+	if ((workers = calloc(threads, sizeof(pthread_t))) == NULL) {
+		errno = ENOMEM;
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	if ((ret = kp_storage_batch_begin(ctx, &batch, kp_upgrade_done,
+	                                  &upgrade)) != KP_SUCCESS) {
+		goto out;
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&workers[i], NULL, kp_upgrade_worker,
+		                   &upgrade) != 0) {
+			break;
+		}
+		nworkers++;
+	}
+
+	/* No thread at all, do it ourself */
+	if (nworkers == 0) {
+		kp_upgrade_worker(&upgrade);
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	ret = kp_storage_batch_commit(ctx);
+
+out:
+	if (ret == KP_SUCCESS) {
+		ret = upgrade.ret;
+	}
+
+	for (n = 0; n < upgrade.ngroups; n++) {
+		free(upgrade.groups[n].names);
+	}
+	free(upgrade.groups);
+	free(workers);
+	if (upgrade.target) {
+		sodium_free(upgrade.target);
+	}
+	pthread_cond_destroy(&upgrade.cond);
+	pthread_mutex_destroy(&upgrade.lock);
+
+	return ret;
+}
+
+static kp_error_t
+kp_upgrade_group(struct kp_upgrade *upgrade, const char *name,
+                 const struct kp_kdf_params *params)
+{
+	struct kp_upgrade_group *group = NULL;
+	size_t i;
+
+	for (i = 0; i < upgrade->ngroups; i++) {
+		if (kp_upgrade_params_eq(&upgrade->groups[i].params, params)) {
+			group = &upgrade->groups[i];
+			break;
+		}
+	}
+
+	if (group == NULL) {
+		group = reallocarray(upgrade->groups, upgrade->ngroups + 1,
+		                     sizeof(struct kp_upgrade_group));
+		if (group == NULL) {
+			errno = ENOMEM;
+			return KP_ERRNO;
+		}
+		upgrade->groups = group;
+		group = &upgrade->groups[upgrade->ngroups++];
+		memcpy(&group->params, params, sizeof(struct kp_kdf_params));
+		group->mem = kp_kdf_mem(params->kdf, params->memlimit,
+		                        params->parallelism);
+		group->names = NULL;
+		group->nnames = 0;
+	}
+
+	group->names = reallocarray(group->names, group->nnames + 1,
+	                            sizeof(char *));
+	if (group->names == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+	group->names[group->nnames++] = name;
+
+	return KP_SUCCESS;
+}
+
+static bool
+kp_upgrade_params_eq(const struct kp_kdf_params *a,
+                     const struct kp_kdf_params *b)
+{
+	return a->kdf == b->kdf
+	    && a->opslimit == b->opslimit
+	    && a->memlimit == b->memlimit
+	    && a->parallelism == b->parallelism
+	    && memcmp(a->salt, b->salt, KP_KDF_SALT_SIZE) == 0;
+}
+
+static int
+kp_upgrade_group_sort(const void *a, const void *b)
+{
+	size_t mem_a = ((const struct kp_upgrade_group *)a)->mem;
+	size_t mem_b = ((const struct kp_upgrade_group *)b)->mem;
+
+	return (mem_a < mem_b) - (mem_a > mem_b);
+}
+
+/*
+ * Must be called with lock held, or before workers start.
+ */
+static void
+kp_upgrade_report(struct kp_upgrade *upgrade, const char *name,
+                  kp_error_t ret)
+{
+	struct timespec now;
+
+	if (ret == KP_SUCCESS) {
+		upgrade->progress.done++;
+	} else {
+		upgrade->progress.failed++;
+		if (upgrade->ret == KP_SUCCESS) {
+			upgrade->ret = ret;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	upgrade->progress.elapsed = (now.tv_sec - upgrade->start.tv_sec)
+		+ (now.tv_nsec - upgrade->start.tv_nsec) / 1e9;
+
+	if (upgrade->cb) {
+		upgrade->cb(&upgrade->progress, name, ret, upgrade->arg);
+	}
+}
+
+/*
+ * Batch callback, a rewrapped safe is synced and replaced, or failed to.
+ */
+static void
+kp_upgrade_done(const char *name, kp_error_t ret, void *arg)
+{
+	struct kp_upgrade *upgrade = arg;
+
+	pthread_mutex_lock(&upgrade->lock);
+	kp_upgrade_report(upgrade, name, ret);
+	pthread_mutex_unlock(&upgrade->lock);
+}
+
+static void *
+kp_upgrade_worker(void *arg)
+{
+	struct kp_upgrade *upgrade = arg;
+	struct kp_upgrade_group *group;
+	struct kp_key *old;
+	size_t i;
+
+	/* Old master key of the group being upgraded */
+	old = sodium_malloc(sizeof(struct kp_key));
+
+	pthread_mutex_lock(&upgrade->lock);
+	while (upgrade->next < upgrade->ngroups) {
+		kp_error_t ret;
+
+		group = &upgrade->groups[upgrade->next];
+
+		if (upgrade->mem_used > 0
+		    && upgrade->mem_used + group->mem > upgrade->mem_budget) {
+			pthread_cond_wait(&upgrade->cond, &upgrade->lock);
+			continue;
+		}
+
+		upgrade->next++;
+		upgrade->mem_used += group->mem;
+		pthread_mutex_unlock(&upgrade->lock);
+
+		if (old == NULL) {
+			errno = ENOMEM;
+			ret = KP_ERRNO;
+		} else {
+			ret = kp_upgrade_derive(upgrade, &group->params, old);
+		}
+
+		for (i = 0; i < group->nnames; i++) {
+			kp_error_t err = ret;
+
+			if (err == KP_SUCCESS) {
+				err = kp_storage_rewrap(upgrade->ctx,
+				                        group->names[i],
+				                        upgrade->ctx->password,
+				                        old, upgrade->target);
+			}
+
+			/* Batch reports it once synced and replaced */
+			if (err == KP_SUCCESS) {
+				continue;
+			}
+
+			pthread_mutex_lock(&upgrade->lock);
+			kp_upgrade_report(upgrade, group->names[i], err);
+			pthread_mutex_unlock(&upgrade->lock);
+		}
+
+		pthread_mutex_lock(&upgrade->lock);
+		upgrade->mem_used -= group->mem;
+		pthread_cond_broadcast(&upgrade->cond);
+	}
+	pthread_mutex_unlock(&upgrade->lock);
+
+	if (old != NULL) {
+		sodium_free(old);
+	}
+
+	return NULL;
+}
+
+/*
+ * Derive master key of ctx password with params into key.
+ */
+static kp_error_t
+kp_upgrade_derive(struct kp_upgrade *upgrade,
+                  const struct kp_kdf_params *params, struct kp_key *key)
+{
+	kp_error_t ret;
+
+	if ((ret = kp_kdf_derive(params->kdf, key->key, KP_MASTER_KEY_SIZE,
+	                         upgrade->ctx->password, params->salt,
+	                         params->opslimit, params->memlimit,
+	                         params->parallelism)) != KP_SUCCESS) {
+		sodium_memzero(key, sizeof(struct kp_key));
+		return ret;
+	}
+
+	key->used = true;
+	key->kdf = params->kdf;
+	key->opslimit = params->opslimit;
+	key->memlimit = params->memlimit;
+	key->parallelism = params->parallelism;
+	memcpy(key->salt, params->salt, KP_KDF_SALT_SIZE);
+
+	return KP_SUCCESS;
+}
@@ -28,10 +28,16 @@
 
 #include "editor.h"
 #include "safe.h"
+#include "slab.h"
 #include "storage.h"
 #include "kpagent.h"
 
 static kp_error_t kp_safe_mkdir(struct kp_ctx *, const char *);
+static kp_error_t kp_safe_agent_open(struct kp_ctx *, struct kp_safe *);
+static kp_error_t kp_safe_agent_save(struct kp_ctx *, struct kp_safe *);
+static kp_error_t kp_safe_agent_discard(struct kp_ctx *, const char *);
+static void kp_safe_refresh(struct kp_ctx *, struct kp_safe *,
+                            struct kp_unsafe *);
 
 kp_error_t
 kp_safe_init(struct kp_ctx *ctx, struct kp_safe *safe, const char *name)
@@ -52,6 +58,7 @@ kp_safe_init(struct kp_ctx *ctx, struct kp_safe *safe, const char *name)
 	*metadata = NULL;
 
 	memset(safe->name, '\0', PATH_MAX);
+	memset(&safe->id, 0, sizeof(struct kp_safe_id));
 
 	if (strlcpy(safe->name, name, PATH_MAX) >= PATH_MAX) {
 		errno = ENAMETOOLONG;
@@ -65,24 +72,18 @@ kp_error_t
 kp_safe_open(struct kp_ctx *ctx, struct kp_safe *safe, int flags)
 {
 	kp_error_t ret;
-	char **password;
-	char **metadata;
 	struct stat stats;
 
 	assert(ctx);
 	assert(safe);
 	assert(!safe->open);
 
-	password = (char **)&safe->password;
-	metadata = (char **)&safe->metadata;
+	if ((ret = kp_safe_set(safe, "", "")) != KP_SUCCESS) {
+		return ret;
+	}
 
 	safe->open = true;
 
-	*password = sodium_malloc(KP_PASSWORD_MAX_LEN);
-	safe->password[0] = '\0';
-	*metadata = sodium_malloc(KP_METADATA_MAX_LEN);
-	safe->metadata[0] = '\0';
-
 	if (KP_CREATE & flags) {
 		/* Ensure path to safe exists */
 		if ((ret = kp_safe_mkdir(ctx, safe->name)) != KP_SUCCESS) {
@@ -102,33 +103,33 @@ kp_safe_open(struct kp_ctx *ctx, struct kp_safe *safe, int flags)
 		return KP_SUCCESS;
 	}
 
+	/* An unlocked agent reads and decrypts the safe itself */
+	if (ctx->agent.connected
+	    && kp_safe_agent_open(ctx, safe) == KP_SUCCESS) {
+		return KP_SUCCESS;
+	}
+
 	if (!(KP_FORCE & flags) && ctx->agent.connected) {
 		struct kp_unsafe unsafe = KP_UNSAFE_INIT;
 
-		if ((ret = kp_agent_send(&ctx->agent, KP_MSG_SEARCH, safe->name,
-		    PATH_MAX)) != KP_SUCCESS) {
+		if ((ret = kp_agent_send(&ctx->agent, KP_MSG_SEARCH,
+		    safe->name, strlen(safe->name) + 1)) != KP_SUCCESS) {
 			/* TODO log reason in verbose mode */
 			goto fallback;
 		}
 
-		if ((ret = kp_agent_receive(&ctx->agent, KP_MSG_SEARCH, &unsafe,
-		    sizeof(struct kp_unsafe))) != KP_SUCCESS) {
+		if ((ret = kp_agent_receive_unsafe(&ctx->agent, KP_MSG_SEARCH,
+		    &unsafe)) != KP_SUCCESS) {
 			/* TODO log reason in verbose mode */
 			goto fallback;
 		}
 
-		if (strlcpy(safe->password, unsafe.password,
-		            KP_PASSWORD_MAX_LEN) >= KP_PASSWORD_MAX_LEN) {
-			errno = ENOMEM;
-			return KP_ERRNO;
-		}
-		if (strlcpy(safe->metadata, unsafe.metadata,
-		            KP_METADATA_MAX_LEN) >= KP_METADATA_MAX_LEN) {
-			errno = ENOMEM;
-			return KP_ERRNO;
-		}
+		ret = kp_safe_set(safe, unsafe.password,
+		                  kp_agent_unsafe_metadata(&unsafe));
+		safe->id = unsafe.id;
+		kp_agent_unsafe_clear(&unsafe);
 
-		return KP_SUCCESS;
+		return ret;
 	}
 
 fallback:
@@ -147,58 +148,52 @@ fallback:
 kp_error_t
 kp_safe_save(struct kp_ctx *ctx, struct kp_safe *safe)
 {
+	kp_error_t ret;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+	bool stored = false;
+
 	assert(ctx);
 	assert(safe);
 	assert(safe->open);
 
+	/* An unlocked agent writes safe and refreshes its own copy, one
+	 * handing over lets its successor do it */
+	if (ctx->agent.connected
+	    && ((ret = kp_safe_agent_save(ctx, safe)) == KP_SUCCESS
+	        || (kp_agent_moved(&ctx->agent, ret)
+	            && kp_safe_agent_save(ctx, safe) == KP_SUCCESS))) {
+		return KP_SUCCESS;
+	}
+
+	/* Agent copy is looked for before the change on disk makes agent
+	 * drop it */
+	if (ctx->agent.connected
+	    && kp_agent_send(&ctx->agent, KP_MSG_SEARCH, safe->name,
+	                     strlen(safe->name) + 1) == KP_SUCCESS
+	    && kp_agent_receive_unsafe(&ctx->agent, KP_MSG_SEARCH,
+	                               &unsafe) == KP_SUCCESS) {
+		stored = true;
+	}
+
 	if (ctx->password[0] == '\0') {
-		kp_error_t ret;
 		if ((ret = kp_password_prompt(ctx, false,
 		                              (char *)ctx->password,
 		                              "master")) != KP_SUCCESS) {
-			return ret;
+			goto out;
 		}
 	}
 
-	if (ctx->agent.connected) {
-		kp_error_t ret;
-		struct kp_unsafe unsafe = KP_UNSAFE_INIT;
-
-		if ((ret = kp_agent_send(&ctx->agent, KP_MSG_SEARCH, safe->name,
-		    PATH_MAX)) != KP_SUCCESS) {
-			/* TODO log reason in verbose mode */
-			goto finally;
-		}
-
-		if ((ret = kp_agent_receive(&ctx->agent, KP_MSG_SEARCH, &unsafe,
-		    sizeof(struct kp_unsafe))) != KP_SUCCESS) {
-			if (ret != KP_ERRNO || errno != ENOENT) {
-				/* TODO log reason in verbose mode */
-			}
-			goto finally;
-		}
-
-		if (strlcpy(unsafe.password, safe->password,
-			    KP_PASSWORD_MAX_LEN) >= KP_PASSWORD_MAX_LEN) {
-			errno = ENOMEM;
-			goto finally;
-		}
-		if (strlcpy(unsafe.metadata, safe->metadata,
-			    KP_METADATA_MAX_LEN) >= KP_METADATA_MAX_LEN) {
-			errno = ENOMEM;
-			goto finally;
-		}
-
-		if ((ret = kp_agent_send(&ctx->agent, KP_MSG_STORE, &unsafe,
-		   sizeof(struct kp_unsafe))) != KP_SUCCESS) {
-			/* TODO log reason in verbose mode */
-			goto finally;
-		}
+	if ((ret = kp_storage_save(ctx, safe)) != KP_SUCCESS) {
+		goto out;
+	}
 
+	if (stored) {
+		kp_safe_refresh(ctx, safe, &unsafe);
 	}
 
-finally:
-	return kp_storage_save(ctx, safe);
+out:
+	kp_agent_unsafe_clear(&unsafe);
+	return ret;
 }
 
 kp_error_t
@@ -214,8 +209,8 @@ kp_safe_close(struct kp_ctx *ctx, struct kp_safe *safe)
 		return KP_SUCCESS;
 	}
 
-	sodium_free((char *)safe->password);
-	sodium_free((char *)safe->metadata);
+	/* metadata lives in password allocation */
+	kp_slab_free(safe->password);
 
 	password = (char **)&safe->password;
 	metadata = (char **)&safe->metadata;
@@ -237,21 +232,10 @@ kp_safe_delete(struct kp_ctx *ctx, struct kp_safe *safe)
 	assert(safe);
 	assert(safe->open);
 
-	if (ctx->agent.connected) {
-		bool result;
-
-		if ((ret = kp_agent_send(&ctx->agent, KP_MSG_DISCARD,
-		                         safe->name, PATH_MAX)) != KP_SUCCESS) {
-			/* TODO log reason in verbose mode */
-			return ret;
-		}
-
-		if ((ret = kp_agent_receive(&ctx->agent, KP_MSG_DISCARD,
-		                            &result, sizeof(bool)))
-		    != KP_SUCCESS) {
-			/* TODO log reason in verbose mode */
-			return ret;
-		}
+	if (ctx->agent.connected
+	    && (ret = kp_safe_agent_discard(ctx, safe->name)) != KP_SUCCESS) {
+		/* TODO log reason in verbose mode */
+		return ret;
 	}
 
 	if (unlinkat(ctx->ws_fd, safe->name, 0) != 0) {
@@ -262,11 +246,71 @@ kp_safe_delete(struct kp_ctx *ctx, struct kp_safe *safe)
 	return KP_SUCCESS;
 }
 
+/*
+ * Replace safe plain text with a copy of password and metadata, both held in
+ * a single slab allocation of the exact size.
+ */
+kp_error_t
+kp_safe_set(struct kp_safe *safe, const char *password, const char *metadata)
+{
+	char **_password;
+	char **_metadata;
+	char *plain;
+	size_t password_len, metadata_len;
+
+	assert(safe);
+	assert(password);
+	assert(metadata);
+
+	password_len = strlen(password);
+	metadata_len = strlen(metadata);
+
+	/* plain is password + '\0' + metadata + '\0' */
+	if ((plain = kp_slab_alloc(password_len + metadata_len + 2)) == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	memcpy(plain, password, password_len + 1);
+	memcpy(&plain[password_len + 1], metadata, metadata_len + 1);
+
+	/* Old plain might be the source, free it only once copied */
+	kp_slab_free(safe->password);
+
+	_password = (char **)&safe->password;
+	_metadata = (char **)&safe->metadata;
+
+	*_password = plain;
+	*_metadata = &plain[password_len + 1];
+
+	return KP_SUCCESS;
+}
+
+kp_error_t
+kp_safe_set_password(struct kp_safe *safe, const char *password)
+{
+	assert(safe);
+
+	return kp_safe_set(safe, password,
+	                   safe->metadata != NULL ? safe->metadata : "");
+}
+
+kp_error_t
+kp_safe_set_metadata(struct kp_safe *safe, const char *metadata)
+{
+	assert(safe);
+
+	return kp_safe_set(safe,
+	                   safe->password != NULL ? safe->password : "",
+	                   metadata);
+}
+
 kp_error_t
 kp_safe_rename(struct kp_ctx *ctx, struct kp_safe *safe, const char *name)
 {
 	kp_error_t ret;
 	char oldname[PATH_MAX] = "";
+	bool stored = false;
 
 	assert(ctx);
 	assert(safe);
@@ -283,48 +327,10 @@ kp_safe_rename(struct kp_ctx *ctx, struct kp_safe *safe, const char *name)
 	}
 
 	if (ctx->agent.connected) {
-		struct kp_unsafe unsafe = KP_UNSAFE_INIT;
-		bool result;
-
-		if ((ret = kp_agent_send(&ctx->agent, KP_MSG_DISCARD,
-		    oldname, PATH_MAX)) != KP_SUCCESS) {
-			/* TODO log reason in verbose mode */
-			goto finally;
-		}
-
-		if ((ret = kp_agent_receive(&ctx->agent, KP_MSG_DISCARD,
-		    &result, sizeof(bool))) != KP_SUCCESS) {
-			if (ret != KP_ERRNO || errno != ENOENT) {
-				/* TODO log reason in verbose mode */
-			}
-			goto finally;
-		}
-
-		if (strlcpy(unsafe.name, safe->name, PATH_MAX) >= PATH_MAX) {
-			errno = ENAMETOOLONG;
-			goto finally;
-		}
-
-		if (strlcpy(unsafe.password, safe->password,
-			    KP_PASSWORD_MAX_LEN) >= KP_PASSWORD_MAX_LEN) {
-			errno = ENOMEM;
-			goto finally;
-		}
-		if (strlcpy(unsafe.metadata, safe->metadata,
-			    KP_METADATA_MAX_LEN) >= KP_METADATA_MAX_LEN) {
-			errno = ENOMEM;
-			goto finally;
-		}
-
-		if ((ret = kp_agent_send(&ctx->agent, KP_MSG_STORE, &unsafe,
-		   sizeof(struct kp_unsafe))) != KP_SUCCESS) {
-			/* TODO log reason in verbose mode */
-			goto finally;
-		}
+		/* TODO log reason in verbose mode */
+		stored = kp_safe_agent_discard(ctx, oldname) == KP_SUCCESS;
 	}
 
-
-finally:
 	if ((ret = kp_safe_mkdir(ctx, safe->name)) != KP_SUCCESS) {
 		return ret;
 	}
@@ -333,11 +339,58 @@ finally:
 		return errno;
 	}
 
+	/* Agent copy goes under the new name once safe is there, file is
+	 * still the one it was read from */
+	if (stored) {
+		struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+
+		unsafe.id = safe->id;
+		if (strlcpy(unsafe.name, safe->name, PATH_MAX) < PATH_MAX
+		    && strlcpy(unsafe.password, safe->password,
+		               KP_PASSWORD_MAX_LEN) < KP_PASSWORD_MAX_LEN) {
+			kp_agent_unsafe_set_metadata(&unsafe, safe->metadata);
+			/* TODO log reason in verbose mode */
+			kp_agent_send_unsafe(&ctx->agent, KP_MSG_STORE,
+			                     &unsafe);
+		}
+		sodium_memzero(&unsafe, sizeof(struct kp_unsafe));
+	}
+
 	return KP_SUCCESS;
 }
 
+/*
+ * Wrap safe key again for current workspace config, without opening it.
+ * Master key of old_password is kept in old, if given, for the next safes.
+ */
 kp_error_t
-kp_safe_store(struct kp_ctx *ctx, struct kp_safe *safe, int timeout)
+kp_safe_rewrap(struct kp_ctx *ctx, struct kp_safe *safe,
+               const char *old_password, struct kp_key *old)
+{
+	assert(ctx);
+	assert(safe);
+	assert(!safe->open);
+
+	return kp_storage_rewrap(ctx, safe->name, old_password, old, NULL);
+}
+
+/*
+ * Read safe header only, without opening it.
+ */
+kp_error_t
+kp_safe_stat(struct kp_ctx *ctx, struct kp_safe *safe,
+             struct kp_safe_stat *stat)
+{
+	assert(ctx);
+	assert(safe);
+	assert(stat);
+
+	return kp_storage_stat(ctx, safe->name, stat);
+}
+
+kp_error_t
+kp_safe_store(struct kp_ctx *ctx, struct kp_safe *safe, int timeout,
+              bool idle)
 {
 	kp_error_t ret;
 	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
@@ -347,26 +400,43 @@ kp_safe_store(struct kp_ctx *ctx, struct kp_safe *safe, int timeout)
 		return ret;
 	}
 
+	if (idle && !(ctx->agent.caps & KP_AGENT_CAP_IDLE)) {
+		errno = ENOTSUP;
+		return KP_ERRNO;
+	}
+
 	unsafe.timeout = timeout;
+	unsafe.idle = idle;
+	unsafe.id = safe->id;
 	if (strlcpy(unsafe.name, safe->name, PATH_MAX) >= PATH_MAX) {
 		errno = ENOMEM;
 		return KP_ERRNO;
 	}
+	/* Agent messages hold a typed password at most */
 	if (strlcpy(unsafe.password, safe->password,
 	            KP_PASSWORD_MAX_LEN) >= KP_PASSWORD_MAX_LEN) {
-		errno = ENOMEM;
-		return KP_ERRNO;
-	}
-	if (strlcpy(unsafe.metadata, safe->metadata,
-	            KP_METADATA_MAX_LEN) >= KP_METADATA_MAX_LEN) {
-		errno = ENOMEM;
+		errno = EMSGSIZE;
 		return KP_ERRNO;
 	}
+	kp_agent_unsafe_set_metadata(&unsafe, safe->metadata);
 
-	kp_agent_send(&ctx->agent, KP_MSG_STORE, &unsafe,
-	              sizeof(struct kp_unsafe));
+	ret = kp_agent_send_unsafe(&ctx->agent, KP_MSG_STORE, &unsafe);
+	sodium_memzero(&unsafe, sizeof(struct kp_unsafe));
 
-	return KP_SUCCESS;
+	return ret;
+}
+
+/*
+ * Whether id tells a safe file, rather than nothing known of it.
+ */
+bool
+kp_safe_id_known(const struct kp_safe_id *id)
+{
+	static const struct kp_safe_id unknown;
+
+	assert(id);
+
+	return memcmp(id, &unknown, sizeof(struct kp_safe_id)) != 0;
 }
 
 static kp_error_t
@@ -399,3 +469,125 @@ kp_safe_mkdir(struct kp_ctx *ctx, const char *name)
 	}
 	return KP_SUCCESS;
 }
+
+/*
+ * Ask an unlocked agent to read and decrypt safe from workspace.
+ */
+static kp_error_t
+kp_safe_agent_open(struct kp_ctx *ctx, struct kp_safe *safe)
+{
+	kp_error_t ret;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+
+	if ((ret = kp_agent_send(&ctx->agent, KP_MSG_OPEN, safe->name,
+	                         strlen(safe->name) + 1)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = kp_agent_receive_unsafe(&ctx->agent, KP_MSG_OPEN, &unsafe))
+	    != KP_SUCCESS) {
+		goto out;
+	}
+
+	ctx->agent.unlocked = true;
+
+	ret = kp_safe_set(safe, unsafe.password,
+	                  kp_agent_unsafe_metadata(&unsafe));
+	safe->id = unsafe.id;
+
+out:
+	kp_agent_unsafe_clear(&unsafe);
+	return ret;
+}
+
+/*
+ * Ask an unlocked agent to encrypt and write safe to workspace.
+ */
+static kp_error_t
+kp_safe_agent_save(struct kp_ctx *ctx, struct kp_safe *safe)
+{
+	kp_error_t ret;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+
+	if (strlcpy(unsafe.name, safe->name, PATH_MAX) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		ret = KP_ERRNO;
+		goto out;
+	}
+	if (strlcpy(unsafe.password, safe->password,
+	            KP_PASSWORD_MAX_LEN) >= KP_PASSWORD_MAX_LEN) {
+		errno = ENOMEM;
+		ret = KP_ERRNO;
+		goto out;
+	}
+	kp_agent_unsafe_set_metadata(&unsafe, safe->metadata);
+
+	if ((ret = kp_agent_send_unsafe(&ctx->agent, KP_MSG_SAVE, &unsafe))
+	    != KP_SUCCESS) {
+		goto out;
+	}
+
+	if ((ret = kp_agent_receive_saved(&ctx->agent, &safe->id))
+	    != KP_SUCCESS) {
+		goto out;
+	}
+
+	ctx->agent.unlocked = true;
+
+out:
+	sodium_memzero(&unsafe, sizeof(struct kp_unsafe));
+	return ret;
+}
+
+/*
+ * Drop agent copy of safe, from successor of an agent handing over.
+ */
+static kp_error_t
+kp_safe_agent_discard(struct kp_ctx *ctx, const char *name)
+{
+	kp_error_t ret;
+	bool result;
+	int tries = 0;
+
+	do {
+		if ((ret = kp_agent_send(&ctx->agent, KP_MSG_DISCARD,
+		                         (void *)name, strlen(name) + 1))
+		    == KP_SUCCESS) {
+			ret = kp_agent_receive(&ctx->agent, KP_MSG_DISCARD,
+			                       &result, sizeof(bool));
+		}
+	} while (kp_agent_moved(&ctx->agent, ret) && tries++ == 0);
+
+	return ret;
+}
+
+/*
+ * Replace agent copy unsafe of safe with what was just saved, keeping its
+ * timeout. Agent must not serve a stale copy, copy too large is discarded.
+ * An agent aware of batches answers a store, so that one handing over
+ * cannot drop it unnoticed.
+ */
+static void
+kp_safe_refresh(struct kp_ctx *ctx, struct kp_safe *safe,
+                struct kp_unsafe *unsafe)
+{
+	kp_error_t ret;
+	struct kp_msg_error error = { KP_SUCCESS, 0 };
+	int tries = 0;
+
+	kp_agent_unsafe_set_metadata(unsafe, safe->metadata);
+	unsafe->id = safe->id;
+	if (strlcpy(unsafe->password, safe->password,
+	            KP_PASSWORD_MAX_LEN) < KP_PASSWORD_MAX_LEN) {
+		do {
+			ret = kp_agent_store_many(&ctx->agent, unsafe, 1,
+			                          &error);
+		} while (kp_agent_moved(&ctx->agent, ret) && tries++ == 0);
+
+		if (ret == KP_SUCCESS && error.err == KP_SUCCESS) {
+			return;
+		}
+	}
+
+	kp_safe_agent_discard(ctx, safe->name);
+}
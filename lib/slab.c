@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/mman.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <sodium.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "slab.h"
+
+/*
+ * A region is a locked mapping between two guard pages, excluded from core
+ * dumps, carved into slots of a single size class. Each slot ends with a
+ * canary checked on free, data is placed right before it so that any
+ * overflow hits the canary. As with sodium_malloc, returned memory is thus
+ * not aligned. Freed slots are zeroed. Buffers too large for any class are
+ * left to sodium_malloc.
+ */
+#define KP_SLAB_REGION_SIZE (64 * 1024)
+#define KP_SLAB_MIN_SIZE    32
+#define KP_SLAB_CLASSES     8 /* 32 to 4096 bytes */
+#define KP_SLAB_MAX_SIZE    (KP_SLAB_MIN_SIZE << (KP_SLAB_CLASSES - 1))
+#define KP_SLAB_CANARY_SIZE 16
+
+struct kp_slab_region {
+	struct kp_slab_region *next;
+	unsigned char *mapping;  /* including guard pages */
+	size_t mapping_size;
+	unsigned char *slots;
+	size_t slot_size;
+	size_t nslots;
+	size_t nfree;
+	uint16_t *free;          /* stack of free slot indexes */
+	unsigned char *used;     /* whether each slot is allocated */
+};
+
+static struct {
+	pthread_mutex_t lock;
+	bool init;
+	size_t page_size;
+	unsigned char canary[KP_SLAB_CANARY_SIZE];
+	struct kp_slab_region *regions[KP_SLAB_CLASSES];
+} slab = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static bool kp_slab_init(void);
+static int kp_slab_class(size_t);
+static struct kp_slab_region *kp_slab_region_new(size_t);
+static void kp_slab_region_free(struct kp_slab_region *);
+static struct kp_slab_region *kp_slab_region_find(void *, int *);
+
+void *
+kp_slab_alloc(size_t size)
+{
+	struct kp_slab_region *region;
+	unsigned char *slot;
+	uint16_t index;
+	int class;
+
+	if (size > KP_SLAB_MAX_SIZE - KP_SLAB_CANARY_SIZE) {
+		return sodium_malloc(size);
+	}
+
+	class = kp_slab_class(size + KP_SLAB_CANARY_SIZE);
+
+	pthread_mutex_lock(&slab.lock);
+
+	if (!kp_slab_init()) {
+		pthread_mutex_unlock(&slab.lock);
+		return NULL;
+	}
+
+	for (region = slab.regions[class]; region != NULL;
+	     region = region->next) {
+		if (region->nfree > 0) {
+			break;
+		}
+	}
+
+	if (region == NULL) {
+		region = kp_slab_region_new(KP_SLAB_MIN_SIZE << class);
+		if (region == NULL) {
+			pthread_mutex_unlock(&slab.lock);
+			return NULL;
+		}
+		region->next = slab.regions[class];
+		slab.regions[class] = region;
+	}
+
+	index = region->free[--region->nfree];
+	region->used[index] = 1;
+	slot = region->slots + index * region->slot_size;
+	memcpy(slot + region->slot_size - KP_SLAB_CANARY_SIZE, slab.canary,
+	       KP_SLAB_CANARY_SIZE);
+
+	pthread_mutex_unlock(&slab.lock);
+
+	return slot + region->slot_size - KP_SLAB_CANARY_SIZE - size;
+}
+
+void
+kp_slab_free(void *ptr)
+{
+	struct kp_slab_region *region, **prev;
+	unsigned char *slot;
+	size_t index;
+	int class;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&slab.lock);
+
+	if ((region = kp_slab_region_find(ptr, &class)) == NULL) {
+		pthread_mutex_unlock(&slab.lock);
+		sodium_free(ptr);
+		return;
+	}
+
+	index = ((unsigned char *)ptr - region->slots) / region->slot_size;
+	slot = region->slots + index * region->slot_size;
+
+	if (!region->used[index]
+	    || sodium_memcmp(slot + region->slot_size - KP_SLAB_CANARY_SIZE,
+	                     slab.canary, KP_SLAB_CANARY_SIZE) != 0) {
+		/* Double free or overflow, same as sodium_free */
+		abort();
+	}
+
+	sodium_memzero(slot, region->slot_size);
+	region->used[index] = 0;
+	region->free[region->nfree++] = index;
+
+	/* Give empty regions back, but the last one of its class */
+	if (region->nfree == region->nslots
+	    && !(slab.regions[class] == region && region->next == NULL)) {
+		for (prev = &slab.regions[class]; *prev != region;
+		     prev = &(*prev)->next);
+		*prev = region->next;
+		kp_slab_region_free(region);
+	}
+
+	pthread_mutex_unlock(&slab.lock);
+}
+
+/*
+ * Locked memory held by an allocation of size bytes.
+ */
+size_t
+kp_slab_size(size_t size)
+{
+	long page_size;
+
+	if (size <= KP_SLAB_MAX_SIZE - KP_SLAB_CANARY_SIZE) {
+		return KP_SLAB_MIN_SIZE << kp_slab_class(size
+		                                         + KP_SLAB_CANARY_SIZE);
+	}
+
+	/* sodium_malloc locks data and its canary, rounded up to pages */
+	page_size = sysconf(_SC_PAGESIZE);
+	return (size + KP_SLAB_CANARY_SIZE + page_size - 1)
+	    / page_size * page_size;
+}
+
+/*
+ * Called with lock held.
+ */
+static bool
+kp_slab_init(void)
+{
+	long page_size;
+
+	if (slab.init) {
+		return true;
+	}
+
+	if (sodium_init() < 0) {
+		return false;
+	}
+
+	if ((page_size = sysconf(_SC_PAGESIZE)) <= 0) {
+		return false;
+	}
+
+	slab.page_size = page_size;
+	randombytes_buf(slab.canary, KP_SLAB_CANARY_SIZE);
+	slab.init = true;
+
+	return true;
+}
+
+/*
+ * Smallest class whose slots hold size bytes.
+ */
+static int
+kp_slab_class(size_t size)
+{
+	int class = 0;
+
+	while ((size_t)(KP_SLAB_MIN_SIZE << class) < size) {
+		class++;
+	}
+
+	return class;
+}
+
+static struct kp_slab_region *
+kp_slab_region_new(size_t slot_size)
+{
+	struct kp_slab_region *region;
+	size_t i;
+
+	if ((region = calloc(1, sizeof(struct kp_slab_region))) == NULL) {
+		return NULL;
+	}
+
+	region->slot_size = slot_size;
+	region->nslots = KP_SLAB_REGION_SIZE / slot_size;
+	region->free = calloc(region->nslots, sizeof(uint16_t));
+	region->used = calloc(region->nslots, 1);
+	if (region->free == NULL || region->used == NULL) {
+		goto fail;
+	}
+
+	region->mapping_size = KP_SLAB_REGION_SIZE + 2 * slab.page_size;
+	region->mapping = mmap(NULL, region->mapping_size, PROT_NONE,
+	                       MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (region->mapping == MAP_FAILED) {
+		region->mapping = NULL;
+		goto fail;
+	}
+
+	region->slots = region->mapping + slab.page_size;
+	if (mprotect(region->slots, KP_SLAB_REGION_SIZE,
+	             PROT_READ | PROT_WRITE) != 0) {
+		goto fail;
+	}
+
+	/* Like sodium_malloc, keep going if memory cannot be locked */
+	(void)sodium_mlock(region->slots, KP_SLAB_REGION_SIZE);
+#if defined(MADV_DONTDUMP)
+	(void)madvise(region->slots, KP_SLAB_REGION_SIZE, MADV_DONTDUMP);
+#elif defined(MADV_NOCORE)
+	(void)madvise(region->slots, KP_SLAB_REGION_SIZE, MADV_NOCORE);
+#endif
+
+	/* Hand lowest slots out first */
+	for (i = 0; i < region->nslots; i++) {
+		region->free[i] = region->nslots - 1 - i;
+	}
+	region->nfree = region->nslots;
+
+	return region;
+
+fail:
+	kp_slab_region_free(region);
+	return NULL;
+}
+
+static void
+kp_slab_region_free(struct kp_slab_region *region)
+{
+	if (region->mapping != NULL) {
+		/* Slots are already zeroed, munlock zeroes them again */
+		sodium_munlock(region->slots, KP_SLAB_REGION_SIZE);
+		munmap(region->mapping, region->mapping_size);
+	}
+	free(region->free);
+	free(region->used);
+	free(region);
+}
+
+/*
+ * Region holding ptr, if any. Called with lock held.
+ */
+static struct kp_slab_region *
+kp_slab_region_find(void *ptr, int *class)
+{
+	struct kp_slab_region *region;
+	unsigned char *p = ptr;
+
+	for (*class = 0; *class < KP_SLAB_CLASSES; (*class)++) {
+		for (region = slab.regions[*class]; region != NULL;
+		     region = region->next) {
+			if (p >= region->slots
+			    && p < region->slots + KP_SLAB_REGION_SIZE) {
+				return region;
+			}
+		}
+	}
+
+	return NULL;
+}
@@ -34,48 +34,142 @@
 
 #include "kickpass.h"
 
+#include "kdf.h"
 #include "safe.h"
+#include "slab.h"
 #include "storage.h"
 
-static uint16_t kp_storage_version = 0x0001;
+#define KP_STORAGE_V1 0x0001
+#define KP_STORAGE_V2 0x0002
+
+/* Payload ciphers, stored in header since v2, never change them */
+#define KP_STORAGE_CHACHA20POLY1305  0x0001 /* implicit in v1 */
+#define KP_STORAGE_AES256GCM         0x0002
+#define KP_STORAGE_XCHACHA20POLY1305 0x0003
+
+static uint16_t kp_storage_version = KP_STORAGE_V2;
 
 #ifndef betoh16
 #define betoh16 be16toh
 #endif
+#ifndef betoh32
+#define betoh32 be32toh
+#endif
 #ifndef betoh64
 #define betoh64 be64toh
 #endif
 
 #define KP_STORAGE_SALT_SIZE   crypto_pwhash_scryptsalsa208sha256_SALTBYTES
 #define KP_STORAGE_NONCE_SIZE  crypto_aead_chacha20poly1305_NPUBBYTES
-#define KP_STORAGE_HEADER_SIZE (2+2+8+8+KP_STORAGE_SALT_SIZE+KP_STORAGE_NONCE_SIZE)
+#define KP_STORAGE_NONCE_SIZE_V2 crypto_aead_xchacha20poly1305_ietf_NPUBBYTES
+#define KP_STORAGE_KEY_SIZE    crypto_aead_chacha20poly1305_KEYBYTES
+#define KP_STORAGE_WRAPPED_KEY_SIZE (KP_STORAGE_KEY_SIZE+crypto_aead_chacha20poly1305_ABYTES)
+#define KP_STORAGE_HEADER_SIZE_V1 (2+2+8+8+KP_STORAGE_SALT_SIZE+KP_STORAGE_NONCE_SIZE)
+#define KP_STORAGE_HEADER_SIZE_V2 (2+2+8+8+KP_STORAGE_SALT_SIZE+KP_STORAGE_NONCE_SIZE_V2+KP_STORAGE_SALT_SIZE+2+2+2+4+KP_STORAGE_WRAPPED_KEY_SIZE)
+#define KP_STORAGE_HEADER_SIZE KP_STORAGE_HEADER_SIZE_V2
+#define KP_STORAGE_AD_SIZE_V2 (2+2+KP_STORAGE_NONCE_SIZE_V2)
+#define KP_STORAGE_TMP_RETRY 16 /* temporary names tried, each random */
 
+/*
+ * Version 1 derive the safe key from master password with salt.
+ * Version 2 encrypt the safe with a random data key, stored wrapped by a key
+ * derived from workspace master key with subkey_salt. Workspace master key is
+ * derived from master password with salt. Changing master password thus only
+ * requires to wrap data keys again.
+ * Version 2 also tells which kdf, and with how many lanes, was used, and which
+ * cipher encrypts the payload. Its nonce is large enough for any of them.
+ * Its plain size lets readers allocate exactly what the safe needs, it tells
+ * nothing the cipher size does not.
+ */
 struct kp_storage_header {
 	uint16_t       version;
 	uint16_t       sodium_version;
 	uint64_t       opslimit;
 	uint64_t       memlimit;
 	unsigned char  salt[KP_STORAGE_SALT_SIZE];
-	unsigned char  nonce[KP_STORAGE_NONCE_SIZE];
+	unsigned char  nonce[KP_STORAGE_NONCE_SIZE_V2];   /* 8 bytes in v1 */
+	unsigned char  subkey_salt[KP_STORAGE_SALT_SIZE]; /* since v2 */
+	uint16_t       kdf;                               /* since v2 */
+	uint16_t       parallelism;                       /* since v2 */
+	uint16_t       cipher;                            /* since v2 */
+	uint32_t       plain_size;                        /* since v2 */
+	unsigned char  wrapped_key[KP_STORAGE_WRAPPED_KEY_SIZE]; /* since v2 */
 };
 
-#define KP_STORAGE_HEADER_INIT { 0, 0, 0, 0, { 0 }, { 0 } }
+#define KP_STORAGE_HEADER_INIT { 0, 0, 0, 0, { 0 }, { 0 }, { 0 }, 0, 0, 0, 0, { 0 } }
 
+static size_t kp_storage_header_size(uint16_t);
 static void kp_storage_header_pack(const struct kp_storage_header *,
                                    unsigned char *);
 static void kp_storage_header_unpack(struct kp_storage_header *,
                                      const unsigned char *);
+static void kp_storage_header_init(struct kp_ctx *,
+                                   struct kp_storage_header *);
+static bool kp_storage_header_current(struct kp_ctx *,
+                                      const struct kp_storage_header *);
+static uint16_t kp_storage_cipher(void);
+static size_t kp_storage_ad(const struct kp_storage_header *,
+                            unsigned char *);
+static kp_error_t kp_storage_kek(struct kp_ctx *, struct kp_storage_header *,
+                                 const char *, struct kp_key *,
+                                 unsigned char *);
+static kp_error_t kp_storage_wrap(struct kp_ctx *, struct kp_storage_header *,
+                                  struct kp_key *, const unsigned char *);
+static kp_error_t kp_storage_unwrap(struct kp_ctx *,
+                                    struct kp_storage_header *,
+                                    const char *, struct kp_key *,
+                                    unsigned char *);
+static kp_error_t kp_storage_seal(const struct kp_storage_header *,
+                                  const unsigned char *,
+                                  const unsigned char *, unsigned long long,
+                                  unsigned char *, unsigned long long *);
+static kp_error_t kp_storage_unseal(const struct kp_storage_header *,
+                                    const unsigned char *,
+                                    unsigned char *, unsigned long long *,
+                                    const unsigned char *,
+                                    unsigned long long);
 static kp_error_t kp_storage_encrypt(struct kp_ctx *,
                                      struct kp_storage_header *,
-                                     const unsigned char *, unsigned long long,
+                                     struct kp_key *,
                                      const unsigned char *, unsigned long long,
                                      unsigned char *, unsigned long long *);
 static kp_error_t kp_storage_decrypt(struct kp_ctx *,
                                      struct kp_storage_header *,
-                                     const unsigned char *, unsigned long long,
                                      unsigned char *, unsigned long long *,
                                      const unsigned char *,
                                      unsigned long long);
+static kp_error_t kp_storage_read_header(int, struct kp_storage_header *);
+static kp_error_t kp_storage_read(struct kp_ctx *, int,
+                                  struct kp_storage_header *,
+                                  unsigned char **, unsigned long long *);
+static kp_error_t kp_storage_write(int, const struct kp_storage_header *,
+                                   const unsigned char *, unsigned long long);
+static kp_error_t kp_storage_tmpname(const char *, const char *, char *,
+                                     size_t);
+static void kp_storage_suffix(char *);
+static kp_error_t kp_storage_dirname(const char *, char *, size_t);
+static kp_error_t kp_storage_create(struct kp_ctx *, const char *, int *,
+                                    char *);
+static kp_error_t kp_storage_mktemp(struct kp_ctx *, const char *, int *,
+                                    char *);
+static kp_error_t kp_storage_link(struct kp_ctx *, int, const char *, char *);
+static kp_error_t kp_storage_publish(struct kp_ctx *, int, const char *,
+                                     char *);
+static kp_error_t kp_storage_sync_dir(struct kp_ctx *, const char *);
+static void kp_storage_discard(struct kp_ctx *, int, const char *,
+                               const char *);
+static kp_error_t kp_storage_replace(struct kp_ctx *, int, const char *,
+                                     char *);
+static kp_error_t kp_storage_batch_add(struct kp_ctx *, int, const char *,
+                                       const char *);
+static kp_error_t kp_storage_batch_flush(struct kp_ctx *,
+                                         struct kp_storage_batch *,
+                                         struct kp_storage_pending *, size_t);
+static void kp_storage_batch_done(struct kp_storage_batch *, const char *,
+                                  kp_error_t, int);
+static bool kp_storage_same_dir(const char *, const char *);
+static kp_error_t kp_storage_identify(int, const struct kp_storage_header *,
+                                      struct kp_safe_id *);
 
 #define READ_HEADER(s, packed, field) do {\
 	memcpy(&(field), (packed), (s)/8);\
@@ -89,6 +183,19 @@ static kp_error_t kp_storage_decrypt(struct kp_ctx *,
 	(packed) = (packed) + (s)/8;\
 } while(0)
 
+static size_t
+kp_storage_header_size(uint16_t version)
+{
+	switch (version) {
+	case KP_STORAGE_V1:
+		return KP_STORAGE_HEADER_SIZE_V1;
+	case KP_STORAGE_V2:
+		return KP_STORAGE_HEADER_SIZE_V2;
+	default:
+		return 0;
+	}
+}
+
 static void
 kp_storage_header_pack(const struct kp_storage_header *header,
                        unsigned char *packed)
@@ -102,7 +209,21 @@ kp_storage_header_pack(const struct kp_storage_header *header,
 	WRITE_HEADER(64, packed, header->memlimit);
 	memcpy(packed, header->salt, KP_STORAGE_SALT_SIZE);
 	packed = packed + KP_STORAGE_SALT_SIZE;
-	memcpy(packed, header->nonce, KP_STORAGE_NONCE_SIZE);
+
+	if (header->version < KP_STORAGE_V2) {
+		memcpy(packed, header->nonce, KP_STORAGE_NONCE_SIZE);
+		return;
+	}
+
+	memcpy(packed, header->nonce, KP_STORAGE_NONCE_SIZE_V2);
+	packed = packed + KP_STORAGE_NONCE_SIZE_V2;
+	memcpy(packed, header->subkey_salt, KP_STORAGE_SALT_SIZE);
+	packed = packed + KP_STORAGE_SALT_SIZE;
+	WRITE_HEADER(16, packed, header->kdf);
+	WRITE_HEADER(16, packed, header->parallelism);
+	WRITE_HEADER(16, packed, header->cipher);
+	WRITE_HEADER(32, packed, header->plain_size);
+	memcpy(packed, header->wrapped_key, KP_STORAGE_WRAPPED_KEY_SIZE);
 }
 
 static void
@@ -118,236 +239,1451 @@ kp_storage_header_unpack(struct kp_storage_header *header,
 	READ_HEADER(64, packed, header->memlimit);
 	memcpy(header->salt, packed, KP_STORAGE_SALT_SIZE);
 	packed = packed + KP_STORAGE_SALT_SIZE;
-	memcpy(header->nonce, packed, KP_STORAGE_NONCE_SIZE);
+
+	if (header->version < KP_STORAGE_V2) {
+		memcpy(header->nonce, packed, KP_STORAGE_NONCE_SIZE);
+		header->kdf = KP_KDF_SCRYPT;
+		header->parallelism = 1;
+		header->cipher = KP_STORAGE_CHACHA20POLY1305;
+		return;
+	}
+
+	memcpy(header->nonce, packed, KP_STORAGE_NONCE_SIZE_V2);
+	packed = packed + KP_STORAGE_NONCE_SIZE_V2;
+	memcpy(header->subkey_salt, packed, KP_STORAGE_SALT_SIZE);
+	packed = packed + KP_STORAGE_SALT_SIZE;
+	READ_HEADER(16, packed, header->kdf);
+	READ_HEADER(16, packed, header->parallelism);
+	READ_HEADER(16, packed, header->cipher);
+	READ_HEADER(32, packed, header->plain_size);
+	memcpy(header->wrapped_key, packed, KP_STORAGE_WRAPPED_KEY_SIZE);
+}
+
+/*
+ * Fill header with current workspace config, with fresh nonce and subkey_salt.
+ */
+static void
+kp_storage_header_init(struct kp_ctx *ctx, struct kp_storage_header *header)
+{
+	static const unsigned char zero_salt[KP_STORAGE_SALT_SIZE] = { 0 };
+
+	/* Workspace salt is normally set by config, ensure we have one */
+	if (sodium_memcmp(ctx->cfg.salt, zero_salt, KP_STORAGE_SALT_SIZE)
+	    == 0) {
+		randombytes_buf(ctx->cfg.salt, KP_STORAGE_SALT_SIZE);
+	}
+
+	header->version = kp_storage_version;
+	header->sodium_version = SODIUM_LIBRARY_VERSION_MAJOR << 8 |
+		SODIUM_LIBRARY_VERSION_MINOR;
+	header->opslimit = ctx->cfg.opslimit;
+	header->memlimit = ctx->cfg.memlimit;
+	header->kdf = ctx->cfg.kdf;
+	header->parallelism = ctx->cfg.parallelism;
+	header->cipher = kp_storage_cipher();
+	memcpy(header->salt, ctx->cfg.salt, KP_STORAGE_SALT_SIZE);
+	randombytes_buf(header->nonce, KP_STORAGE_NONCE_SIZE_V2);
+	randombytes_buf(header->subkey_salt, KP_STORAGE_SALT_SIZE);
+}
+
+/*
+ * AES-256-GCM is the fastest when the cpu has AES instructions, otherwise
+ * XChaCha20-Poly1305 is. Data key is new on each save, so random nonces never
+ * repeat under a key, whatever the nonce size.
+ * libsodium has no AES-256-GCM without those instructions: a safe written
+ * here cannot be read on a cpu lacking them, see KP_ENOAES.
+ */
+static uint16_t
+kp_storage_cipher(void)
+{
+	if (crypto_aead_aes256gcm_is_available()) {
+		return KP_STORAGE_AES256GCM;
+	}
+
+	return KP_STORAGE_XCHACHA20POLY1305;
+}
+
+/*
+ * Whether header data key is wrapped according to current workspace config.
+ */
+static bool
+kp_storage_header_current(struct kp_ctx *ctx,
+                          const struct kp_storage_header *header)
+{
+	return header->version == kp_storage_version
+	    && header->kdf == ctx->cfg.kdf
+	    && header->parallelism == ctx->cfg.parallelism
+	    && header->opslimit == ctx->cfg.opslimit
+	    && header->memlimit == ctx->cfg.memlimit
+	    && sodium_memcmp(header->salt, ctx->cfg.salt,
+	                     KP_STORAGE_SALT_SIZE) == 0;
 }
 
+/*
+ * Additional data authenticated along with the payload.
+ * Version 1 authenticates the whole header. Version 2 only authenticates what
+ * does not change when data key is wrapped again, the rest being bound to the
+ * data key by wrapping.
+ */
+static size_t
+kp_storage_ad(const struct kp_storage_header *header, unsigned char *ad)
+{
+	if (header->version == KP_STORAGE_V1) {
+		kp_storage_header_pack(header, ad);
+		return KP_STORAGE_HEADER_SIZE_V1;
+	}
+
+	WRITE_HEADER(16, ad, header->version);
+	WRITE_HEADER(16, ad, header->cipher);
+	memcpy(ad, header->nonce, KP_STORAGE_NONCE_SIZE_V2);
+
+	return KP_STORAGE_AD_SIZE_V2;
+}
 
+/*
+ * Key encryption key. Version 1 uses it directly as the safe key.
+ * Master key is cached by ctx, so that safes sharing kdf parameters and salt
+ * cost a single derivation. A master key already held by caller in known is
+ * used first.
+ * Given old_password, ctx cache, which derives from current password, is only
+ * looked up. On a miss master key is derived from old_password into known,
+ * kept by caller for the next safes.
+ */
 static kp_error_t
-kp_storage_encrypt(struct kp_ctx *ctx, struct kp_storage_header *header,
-                   const unsigned char *packed_header,
-                   unsigned long long header_size, const unsigned char *plain,
-                   unsigned long long plain_size, unsigned char *cipher,
-                   unsigned long long *cipher_size)
-{
-	unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES];
-
-	if (crypto_pwhash_scryptsalsa208sha256(key,
-	                                       crypto_aead_chacha20poly1305_KEYBYTES,
-	                                       ctx->password,
-	                                       strlen(ctx->password),
-	                                       header->salt, header->opslimit,
-	                                       header->memlimit) != 0) {
-		errno = ENOMEM;
-		return KP_ERRNO;
+kp_storage_kek(struct kp_ctx *ctx, struct kp_storage_header *header,
+               const char *old_password, struct kp_key *known,
+               unsigned char *kek)
+{
+	kp_error_t ret = KP_SUCCESS;
+	unsigned char master[KP_MASTER_KEY_SIZE];
+
+	switch (header->version) {
+	case KP_STORAGE_V1:
+		/* implicit in version 1 */
+		header->kdf = KP_KDF_SCRYPT;
+		header->parallelism = 1;
+		break;
+	case KP_STORAGE_V2:
+		if (kp_kdf_name(header->kdf) == NULL) {
+			return KP_INVALID_STORAGE;
+		}
+		break;
+	default:
+		return KP_INVALID_STORAGE;
 	}
 
-	if (crypto_aead_chacha20poly1305_encrypt(cipher, cipher_size,
-	                                         plain, plain_size,
-	                                         packed_header, header_size,
-	                                         NULL, header->nonce,
-	                                         key) != 0) {
-		return KP_EENCRYPT;
+	if (known != NULL
+	    && kp_kdf_key_match(known, header->kdf, header->salt,
+	                        header->opslimit, header->memlimit,
+	                        header->parallelism)) {
+		memcpy(master, known->key, KP_MASTER_KEY_SIZE);
+	} else if (old_password == NULL) {
+		ret = kp_kdf_cache_derive(ctx, header->kdf, header->salt,
+		                          header->opslimit, header->memlimit,
+		                          header->parallelism, master);
+	} else if (!kp_kdf_cache_lookup(ctx, header->kdf, header->salt,
+	                                header->opslimit, header->memlimit,
+	                                header->parallelism, master)) {
+		ret = kp_kdf_derive(header->kdf, master, KP_MASTER_KEY_SIZE,
+		                    old_password, header->salt,
+		                    header->opslimit, header->memlimit,
+		                    header->parallelism);
+		if (ret == KP_SUCCESS && known != NULL) {
+			known->used = true;
+			known->kdf = header->kdf;
+			known->opslimit = header->opslimit;
+			known->memlimit = header->memlimit;
+			known->parallelism = header->parallelism;
+			memcpy(known->salt, header->salt, KP_KDF_SALT_SIZE);
+			memcpy(known->key, master, KP_MASTER_KEY_SIZE);
+		}
 	}
 
-	return KP_SUCCESS;
+	if (ret != KP_SUCCESS) {
+		sodium_memzero(master, sizeof(master));
+		return ret;
+	}
+
+	if (header->version == KP_STORAGE_V1) {
+		memcpy(kek, master, KP_STORAGE_KEY_SIZE);
+	} else if (crypto_generichash(kek, KP_STORAGE_KEY_SIZE,
+	                              header->subkey_salt, KP_STORAGE_SALT_SIZE,
+	                              master, KP_MASTER_KEY_SIZE) != 0) {
+		ret = KP_EINTERNAL;
+	}
+
+	sodium_memzero(master, sizeof(master));
+
+	return ret;
 }
+
+/*
+ * Wrap data key into header, with master key in target if it matches header.
+ * Key encryption key is unique to subkey_salt, which is renewed on each wrap,
+ * so a zero nonce is safe.
+ */
 static kp_error_t
-kp_storage_decrypt(struct kp_ctx *ctx, struct kp_storage_header *header,
-                   const unsigned char *packed_header,
-                   unsigned long long header_size, unsigned char *plain,
-                   unsigned long long *plain_size, const unsigned char *cipher,
-                   unsigned long long cipher_size)
+kp_storage_wrap(struct kp_ctx *ctx, struct kp_storage_header *header,
+                struct kp_key *target, const unsigned char *key)
 {
-	unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES];
+	kp_error_t ret;
+	unsigned char kek[KP_STORAGE_KEY_SIZE];
+	static const unsigned char nonce[KP_STORAGE_NONCE_SIZE] = { 0 };
 
-	if (crypto_pwhash_scryptsalsa208sha256(key,
-	                                       crypto_aead_chacha20poly1305_KEYBYTES,
-	                                       ctx->password,
-	                                       strlen(ctx->password),
-	                                       header->salt, header->opslimit,
-	                                       header->memlimit) != 0) {
-		errno = ENOMEM;
-		return KP_ERRNO;
+	if ((ret = kp_storage_kek(ctx, header, NULL, target, kek))
+	    != KP_SUCCESS) {
+		return ret;
 	}
 
-	if (crypto_aead_chacha20poly1305_decrypt(plain, plain_size,
-	                                         NULL, cipher, cipher_size,
-	                                         packed_header, header_size,
-	                                         header->nonce, key) != 0) {
-		return KP_EDECRYPT;
+	if (crypto_aead_chacha20poly1305_encrypt(header->wrapped_key, NULL,
+	                                         key, KP_STORAGE_KEY_SIZE,
+	                                         NULL, 0, NULL, nonce,
+	                                         kek) != 0) {
+		ret = KP_EENCRYPT;
 	}
 
-	return KP_SUCCESS;
+	sodium_memzero(kek, sizeof(kek));
+
+	return ret;
 }
 
-kp_error_t
-kp_storage_save(struct kp_ctx *ctx, struct kp_safe *safe)
+/*
+ * Unwrap data key from header, with master key of old_password if given, see
+ * kp_storage_kek.
+ */
+static kp_error_t
+kp_storage_unwrap(struct kp_ctx *ctx, struct kp_storage_header *header,
+                  const char *old_password, struct kp_key *known,
+                  unsigned char *key)
 {
-	kp_error_t ret = KP_SUCCESS;
-	int cipher_fd;
-	unsigned char *cipher = NULL, *plain = NULL;
-	unsigned long long cipher_size, plain_size;
-	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
-	unsigned char packed_header[KP_STORAGE_HEADER_SIZE];
-	size_t password_len, metadata_len;
+	kp_error_t ret;
+	unsigned char kek[KP_STORAGE_KEY_SIZE];
+	static const unsigned char nonce[KP_STORAGE_NONCE_SIZE] = { 0 };
 
-	assert(ctx);
-	assert(safe);
-	assert(safe->open == true);
+	if ((ret = kp_storage_kek(ctx, header, old_password, known, kek))
+	    != KP_SUCCESS) {
+		return ret;
+	}
 
-	cipher_fd = openat(ctx->ws_fd, safe->name,
-	                   O_WRONLY | O_NONBLOCK | O_CREAT,
-	                   S_IRUSR | S_IWUSR);
-	if (cipher_fd < 0) {
-		ret = KP_ERRNO;
-		goto out;
+	if (crypto_aead_chacha20poly1305_decrypt(key, NULL, NULL,
+	                                         header->wrapped_key,
+	                                         KP_STORAGE_WRAPPED_KEY_SIZE,
+	                                         NULL, 0, nonce, kek) != 0) {
+		/* Master key might come from a wrong password */
+		kp_kdf_cache_forget(ctx, header->kdf, header->salt,
+		                    header->opslimit, header->memlimit,
+		                    header->parallelism);
+		ret = KP_EDECRYPT;
 	}
 
-	password_len = strlen(safe->password);
-	assert(password_len < KP_PASSWORD_MAX_LEN);
-	metadata_len = strlen(safe->metadata);
-	assert(metadata_len < KP_METADATA_MAX_LEN);
+	sodium_memzero(kek, sizeof(kek));
 
-	/* Ensure we are at the beginning of the safe */
-	if (lseek(cipher_fd, 0, SEEK_SET) != 0) {
-		ret = KP_ERRNO;
-		goto out;
+	return ret;
+}
+
+/*
+ * Encrypt payload with the cipher named in header, version 1 has only one.
+ */
+static kp_error_t
+kp_storage_seal(const struct kp_storage_header *header,
+                const unsigned char *key, const unsigned char *plain,
+                unsigned long long plain_size, unsigned char *cipher,
+                unsigned long long *cipher_size)
+{
+	unsigned char ad[KP_STORAGE_HEADER_SIZE];
+	size_t ad_size;
+	int ret;
+
+	ad_size = kp_storage_ad(header, ad);
+
+	switch (header->version == KP_STORAGE_V1
+	        ? KP_STORAGE_CHACHA20POLY1305 : header->cipher) {
+	case KP_STORAGE_CHACHA20POLY1305:
+		ret = crypto_aead_chacha20poly1305_encrypt(cipher, cipher_size,
+		                                           plain, plain_size,
+		                                           ad, ad_size, NULL,
+		                                           header->nonce, key);
+		break;
+	case KP_STORAGE_AES256GCM:
+		if (!crypto_aead_aes256gcm_is_available()) {
+			return KP_ENOAES;
+		}
+		ret = crypto_aead_aes256gcm_encrypt(cipher, cipher_size,
+		                                    plain, plain_size,
+		                                    ad, ad_size, NULL,
+		                                    header->nonce, key);
+		break;
+	case KP_STORAGE_XCHACHA20POLY1305:
+		ret = crypto_aead_xchacha20poly1305_ietf_encrypt(cipher,
+		                                                 cipher_size,
+		                                                 plain,
+		                                                 plain_size,
+		                                                 ad, ad_size,
+		                                                 NULL,
+		                                                 header->nonce,
+		                                                 key);
+		break;
+	default:
+		return KP_INVALID_STORAGE;
 	}
 
-	if (ftruncate(cipher_fd, 0) != 0) {
-		ret = KP_ERRNO;
-		goto out;
+	if (ret != 0) {
+		return KP_EENCRYPT;
 	}
 
-	/* construct full plain */
-	/* plain is password + '\0' + metadata + '\0' */
-	plain_size = password_len + metadata_len + 2;
-	plain = sodium_malloc(plain_size);
-	strncpy((char *)plain, (char *)safe->password, password_len);
-	plain[password_len] = '\0';
-	strncpy((char *)&plain[password_len+1], (char *)safe->metadata,
-	        metadata_len);
-	plain[plain_size-1] = '\0';
+	return KP_SUCCESS;
+}
 
-	/* alloc cipher to max size */
-	cipher = malloc(plain_size+crypto_aead_chacha20poly1305_ABYTES);
-	if (!cipher) {
-		errno = ENOMEM;
-		ret = KP_ERRNO;
-		goto out;
+static kp_error_t
+kp_storage_unseal(const struct kp_storage_header *header,
+                  const unsigned char *key, unsigned char *plain,
+                  unsigned long long *plain_size, const unsigned char *cipher,
+                  unsigned long long cipher_size)
+{
+	unsigned char ad[KP_STORAGE_HEADER_SIZE];
+	size_t ad_size;
+	int ret;
+
+	ad_size = kp_storage_ad(header, ad);
+
+	switch (header->version == KP_STORAGE_V1
+	        ? KP_STORAGE_CHACHA20POLY1305 : header->cipher) {
+	case KP_STORAGE_CHACHA20POLY1305:
+		ret = crypto_aead_chacha20poly1305_decrypt(plain, plain_size,
+		                                           NULL, cipher,
+		                                           cipher_size,
+		                                           ad, ad_size,
+		                                           header->nonce, key);
+		break;
+	case KP_STORAGE_AES256GCM:
+		/* No software fallback in libsodium, safe is readable from
+		 * a cpu with AES instructions only */
+		if (!crypto_aead_aes256gcm_is_available()) {
+			return KP_ENOAES;
+		}
+		ret = crypto_aead_aes256gcm_decrypt(plain, plain_size,
+		                                    NULL, cipher, cipher_size,
+		                                    ad, ad_size,
+		                                    header->nonce, key);
+		break;
+	case KP_STORAGE_XCHACHA20POLY1305:
+		ret = crypto_aead_xchacha20poly1305_ietf_decrypt(plain,
+		                                                 plain_size,
+		                                                 NULL, cipher,
+		                                                 cipher_size,
+		                                                 ad, ad_size,
+		                                                 header->nonce,
+		                                                 key);
+		break;
+	default:
+		return KP_INVALID_STORAGE;
 	}
 
-	header.version = kp_storage_version;
-	header.sodium_version = SODIUM_LIBRARY_VERSION_MAJOR << 8 |
-		SODIUM_LIBRARY_VERSION_MINOR;
-	header.opslimit = ctx->cfg.opslimit;
-	header.memlimit = ctx->cfg.memlimit;
-	randombytes_buf(header.salt, KP_STORAGE_SALT_SIZE);
-	randombytes_buf(header.nonce, KP_STORAGE_NONCE_SIZE);
+	if (ret != 0) {
+		return KP_EDECRYPT;
+	}
+
+	return KP_SUCCESS;
+}
 
-	kp_storage_header_pack(&header, packed_header);
+/*
+ * Encrypt plain, in version 2 with a new data key wrapped into header. Master
+ * key is taken from target if it matches header.
+ */
+static kp_error_t
+kp_storage_encrypt(struct kp_ctx *ctx, struct kp_storage_header *header,
+                   struct kp_key *target,
+                   const unsigned char *plain, unsigned long long plain_size,
+                   unsigned char *cipher, unsigned long long *cipher_size)
+{
+	kp_error_t ret;
+	unsigned char key[KP_STORAGE_KEY_SIZE];
 
-	if ((ret = kp_storage_encrypt(ctx, &header,
-	                              packed_header, KP_STORAGE_HEADER_SIZE,
-	                              plain, plain_size, cipher, &cipher_size))
-	    != KP_SUCCESS) {
-		goto out;
+	if (header->version == KP_STORAGE_V1) {
+		ret = kp_storage_kek(ctx, header, NULL, target, key);
+	} else {
+		randombytes_buf(key, KP_STORAGE_KEY_SIZE);
+		ret = kp_storage_wrap(ctx, header, target, key);
 	}
 
-	if (write(cipher_fd, packed_header, KP_STORAGE_HEADER_SIZE)
-	    < KP_STORAGE_HEADER_SIZE) {
-		ret = KP_ERRNO;
+	if (ret != KP_SUCCESS) {
 		goto out;
 	}
 
-	if (write(cipher_fd, cipher, cipher_size) < cipher_size) {
-		ret = KP_ERRNO;
+	ret = kp_storage_seal(header, key, plain, plain_size,
+	                      cipher, cipher_size);
+
+out:
+	sodium_memzero(key, sizeof(key));
+
+	return ret;
+}
+
+static kp_error_t
+kp_storage_decrypt(struct kp_ctx *ctx, struct kp_storage_header *header,
+                   unsigned char *plain, unsigned long long *plain_size,
+                   const unsigned char *cipher,
+                   unsigned long long cipher_size)
+{
+	kp_error_t ret;
+	unsigned char key[KP_STORAGE_KEY_SIZE];
+
+	if (header->version == KP_STORAGE_V1) {
+		ret = kp_storage_kek(ctx, header, NULL, NULL, key);
+	} else {
+		ret = kp_storage_unwrap(ctx, header, NULL, NULL, key);
+	}
+
+	if (ret != KP_SUCCESS) {
 		goto out;
 	}
 
+	ret = kp_storage_unseal(header, key, plain, plain_size,
+	                        cipher, cipher_size);
+
+	if (ret == KP_EDECRYPT && header->version == KP_STORAGE_V1) {
+		/* Key might come from a wrong password */
+		kp_kdf_cache_forget(ctx, header->kdf, header->salt,
+		                    header->opslimit, header->memlimit,
+		                    header->parallelism);
+	}
+
 out:
-	close(cipher_fd);
-	sodium_free(plain);
-	free(cipher);
+	sodium_memzero(key, sizeof(key));
 
 	return ret;
 }
 
-kp_error_t
-kp_storage_open(struct kp_ctx *ctx, struct kp_safe *safe)
+static kp_error_t
+kp_storage_read_header(int fd, struct kp_storage_header *header)
 {
-	kp_error_t ret = KP_SUCCESS;
-	int cipher_fd;
-	unsigned char *cipher = NULL, *plain = NULL;
-	unsigned long long cipher_size, plain_size;
-	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
 	unsigned char packed_header[KP_STORAGE_HEADER_SIZE];
-	size_t password_len;
+	size_t header_size;
+	uint16_t version;
 
-	assert(ctx);
-	assert(safe);
+	/* Read common part first, then version specific part */
+	errno = 0;
+	if (read(fd, packed_header, KP_STORAGE_HEADER_SIZE_V1)
+	    != KP_STORAGE_HEADER_SIZE_V1) {
+		if (errno != 0) {
+			return KP_ERRNO;
+		}
+		return KP_INVALID_STORAGE;
+	}
 
-	cipher_fd = openat(ctx->ws_fd, safe->name, O_RDONLY | O_NONBLOCK);
-	if (cipher_fd < 0) {
-		ret = KP_ERRNO;
-		goto out;
+	memcpy(&version, packed_header, sizeof(version));
+	header_size = kp_storage_header_size(betoh16(version));
+	if (header_size == 0) {
+		return KP_INVALID_STORAGE;
 	}
 
 	errno = 0;
-	if (read(cipher_fd, packed_header, KP_STORAGE_HEADER_SIZE)
-	    != KP_STORAGE_HEADER_SIZE) {
+	if (header_size > KP_STORAGE_HEADER_SIZE_V1
+	    && read(fd, &packed_header[KP_STORAGE_HEADER_SIZE_V1],
+	            header_size - KP_STORAGE_HEADER_SIZE_V1)
+	    != (ssize_t)(header_size - KP_STORAGE_HEADER_SIZE_V1)) {
 		if (errno != 0) {
-			ret = KP_ERRNO;
-		} else {
-			ret = KP_INVALID_STORAGE;
+			return KP_ERRNO;
 		}
-		goto out;
+		return KP_INVALID_STORAGE;
 	}
 
-	kp_storage_header_unpack(&header, packed_header);
+	kp_storage_header_unpack(header, packed_header);
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Read header then cipher, allocated to its exact size. Version 2 header
+ * tells plain size, version 1 safe size is what follows its header.
+ */
+static kp_error_t
+kp_storage_read(struct kp_ctx *ctx, int fd, struct kp_storage_header *header,
+                unsigned char **cipher, unsigned long long *cipher_size)
+{
+	kp_error_t ret;
+	struct stat stats;
+	unsigned long long plain_size;
+	ssize_t len;
 
-	/* alloc plain to max size */
-	plain = sodium_malloc(KP_PLAIN_MAX_SIZE);
+	*cipher = NULL;
 
-	/* alloc cipher to max size */
-	cipher = malloc(KP_PLAIN_MAX_SIZE+crypto_aead_chacha20poly1305_ABYTES);
-	cipher_size = read(cipher_fd, cipher,
-	                   KP_PLAIN_MAX_SIZE
-	                   +crypto_aead_chacha20poly1305_ABYTES);
+	if ((ret = kp_storage_read_header(fd, header)) != KP_SUCCESS) {
+		return ret;
+	}
 
-	if (cipher_size <= crypto_aead_chacha20poly1305_ABYTES) {
-		ret = KP_INVALID_STORAGE;
-		goto out;
+	if (header->version == KP_STORAGE_V1) {
+		if (fstat(fd, &stats) != 0) {
+			return KP_ERRNO;
+		}
+		if ((unsigned long long)stats.st_size
+		    <= KP_STORAGE_HEADER_SIZE_V1
+		    + crypto_aead_chacha20poly1305_ABYTES) {
+			return KP_INVALID_STORAGE;
+		}
+		plain_size = stats.st_size - KP_STORAGE_HEADER_SIZE_V1
+		    - crypto_aead_chacha20poly1305_ABYTES;
+	} else {
+		plain_size = header->plain_size;
 	}
 
-	if (cipher_size - crypto_aead_chacha20poly1305_ABYTES
-	    > KP_PLAIN_MAX_SIZE) {
+	if (plain_size == 0) {
+		return KP_INVALID_STORAGE;
+	}
+
+	if (plain_size > ctx->plain_max_size) {
+		errno = EFBIG;
+		return KP_ERRNO;
+	}
+
+	*cipher_size = plain_size + crypto_aead_chacha20poly1305_ABYTES;
+	if ((*cipher = malloc(*cipher_size)) == NULL) {
 		errno = ENOMEM;
-		ret = KP_ERRNO;
-		goto out;
+		return KP_ERRNO;
 	}
 
-	if ((ret = kp_storage_decrypt(ctx, &header,
-	                              packed_header, KP_STORAGE_HEADER_SIZE,
-	                              plain, &plain_size,
-	                              cipher, cipher_size))
-	    != KP_SUCCESS) {
-		goto out;
+	errno = 0;
+	if ((len = read(fd, *cipher, *cipher_size)) < 0) {
+		return KP_ERRNO;
 	}
 
-	strncpy((char *)safe->password, (char *)plain, KP_PASSWORD_MAX_LEN);
-	/* ensure null termination */
-	safe->password[KP_PASSWORD_MAX_LEN-1] = '\0';
-	password_len = strlen((char *)safe->password);
+	if ((unsigned long long)len != *cipher_size) {
+		return KP_INVALID_STORAGE;
+	}
 
-	strncpy((char *)safe->metadata, (char *)&plain[password_len+1], KP_METADATA_MAX_LEN);
-	/* ensure null termination */
-	safe->metadata[KP_METADATA_MAX_LEN-1] = '\0';
+	return KP_SUCCESS;
+}
 
-out:
-	close(cipher_fd);
-	sodium_free(plain);
-	free(cipher);
+static kp_error_t
+kp_storage_write(int fd, const struct kp_storage_header *header,
+                 const unsigned char *cipher, unsigned long long cipher_size)
+{
+	unsigned char packed_header[KP_STORAGE_HEADER_SIZE];
+	size_t header_size;
 
-	return ret;
+	header_size = kp_storage_header_size(header->version);
+	kp_storage_header_pack(header, packed_header);
+
+	if (write(fd, packed_header, header_size) != (ssize_t)header_size) {
+		return KP_ERRNO;
+	}
+
+	if (write(fd, cipher, cipher_size) < cipher_size) {
+		return KP_ERRNO;
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Hidden file next to the safe, so that it is replaced by a rename. Random
+ * suffix keeps concurrent writers of the same safe apart.
+ */
+static kp_error_t
+kp_storage_tmpname(const char *name, const char *suffix, char *tmp,
+                   size_t size)
+{
+	const char *base;
+	int len;
+
+	base = strrchr(name, '/');
+	base = base == NULL ? name : base + 1;
+
+	len = snprintf(tmp, size, "%.*s.%s.%s.tmp", (int)(base - name), name,
+	               base, suffix);
+	if (len < 0 || (size_t)len >= size) {
+		errno = ENAMETOOLONG;
+		return KP_ERRNO;
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Pick a random suffix of KP_STORAGE_SUFFIX_SIZE, terminating nul included.
+ */
+static void
+kp_storage_suffix(char *suffix)
+{
+	unsigned char bytes[(KP_STORAGE_SUFFIX_SIZE - 1) / 2];
+
+	randombytes_buf(bytes, sizeof(bytes));
+	sodium_bin2hex(suffix, KP_STORAGE_SUFFIX_SIZE, bytes, sizeof(bytes));
+}
+
+/*
+ * Directory holding safe, relative to workspace.
+ */
+static kp_error_t
+kp_storage_dirname(const char *name, char *dir, size_t size)
+{
+	const char *base;
+	int len;
+
+	if ((base = strrchr(name, '/')) == NULL) {
+		len = snprintf(dir, size, ".");
+	} else {
+		len = snprintf(dir, size, "%.*s", (int)(base - name), name);
+	}
+	if (len < 0 || (size_t)len >= size) {
+		errno = ENAMETOOLONG;
+		return KP_ERRNO;
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * File the new version of safe is written to. It is anonymous where the
+ * system allows it, so that nothing is left behind by a crash, otherwise it
+ * has a temporary name of safe, whose suffix is set.
+ */
+static kp_error_t
+kp_storage_create(struct kp_ctx *ctx, const char *name, int *fd,
+                  char *suffix)
+{
+#ifdef O_TMPFILE
+	kp_error_t ret;
+	char path[PATH_MAX];
+
+	if ((ret = kp_storage_dirname(name, path, PATH_MAX)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	*fd = openat(ctx->ws_fd, path, O_TMPFILE | O_WRONLY | O_CLOEXEC,
+	             S_IRUSR | S_IWUSR);
+	if (*fd >= 0) {
+		suffix[0] = '\0';
+		return KP_SUCCESS;
+	}
+
+	/* Kernel or file system without anonymous files */
+	if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+		return KP_ERRNO;
+	}
+#endif
+
+	return kp_storage_mktemp(ctx, name, fd, suffix);
+}
+
+/*
+ * Create a file under a temporary name of safe no one else holds, and set
+ * its suffix.
+ */
+static kp_error_t
+kp_storage_mktemp(struct kp_ctx *ctx, const char *name, int *fd,
+                  char *suffix)
+{
+	kp_error_t ret;
+	char tmp[PATH_MAX];
+	int retry;
+
+	for (retry = 0; retry < KP_STORAGE_TMP_RETRY; retry++) {
+		kp_storage_suffix(suffix);
+		if ((ret = kp_storage_tmpname(name, suffix, tmp, PATH_MAX))
+		    != KP_SUCCESS) {
+			break;
+		}
+
+		*fd = openat(ctx->ws_fd, tmp,
+		             O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		             S_IRUSR | S_IWUSR);
+		if (*fd >= 0) {
+			return KP_SUCCESS;
+		}
+
+		ret = KP_ERRNO;
+		if (errno != EEXIST) {
+			break;
+		}
+	}
+
+	suffix[0] = '\0';
+	return ret;
+}
+
+/*
+ * Give anonymous file fd a temporary name of safe no one else holds, and set
+ * its suffix. Names already taken are left to their owner.
+ */
+static kp_error_t
+kp_storage_link(struct kp_ctx *ctx, int fd, const char *name, char *suffix)
+{
+#ifdef O_TMPFILE
+	kp_error_t ret;
+	char proc[32], tmp[PATH_MAX];
+	int retry;
+
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+
+	for (retry = 0; retry < KP_STORAGE_TMP_RETRY; retry++) {
+		kp_storage_suffix(suffix);
+		if ((ret = kp_storage_tmpname(name, suffix, tmp, PATH_MAX))
+		    != KP_SUCCESS) {
+			break;
+		}
+
+		if (linkat(AT_FDCWD, proc, ctx->ws_fd, tmp,
+		           AT_SYMLINK_FOLLOW) == 0) {
+			return KP_SUCCESS;
+		}
+
+		/* Without /proc, needs CAP_DAC_READ_SEARCH */
+		if (errno == ENOENT
+		    && linkat(fd, "", ctx->ws_fd, tmp, AT_EMPTY_PATH) == 0) {
+			return KP_SUCCESS;
+		}
+
+		ret = KP_ERRNO;
+		if (errno != EEXIST) {
+			break;
+		}
+	}
+
+	suffix[0] = '\0';
+	return ret;
+#else
+	errno = ENOTSUP;
+	return KP_ERRNO;
+#endif
+}
+
+/*
+ * Replace safe with written file fd, linked to the temporary name suffix
+ * tells, if any. That name is gone once done, whatever the result.
+ */
+static kp_error_t
+kp_storage_publish(struct kp_ctx *ctx, int fd, const char *name,
+                   char *suffix)
+{
+	kp_error_t ret;
+	char tmp[PATH_MAX];
+
+	if (suffix[0] == '\0'
+	    && (ret = kp_storage_link(ctx, fd, name, suffix)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = kp_storage_tmpname(name, suffix, tmp, PATH_MAX))
+	    != KP_SUCCESS) {
+		return ret;
+	}
+
+	if (renameat(ctx->ws_fd, tmp, ctx->ws_fd, name) != 0) {
+		ret = KP_ERRNO;
+		unlinkat(ctx->ws_fd, tmp, 0);
+		return ret;
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Sync directory of safe, so that its replacement survives a crash.
+ */
+static kp_error_t
+kp_storage_sync_dir(struct kp_ctx *ctx, const char *name)
+{
+	kp_error_t ret = KP_SUCCESS;
+	char dir[PATH_MAX];
+	int fd;
+
+	if ((ret = kp_storage_dirname(name, dir, PATH_MAX)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((fd = openat(ctx->ws_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+	    < 0) {
+		return KP_ERRNO;
+	}
+
+	if (fsync(fd) != 0) {
+		ret = KP_ERRNO;
+	}
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Drop written file fd, safe is left as it was.
+ */
+static void
+kp_storage_discard(struct kp_ctx *ctx, int fd, const char *name,
+                   const char *suffix)
+{
+	char tmp[PATH_MAX];
+
+	if (suffix[0] != '\0'
+	    && kp_storage_tmpname(name, suffix, tmp, PATH_MAX) == KP_SUCCESS) {
+		unlinkat(ctx->ws_fd, tmp, 0);
+	}
+	close(fd);
+}
+
+/*
+ * Replace safe with written file fd, synced as ctx tells, or later along
+ * with its batch. Takes fd over, whatever the result.
+ */
+static kp_error_t
+kp_storage_replace(struct kp_ctx *ctx, int fd, const char *name,
+                   char *suffix)
+{
+	kp_error_t ret;
+
+	if (ctx->batch != NULL && ctx->sync != KP_SYNC_NONE) {
+		return kp_storage_batch_add(ctx, fd, name, suffix);
+	}
+
+	if (ctx->sync >= KP_SYNC_FILE && fsync(fd) != 0) {
+		ret = KP_ERRNO;
+		kp_storage_discard(ctx, fd, name, suffix);
+		return ret;
+	}
+
+	if ((ret = kp_storage_publish(ctx, fd, name, suffix)) != KP_SUCCESS) {
+		close(fd);
+		return ret;
+	}
+	close(fd);
+
+	if (ctx->sync >= KP_SYNC_DIR) {
+		return kp_storage_sync_dir(ctx, name);
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Identify safe file fd, whose header was read or written.
+ */
+static kp_error_t
+kp_storage_identify(int fd, const struct kp_storage_header *header,
+                    struct kp_safe_id *id)
+{
+	struct stat stats;
+
+	if (fstat(fd, &stats) != 0) {
+		return KP_ERRNO;
+	}
+
+	memset(id, 0, sizeof(struct kp_safe_id));
+	id->dev = stats.st_dev;
+	id->ino = stats.st_ino;
+	id->size = stats.st_size;
+#ifdef HAS_STAT_MTIM
+	id->mtime = (int64_t)stats.st_mtim.tv_sec * 1000000000
+	          + stats.st_mtim.tv_nsec;
+#else
+	id->mtime = (int64_t)stats.st_mtime * 1000000000;
+#endif
+	memcpy(id->nonce, header->nonce, sizeof(id->nonce));
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Write safe to a new file replacing the previous version at once, so that
+ * an interrupted save leaves either of them.
+ */
+kp_error_t
+kp_storage_save(struct kp_ctx *ctx, struct kp_safe *safe)
+{
+	kp_error_t ret = KP_SUCCESS;
+	int cipher_fd = -1;
+	char suffix[KP_STORAGE_SUFFIX_SIZE];
+	unsigned char *cipher = NULL, *plain = NULL;
+	unsigned long long cipher_size, plain_size;
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+	size_t password_len, metadata_len;
+
+	assert(ctx);
+	assert(safe);
+	assert(safe->open == true);
+
+	password_len = strlen(safe->password);
+	metadata_len = strlen(safe->metadata);
+	if (password_len + metadata_len + 2 > ctx->plain_max_size) {
+		errno = EFBIG;
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	/* construct full plain */
+	/* plain is password + '\0' + metadata + '\0' */
+	plain_size = password_len + metadata_len + 2;
+	plain = kp_slab_alloc(plain_size);
+	if (!plain) {
+		errno = ENOMEM;
+		ret = KP_ERRNO;
+		goto out;
+	}
+	memcpy(plain, safe->password, password_len + 1);
+	memcpy(&plain[password_len+1], safe->metadata, metadata_len + 1);
+
+	cipher = malloc(plain_size+crypto_aead_chacha20poly1305_ABYTES);
+	if (!cipher) {
+		errno = ENOMEM;
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	kp_storage_header_init(ctx, &header);
+	header.plain_size = plain_size;
+
+	if ((ret = kp_storage_encrypt(ctx, &header, NULL, plain, plain_size,
+	                              cipher, &cipher_size)) != KP_SUCCESS) {
+		goto out;
+	}
+
+	if ((ret = kp_storage_create(ctx, safe->name, &cipher_fd, suffix))
+	    != KP_SUCCESS) {
+		goto out;
+	}
+
+	if ((ret = kp_storage_write(cipher_fd, &header, cipher, cipher_size))
+	    != KP_SUCCESS
+	    || (ret = kp_storage_identify(cipher_fd, &header, &safe->id))
+	       != KP_SUCCESS) {
+		kp_storage_discard(ctx, cipher_fd, safe->name, suffix);
+		goto out;
+	}
+
+	ret = kp_storage_replace(ctx, cipher_fd, safe->name, suffix);
+
+out:
+	kp_slab_free(plain);
+	free(cipher);
+
+	return ret;
+}
+
+kp_error_t
+kp_storage_open(struct kp_ctx *ctx, struct kp_safe *safe)
+{
+	kp_error_t ret = KP_SUCCESS;
+	int cipher_fd;
+	unsigned char *cipher = NULL, *plain = NULL;
+	unsigned long long cipher_size, plain_size;
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+	size_t password_len;
+	char **password;
+	char **metadata;
+
+	assert(ctx);
+	assert(safe);
+
+	cipher_fd = openat(ctx->ws_fd, safe->name, O_RDONLY | O_NONBLOCK);
+	if (cipher_fd < 0) {
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	if ((ret = kp_storage_read(ctx, cipher_fd, &header, &cipher,
+	                           &cipher_size)) != KP_SUCCESS) {
+		goto out;
+	}
+
+	/* Safe takes plain over, alloc it to the exact size */
+	plain = kp_slab_alloc(cipher_size - crypto_aead_chacha20poly1305_ABYTES);
+	if (!plain) {
+		errno = ENOMEM;
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	if ((ret = kp_storage_decrypt(ctx, &header,
+	                              plain, &plain_size,
+	                              cipher, cipher_size))
+	    != KP_SUCCESS) {
+		goto out;
+	}
+
+	/* plain is password + '\0' + metadata + '\0' */
+	password_len = strnlen((char *)plain, plain_size);
+	if (password_len + 1 >= plain_size) {
+		ret = KP_INVALID_STORAGE;
+		goto out;
+	}
+	/* ensure null termination */
+	plain[plain_size-1] = '\0';
+
+	kp_slab_free(safe->password);
+
+	password = (char **)&safe->password;
+	metadata = (char **)&safe->metadata;
+
+	*password = (char *)plain;
+	*metadata = (char *)&plain[password_len+1];
+	plain = NULL;
+
+	ret = kp_storage_identify(cipher_fd, &header, &safe->id);
+
+out:
+	close(cipher_fd);
+	kp_slab_free(plain);
+	free(cipher);
+
+	return ret;
+}
+
+/*
+ * Tell which kdf parameters safe key derives from, and whether they are the
+ * ones of current workspace config.
+ */
+kp_error_t
+kp_storage_peek(struct kp_ctx *ctx, const char *name,
+                struct kp_kdf_params *params, bool *current)
+{
+	kp_error_t ret;
+	int fd;
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+
+	assert(ctx);
+	assert(name);
+	assert(params);
+	assert(current);
+
+	if ((fd = openat(ctx->ws_fd, name, O_RDONLY | O_NONBLOCK)) < 0) {
+		return KP_ERRNO;
+	}
+
+	ret = kp_storage_read_header(fd, &header);
+	close(fd);
+	if (ret != KP_SUCCESS) {
+		return ret;
+	}
+
+	params->kdf = header.kdf;
+	params->opslimit = header.opslimit;
+	params->memlimit = header.memlimit;
+	params->parallelism = header.parallelism;
+	memcpy(params->salt, header.salt, KP_KDF_SALT_SIZE);
+	*current = kp_storage_header_current(ctx, &header);
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Identify safe name relative to directory dirfd, as it is now on disk.
+ */
+kp_error_t
+kp_storage_id(int dirfd, const char *name, struct kp_safe_id *id)
+{
+	kp_error_t ret;
+	int fd;
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+
+	assert(name);
+	assert(id);
+
+	if ((fd = openat(dirfd, name, O_RDONLY | O_NONBLOCK)) < 0) {
+		return KP_ERRNO;
+	}
+
+	if ((ret = kp_storage_read_header(fd, &header)) == KP_SUCCESS) {
+		ret = kp_storage_identify(fd, &header, id);
+	}
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Read safe header and file attributes, with a single read of the largest
+ * header size whatever the safe version.
+ */
+kp_error_t
+kp_storage_stat(struct kp_ctx *ctx, const char *name,
+                struct kp_safe_stat *stat)
+{
+	kp_error_t ret = KP_SUCCESS;
+	int fd;
+	unsigned char packed_header[KP_STORAGE_HEADER_SIZE];
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+	struct stat stats;
+	size_t header_size;
+	ssize_t len;
+	uint16_t version;
+
+	assert(ctx);
+	assert(name);
+	assert(stat);
+
+	if ((fd = openat(ctx->ws_fd, name, O_RDONLY | O_NONBLOCK)) < 0) {
+		return KP_ERRNO;
+	}
+
+	if (fstat(fd, &stats) != 0) {
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	if ((len = pread(fd, packed_header, KP_STORAGE_HEADER_SIZE, 0)) < 0) {
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	if (len < KP_STORAGE_HEADER_SIZE_V1) {
+		ret = KP_INVALID_STORAGE;
+		goto out;
+	}
+
+	memcpy(&version, packed_header, sizeof(version));
+	header_size = kp_storage_header_size(betoh16(version));
+	if (header_size == 0 || (size_t)len < header_size) {
+		ret = KP_INVALID_STORAGE;
+		goto out;
+	}
+
+	kp_storage_header_unpack(&header, packed_header);
+
+	stat->version = header.version;
+	stat->kdf = header.kdf;
+	stat->opslimit = header.opslimit;
+	stat->memlimit = header.memlimit;
+	stat->parallelism = header.parallelism;
+	stat->size = stats.st_size - header_size;
+	stat->mtime = stats.st_mtime;
+
+out:
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Wrap safe data key again according to current workspace config, leaving
+ * payload untouched. Data key is unwrapped with old_password, whose master key
+ * is taken from old or ctx cache when already derived, see kp_storage_kek.
+ * It is wrapped again with master key in target, or the cached one.
+ * Safes still in version 1 are decrypted with old_password and upgraded.
+ * Safe is atomically replaced, thus an interrupted rewrap leaves either the
+ * old or the new safe.
+ */
+kp_error_t
+kp_storage_rewrap(struct kp_ctx *ctx, const char *name,
+                  const char *old_password, struct kp_key *old,
+                  struct kp_key *target)
+{
+	kp_error_t ret = KP_SUCCESS;
+	int cipher_fd, tmp_fd;
+	char suffix[KP_STORAGE_SUFFIX_SIZE];
+	unsigned char *cipher = NULL, *plain = NULL;
+	unsigned long long cipher_size, plain_size;
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+	unsigned char key[KP_STORAGE_KEY_SIZE];
+	unsigned char nonce[KP_STORAGE_NONCE_SIZE_V2];
+	uint16_t cipher_id;
+
+	assert(ctx);
+	assert(name);
+	assert(old_password);
+
+	cipher_fd = openat(ctx->ws_fd, name, O_RDONLY | O_NONBLOCK);
+	if (cipher_fd < 0) {
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	if ((ret = kp_storage_read(ctx, cipher_fd, &header, &cipher,
+	                           &cipher_size)) != KP_SUCCESS) {
+		goto out;
+	}
+
+	switch (header.version) {
+	case KP_STORAGE_V1:
+		if ((ret = kp_storage_kek(ctx, &header, old_password, old,
+		                          key)) != KP_SUCCESS) {
+			goto out;
+		}
+
+		plain = kp_slab_alloc(cipher_size
+		                      - crypto_aead_chacha20poly1305_ABYTES);
+		if (!plain) {
+			errno = ENOMEM;
+			ret = KP_ERRNO;
+			goto out;
+		}
+		if ((ret = kp_storage_unseal(&header, key, plain, &plain_size,
+		                             cipher, cipher_size))
+		    != KP_SUCCESS) {
+			goto out;
+		}
+
+		kp_storage_header_init(ctx, &header);
+		header.plain_size = plain_size;
+		if ((ret = kp_storage_encrypt(ctx, &header, target, plain,
+		                              plain_size, cipher, &cipher_size))
+		    != KP_SUCCESS) {
+			goto out;
+		}
+		break;
+	case KP_STORAGE_V2:
+		if (kp_storage_header_current(ctx, &header)) {
+			/* Already done by an interrupted rewrap */
+			if (ctx->batch != NULL) {
+				kp_storage_batch_done(ctx->batch, name,
+				                      KP_SUCCESS, 0);
+			}
+			goto out;
+		}
+
+		if ((ret = kp_storage_unwrap(ctx, &header, old_password, old,
+		                             key)) != KP_SUCCESS) {
+			goto out;
+		}
+
+		/* Payload is authenticated with its cipher and nonce */
+		memcpy(nonce, header.nonce, KP_STORAGE_NONCE_SIZE_V2);
+		cipher_id = header.cipher;
+		plain_size = header.plain_size;
+		kp_storage_header_init(ctx, &header);
+		memcpy(header.nonce, nonce, KP_STORAGE_NONCE_SIZE_V2);
+		header.cipher = cipher_id;
+		header.plain_size = plain_size;
+
+		if ((ret = kp_storage_wrap(ctx, &header, target, key))
+		    != KP_SUCCESS) {
+			goto out;
+		}
+		break;
+	default:
+		ret = KP_INVALID_STORAGE;
+		goto out;
+	}
+
+	if ((ret = kp_storage_create(ctx, name, &tmp_fd, suffix))
+	    != KP_SUCCESS) {
+		goto out;
+	}
+
+	if ((ret = kp_storage_write(tmp_fd, &header, cipher, cipher_size))
+	    != KP_SUCCESS) {
+		kp_storage_discard(ctx, tmp_fd, name, suffix);
+		goto out;
+	}
+
+	ret = kp_storage_replace(ctx, tmp_fd, name, suffix);
+
+out:
+	close(cipher_fd);
+	sodium_memzero(key, sizeof(key));
+	kp_slab_free(plain);
+	free(cipher);
+
+	return ret;
+}
+
+/*
+ * Write safes along with batch from now on, until kp_storage_batch_commit.
+ * Once a safe successfully written or rewrapped meanwhile is synced and
+ * replaced, or failed to, cb is given its name and outcome. It might be called
+ * by any thread writing a safe.
+ */
+kp_error_t
+kp_storage_batch_begin(struct kp_ctx *ctx, struct kp_storage_batch *batch,
+                       void (*cb)(const char *, kp_error_t, void *),
+                       void *arg)
+{
+	assert(ctx);
+	assert(batch);
+	assert(ctx->batch == NULL);
+
+	batch->npending = 0;
+	batch->ret = KP_SUCCESS;
+	batch->err_no = 0;
+	batch->cb = cb;
+	batch->arg = arg;
+	if ((errno = pthread_mutex_init(&batch->lock, NULL)) != 0) {
+		return KP_ERRNO;
+	}
+
+	ctx->batch = batch;
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Sync and replace pending safes, and end batch. Returns first error of the
+ * whole batch, safes it concerns are left as they were.
+ */
+kp_error_t
+kp_storage_batch_commit(struct kp_ctx *ctx)
+{
+	kp_error_t ret;
+	struct kp_storage_batch *batch = ctx->batch;
+
+	assert(batch);
+
+	ctx->batch = NULL;
+
+	ret = kp_storage_batch_flush(ctx, batch, batch->pending,
+	                             batch->npending);
+	batch->npending = 0;
+	pthread_mutex_destroy(&batch->lock);
+
+	if (batch->ret != KP_SUCCESS) {
+		errno = batch->err_no;
+		return batch->ret;
+	}
+
+	return ret;
+}
+
+/*
+ * Pend written file fd, syncing the whole batch once full. Takes fd over.
+ */
+static kp_error_t
+kp_storage_batch_add(struct kp_ctx *ctx, int fd, const char *name,
+                     const char *suffix)
+{
+	kp_error_t ret;
+	struct kp_storage_batch *batch = ctx->batch;
+	struct kp_storage_pending full[KP_STORAGE_BATCH_MAX];
+	char *copy;
+
+	if ((copy = strdup(name)) == NULL) {
+		kp_storage_discard(ctx, fd, name, suffix);
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	pthread_mutex_lock(&batch->lock);
+	batch->pending[batch->npending].fd = fd;
+	batch->pending[batch->npending].name = copy;
+	strlcpy(batch->pending[batch->npending].suffix, suffix,
+	        KP_STORAGE_SUFFIX_SIZE);
+	if (++batch->npending < KP_STORAGE_BATCH_MAX) {
+		pthread_mutex_unlock(&batch->lock);
+		return KP_SUCCESS;
+	}
+
+	/* Others keep pending while this one syncs */
+	memcpy(full, batch->pending, sizeof(full));
+	batch->npending = 0;
+	pthread_mutex_unlock(&batch->lock);
+
+	if ((ret = kp_storage_batch_flush(ctx, batch, full,
+	                                  KP_STORAGE_BATCH_MAX))
+	    != KP_SUCCESS) {
+		pthread_mutex_lock(&batch->lock);
+		if (batch->ret == KP_SUCCESS) {
+			batch->ret = ret;
+			batch->err_no = errno;
+		}
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Sync every file, replace their safe, then sync each directory once. Safes of
+ * a directory which failed to sync are reported as failed, their replacement
+ * might not survive a crash.
+ */
+static kp_error_t
+kp_storage_batch_flush(struct kp_ctx *ctx, struct kp_storage_batch *batch,
+                       struct kp_storage_pending *pending, size_t n)
+{
+	kp_error_t ret = KP_SUCCESS, err;
+	kp_error_t outcome[KP_STORAGE_BATCH_MAX];
+	int errnos[KP_STORAGE_BATCH_MAX];
+	int err_no = 0;
+	size_t i, j;
+	bool synced;
+
+	for (i = 0; i < n; i++) {
+		if (fsync(pending[i].fd) != 0) {
+			err = KP_ERRNO;
+		} else {
+			err = kp_storage_publish(ctx, pending[i].fd,
+			                         pending[i].name, pending[i].suffix);
+			pending[i].suffix[0] = '\0';
+		}
+		outcome[i] = err;
+		errnos[i] = errno;
+		if (err != KP_SUCCESS) {
+			if (ret == KP_SUCCESS) {
+				ret = err;
+				err_no = errno;
+			}
+			kp_storage_discard(ctx, pending[i].fd, pending[i].name,
+			                   pending[i].suffix);
+			continue;
+		}
+		close(pending[i].fd);
+	}
+
+	for (i = 0; ctx->sync >= KP_SYNC_DIR && i < n; i++) {
+		if (outcome[i] != KP_SUCCESS) {
+			continue;
+		}
+
+		/* Directory already synced for an earlier safe */
+		synced = false;
+		for (j = 0; j < i && !synced; j++) {
+			synced = outcome[j] == KP_SUCCESS
+			      && kp_storage_same_dir(pending[j].name,
+			                             pending[i].name);
+		}
+		if (synced) {
+			continue;
+		}
+
+		if ((err = kp_storage_sync_dir(ctx, pending[i].name))
+		    != KP_SUCCESS) {
+			if (ret == KP_SUCCESS) {
+				ret = err;
+				err_no = errno;
+			}
+			for (j = i; j < n; j++) {
+				if (kp_storage_same_dir(pending[i].name,
+				                        pending[j].name)) {
+					outcome[j] = err;
+					errnos[j] = errno;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		kp_storage_batch_done(batch, pending[i].name, outcome[i],
+		                      errnos[i]);
+		free(pending[i].name);
+	}
+
+	errno = err_no;
+	return ret;
+}
+
+/*
+ * Give outcome of a batched safe to batch callback, along with its errno.
+ */
+static void
+kp_storage_batch_done(struct kp_storage_batch *batch, const char *name,
+                      kp_error_t ret, int err_no)
+{
+	int saved = errno;
+
+	if (batch->cb != NULL) {
+		errno = err_no;
+		batch->cb(name, ret, batch->arg);
+	}
+
+	errno = saved;
+}
+
+/*
+ * Whether safes a and b are in the same directory.
+ */
+static bool
+kp_storage_same_dir(const char *a, const char *b)
+{
+	size_t len;
+
+	len = strrchr(a, '/') == NULL ? 0 : strrchr(a, '/') - a + 1;
+
+	return strncmp(a, b, len) == 0 && strchr(b + len, '/') == NULL;
 }
@@ -23,5 +23,12 @@
 
 kp_error_t kp_storage_open(struct kp_ctx *, struct kp_safe *);
 kp_error_t kp_storage_save(struct kp_ctx *, struct kp_safe *);
+kp_error_t kp_storage_rewrap(struct kp_ctx *, const char *, const char *,
+                             struct kp_key *, struct kp_key *);
+kp_error_t kp_storage_peek(struct kp_ctx *, const char *,
+                           struct kp_kdf_params *, bool *);
+kp_error_t kp_storage_stat(struct kp_ctx *, const char *,
+                           struct kp_safe_stat *);
+kp_error_t kp_storage_id(int, const char *, struct kp_safe_id *);
 
 #endif /* KP_STORAGE_H */
@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kickpass.h"
+
+/* Availability comes from kickpass config */
+#ifdef HAS_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+
+#ifdef HAS_INOTIFY
+
+/*
+ * Safes are replaced by a rename, or written in place by older versions.
+ */
+#define KP_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                       | IN_CLOSE_WRITE | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+#define KP_WATCH_BUF_SIZE 4096
+
+static kp_error_t kp_watch_scan(struct kp_watch *, const char *);
+static kp_error_t kp_watch_add(struct kp_watch *, int, const char *);
+static void kp_watch_forget(struct kp_watch *, const char *);
+static kp_error_t kp_watch_reset(struct kp_watch *);
+static kp_error_t kp_watch_event(struct kp_watch *,
+                                 const struct inotify_event *);
+static kp_error_t kp_watch_join(char *, const char *, const char *);
+
+kp_error_t
+kp_watch_init(struct kp_watch *watch, const char *root, kp_watch_cb cb,
+              void *arg)
+{
+	kp_error_t ret;
+	int err;
+
+	assert(watch);
+	assert(root);
+	assert(cb);
+
+	watch->fd = -1;
+	watch->dirs = NULL;
+	watch->ndirs = 0;
+	watch->cb = cb;
+	watch->arg = arg;
+
+	if (strlcpy(watch->root, root, PATH_MAX) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return KP_ERRNO;
+	}
+
+	if ((watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		return KP_ERRNO;
+	}
+
+	if ((ret = kp_watch_scan(watch, "")) != KP_SUCCESS) {
+		err = errno;
+		kp_watch_fini(watch);
+		errno = err;
+		return ret;
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Handle pending events, never blocks. Once it failed, safes may have been
+ * missed and watch should not be trusted anymore.
+ */
+kp_error_t
+kp_watch_read(struct kp_watch *watch)
+{
+	kp_error_t ret;
+	char buf[KP_WATCH_BUF_SIZE]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t n, off;
+
+	assert(watch);
+
+	for (;;) {
+		if ((n = read(watch->fd, buf, sizeof(buf))) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				return KP_SUCCESS;
+			}
+			return KP_ERRNO;
+		}
+
+		for (off = 0; off < n;
+		     off += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)&buf[off];
+			if ((ret = kp_watch_event(watch, event)) != KP_SUCCESS) {
+				return ret;
+			}
+		}
+	}
+}
+
+void
+kp_watch_fini(struct kp_watch *watch)
+{
+	size_t i;
+
+	assert(watch);
+
+	/* Closing removes every watch */
+	if (watch->fd >= 0) {
+		close(watch->fd);
+		watch->fd = -1;
+	}
+
+	for (i = 0; i < watch->ndirs; i++) {
+		free(watch->dirs[i]);
+	}
+	free(watch->dirs);
+	watch->dirs = NULL;
+	watch->ndirs = 0;
+}
+
+/*
+ * Watch directory, then add every safe below it. Watching before reading
+ * directory ensures nothing created meanwhile is missed, at worst a safe is
+ * added twice.
+ */
+static kp_error_t
+kp_watch_scan(struct kp_watch *watch, const char *dir)
+{
+	kp_error_t ret = KP_SUCCESS;
+	char path[PATH_MAX], name[PATH_MAX];
+	struct dirent *dirent;
+	struct stat sb;
+	DIR *dirp;
+	int wd, err;
+
+	if ((ret = kp_watch_join(path, watch->root, dir)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((wd = inotify_add_watch(watch->fd, path, KP_WATCH_MASK)) < 0) {
+		goto gone;
+	}
+
+	if ((ret = kp_watch_add(watch, wd, dir)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((dirp = opendir(path)) == NULL) {
+		goto gone;
+	}
+
+	while ((dirent = readdir(dirp)) != NULL) {
+		unsigned char type = dirent->d_type;
+
+		if (dirent->d_name[0] == '.') {
+			continue;
+		}
+
+		if ((ret = kp_watch_join(name, dir, dirent->d_name))
+		    != KP_SUCCESS) {
+			break;
+		}
+
+		if (type == DT_UNKNOWN) {
+			if (fstatat(dirfd(dirp), dirent->d_name, &sb,
+			            AT_SYMLINK_NOFOLLOW) < 0) {
+				continue;
+			}
+			type = S_ISDIR(sb.st_mode) ? DT_DIR
+			     : S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		switch (type) {
+		case DT_DIR:
+			ret = kp_watch_scan(watch, name);
+			break;
+		case DT_REG:
+			ret = watch->cb(KP_WATCH_ADD, name, watch->arg);
+			break;
+		}
+
+		if (ret != KP_SUCCESS) {
+			break;
+		}
+	}
+
+	err = errno;
+	closedir(dirp);
+	errno = err;
+
+	return ret;
+
+gone:
+	/* Directory removed before it could be read, its parent reports it */
+	if (dir[0] != '\0' && (errno == ENOENT || errno == ENOTDIR)) {
+		return KP_SUCCESS;
+	}
+
+	return KP_ERRNO;
+}
+
+/*
+ * Remember path of directory watched as wd. Watch descriptors are small
+ * integers, they index directories.
+ */
+static kp_error_t
+kp_watch_add(struct kp_watch *watch, int wd, const char *dir)
+{
+	char **dirs, *copy;
+
+	if ((copy = strdup(dir)) == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	if ((size_t)wd >= watch->ndirs) {
+		if ((dirs = reallocarray(watch->dirs, wd + 1, sizeof(char *)))
+		    == NULL) {
+			free(copy);
+			errno = ENOMEM;
+			return KP_ERRNO;
+		}
+		memset(&dirs[watch->ndirs], 0,
+		       (wd + 1 - watch->ndirs) * sizeof(char *));
+		watch->dirs = dirs;
+		watch->ndirs = wd + 1;
+	}
+
+	/* Directory already watched gets its current path */
+	free(watch->dirs[wd]);
+	watch->dirs[wd] = copy;
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Stop watching dir and directories below it, every one of them if dir is
+ * empty. Their paths no longer hold once moved or removed.
+ */
+static void
+kp_watch_forget(struct kp_watch *watch, const char *dir)
+{
+	size_t i, len = strlen(dir);
+
+	for (i = 0; i < watch->ndirs; i++) {
+		if (watch->dirs[i] == NULL) {
+			continue;
+		}
+
+		if (len > 0 && (strncmp(watch->dirs[i], dir, len) != 0
+		    || (watch->dirs[i][len] != '\0'
+		        && watch->dirs[i][len] != '/'))) {
+			continue;
+		}
+
+		inotify_rm_watch(watch->fd, i);
+		free(watch->dirs[i]);
+		watch->dirs[i] = NULL;
+	}
+}
+
+/*
+ * Events were lost, start over from a fresh scan.
+ */
+static kp_error_t
+kp_watch_reset(struct kp_watch *watch)
+{
+	kp_error_t ret;
+
+	kp_watch_forget(watch, "");
+
+	if ((ret = watch->cb(KP_WATCH_RESET, "", watch->arg)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	return kp_watch_scan(watch, "");
+}
+
+static kp_error_t
+kp_watch_event(struct kp_watch *watch, const struct inotify_event *event)
+{
+	kp_error_t ret;
+	char name[PATH_MAX], path[PATH_MAX];
+	struct stat sb;
+	const char *dir;
+
+	if (event->mask & IN_Q_OVERFLOW) {
+		return kp_watch_reset(watch);
+	}
+
+	/* Directory forgotten already */
+	if (event->wd < 0 || (size_t)event->wd >= watch->ndirs
+	    || (dir = watch->dirs[event->wd]) == NULL) {
+		return KP_SUCCESS;
+	}
+
+	if (event->mask & IN_IGNORED) {
+		/* Workspace itself is gone */
+		if (dir[0] == '\0') {
+			errno = ENOENT;
+			return KP_ERRNO;
+		}
+		free(watch->dirs[event->wd]);
+		watch->dirs[event->wd] = NULL;
+		return KP_SUCCESS;
+	}
+
+	if (event->len == 0 || event->name[0] == '.') {
+		return KP_SUCCESS;
+	}
+
+	if ((ret = kp_watch_join(name, dir, event->name)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		if (event->mask & IN_ISDIR) {
+			kp_watch_forget(watch, name);
+		}
+		return watch->cb(KP_WATCH_REMOVE, name, watch->arg);
+	}
+
+	if (event->mask & IN_ISDIR) {
+		return kp_watch_scan(watch, name);
+	}
+
+	/* Only regular files are safes */
+	if ((ret = kp_watch_join(path, watch->root, name)) != KP_SUCCESS) {
+		return ret;
+	}
+	if (fstatat(AT_FDCWD, path, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+		return errno == ENOENT ? KP_SUCCESS : KP_ERRNO;
+	}
+	if (!S_ISREG(sb.st_mode)) {
+		return KP_SUCCESS;
+	}
+
+	return watch->cb(KP_WATCH_ADD, name, watch->arg);
+}
+
+/*
+ * Path of name in dir, name itself if dir is empty.
+ */
+static kp_error_t
+kp_watch_join(char *path, const char *dir, const char *name)
+{
+	int len;
+
+	if (dir[0] == '\0') {
+		len = snprintf(path, PATH_MAX, "%s", name);
+	} else if (name[0] == '\0') {
+		len = snprintf(path, PATH_MAX, "%s", dir);
+	} else {
+		len = snprintf(path, PATH_MAX, "%s/%s", dir, name);
+	}
+
+	if (len < 0 || len >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return KP_ERRNO;
+	}
+
+	return KP_SUCCESS;
+}
+
+#else /* HAS_INOTIFY */
+
+kp_error_t
+kp_watch_init(struct kp_watch *watch, const char *root, kp_watch_cb cb,
+              void *arg)
+{
+	watch->fd = -1;
+	watch->dirs = NULL;
+	watch->ndirs = 0;
+
+	errno = ENOTSUP;
+	return KP_ERRNO;
+}
+
+kp_error_t
+kp_watch_read(struct kp_watch *watch)
+{
+	return KP_SUCCESS;
+}
+
+void
+kp_watch_fini(struct kp_watch *watch)
+{
+}
+
+#endif /* HAS_INOTIFY */
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef KP_WATCH_H
+#define KP_WATCH_H
+
+#include <limits.h>
+#include <stddef.h>
+
+#include "kickpass.h"
+
+enum kp_watch_event {
+	KP_WATCH_ADD,    /* safe appeared, or was written */
+	KP_WATCH_REMOVE, /* safe, or directory and all safes below it, is gone */
+	KP_WATCH_RESET,  /* events were lost, all safes are added again */
+};
+
+typedef kp_error_t (*kp_watch_cb)(enum kp_watch_event, const char *, void *);
+
+/*
+ * Watch a workspace tree for safes coming and going. Safes are named
+ * relative to workspace, hidden files and links are ignored as listing
+ * does. A callback failure fails the init or read it happened in.
+ */
+struct kp_watch {
+	int fd;
+	char root[PATH_MAX];
+	char **dirs;  /* path of watched directories, by watch descriptor */
+	size_t ndirs;
+	kp_watch_cb cb;
+	void *arg;
+};
+
+kp_error_t kp_watch_init(struct kp_watch *, const char *, kp_watch_cb, void *);
+kp_error_t kp_watch_read(struct kp_watch *);
+void kp_watch_fini(struct kp_watch *);
+
+#endif /* KP_WATCH_H */
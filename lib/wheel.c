@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+
+#include "wheel.h"
+
+#define KP_WHEEL_MASK (KP_WHEEL_SLOTS - 1)
+
+static void kp_wheel_insert(struct kp_wheel *, struct kp_timer *);
+static void kp_wheel_cascade(struct kp_wheel *, int);
+
+void
+kp_wheel_init(struct kp_wheel *wheel, uint64_t now)
+{
+	int level, slot;
+
+	assert(wheel);
+
+	wheel->now = now;
+	wheel->count = 0;
+	for (level = 0; level < KP_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < KP_WHEEL_SLOTS; slot++) {
+			LIST_INIT(&wheel->slots[level][slot]);
+		}
+	}
+}
+
+/*
+ * Arm timer to fire at given tick, or rearm it if already armed. Timer due
+ * in the past fires on next tick.
+ */
+void
+kp_wheel_arm(struct kp_wheel *wheel, struct kp_timer *timer, uint64_t expire)
+{
+	assert(wheel);
+	assert(timer);
+
+	if (timer->armed) {
+		kp_wheel_cancel(wheel, timer);
+	}
+
+	if (expire <= wheel->now) {
+		expire = wheel->now + 1;
+	}
+
+	timer->expire = expire;
+	timer->armed = true;
+	wheel->count++;
+	kp_wheel_insert(wheel, timer);
+}
+
+void
+kp_wheel_cancel(struct kp_wheel *wheel, struct kp_timer *timer)
+{
+	assert(wheel);
+	assert(timer);
+
+	if (!timer->armed) {
+		return;
+	}
+
+	LIST_REMOVE(timer, entry);
+	timer->armed = false;
+	wheel->count--;
+}
+
+/*
+ * Turn the wheel up to given tick, calling cb on every timer due. Timer is
+ * disarmed before cb is called, which may thus free or rearm it.
+ */
+void
+kp_wheel_advance(struct kp_wheel *wheel, uint64_t now,
+                 void (*cb)(struct kp_timer *, void *), void *arg)
+{
+	struct kp_timers *slot;
+	struct kp_timer *timer;
+	int level;
+
+	assert(wheel);
+	assert(cb);
+
+	while (wheel->now < now) {
+		/* Nothing can fire, skip idle turns */
+		if (wheel->count == 0) {
+			wheel->now = now;
+			break;
+		}
+
+		wheel->now++;
+
+		/* Higher levels first, they may cascade into lower ones */
+		for (level = KP_WHEEL_LEVELS - 1; level > 0; level--) {
+			if ((wheel->now
+			     & ((1ULL << (KP_WHEEL_BITS * level)) - 1)) == 0) {
+				kp_wheel_cascade(wheel, level);
+			}
+		}
+
+		slot = &wheel->slots[0][wheel->now & KP_WHEEL_MASK];
+		while ((timer = LIST_FIRST(slot)) != NULL) {
+			kp_wheel_cancel(wheel, timer);
+			cb(timer, arg);
+		}
+	}
+}
+
+/*
+ * Timer goes to the lowest level whose turn covers it. Beyond highest level,
+ * it is cascaded again until it gets close enough.
+ */
+static void
+kp_wheel_insert(struct kp_wheel *wheel, struct kp_timer *timer)
+{
+	uint64_t delta = 0;
+	int level = 0;
+
+	if (timer->expire > wheel->now) {
+		delta = timer->expire - wheel->now;
+	}
+
+	while (level < KP_WHEEL_LEVELS - 1
+	       && delta >= (1ULL << (KP_WHEEL_BITS * (level + 1)))) {
+		level++;
+	}
+
+	LIST_INSERT_HEAD(&wheel->slots[level][(timer->expire
+	                 >> (KP_WHEEL_BITS * level)) & KP_WHEEL_MASK],
+	                 timer, entry);
+}
+
+static void
+kp_wheel_cascade(struct kp_wheel *wheel, int level)
+{
+	struct kp_timers *slot;
+	struct kp_timer *timer, *next;
+
+	slot = &wheel->slots[level][(wheel->now >> (KP_WHEEL_BITS * level))
+	                            & KP_WHEEL_MASK];
+
+	/* Timers may land back in this very slot, detach it first */
+	timer = LIST_FIRST(slot);
+	LIST_INIT(slot);
+
+	for (; timer != NULL; timer = next) {
+		next = LIST_NEXT(timer, entry);
+		kp_wheel_insert(wheel, timer);
+	}
+}
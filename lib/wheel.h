@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef KP_WHEEL_H
+#define KP_WHEEL_H
+
+#include <sys/queue.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KP_WHEEL_BITS   6
+#define KP_WHEEL_SLOTS  (1 << KP_WHEEL_BITS)
+#define KP_WHEEL_LEVELS 4
+
+/*
+ * Timer to embed in whatever expires. Expiry is expressed in ticks, the
+ * wheel does not know what a tick lasts.
+ */
+struct kp_timer {
+	LIST_ENTRY(kp_timer) entry;
+	uint64_t expire; /* tick timer fires at */
+	bool armed;
+	void *data;
+};
+
+LIST_HEAD(kp_timers, kp_timer);
+
+/*
+ * Hierarchical timer wheel. Each level has KP_WHEEL_SLOTS slots, each slot of
+ * a level spans a whole turn of the level below. Timers are cascaded down as
+ * the wheel turns, so that arm, cancel and refresh are O(1).
+ */
+struct kp_wheel {
+	uint64_t now;  /* current tick */
+	size_t count;  /* armed timers */
+	struct kp_timers slots[KP_WHEEL_LEVELS][KP_WHEEL_SLOTS];
+};
+
+void kp_wheel_init(struct kp_wheel *, uint64_t);
+void kp_wheel_arm(struct kp_wheel *, struct kp_timer *, uint64_t);
+void kp_wheel_cancel(struct kp_wheel *, struct kp_timer *);
+void kp_wheel_advance(struct kp_wheel *, uint64_t,
+                      void (*)(struct kp_timer *, void *), void *);
+
+#endif /* KP_WHEEL_H */
@@ -15,6 +15,7 @@
  */
 
 #include <sys/queue.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -23,8 +24,10 @@
 
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <signal.h>
 #include <sodium.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,55 +38,171 @@
 #include "kickpass.h"
 
 #include "command.h"
+#include "config.h"
 #include "imsg.h"
+#include "kdf.h"
 #include "kpagent.h"
 #include "log.h"
-
-#ifndef EPROTO
-#define EPROTO ENOPROTOOPT
-#endif
+#include "safe.h"
 
 #define TMP_TEMPLATE "/tmp/kickpass-XXXXXX"
 
+/*
+ * Locked memory left out of stored safes budget: master password, key cache,
+ * plain text being read or written, and partly used slab regions.
+ */
+#define MEMLOCK_RESERVE (1024 * 1024)
+
+/*
+ * Replies queued for a client beyond which its requests are no longer
+ * read, and seconds a client may leave them unread before being dropped.
+ */
+#define CONN_QUEUE_MAX     (256 * 1024)
+#define CONN_STUCK_TIMEOUT 30
+
+/*
+ * Milliseconds before trying again to hand state over, while a job changes
+ * it.
+ */
+#define HANDOFF_RETRY 50
+
+/*
+ * Requests opening, saving or unlocking workspace run kdf and disk io, they
+ * are handed to workers. Event loop keeps every socket and stored safes to
+ * itself, it sends job result once done.
+ */
+enum job_type {
+	JOB_UNLOCK,
+	JOB_OPEN,
+	JOB_SAVE,
+};
+
+/*
+ * Jobs of a client with more requests already waiting, such as a script
+ * opening many safes, go behind interactive ones.
+ */
+enum job_priority {
+	JOB_INTERACTIVE,
+	JOB_BULK,
+	JOB_PRIORITIES,
+};
+
+struct job {
+	TAILQ_ENTRY(job) entry;
+	enum job_type type;
+	struct conn *conn;       /* NULL once client is gone */
+	struct kp_unsafe unsafe; /* request, and reply of open */
+	bool stored;             /* save stores safe again, agent had a copy */
+	kp_error_t ret;
+	int err_no;
+};
+
+TAILQ_HEAD(jobs, job);
+
 struct agent {
 	struct event_base *evb;
+	struct event *tick; /* turns stored safes expiry wheel */
+	struct event *listener;
+	struct event *watcher; /* workspace changes, known safes follow */
 	struct kp_agent kp_agent;
+	struct kp_ctx *ctx;
+	size_t nconns;
+	struct conn *successor;    /* agent taking over, not accepting meanwhile */
+	struct conn *pending;      /* agent taking over, waiting for ctx */
+	struct event *retry;       /* hands state over to pending */
+	bool handed_over;          /* socket belongs to successor */
+	bool dumped;               /* successor got state, changes are refused */
+	pthread_rwlock_t ctx_lock; /* unlock and save change ctx */
+	pthread_mutex_t lock;      /* protects queue, done, stop and dumped */
+	pthread_cond_t cond;
+	struct jobs queue[JOB_PRIORITIES];
+	struct jobs done;
+	bool stop;
+	pthread_t *workers;
+	unsigned int nworkers;
+	int notify[2];             /* done jobs wake event loop up */
+	struct event *notified;
 };
 
-struct conn {
-	struct event *ev;
-	struct agent agent;
-	struct imsgbuf ibuf;
+/*
+ * Imsg buffer of a client, read buffer included. Only a connection with a
+ * partial request to read or replies to write holds one, idle connections
+ * give it back to the pool.
+ */
+struct peer {
+	SLIST_ENTRY(peer) entry;
+	struct kp_agent kp_agent;
+	size_t dirty; /* read buffer bytes to clear on release */
 };
 
-struct timeout {
+#define PEER_POOL_MAX 64 /* spare peers kept for reuse */
+
+struct conn {
 	struct agent *agent;
-	char name[PATH_MAX];
+	struct peer *peer; /* NULL while idle */
+	struct event *ev;  /* requests to read */
+	struct event *wev; /* replies to write, while some are queued */
+	struct job *job;   /* running, further requests wait */
+	int sock;
+	uint32_t caps;     /* negotiated capabilities, kept while idle */
 };
 
 static kp_error_t agent(struct kp_ctx *, int, char **);
 static void agent_accept(evutil_socket_t, short, void *);
 static void agent_kill(evutil_socket_t, short, void *);
-static void timeout_discard(evutil_socket_t, short, void *);
+static kp_error_t agent_socket(struct agent *, pid_t, char *, char *);
+static kp_error_t take_over(struct agent *, char *, char *);
+static void handoff(struct conn *);
+static void handoff_retry(evutil_socket_t, short, void *);
+static void handoff_done(struct agent *, bool);
+static void tick(evutil_socket_t, short, void *);
+static void refresh(evutil_socket_t, short, void *);
 static void dispatch(evutil_socket_t, short, void *);
+static void drain(evutil_socket_t, short, void *);
+static void process(struct conn *);
+static bool refused(struct conn *, uint32_t);
+static kp_error_t conn_hold(struct conn *);
+static void conn_idle(struct conn *);
+static void conn_close(struct conn *);
+static struct peer *peer_get(void);
+static void peer_put(struct peer *);
 static kp_error_t parse_opt(struct kp_ctx *, int, char **);
-static kp_error_t store(struct agent *, struct kp_unsafe *);
+static size_t     memlock_budget(void);
+static kp_error_t store(struct conn *, struct kp_unsafe *);
+static kp_error_t store_many(struct conn *, struct imsg *);
+static kp_error_t submit(struct conn *, enum job_type, struct kp_unsafe *);
+static void       reply(struct conn *, struct job *);
+static void       complete(evutil_socket_t, short, void *);
+static void      *worker(void *);
+static void       run(struct agent *, struct job *);
+static kp_error_t workers_start(struct agent *);
+static void       workers_stop(struct agent *);
+static kp_error_t unlock(struct agent *, const char *);
+static kp_error_t open_safe(struct agent *, struct kp_unsafe *);
+static kp_error_t save_safe(struct agent *, struct kp_unsafe *);
 static void       usage(void);
 
 struct kp_cmd kp_cmd_agent = {
 	.main  = agent,
 	.usage = usage,
-	.opts  = "agent [-d] [command [arg ...]]",
+	.opts  = "agent [-d] [-j jobs] [--max-mem bytes] [--encrypt] [--takeover] [command [arg ...]]",
 	.desc  = "Run a kickpass agent in background",
 };
 
 static bool daemonize = true;
+static bool takeover = false;
+static bool encrypt = false;
+static size_t max_mem = 0;
+static unsigned int jobs = 0;
+static SLIST_HEAD(, peer) pool = SLIST_HEAD_INITIALIZER(pool);
+static size_t pooled = 0;
 
 static void
 agent_accept(evutil_socket_t fd, short events, void *_agent)
 {
 	struct agent *agent = _agent;
 	struct conn *conn;
+	struct peer *peer;
 
 	if ((conn = malloc(sizeof(struct conn))) == NULL) {
 		errno = ENOMEM;
@@ -91,17 +210,49 @@ agent_accept(evutil_socket_t fd, short events, void *_agent)
 		return;
 	}
 
-	if ((kp_agent_accept(&agent->kp_agent,
-	                     &conn->agent.kp_agent)) != KP_SUCCESS) {
+	if ((peer = peer_get()) == NULL) {
+		kp_warn(KP_ERRNO, "cannot accept client");
+		free(conn);
+		return;
+	}
+
+	if ((kp_agent_accept(&agent->kp_agent, &peer->kp_agent))
+	    != KP_SUCCESS) {
+		kp_warn(KP_ERRNO, "cannot accept client");
+		peer_put(peer);
+		free(conn);
+		return;
+	}
+
+	conn->agent = agent;
+	conn->peer = peer;
+	conn->sock = peer->kp_agent.sock;
+	conn->caps = 0;
+	conn->job = NULL;
+	conn->ev = NULL;
+	conn->wev = NULL;
+	agent->nconns++;
+
+	/* A client not reading its replies must not stall others */
+	if (evutil_make_socket_nonblocking(conn->sock) < 0) {
 		kp_warn(KP_ERRNO, "cannot accept client");
+		conn_close(conn);
 		return;
 	}
 
-	conn->agent.evb = agent->evb;
-	imsg_init(&conn->ibuf, conn->agent.kp_agent.sock);
-	conn->ev = event_new(agent->evb, conn->agent.kp_agent.sock,
-	               EV_READ | EV_PERSIST, dispatch, conn);
+	conn->ev = event_new(agent->evb, conn->sock, EV_READ | EV_PERSIST,
+	                     dispatch, conn);
+	conn->wev = event_new(agent->evb, conn->sock, EV_WRITE | EV_PERSIST,
+	                      drain, conn);
+	if (conn->ev == NULL || conn->wev == NULL) {
+		kp_warnx(KP_EINTERNAL, "cannot accept client");
+		conn_close(conn);
+		return;
+	}
 	event_add(conn->ev, NULL);
+
+	/* Nothing to read yet */
+	conn_idle(conn);
 }
 
 static void
@@ -112,132 +263,110 @@ agent_kill(evutil_socket_t fd, short events, void *_agent)
 	event_base_loopexit(agent->evb, NULL);
 }
 
+/*
+ * A new agent asks for state, then tells once it took over. Clients
+ * connecting meanwhile wait in listening socket backlog, which both agents
+ * share. Old agent answers its remaining clients before exiting, but
+ * refuses their changes once state is handed over.
+ */
 static void
-dispatch(evutil_socket_t fd, short events, void *_conn)
+handoff(struct conn *conn)
 {
-	struct imsg imsg;
-	struct conn *conn = _conn;
+	kp_error_t ret;
+	struct agent *agent = conn->agent;
+	struct timeval grace = { CONN_STUCK_TIMEOUT, 0 };
+	struct timeval later = { 0, HANDOFF_RETRY * 1000 };
+
+	if (agent->successor == conn) {
+		agent->successor = NULL;
+		agent->handed_over = true;
+		event_base_loopexit(agent->evb, &grace);
+		return;
+	}
 
-	if (imsg_read(&conn->ibuf) <= 0) {
-		imsg_clear(&conn->ibuf);
-		event_del(conn->ev);
-		free(conn);
+	if (agent->successor != NULL || agent->handed_over
+	    || (agent->pending != NULL && agent->pending != conn)) {
+		errno = EBUSY;
+		kp_agent_error(&conn->peer->kp_agent, KP_ERRNO);
 		return;
 	}
 
-	while (imsg_get(&conn->ibuf, &imsg) > 0) {
-		size_t data_size;
+	event_del(agent->listener);
 
-		data_size = imsg.hdr.len - IMSG_HEADER_SIZE;
+	/* Unlocking or saving holds ctx for a whole kdf, event loop keeps
+	 * serving meanwhile */
+	if (pthread_rwlock_tryrdlock(&agent->ctx_lock) != 0) {
+		agent->pending = conn;
+		evtimer_add(agent->retry, &later);
+		return;
+	}
+	agent->pending = NULL;
 
-		switch (imsg.hdr.type) {
-		case KP_MSG_STORE:
-			if (data_size != sizeof(struct kp_unsafe)) {
-				errno = EPROTO;
-				kp_warn(KP_ERRNO, "invalid message");
-				break;
-			}
-			store(&conn->agent, (struct kp_unsafe *)imsg.data);
-			/* XXX handle error */
-			break;
-		case KP_MSG_SEARCH:
-			if (data_size != PATH_MAX) {
-				errno = EPROTO;
-				kp_warn(KP_ERRNO, "invalid message");
-				break;
-			}
-			/* ensure null termination */
-			((char *)imsg.data)[PATH_MAX-1] = '\0';
-			kp_agent_search(&conn->agent.kp_agent,
-			                (char *)imsg.data);
-			break;
-		case KP_MSG_DISCARD:
-			if (data_size != PATH_MAX) {
-				errno = EPROTO;
-				kp_warn(KP_ERRNO, "invalid message");
-				break;
-			}
-			/* ensure null termination */
-			((char *)imsg.data)[PATH_MAX-1] = '\0';
-			kp_agent_discard(&conn->agent.kp_agent,
-			                 (char *)imsg.data, false);
-			break;
-		}
+	ret = kp_agent_handoff(&conn->peer->kp_agent, agent->ctx,
+	                       agent->kp_agent.sock);
+	if (ret == KP_SUCCESS) {
+		handoff_done(agent, true);
+	}
+	pthread_rwlock_unlock(&agent->ctx_lock);
 
-		imsg_free(&imsg);
+	if (ret != KP_SUCCESS) {
+		kp_warn(ret, "cannot hand state over");
+		kp_agent_error(&conn->peer->kp_agent, ret);
+		event_add(agent->listener, NULL);
+		return;
 	}
+
+	agent->successor = conn;
 }
 
-kp_error_t
-agent(struct kp_ctx *ctx, int argc, char **argv)
+static void
+handoff_retry(evutil_socket_t fd, short events, void *_agent)
 {
-	kp_error_t ret = KP_SUCCESS;
-	pid_t agent_pid = 0, child_pid = 0, parent_pid = 0;
-	char socket_dir[PATH_MAX];
-	char socket_path[PATH_MAX];
-	struct agent agent;
-	struct event *ev;
-	struct stat sb;
+	struct agent *agent = _agent;
+	struct conn *conn = agent->pending;
 
-	if ((ret = parse_opt(ctx, argc, argv)) != KP_SUCCESS) {
-		return ret;
+	if (conn_hold(conn) != KP_SUCCESS) {
+		kp_warn(KP_ERRNO, "cannot hand state over");
+		conn_close(conn);
+		return;
 	}
 
-	if (daemonize) {
-		parent_pid = getpid();
-
-		if ((agent_pid = fork()) < 0) {
-			ret = KP_ERRNO;
-			kp_warn(ret, "cannot daemonize");
-			return ret;
-		}
-
-		if (agent_pid != 0) {
-			sigset_t set;
-			int sig, wstatus;
-
-			if (sigemptyset(&set) < 0) {
-				ret = KP_ERRNO;
-				kp_warn(ret, "cannot wait for child");
-				return ret;
-			}
-
-			if (sigaddset(&set, SIGCONT) < 0) {
-				ret = KP_ERRNO;
-				kp_warn(ret, "cannot wait for child");
-				return ret;
-			}
-
-			if (sigaddset(&set, SIGCHLD) < 0) {
-				ret = KP_ERRNO;
-				kp_warn(ret, "cannot wait for child");
-				return ret;
-			}
-
-			sigprocmask(SIG_BLOCK, &set, NULL);
-			sigwait(&set, &sig);
+	handoff(conn);
+	process(conn);
+}
 
-			if (sig == SIGCHLD) {
-				waitpid(agent_pid, &wstatus, 0);
-				exit(wstatus);
-			}
+/*
+ * Tell workers whether successor got state, jobs queued before must not
+ * change it either.
+ */
+static void
+handoff_done(struct agent *agent, bool dumped)
+{
+	pthread_mutex_lock(&agent->lock);
+	agent->dumped = dumped;
+	pthread_mutex_unlock(&agent->lock);
+}
 
-			exit(KP_SUCCESS);
-		}
-	}
+/*
+ * Listen on a new socket in a private temp dir.
+ */
+static kp_error_t
+agent_socket(struct agent *agent, pid_t agent_pid, char *socket_path,
+             char *socket_dir)
+{
+	kp_error_t ret;
 
-	agent_pid = getpid();
 	if (strlcpy(socket_dir, TMP_TEMPLATE, PATH_MAX) >= PATH_MAX) {
 		errno = ENAMETOOLONG;
 		ret = KP_ERRNO;
 		kp_warn(ret, "cannot create socket temp dir");
-		goto out;
+		return ret;
 	}
 
 	if (mkdtemp(socket_dir) == NULL) {
 		ret = KP_ERRNO;
 		kp_warn(ret, "cannot create socket temp dir");
-		goto out;
+		return ret;
 	}
 
 	if (snprintf(socket_path, PATH_MAX, "%s/agent.%ld", socket_dir,
@@ -245,153 +374,1249 @@ agent(struct kp_ctx *ctx, int argc, char **argv)
 		errno = ENAMETOOLONG;
 		ret = KP_ERRNO;
 		kp_warn(ret, "cannot create socket");
-		goto out;
+		return ret;
 	}
 
-	if ((ret = kp_agent_init(&agent.kp_agent, socket_path)) != KP_SUCCESS) {
+	if ((ret = kp_agent_init(&agent->kp_agent, socket_path)) != KP_SUCCESS) {
 		kp_warn(ret, "cannot create socket");
-		goto out;
+		return ret;
 	}
 
-	if ((ret = kp_agent_listen(&agent.kp_agent)) != KP_SUCCESS) {
+	if ((ret = kp_agent_listen(&agent->kp_agent)) != KP_SUCCESS) {
 		kp_warn(ret, "cannot create socket");
-		goto out;
-	}
-
-	if (setenv(KP_AGENT_SOCKET_ENV, socket_path, 1) < 0) {
-		ret = KP_ERRNO;
-		kp_warn(ret, "cannot set environment");
-		goto out;
+		return ret;
 	}
 
-	fprintf(stdout, "%s=%s; export %s;\n", KP_AGENT_SOCKET_ENV,
-	        socket_path, KP_AGENT_SOCKET_ENV);
-	fflush(stdout);
+	return KP_SUCCESS;
+}
 
-	if (optind < argc) {
-		child_pid = fork();
-		if (child_pid == 0) {
-			if (execvp(argv[optind], argv + optind) < 0) {
-				kp_warn(ret, "cannot exec child");
-			}
-		}
+/*
+ * Take over agent listening on socket path from environment, keeping its
+ * socket path and dir.
+ */
+static kp_error_t
+take_over(struct agent *agent, char *socket_path, char *socket_dir)
+{
+	kp_error_t ret;
+	struct kp_ctx *ctx = agent->ctx;
+	struct kp_agent old;
+	const char *path;
+	char *slash;
+	int listener;
+
+	if ((path = getenv(KP_AGENT_SOCKET_ENV)) == NULL) {
+		kp_warnx(KP_EINPUT, "no agent to take over, %s is not set",
+		         KP_AGENT_SOCKET_ENV);
+		return KP_EINPUT;
 	}
 
-	if (daemonize) {
-		int devnull;
-
-		if (chdir("/") < 0) {
-			ret = KP_ERRNO;
-			kp_warn(ret, "cannot chdir to /");
-			return ret;
-		}
-
-		if ((devnull = open("/dev/null", O_RDWR)) < 0) {
-			ret = KP_ERRNO;
-			kp_warn(ret, "cannot close standard inputs");
-			return ret;
-		}
-
-		dup2(devnull, STDIN_FILENO);
-		dup2(devnull, STDOUT_FILENO);
-		dup2(devnull, STDERR_FILENO);
-
-		close(devnull);
-
-		kill(parent_pid, SIGCONT);
+	if (strlcpy(socket_path, path, PATH_MAX) >= PATH_MAX
+	    || strlcpy(socket_dir, path, PATH_MAX) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return KP_ERRNO;
+	}
+	if ((slash = strrchr(socket_dir, '/')) != NULL) {
+		*slash = '\0';
 	}
 
-	agent.evb = event_base_new();
+	if ((ret = kp_agent_init(&old, socket_path)) != KP_SUCCESS) {
+		return ret;
+	}
 
-	ev = event_new(agent.evb, agent.kp_agent.sock, EV_READ | EV_PERSIST,
-	               agent_accept, &agent);
-	event_add(ev, NULL);
+	if ((ret = kp_agent_connect(&old)) != KP_SUCCESS) {
+		kp_agent_close(&old);
+		return ret;
+	}
 
-signal(SIGPIPE, SIG_IGN);
+	ret = kp_agent_takeover(&old, ctx, &listener);
+	kp_agent_close(&old);
+	if (ret != KP_SUCCESS) {
+		/* Restored safes are dropped with this process */
+		sodium_memzero(ctx->password, KP_PASSWORD_MAX_LEN);
+		kp_kdf_cache_clear(ctx);
+		return ret;
+	}
 
-	if (child_pid != 0) {
-		ev = event_new(agent.evb, SIGCHLD, EV_SIGNAL | EV_PERSIST,
-		               agent_kill, &agent);
-		event_add(ev, NULL);
+	if ((ret = kp_agent_init(&agent->kp_agent, socket_path))
+	    != KP_SUCCESS) {
+		close(listener);
+		return ret;
+	}
+	close(agent->kp_agent.sock);
+	agent->kp_agent.sock = listener;
+	agent->kp_agent.ibuf.fd = listener;
+	agent->kp_agent.ibuf.w.fd = listener;
+
+	/* Keys are cached, config is loaded without derivation */
+	if (ctx->password[0] != '\0'
+	    && (ret = kp_cfg_load(ctx, "")) != KP_SUCCESS) {
+		kp_warn(ret, "cannot load workspace config, agent is locked");
+		sodium_memzero(ctx->password, KP_PASSWORD_MAX_LEN);
+		kp_kdf_cache_clear(ctx);
 	}
 
-	event_base_dispatch(agent.evb);
+	return KP_SUCCESS;
+}
 
-out:
-	event_base_free(agent.evb);
+static void
+dispatch(evutil_socket_t fd, short events, void *_conn)
+{
+	struct conn *conn = _conn;
+	struct imsgbuf *ibuf;
+	ssize_t n;
 
-	kp_agent_close(&agent.kp_agent);
+	if (conn_hold(conn) != KP_SUCCESS) {
+		kp_warn(KP_ERRNO, "cannot read client");
+		conn_close(conn);
+		return;
+	}
+	ibuf = &conn->peer->kp_agent.ibuf;
 
-	if (stat(socket_path, &sb) == 0) {
-		if (unlink(socket_path) != 0) {
-			kp_warn(KP_ERRNO, "cannot delete agent socket %s",
-			        socket_path);
+	if ((n = imsg_read(ibuf)) <= 0) {
+		if (n < 0 && errno == EAGAIN) {
+			conn_idle(conn);
+			return;
 		}
+		conn_close(conn);
+		return;
 	}
 
-	if (stat(socket_dir, &sb) == 0) {
-		if (rmdir(socket_dir) != 0) {
-			kp_warn(KP_ERRNO, "cannot delete agent socket dir %s",
-			        socket_dir);
-		}
+	if (ibuf->r.wpos > conn->peer->dirty) {
+		conn->peer->dirty = ibuf->r.wpos;
 	}
 
-	return ret;
+	process(conn);
 }
 
-static kp_error_t
-store(struct agent *agent, struct kp_unsafe *unsafe)
+/*
+ * Write queued replies as socket takes them. Drop client once it did not
+ * take any for too long.
+ */
+static void
+drain(evutil_socket_t fd, short events, void *_conn)
 {
-	struct kp_agent *kp_agent = &agent->kp_agent;
-	struct timeout *timeout;
-	struct event *timer;
-	struct timeval timeval;
+	struct conn *conn = _conn;
+	struct msgbuf *w = &conn->peer->kp_agent.ibuf.w;
+	int n;
 
-	if (unsafe->timeout > 0) {
-		if ((timeout = malloc(sizeof(struct timeout))) == NULL) {
-			errno = ENOMEM;
-			return KP_ERRNO;
-		}
-		timeout->agent = agent;
-		if (strlcpy(timeout->name, unsafe->name, PATH_MAX)
-		    >= PATH_MAX) {
-			errno = ENAMETOOLONG;
-			return KP_ERRNO;
-		}
-		timeval.tv_sec = unsafe->timeout;
-		timeval.tv_usec = 0;
-		timer = evtimer_new(agent->evb, timeout_discard, timeout);
-		evtimer_add(timer, &timeval);
+	if (events & EV_TIMEOUT) {
+		kp_warnx(KP_EINPUT, "client stuck, disconnecting");
+		conn_close(conn);
+		return;
+	}
+
+	if ((n = msgbuf_write(w)) == 0 || (n < 0 && errno != EAGAIN)) {
+		conn_close(conn);
+		return;
 	}
 
-	return kp_agent_store(kp_agent, unsafe);
+	process(conn);
 }
 
+/*
+ * Handle requests already read as long as replies queue is not full, then
+ * watch socket according to what is left to do.
+ */
 static void
-timeout_discard(evutil_socket_t fd, short events, void *_timeout)
+process(struct conn *conn)
 {
-	struct timeout *timeout = _timeout;
-	struct kp_agent *kp_agent = &timeout->agent->kp_agent;
+	struct timeval stuck = { CONN_STUCK_TIMEOUT, 0 };
+	struct msgbuf *w = &conn->peer->kp_agent.ibuf.w;
+	struct imsg imsg;
+	struct kp_unsafe unsafe;
 
-	kp_agent_discard(kp_agent, timeout->name, true);
+	while (conn->job == NULL && w->queued < CONN_QUEUE_MAX
+	       && imsg_get(&conn->peer->kp_agent.ibuf, &imsg) > 0) {
+		kp_error_t ret;
+		size_t data_size;
+		char *string;
 
-	free(timeout);
-}
+		data_size = imsg.hdr.len - IMSG_HEADER_SIZE;
 
-static kp_error_t
-parse_opt(struct kp_ctx *ctx, int argc, char **argv)
-{
-	int opt;
-	kp_error_t ret = KP_SUCCESS;
-	static struct option longopts[] = {
-		{ "no-daemon", no_argument,       NULL, 'd' },
-		{ NULL,        0,                 NULL, 0   },
-	};
+		if (refused(conn, imsg.hdr.type)) {
+			goto clear;
+		}
 
-	while ((opt = getopt_long(argc, argv, "d", longopts, NULL)) != -1) {
-		switch (opt) {
-		case 'd':
-			daemonize = false;
+		switch (imsg.hdr.type) {
+		case KP_MSG_HELLO:
+			kp_agent_welcome(&conn->peer->kp_agent, &imsg);
+			break;
+		case KP_MSG_STORE:
+			unsafe = (struct kp_unsafe)KP_UNSAFE_INIT;
+			if ((ret = kp_agent_msg_unsafe(&imsg, &unsafe))
+			    != KP_SUCCESS) {
+				kp_warn(ret, "invalid message");
+				break;
+			}
+			if ((ret = store(conn, &unsafe))
+			    != KP_SUCCESS) {
+				kp_warn(ret, "cannot store %s", unsafe.name);
+			}
+			kp_agent_unsafe_clear(&unsafe);
+			break;
+		case KP_MSG_SEARCH:
+			if ((ret = kp_agent_msg_string(&imsg, &string,
+			                               PATH_MAX)) != KP_SUCCESS) {
+				kp_warn(ret, "invalid message");
+				break;
+			}
+			kp_agent_search(&conn->peer->kp_agent, string);
+			break;
+		case KP_MSG_SEARCH_MANY:
+			kp_agent_search_batch(&conn->peer->kp_agent, &imsg);
+			break;
+		case KP_MSG_STORE_MANY:
+			store_many(conn, &imsg);
+			break;
+		case KP_MSG_DISCARD:
+			if ((ret = kp_agent_msg_string(&imsg, &string,
+			                               PATH_MAX)) != KP_SUCCESS) {
+				kp_warn(ret, "invalid message");
+				break;
+			}
+			kp_agent_discard(&conn->peer->kp_agent, string, false);
+			break;
+		case KP_MSG_UNLOCK:
+			if ((ret = kp_agent_msg_string(&imsg, &string,
+			                               KP_PASSWORD_MAX_LEN))
+			    != KP_SUCCESS) {
+				kp_warn(ret, "invalid message");
+				break;
+			}
+			unsafe = (struct kp_unsafe)KP_UNSAFE_INIT;
+			strlcpy(unsafe.password, string, KP_PASSWORD_MAX_LEN);
+			submit(conn, JOB_UNLOCK, &unsafe);
+			sodium_memzero(&unsafe, sizeof(struct kp_unsafe));
+			break;
+		case KP_MSG_OPEN:
+			if ((ret = kp_agent_msg_string(&imsg, &string,
+			                               PATH_MAX)) != KP_SUCCESS) {
+				kp_warn(ret, "invalid message");
+				break;
+			}
+			unsafe = (struct kp_unsafe)KP_UNSAFE_INIT;
+			strlcpy(unsafe.name, string, PATH_MAX);
+			submit(conn, JOB_OPEN, &unsafe);
+			break;
+		case KP_MSG_SAVE:
+			unsafe = (struct kp_unsafe)KP_UNSAFE_INIT;
+			if ((ret = kp_agent_msg_unsafe(&imsg, &unsafe))
+			    != KP_SUCCESS) {
+				kp_warn(ret, "invalid message");
+				break;
+			}
+			submit(conn, JOB_SAVE, &unsafe);
+			sodium_memzero(&unsafe, sizeof(struct kp_unsafe));
+			break;
+		case KP_MSG_TAKEOVER:
+			handoff(conn);
+			break;
+		case KP_MSG_LIST:
+			kp_agent_list_names(&conn->peer->kp_agent, &imsg);
+			break;
+		}
+
+clear:
+		/* Messages may hold plain text, and a memory file not taken */
+		sodium_memzero(imsg.data, data_size);
+		if (imsg.fd >= 0) {
+			close(imsg.fd);
+		}
+		imsg_free(&imsg);
+	}
+
+	if (w->queued == 0) {
+		event_del(conn->wev);
+	} else if (!event_pending(conn->wev, EV_WRITE, NULL)) {
+		event_add(conn->wev, &stuck);
+	}
+
+	/* Stop reading from a client not reading its replies, or waiting for
+	 * a job */
+	if (conn->job != NULL || w->queued >= CONN_QUEUE_MAX) {
+		event_del(conn->ev);
+	} else if (!event_pending(conn->ev, EV_READ, NULL)) {
+		event_add(conn->ev, NULL);
+	}
+
+	conn_idle(conn);
+}
+
+/*
+ * Once successor got state, a change made here would be lost with this
+ * agent. Client is told so, even for a store which has no answer otherwise,
+ * and reconnects to successor.
+ */
+static bool
+refused(struct conn *conn, uint32_t type)
+{
+	if (!conn->agent->dumped) {
+		return false;
+	}
+
+	switch (type) {
+	case KP_MSG_STORE:
+	case KP_MSG_STORE_MANY:
+	case KP_MSG_DISCARD:
+	case KP_MSG_UNLOCK:
+	case KP_MSG_SAVE:
+		errno = ESHUTDOWN;
+		kp_agent_error(&conn->peer->kp_agent, KP_ERRNO);
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Get a peer to read requests and queue replies with.
+ */
+static kp_error_t
+conn_hold(struct conn *conn)
+{
+	struct kp_agent *kp_agent;
+
+	if (conn->peer != NULL) {
+		return KP_SUCCESS;
+	}
+
+	if ((conn->peer = peer_get()) == NULL) {
+		return KP_ERRNO;
+	}
+
+	kp_agent = &conn->peer->kp_agent;
+	kp_agent->sock = conn->sock;
+	kp_agent->connected = true;
+	kp_agent->unlocked = false;
+	kp_agent->caps = conn->caps;
+	kp_agent->nonblock = true;
+	/* imsg_init would clear whole read buffer, it is empty already */
+	kp_agent->ibuf.fd = conn->sock;
+	kp_agent->ibuf.w.fd = conn->sock;
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Give peer back once there is neither a partial request nor a reply left.
+ */
+static void
+conn_idle(struct conn *conn)
+{
+	struct peer *peer = conn->peer;
+
+	if (peer == NULL || peer->kp_agent.ibuf.r.wpos > 0
+	    || peer->kp_agent.ibuf.w.queued > 0) {
+		return;
+	}
+
+	conn->caps = peer->kp_agent.caps;
+	conn->peer = NULL;
+	peer_put(peer);
+}
+
+static void
+conn_close(struct conn *conn)
+{
+	struct agent *agent = conn->agent;
+
+	/* Successor gone before it took over */
+	if (agent->successor == conn || agent->pending == conn) {
+		kp_warnx(KP_EINPUT, "takeover failed, resuming");
+		if (agent->successor == conn) {
+			handoff_done(agent, false);
+		}
+		agent->successor = NULL;
+		agent->pending = NULL;
+		evtimer_del(agent->retry);
+		event_add(agent->listener, NULL);
+	}
+
+	/* Job result is dropped once done */
+	if (conn->job != NULL) {
+		conn->job->conn = NULL;
+	}
+	if (conn->ev != NULL) {
+		event_free(conn->ev);
+	}
+	if (conn->wev != NULL) {
+		event_free(conn->wev);
+	}
+	if (conn->peer != NULL) {
+		peer_put(conn->peer);
+	}
+	close(conn->sock);
+	free(conn);
+
+	if (--agent->nconns == 0 && agent->handed_over) {
+		event_base_loopexit(agent->evb, NULL);
+	}
+}
+
+static struct peer *
+peer_get(void)
+{
+	struct peer *peer;
+
+	if ((peer = SLIST_FIRST(&pool)) != NULL) {
+		SLIST_REMOVE_HEAD(&pool, entry);
+		pooled--;
+		return peer;
+	}
+
+	if ((peer = malloc(sizeof(struct peer))) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	imsg_init(&peer->kp_agent.ibuf, -1);
+	peer->kp_agent.sock = -1;
+	peer->dirty = 0;
+
+	return peer;
+}
+
+/*
+ * Read buffer may hold plain text of former requests, clear it before
+ * another client gets it.
+ */
+static void
+peer_put(struct peer *peer)
+{
+	sodium_memzero(peer->kp_agent.ibuf.r.buf, peer->dirty);
+	peer->dirty = 0;
+	imsg_clear(&peer->kp_agent.ibuf);
+	peer->kp_agent.ibuf.r.wpos = 0;
+	peer->kp_agent.sock = -1;
+
+	if (pooled >= PEER_POOL_MAX) {
+		free(peer);
+		return;
+	}
+
+	SLIST_INSERT_HEAD(&pool, peer, entry);
+	pooled++;
+}
+
+kp_error_t
+agent(struct kp_ctx *ctx, int argc, char **argv)
+{
+	kp_error_t ret = KP_SUCCESS;
+	pid_t agent_pid = 0, child_pid = 0, parent_pid = 0;
+	char socket_dir[PATH_MAX] = "";
+	char socket_path[PATH_MAX] = "";
+	struct agent agent;
+	struct event *ev;
+	struct stat sb;
+	int fd;
+
+	if ((ret = parse_opt(ctx, argc, argv)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	/* Agent acts on its own workspace, never prompt nor chain agents */
+	if (ctx->agent.connected) {
+		kp_agent_close(&ctx->agent);
+		ctx->agent.connected = false;
+	}
+	ctx->password_prompt = NULL;
+	agent.ctx = ctx;
+	agent.evb = NULL;
+	agent.tick = NULL;
+	agent.listener = NULL;
+	agent.watcher = NULL;
+	agent.notified = NULL;
+	agent.kp_agent.sock = -1;
+	agent.nconns = 0;
+	agent.successor = NULL;
+	agent.pending = NULL;
+	agent.retry = NULL;
+	agent.handed_over = false;
+	agent.dumped = false;
+
+	if (max_mem == 0) {
+		max_mem = memlock_budget();
+	}
+	kp_agent_budget(&agent.kp_agent, max_mem);
+
+	if (daemonize) {
+		parent_pid = getpid();
+
+		if ((agent_pid = fork()) < 0) {
+			ret = KP_ERRNO;
+			kp_warn(ret, "cannot daemonize");
+			return ret;
+		}
+
+		if (agent_pid != 0) {
+			sigset_t set;
+			int sig, wstatus;
+
+			if (sigemptyset(&set) < 0) {
+				ret = KP_ERRNO;
+				kp_warn(ret, "cannot wait for child");
+				return ret;
+			}
+
+			if (sigaddset(&set, SIGCONT) < 0) {
+				ret = KP_ERRNO;
+				kp_warn(ret, "cannot wait for child");
+				return ret;
+			}
+
+			if (sigaddset(&set, SIGCHLD) < 0) {
+				ret = KP_ERRNO;
+				kp_warn(ret, "cannot wait for child");
+				return ret;
+			}
+
+			sigprocmask(SIG_BLOCK, &set, NULL);
+			sigwait(&set, &sig);
+
+			if (sig == SIGCHLD) {
+				waitpid(agent_pid, &wstatus, 0);
+				exit(wstatus);
+			}
+
+			exit(KP_SUCCESS);
+		}
+	}
+
+	agent_pid = getpid();
+	/* Key is locked by the process using it, lock is not inherited */
+	if (encrypt && (ret = kp_agent_encrypt(&agent.kp_agent))
+	    != KP_SUCCESS) {
+		kp_warn(ret, "cannot encrypt stored safes");
+		goto out;
+	}
+
+	if (takeover) {
+		if ((ret = take_over(&agent, socket_path, socket_dir))
+		    != KP_SUCCESS) {
+			kp_warn(ret, "cannot take agent over");
+			/* Socket belongs to running agent */
+			agent.handed_over = true;
+			goto out;
+		}
+	} else if ((ret = agent_socket(&agent, agent_pid, socket_path,
+	                               socket_dir)) != KP_SUCCESS) {
+		goto out;
+	}
+
+	if (setenv(KP_AGENT_SOCKET_ENV, socket_path, 1) < 0) {
+		ret = KP_ERRNO;
+		kp_warn(ret, "cannot set environment");
+		goto out;
+	}
+
+	fprintf(stdout, "%s=%s; export %s;\n", KP_AGENT_SOCKET_ENV,
+	        socket_path, KP_AGENT_SOCKET_ENV);
+	fflush(stdout);
+
+	if (optind < argc) {
+		child_pid = fork();
+		if (child_pid == 0) {
+			if (execvp(argv[optind], argv + optind) < 0) {
+				kp_warn(ret, "cannot exec child");
+			}
+		}
+	}
+
+	if (daemonize) {
+		int devnull;
+
+		if (chdir("/") < 0) {
+			ret = KP_ERRNO;
+			kp_warn(ret, "cannot chdir to /");
+			return ret;
+		}
+
+		if ((devnull = open("/dev/null", O_RDWR)) < 0) {
+			ret = KP_ERRNO;
+			kp_warn(ret, "cannot close standard inputs");
+			return ret;
+		}
+
+		dup2(devnull, STDIN_FILENO);
+		dup2(devnull, STDOUT_FILENO);
+		dup2(devnull, STDERR_FILENO);
+
+		close(devnull);
+
+		kill(parent_pid, SIGCONT);
+	}
+
+	agent.evb = event_base_new();
+	agent.tick = evtimer_new(agent.evb, tick, &agent);
+	agent.retry = evtimer_new(agent.evb, handoff_retry, &agent);
+
+	agent.listener = event_new(agent.evb, agent.kp_agent.sock,
+	                           EV_READ | EV_PERSIST, agent_accept, &agent);
+	event_add(agent.listener, NULL);
+
+	/* Lists are answered from memory while workspace is watched, workspace
+	 * may not exist yet */
+	if ((ret = kp_agent_watch(&agent.kp_agent, ctx->ws_path, &fd))
+	    == KP_SUCCESS) {
+		agent.watcher = event_new(agent.evb, fd, EV_READ | EV_PERSIST,
+		                          refresh, &agent);
+		event_add(agent.watcher, NULL);
+	} else if (errno != ENOTSUP && errno != ENOENT) {
+		kp_warn(ret, "cannot watch workspace, clients list it");
+	}
+	ret = KP_SUCCESS;
+
+	/* Restored safes may have a timeout */
+	if (takeover) {
+		tick(-1, 0, &agent);
+	}
+
+	if ((ret = workers_start(&agent)) != KP_SUCCESS) {
+		kp_warn(ret, "cannot start workers");
+		goto out;
+	}
+
+signal(SIGPIPE, SIG_IGN);
+
+	if (child_pid != 0) {
+		ev = event_new(agent.evb, SIGCHLD, EV_SIGNAL | EV_PERSIST,
+		               agent_kill, &agent);
+		event_add(ev, NULL);
+	}
+
+	event_base_dispatch(agent.evb);
+
+out:
+	if (agent.notified) {
+		workers_stop(&agent);
+	}
+	if (agent.tick) {
+		event_free(agent.tick);
+	}
+	if (agent.retry) {
+		event_free(agent.retry);
+	}
+	if (agent.listener) {
+		event_free(agent.listener);
+	}
+	if (agent.watcher) {
+		event_free(agent.watcher);
+	}
+	kp_agent_unwatch(&agent.kp_agent);
+	event_base_free(agent.evb);
+
+	if (agent.kp_agent.sock >= 0) {
+		kp_agent_close(&agent.kp_agent);
+	}
+
+	/* Successor keeps socket */
+	if (agent.handed_over) {
+		return ret;
+	}
+
+	if (stat(socket_path, &sb) == 0) {
+		if (unlink(socket_path) != 0) {
+			kp_warn(KP_ERRNO, "cannot delete agent socket %s",
+			        socket_path);
+		}
+	}
+
+	if (stat(socket_dir, &sb) == 0) {
+		if (rmdir(socket_dir) != 0) {
+			kp_warn(KP_ERRNO, "cannot delete agent socket dir %s",
+			        socket_dir);
+		}
+	}
+
+	return ret;
+}
+
+static kp_error_t
+store(struct conn *conn, struct kp_unsafe *unsafe)
+{
+	kp_error_t ret;
+
+	if ((ret = kp_agent_store(&conn->peer->kp_agent, unsafe)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if (unsafe->timeout > 0 && !evtimer_pending(conn->agent->tick, NULL)) {
+		tick(-1, 0, conn->agent);
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Store every safe of a batch and answer with their status at once.
+ */
+static kp_error_t
+store_many(struct conn *conn, struct imsg *imsg)
+{
+	kp_error_t ret;
+	struct kp_unsafe unsafe;
+	struct kp_msg_error errors[KP_AGENT_BATCH_MAX];
+	size_t off = 0, n;
+
+	for (n = 0; n < KP_AGENT_BATCH_MAX; n++) {
+		if ((ret = kp_agent_msg_next_unsafe(imsg, &off, &unsafe))
+		    != KP_SUCCESS) {
+			if (errno != ENOENT) {
+				kp_warn(ret, "invalid message");
+			}
+			break;
+		}
+
+		errors[n].err = store(conn, &unsafe);
+		errors[n].err_no = errors[n].err == KP_ERRNO ? errno : 0;
+		if (errors[n].err != KP_SUCCESS) {
+			kp_warn(errors[n].err, "cannot store %s", unsafe.name);
+		}
+	}
+	sodium_memzero(&unsafe, sizeof(struct kp_unsafe));
+
+	return kp_agent_send_errors(&conn->peer->kp_agent, KP_MSG_STORE_MANY,
+	                            errors, n);
+}
+
+/*
+ * Hand request to workers, client gets no other answer until it is done.
+ * Without worker it runs at once.
+ */
+static kp_error_t
+submit(struct conn *conn, enum job_type type, struct kp_unsafe *unsafe)
+{
+	struct agent *agent = conn->agent;
+	enum job_priority priority = JOB_INTERACTIVE;
+	struct job *job;
+
+	if ((job = malloc(sizeof(struct job))) == NULL) {
+		kp_agent_unsafe_clear(unsafe);
+		errno = ENOMEM;
+		kp_agent_error(&conn->peer->kp_agent, KP_ERRNO);
+		return KP_ERRNO;
+	}
+
+	job->type = type;
+	job->conn = conn;
+	job->unsafe = *unsafe;
+	/* Copy is dropped as soon as save changes the file, remember it was
+	 * there */
+	job->stored = type == JOB_SAVE
+	           && kp_agent_stored(&conn->peer->kp_agent, &job->unsafe);
+	job->ret = KP_SUCCESS;
+	job->err_no = 0;
+
+	if (agent->nworkers == 0) {
+		run(agent, job);
+		reply(conn, job);
+		return KP_SUCCESS;
+	}
+
+	if (conn->peer->kp_agent.ibuf.r.wpos > 0) {
+		priority = JOB_BULK;
+	}
+
+	conn->job = job;
+	pthread_mutex_lock(&agent->lock);
+	TAILQ_INSERT_TAIL(&agent->queue[priority], job, entry);
+	pthread_cond_signal(&agent->cond);
+	pthread_mutex_unlock(&agent->lock);
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Send job result and free it.
+ */
+static void
+reply(struct conn *conn, struct job *job)
+{
+	struct kp_agent *kp_agent = &conn->peer->kp_agent;
+	kp_error_t ret;
+	bool result = true;
+
+	if (job->ret != KP_SUCCESS) {
+		errno = job->err_no;
+		kp_agent_error(kp_agent, job->ret);
+	} else {
+		switch (job->type) {
+		case JOB_UNLOCK:
+			kp_agent_send(kp_agent, KP_MSG_UNLOCK, &result,
+			              sizeof(bool));
+			break;
+		case JOB_OPEN:
+			if (kp_agent_send_unsafe(kp_agent, KP_MSG_OPEN,
+			                         &job->unsafe) != KP_SUCCESS
+			    && errno == EMSGSIZE) {
+				/* Client reads such a large safe itself */
+				errno = ENOMEM;
+				kp_agent_error(kp_agent, KP_ERRNO);
+			}
+			break;
+		case JOB_SAVE:
+			if (job->stored && (ret = store(conn, &job->unsafe))
+			    != KP_SUCCESS) {
+				kp_warn(ret, "cannot store %s",
+				        job->unsafe.name);
+			}
+			kp_agent_send_saved(kp_agent, &job->unsafe.id);
+			break;
+		}
+	}
+
+	kp_agent_unsafe_clear(&job->unsafe);
+	free(job);
+}
+
+/*
+ * Answer clients whose jobs are done and resume their requests.
+ */
+static void
+complete(evutil_socket_t fd, short events, void *_agent)
+{
+	struct agent *agent = _agent;
+	struct jobs done = TAILQ_HEAD_INITIALIZER(done);
+	struct job *job;
+	struct conn *conn;
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0);
+
+	pthread_mutex_lock(&agent->lock);
+	TAILQ_CONCAT(&done, &agent->done, entry);
+	pthread_mutex_unlock(&agent->lock);
+
+	while ((job = TAILQ_FIRST(&done)) != NULL) {
+		TAILQ_REMOVE(&done, job, entry);
+
+		if ((conn = job->conn) == NULL) {
+			kp_agent_unsafe_clear(&job->unsafe);
+			free(job);
+			continue;
+		}
+
+		conn->job = NULL;
+		if (conn_hold(conn) != KP_SUCCESS) {
+			kp_warn(KP_ERRNO, "cannot answer client");
+			kp_agent_unsafe_clear(&job->unsafe);
+			free(job);
+			conn_close(conn);
+			continue;
+		}
+
+		reply(conn, job);
+		process(conn);
+	}
+}
+
+static void *
+worker(void *_agent)
+{
+	struct agent *agent = _agent;
+	struct job *job = NULL;
+	int priority;
+
+	pthread_mutex_lock(&agent->lock);
+	while (!agent->stop) {
+		for (priority = 0; priority < JOB_PRIORITIES; priority++) {
+			if ((job = TAILQ_FIRST(&agent->queue[priority]))
+			    != NULL) {
+				TAILQ_REMOVE(&agent->queue[priority], job,
+				             entry);
+				break;
+			}
+		}
+
+		if (job == NULL) {
+			pthread_cond_wait(&agent->cond, &agent->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&agent->lock);
+
+		run(agent, job);
+
+		/* Event loop is woken up once for all jobs done meanwhile */
+		pthread_mutex_lock(&agent->lock);
+		if (TAILQ_EMPTY(&agent->done)
+		    && write(agent->notify[1], "", 1) < 0 && errno != EAGAIN) {
+			kp_warn(KP_ERRNO, "cannot wake event loop up");
+		}
+		TAILQ_INSERT_TAIL(&agent->done, job, entry);
+		job = NULL;
+	}
+	pthread_mutex_unlock(&agent->lock);
+
+	return NULL;
+}
+
+/*
+ * Opening safes only reads ctx, unlocking and saving change it. Changes
+ * still queued once state is handed over are refused as later ones.
+ */
+static void
+run(struct agent *agent, struct job *job)
+{
+	bool dumped;
+
+	if (job->type == JOB_OPEN) {
+		pthread_rwlock_rdlock(&agent->ctx_lock);
+	} else {
+		pthread_rwlock_wrlock(&agent->ctx_lock);
+	}
+
+	pthread_mutex_lock(&agent->lock);
+	dumped = agent->dumped;
+	pthread_mutex_unlock(&agent->lock);
+
+	if (dumped && job->type != JOB_OPEN) {
+		errno = ESHUTDOWN;
+		job->ret = KP_ERRNO;
+		goto out;
+	}
+
+	switch (job->type) {
+	case JOB_UNLOCK:
+		job->ret = unlock(agent, job->unsafe.password);
+		break;
+	case JOB_OPEN:
+		job->ret = open_safe(agent, &job->unsafe);
+		break;
+	case JOB_SAVE:
+		job->ret = save_safe(agent, &job->unsafe);
+		break;
+	}
+
+out:
+	job->err_no = errno;
+	pthread_rwlock_unlock(&agent->ctx_lock);
+}
+
+/*
+ * Start up to jobs workers. Event loop runs jobs itself when none could be
+ * started.
+ */
+static kp_error_t
+workers_start(struct agent *agent)
+{
+	unsigned int i;
+
+	for (i = 0; i < JOB_PRIORITIES; i++) {
+		TAILQ_INIT(&agent->queue[i]);
+	}
+	TAILQ_INIT(&agent->done);
+	agent->stop = false;
+	agent->nworkers = 0;
+
+	if ((errno = pthread_rwlock_init(&agent->ctx_lock, NULL)) != 0
+	    || (errno = pthread_mutex_init(&agent->lock, NULL)) != 0
+	    || (errno = pthread_cond_init(&agent->cond, NULL)) != 0) {
+		return KP_ERRNO;
+	}
+
+	if (pipe(agent->notify) < 0) {
+		return KP_ERRNO;
+	}
+	evutil_make_socket_nonblocking(agent->notify[0]);
+	evutil_make_socket_nonblocking(agent->notify[1]);
+	agent->notified = event_new(agent->evb, agent->notify[0],
+	                            EV_READ | EV_PERSIST, complete, agent);
+	if (agent->notified == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+	event_add(agent->notified, NULL);
+
+	if ((agent->workers = calloc(jobs, sizeof(pthread_t))) == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&agent->workers[i], NULL, worker, agent)
+		    != 0) {
+			break;
+		}
+		agent->nworkers++;
+	}
+
+	return KP_SUCCESS;
+}
+
+static void
+workers_stop(struct agent *agent)
+{
+	struct job *job;
+	unsigned int i;
+	int priority;
+
+	pthread_mutex_lock(&agent->lock);
+	agent->stop = true;
+	pthread_cond_broadcast(&agent->cond);
+	pthread_mutex_unlock(&agent->lock);
+
+	for (i = 0; i < agent->nworkers; i++) {
+		pthread_join(agent->workers[i], NULL);
+	}
+	free(agent->workers);
+
+	for (priority = 0; priority < JOB_PRIORITIES; priority++) {
+		TAILQ_CONCAT(&agent->done, &agent->queue[priority], entry);
+	}
+	while ((job = TAILQ_FIRST(&agent->done)) != NULL) {
+		TAILQ_REMOVE(&agent->done, job, entry);
+		kp_agent_unsafe_clear(&job->unsafe);
+		free(job);
+	}
+
+	event_free(agent->notified);
+	close(agent->notify[0]);
+	close(agent->notify[1]);
+	pthread_cond_destroy(&agent->cond);
+	pthread_mutex_destroy(&agent->lock);
+	pthread_rwlock_destroy(&agent->ctx_lock);
+}
+
+/*
+ * Keep master password once it is proven to open workspace config. Candidate
+ * is proven on a scratch ctx, so that a wrong one leaves agent as it was.
+ */
+static kp_error_t
+unlock(struct agent *agent, const char *password)
+{
+	kp_error_t ret;
+	struct kp_ctx *ctx = agent->ctx;
+	struct kp_ctx scratch;
+	struct kp_key *keys = NULL;
+	char **candidate;
+	size_t n, i;
+	int err_no;
+
+	memcpy(&scratch, ctx, sizeof(struct kp_ctx));
+	candidate = (char **)&scratch.password;
+	*candidate = sodium_malloc(KP_PASSWORD_MAX_LEN);
+	if (scratch.password == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	if ((ret = kp_kdf_cache_init(&scratch)) != KP_SUCCESS) {
+		sodium_free(scratch.password);
+		return ret;
+	}
+
+	if (strlcpy(scratch.password, password, KP_PASSWORD_MAX_LEN)
+	    >= KP_PASSWORD_MAX_LEN) {
+		errno = ENOMEM;
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	if ((ret = kp_cfg_load(&scratch, "")) != KP_SUCCESS) {
+		goto out;
+	}
+
+	/* Keys are copied from guarded memory to guarded memory only */
+	keys = sodium_allocarray(KP_KEY_CACHE_SIZE, sizeof(struct kp_key));
+	if (keys == NULL) {
+		errno = ENOMEM;
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	/* Keys of the previous password are dropped along with it */
+	strlcpy(ctx->password, scratch.password, KP_PASSWORD_MAX_LEN);
+	memcpy(&ctx->cfg, &scratch.cfg, sizeof(ctx->cfg));
+	kp_kdf_cache_clear(ctx);
+	n = kp_kdf_cache_export(&scratch, keys);
+	for (i = 0; i < n; i++) {
+		kp_kdf_cache_add(ctx, keys[i].kdf, keys[i].salt,
+		                 keys[i].opslimit, keys[i].memlimit,
+		                 keys[i].parallelism, keys[i].key);
+	}
+
+out:
+	err_no = errno;
+	sodium_free(keys);
+	kp_kdf_cache_fini(&scratch);
+	sodium_free(scratch.password);
+	errno = err_no;
+	return ret;
+}
+
+/*
+ * Fill unsafe with content of safe it names.
+ */
+static kp_error_t
+open_safe(struct agent *agent, struct kp_unsafe *unsafe)
+{
+	kp_error_t ret;
+	struct kp_ctx *ctx = agent->ctx;
+	struct kp_safe safe;
+
+	if (ctx->password[0] == '\0') {
+		return KP_LOCKED;
+	}
+
+	if ((ret = kp_safe_init(ctx, &safe, unsafe->name)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = kp_safe_open(ctx, &safe, 0)) != KP_SUCCESS) {
+		kp_safe_close(ctx, &safe);
+		return ret;
+	}
+
+	/* Safe with a password too large for a message is read by the
+	 * client itself, large metadata goes in a sealed memory file */
+	strlcpy(unsafe->name, safe.name, PATH_MAX);
+	if (strlcpy(unsafe->password, safe.password, KP_PASSWORD_MAX_LEN)
+	    >= KP_PASSWORD_MAX_LEN) {
+		kp_safe_close(ctx, &safe);
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	if (strlcpy(unsafe->metadata, safe.metadata, KP_METADATA_MAX_LEN)
+	    >= KP_METADATA_MAX_LEN) {
+		ret = kp_agent_unsafe_seal(unsafe, safe.metadata);
+	}
+	unsafe->id = safe.id;
+	kp_safe_close(ctx, &safe);
+
+	return ret;
+}
+
+static kp_error_t
+save_safe(struct agent *agent, struct kp_unsafe *unsafe)
+{
+	kp_error_t ret;
+	struct kp_ctx *ctx = agent->ctx;
+	struct kp_safe safe;
+	char cfg_path[PATH_MAX] = "";
+
+	if (ctx->password[0] == '\0') {
+		return KP_LOCKED;
+	}
+
+	/* Safe is encrypted with its own workspace parameters */
+	if ((ret = kp_cfg_find(ctx, unsafe->name, cfg_path, PATH_MAX))
+	    != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = kp_cfg_load(ctx, cfg_path)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = kp_safe_init(ctx, &safe, unsafe->name)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	/* Existing safe is overwritten, no need to decrypt it */
+	ret = kp_safe_open(ctx, &safe, KP_CREATE);
+	if (ret == KP_ERRNO && errno == EEXIST) {
+		ret = KP_SUCCESS;
+	}
+
+	if (ret == KP_SUCCESS) {
+		ret = kp_safe_set(&safe, unsafe->password,
+		                  kp_agent_unsafe_metadata(unsafe));
+	}
+
+	if (ret == KP_SUCCESS) {
+		ret = kp_safe_save(ctx, &safe);
+	}
+	unsafe->id = safe.id;
+
+	kp_safe_close(ctx, &safe);
+
+	return ret;
+}
+
+/*
+ * Turn expiry wheel once a second, as long as some safe has a timeout.
+ */
+static void
+tick(evutil_socket_t fd, short events, void *_agent)
+{
+	struct agent *agent = _agent;
+	struct timeval timeval = { 1, 0 };
+
+	if (kp_agent_expire(&agent->kp_agent) > 0) {
+		evtimer_add(agent->tick, &timeval);
+	}
+}
+
+/*
+ * Workspace changed. Once watch failed, clients list workspace themselves.
+ */
+static void
+refresh(evutil_socket_t fd, short events, void *_agent)
+{
+	struct agent *agent = _agent;
+	kp_error_t ret;
+
+	if ((ret = kp_agent_watch_read(&agent->kp_agent)) != KP_SUCCESS) {
+		kp_warn(ret, "cannot watch workspace anymore");
+		event_del(agent->watcher);
+		kp_agent_unwatch(&agent->kp_agent);
+	}
+}
+
+/*
+ * Most locked memory stored safes may hold, so that the whole agent stays
+ * within RLIMIT_MEMLOCK.
+ */
+static size_t
+memlock_budget(void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_MEMLOCK, &rlim) != 0
+	    || rlim.rlim_cur == RLIM_INFINITY
+	    || rlim.rlim_cur >= SIZE_MAX) {
+		return SIZE_MAX;
+	}
+
+	if (rlim.rlim_cur < 2 * MEMLOCK_RESERVE) {
+		return rlim.rlim_cur / 2;
+	}
+
+	return rlim.rlim_cur - MEMLOCK_RESERVE;
+}
+
+static kp_error_t
+parse_opt(struct kp_ctx *ctx, int argc, char **argv)
+{
+	int opt;
+	long cpus;
+	kp_error_t ret = KP_SUCCESS;
+	static struct option longopts[] = {
+		{ "no-daemon", no_argument,       NULL, 'd' },
+		{ "max-mem",   required_argument, NULL, 'x' },
+		{ "jobs",      required_argument, NULL, 'j' },
+		{ "encrypt",   no_argument,       NULL, 'e' },
+		{ "takeover",  no_argument,       NULL, 't' },
+		{ NULL,        0,                 NULL, 0   },
+	};
+
+	while ((opt = getopt_long(argc, argv, "dj:", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			daemonize = false;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'x':
+			max_mem = atol(optarg);
+			break;
+		case 'e':
+			encrypt = true;
+			break;
+		case 't':
+			takeover = true;
 			break;
 		default:
 			ret = KP_EINPUT;
@@ -399,6 +1624,11 @@ parse_opt(struct kp_ctx *ctx, int argc, char **argv)
 		}
 	}
 
+	if (jobs == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = cpus > 0 ? cpus : 1;
+	}
+
 	return ret;
 }
 
@@ -406,5 +1636,13 @@ void
 usage(void)
 {
 	printf("options:\n");
-	printf("    -d, --no-daemon    Do not daemonize\n");
+	printf("    -d, --no-daemon      Do not daemonize\n");
+	printf("    -j, --jobs=jobs      Number of safes opened or saved at once. Default to one\n"
+	       "                         per cpu\n");
+	printf("    --max-mem=bytes      Locked memory of stored safes, least recently used are\n"
+	       "                         evicted beyond. Default to RLIMIT_MEMLOCK\n");
+	printf("    --encrypt            Keep stored safes encrypted in ordinary memory,\n"
+	       "                         only the agent key stays locked\n");
+	printf("    --takeover           Replace agent from environment, keeping its socket,\n"
+	       "                         stored safes and unlocked workspace\n");
 }
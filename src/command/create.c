@@ -79,7 +79,7 @@ create(struct kp_ctx *ctx, int argc, char **argv)
 		return ret;
 	}
 
-	if (ctx->password[0] == '\0') {
+	if (ctx->password[0] == '\0' && !ctx->agent.unlocked) {
 		/* Ask for password, otherwise it is asked on kp_safe_save which seems
 		 * weird for user */
 		if ((ret = kp_password_prompt(ctx, false,
@@ -101,16 +101,43 @@ create(struct kp_ctx *ctx, int argc, char **argv)
 		goto out;
 	}
 
+	if (generate && password_len <= 0) {
+		ret = KP_EINPUT;
+		kp_warn(ret, "invalid password length %d", password_len);
+		goto out;
+	}
+
+	/* Safe plain is password + '\0' + metadata + '\0' */
+	if (generate && (size_t)password_len + sizeof(KP_METADATA_TEMPLATE) + 1
+	    > ctx->plain_max_size) {
+		errno = EFBIG;
+		ret = KP_ERRNO;
+		kp_warn(ret, "safe too long, %s allows %zu bytes",
+		        KP_PLAIN_MAX_SIZE_ENV, ctx->plain_max_size);
+		goto out;
+	}
+
+	/* Only a typed password is bound to prompt buffer */
+	if ((password = sodium_malloc(generate ? (size_t)password_len + 1
+	                                       : KP_PASSWORD_MAX_LEN)) == NULL) {
+		errno = ENOMEM;
+		ret = KP_ERRNO;
+		goto out;
+	}
+
 	if (generate) {
-		kp_password_generate(safe.password, password_len);
+		kp_password_generate(password, password_len);
 	} else {
-		if ((ret = kp_password_prompt(ctx, true, safe.password,
+		if ((ret = kp_password_prompt(ctx, true, password,
 		                              "safe")) != KP_SUCCESS) {
 			goto out;
 		}
 	}
 
-	snprintf((char *)safe.metadata, KP_METADATA_MAX_LEN, KP_METADATA_TEMPLATE);
+	if ((ret = kp_safe_set(&safe, password, KP_METADATA_TEMPLATE))
+	    != KP_SUCCESS) {
+		goto out;
+	}
 
 	if ((ret = kp_edit(ctx, &safe)) != KP_SUCCESS) {
 		goto out;
@@ -121,7 +148,7 @@ create(struct kp_ctx *ctx, int argc, char **argv)
 	}
 
 	if (open) {
-		if ((ret = kp_safe_store(ctx, &safe, timeout)) != KP_SUCCESS) {
+		if ((ret = kp_safe_store(ctx, &safe, timeout, false)) != KP_SUCCESS) {
 			kp_warn(ret, "cannot store safe in agent");
 			goto out;
 		}
@@ -181,5 +208,5 @@ usage(void)
 	printf("    -g, --generate     Randomly generate a password\n");
 	printf("    -l, --length=len   Length of the generated passwerd. Default to 20\n");
 	printf("    -o, --open         Keep safe open in agent\n");
-	printf("    -t, --timeout      Set safe timeout. Default to %d s\n", timeout);
+	printf("    -t, --timeout      Set safe timeout, 0 for none. Default to %d s\n", timeout);
 }
@@ -35,6 +35,7 @@
 
 static kp_error_t edit(struct kp_ctx *ctx, int argc, char **argv);
 static kp_error_t parse_opt(struct kp_ctx *, int, char **);
+static kp_error_t generate_password(struct kp_ctx *, struct kp_safe *);
 static kp_error_t edit_password(struct kp_ctx *, struct kp_safe *);
 static kp_error_t confirm_empty_password(bool *);
 static void usage(void);
@@ -91,7 +92,9 @@ edit(struct kp_ctx *ctx, int argc, char **argv)
 
 	if (password) {
 		if (generate) {
-			kp_password_generate(safe.password, password_len);
+			if ((ret = generate_password(ctx, &safe)) != KP_SUCCESS) {
+				return ret;
+			}
 		} else {
 			if ((ret = edit_password(ctx, &safe)) != KP_SUCCESS) {
 				return ret;
@@ -116,6 +119,40 @@ edit(struct kp_ctx *ctx, int argc, char **argv)
 	return KP_SUCCESS;
 }
 
+static kp_error_t
+generate_password(struct kp_ctx *ctx, struct kp_safe *safe)
+{
+	kp_error_t ret;
+	char *generated;
+
+	if (password_len <= 0) {
+		ret = KP_EINPUT;
+		kp_warn(ret, "invalid password length %d", password_len);
+		return ret;
+	}
+
+	/* Safe plain is password + '\0' + metadata + '\0' */
+	if ((size_t)password_len + strlen(safe->metadata) + 2
+	    > ctx->plain_max_size) {
+		errno = EFBIG;
+		ret = KP_ERRNO;
+		kp_warn(ret, "safe too long, %s allows %zu bytes",
+		        KP_PLAIN_MAX_SIZE_ENV, ctx->plain_max_size);
+		return ret;
+	}
+
+	if ((generated = sodium_malloc(password_len + 1)) == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	kp_password_generate(generated, password_len);
+	ret = kp_safe_set_password(safe, generated);
+
+	sodium_free(generated);
+	return ret;
+}
+
 static kp_error_t
 edit_password(struct kp_ctx *ctx, struct kp_safe *safe)
 {
@@ -138,8 +175,7 @@ edit_password(struct kp_ctx *ctx, struct kp_safe *safe)
 	}
 
 	if (confirm) {
-		memcpy(safe->password, password, password_len);
-		safe->password[password_len] = '\0';
+		ret = kp_safe_set_password(safe, password);
 	}
 
 out:
@@ -28,19 +28,25 @@
 #include "init.h"
 #include "prompt.h"
 #include "config.h"
+#include "kdf.h"
 #include "log.h"
 
 static kp_error_t init(struct kp_ctx *ctx, int argc, char **argv);
 static kp_error_t parse_opt(struct kp_ctx *, int, char **);
+static void       usage(void);
 
 struct kp_cmd kp_cmd_init = {
 	.main  = init,
-	.usage = NULL,
-	.opts  = "init",
+	.usage = usage,
+	.opts  = "init [-c] [-t ms] [--max-mem bytes]",
 	.desc  = "Initialize a new password safe directory. "
 	         "Default to ~/" KP_PATH,
 };
 
+static bool calibrate = false;
+static unsigned int target_ms = 500;
+static size_t max_mem = 0;
+
 kp_error_t
 init(struct kp_ctx *ctx, int argc, char **argv)
 {
@@ -58,6 +64,24 @@ init(struct kp_ctx *ctx, int argc, char **argv)
 		}
 	}
 
+	if (calibrate) {
+		unsigned int elapsed;
+
+		if ((ret = kp_kdf_calibrate(ctx, target_ms, max_mem, &elapsed))
+		    != KP_SUCCESS) {
+			kp_warn(ret, "cannot calibrate kdf");
+			return ret;
+		}
+
+		printf("%s: memlimit %zu, opslimit %llu, parallelism %u (%u ms)\n",
+		       kp_kdf_name(ctx->cfg.kdf), ctx->cfg.memlimit,
+		       ctx->cfg.opslimit, ctx->cfg.parallelism, elapsed);
+
+		if (elapsed > target_ms) {
+			kp_warn(KP_EINPUT, "cannot meet %u ms target", target_ms);
+		}
+	}
+
 	if ((ret = kp_password_prompt(ctx, true, (char *)ctx->password,
 	                              "master")) != KP_SUCCESS) {
 		kp_warn(ret, "cannot prompt password");
@@ -82,19 +106,46 @@ parse_opt(struct kp_ctx *ctx, int argc, char **argv)
 {
 	int opt;
 	kp_error_t ret = KP_SUCCESS;
+	enum kp_kdf kdf = ctx->cfg.kdf;
+	size_t memlimit = 0;
+	long long unsigned opslimit = 0;
+	unsigned int parallelism = 0;
 	static struct option longopts[] = {
-		{ "memlimit", required_argument, NULL, 'm' }, /* hidden option */
-		{ "opslimit", required_argument, NULL, 'o' }, /* hidden option */
-		{ NULL,       0,                 NULL, 0   },
+		{ "calibrate",   no_argument,       NULL, 'c' },
+		{ "target-ms",   required_argument, NULL, 't' },
+		{ "max-mem",     required_argument, NULL, 'x' },
+		{ "kdf",         required_argument, NULL, 'k' }, /* hidden option */
+		{ "memlimit",    required_argument, NULL, 'm' }, /* hidden option */
+		{ "opslimit",    required_argument, NULL, 'o' }, /* hidden option */
+		{ "parallelism", required_argument, NULL, 'p' }, /* hidden option */
+		{ NULL,          0,                 NULL, 0   },
 	};
 
-	while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "ct:", longopts, NULL)) != -1) {
 		switch (opt) {
+		case 'c':
+			calibrate = true;
+			break;
+		case 't':
+			target_ms = atoi(optarg);
+			break;
+		case 'x':
+			max_mem = atol(optarg);
+			break;
+		case 'k':
+			if (kp_kdf_from_name(optarg, &kdf) != KP_SUCCESS) {
+				ret = KP_EINPUT;
+				kp_warn(ret, "unknown kdf %s", optarg);
+			}
+			break;
 		case 'm':
-			ctx->cfg.memlimit = atol(optarg);
+			memlimit = atol(optarg);
 			break;
 		case 'o':
-			ctx->cfg.opslimit = atoll(optarg);
+			opslimit = atoll(optarg);
+			break;
+		case 'p':
+			parallelism = atoi(optarg);
 			break;
 		default:
 			ret = KP_EINPUT;
@@ -102,5 +153,35 @@ parse_opt(struct kp_ctx *ctx, int argc, char **argv)
 		}
 	}
 
+	if (ret != KP_SUCCESS) {
+		return ret;
+	}
+
+	/* Each kdf has its own cost scale, explicit costs override defaults */
+	if ((ret = kp_kdf_defaults(ctx, kdf)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if (memlimit != 0) {
+		ctx->cfg.memlimit = memlimit;
+	}
+
+	if (opslimit != 0) {
+		ctx->cfg.opslimit = opslimit;
+	}
+
+	if (parallelism != 0) {
+		ctx->cfg.parallelism = parallelism;
+	}
+
 	return ret;
 }
+
+void
+usage(void)
+{
+	printf("options:\n");
+	printf("    -c, --calibrate      Tune kdf cost to this host\n");
+	printf("    -t, --target-ms=ms   Calibration target unlock time. Default to %u ms\n", target_ms);
+	printf("    --max-mem=bytes      Calibration memory ceiling. Default to %zu\n", kp_kdf_default_max_mem());
+}
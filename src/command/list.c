@@ -26,10 +26,22 @@
 #include "kickpass.h"
 
 #include "command.h"
+#include "kpagent.h"
 #include "list.h"
 #include "log.h"
 
+/*
+ * Safes listed by agent.
+ */
+struct names {
+	char **safes;
+	int nsafes;
+};
+
 static kp_error_t list(struct kp_ctx *, int, char **);
+static kp_error_t list_agent(struct kp_ctx *, const char *, char *, bool);
+static kp_error_t list_prefix(char *, const char *);
+static kp_error_t list_name(const char *, void *);
 static kp_error_t list_dir(struct kp_ctx *, char *, char *, bool);
 static kp_error_t list_dir_r(char ***, int *, char *);
 static int        path_sort(const void *, const void *);
@@ -46,13 +58,17 @@ list(struct kp_ctx *ctx, int argc, char **argv)
 {
 	int i;
 
-	if (argc == optind) {
+	if (argc == optind && list_agent(ctx, "", "", false) != KP_SUCCESS) {
 		list_dir(ctx, ctx->ws_path, "", false);
 	}
 
 	for (i = optind; i < argc; i++) {
 		char path[PATH_MAX];
 
+		if (list_agent(ctx, argv[i], "  ", true) == KP_SUCCESS) {
+			continue;
+		}
+
 		if (strlcpy(path, ctx->ws_path, PATH_MAX) >= PATH_MAX) {
 			errno = ENOMEM;
 			return KP_ERRNO;
@@ -73,6 +89,109 @@ list(struct kp_ctx *ctx, int argc, char **argv)
 	return KP_SUCCESS;
 }
 
+/*
+ * List safes below dir as agent knows them, printed as listing workspace
+ * would. Fail when agent cannot tell or knows no such safe, workspace is
+ * then listed instead.
+ */
+static kp_error_t
+list_agent(struct kp_ctx *ctx, const char *dir, char *indent, bool print_path)
+{
+	kp_error_t ret;
+	struct names names = { NULL, 0 };
+	char prefix[PATH_MAX];
+	size_t ignore;
+	int i;
+
+	if (!ctx->agent.connected) {
+		errno = ENOTSUP;
+		return KP_ERRNO;
+	}
+
+	if ((ret = list_prefix(prefix, dir)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = kp_agent_list(&ctx->agent, prefix, list_name, &names))
+	    != KP_SUCCESS) {
+		goto out;
+	}
+
+	if (names.nsafes == 0) {
+		errno = ENOENT;
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	qsort(names.safes, names.nsafes, sizeof(char *), path_sort);
+
+	if (print_path) {
+		printf("%s/\n", dir);
+	}
+	ignore = strlen(prefix);
+	for (i = 0; i < names.nsafes; i++) {
+		printf("%s%s\n", indent, names.safes[i] + ignore);
+	}
+
+out:
+	for (i = 0; i < names.nsafes; i++) {
+		free(names.safes[i]);
+	}
+	free(names.safes);
+
+	return ret;
+}
+
+/*
+ * Directory as a prefix of safe names, separators collapsed and a trailing
+ * one so that whole components only match.
+ */
+static kp_error_t
+list_prefix(char *prefix, const char *dir)
+{
+	size_t len = 0;
+
+	for (; *dir != '\0'; dir++) {
+		if (*dir == '/' && (len == 0 || prefix[len - 1] == '/')) {
+			continue;
+		}
+		if (len >= PATH_MAX - 2) {
+			errno = ENAMETOOLONG;
+			return KP_ERRNO;
+		}
+		prefix[len++] = *dir;
+	}
+
+	if (len > 0 && prefix[len - 1] != '/') {
+		prefix[len++] = '/';
+	}
+	prefix[len] = '\0';
+
+	return KP_SUCCESS;
+}
+
+static kp_error_t
+list_name(const char *name, void *_names)
+{
+	struct names *names = _names;
+	char **safes;
+
+	if ((safes = reallocarray(names->safes, names->nsafes + 1,
+	                          sizeof(char *))) == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+	names->safes = safes;
+
+	if ((safes[names->nsafes] = strdup(name)) == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+	names->nsafes++;
+
+	return KP_SUCCESS;
+}
+
 static kp_error_t
 list_dir_r(char ***safes, int *nsafes, char *root)
 {
@@ -40,11 +40,12 @@ static void       usage(void);
 struct kp_cmd kp_cmd_open = {
 	.main  = open_safe,
 	.usage = usage,
-	.opts  = "open [-t] <safe>",
+	.opts  = "open [-t timeout] [-i] <safe>",
 	.desc  = "Open a password safe and load it in kickpass agent",
 };
 
 static int timeout = 3600;
+static bool idle = false;
 
 kp_error_t
 open_safe(struct kp_ctx *ctx, int argc, char **argv)
@@ -78,7 +79,7 @@ open_safe(struct kp_ctx *ctx, int argc, char **argv)
 		return ret;
 	}
 
-	if ((ret = kp_safe_store(ctx, &safe, timeout)) != KP_SUCCESS) {
+	if ((ret = kp_safe_store(ctx, &safe, timeout, idle)) != KP_SUCCESS) {
 		kp_warn(ret, "cannot store safe in agent");
 		return ret;
 	}
@@ -98,15 +99,19 @@ parse_opt(struct kp_ctx *ctx, int argc, char **argv)
 	int opt;
 	kp_error_t ret = KP_SUCCESS;
 	static struct option longopts[] = {
-		{ "timeout", no_argument,       NULL, 't' },
+		{ "timeout", required_argument, NULL, 't' },
+		{ "idle",    no_argument,       NULL, 'i' },
 		{ NULL,      0,                 NULL, 0   },
 	};
 
-	while ((opt = getopt_long(argc, argv, "t:", longopts, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "t:i", longopts, NULL)) != -1) {
 		switch (opt) {
 		case 't':
 			timeout = atoi(optarg);
 			break;
+		case 'i':
+			idle = true;
+			break;
 		default:
 			ret = KP_EINPUT;
 			kp_warn(ret, "unknown option %c", opt);
@@ -120,5 +125,6 @@ void
 usage(void)
 {
 	printf("options:\n");
-	printf("    -t, --timeout      Set safe timeout. Default to %d s\n", timeout);
+	printf("    -t, --timeout      Set safe timeout, 0 for none. Default to %d s\n", timeout);
+	printf("    -i, --idle         Timeout restarts each time safe is used\n");
 }
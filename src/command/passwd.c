@@ -0,0 +1,492 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sodium.h>
+#include <unistd.h>
+
+#include "kickpass.h"
+
+#include "command.h"
+#include "config.h"
+#include "kdf.h"
+#include "kpagent.h"
+#include "log.h"
+#include "passwd.h"
+#include "safe.h"
+
+#define PASSWD_JOURNAL     ".passwd"
+#define PASSWD_CHECK_SIZE  16
+#define PASSWD_CHECK_MSG   "kickpass passwd"
+
+/*
+ * Journal of an ongoing master password change, so that an interrupted one
+ * can be resumed. Check values tell whether prompted passwords are the same
+ * as the interrupted run ones.
+ */
+struct journal {
+	enum kp_kdf kdf;
+	long long unsigned opslimit;
+	size_t memlimit;
+	unsigned int parallelism;
+	unsigned char salt[KP_KDF_SALT_SIZE];
+	unsigned char check[PASSWD_CHECK_SIZE];
+	unsigned char new_salt[KP_KDF_SALT_SIZE];
+	unsigned char new_check[PASSWD_CHECK_SIZE];
+};
+
+/*
+ * Rewrap of the safes of a workspace, counting safes left with old master
+ * password.
+ */
+struct rewrap {
+	struct kp_ctx *ctx;
+	const char *old_password;
+	struct kp_key *old;
+	int failed;
+};
+
+static kp_error_t passwd(struct kp_ctx *, int, char **);
+static kp_error_t passwd_check(struct kp_ctx *, unsigned char *);
+static kp_error_t path_join(const char *, const char *, char *);
+static kp_error_t journal_read(struct kp_ctx *, const char *,
+                               struct journal *);
+static kp_error_t journal_write(struct kp_ctx *, const char *,
+                                const struct journal *);
+static kp_error_t journal_hex(const char *, unsigned char *, size_t);
+static kp_error_t rewrap_safe(const char *, void *);
+static void rewrap_done(const char *, kp_error_t, void *);
+
+struct kp_cmd kp_cmd_passwd = {
+	.main  = passwd,
+	.usage = NULL,
+	.opts  = "passwd [path]",
+	.desc  = "Change master password of a workspace",
+};
+
+kp_error_t
+passwd(struct kp_ctx *ctx, int argc, char **argv)
+{
+	kp_error_t ret = KP_SUCCESS, err;
+	char sub[PATH_MAX] = "";
+	char path[PATH_MAX];
+	char *old_password = NULL;
+	struct kp_key *old = NULL;
+	struct journal journal;
+	struct kp_storage_batch batch;
+	unsigned char check[PASSWD_CHECK_SIZE];
+	struct rewrap rewrap = { .ctx = ctx, .failed = 0 };
+	bool resume = false;
+
+	if (optind < argc) {
+		if (strlcpy(sub, argv[optind++], PATH_MAX) >= PATH_MAX) {
+			errno = ENOMEM;
+			return KP_ERRNO;
+		}
+	}
+
+	/* Safes are rewrapped here, never by an agent holding old password */
+	if (ctx->agent.connected) {
+		kp_agent_close(&ctx->agent);
+		ctx->agent.connected = false;
+	}
+
+	old_password = sodium_malloc(KP_PASSWORD_MAX_LEN);
+	if (!old_password) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	/* Safes on other kdf params than config are unwrapped with this key */
+	old = sodium_malloc(sizeof(struct kp_key));
+	if (!old) {
+		sodium_free(old_password);
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+	sodium_memzero(old, sizeof(struct kp_key));
+
+	if ((ret = kp_password_prompt(ctx, false, (char *)ctx->password,
+	                              "master")) != KP_SUCCESS) {
+		kp_warn(ret, "cannot prompt password");
+		goto out;
+	}
+
+	ret = journal_read(ctx, sub, &journal);
+	if (ret == KP_SUCCESS) {
+		resume = true;
+	} else if (ret != KP_ERRNO || errno != ENOENT) {
+		kp_warn(ret, "cannot read interrupted passwd journal");
+		goto out;
+	}
+
+	if (resume) {
+		/* Config might already be rewrapped, trust the journal */
+		ctx->cfg.kdf = journal.kdf;
+		ctx->cfg.opslimit = journal.opslimit;
+		ctx->cfg.memlimit = journal.memlimit;
+		ctx->cfg.parallelism = journal.parallelism;
+		memcpy(ctx->cfg.salt, journal.salt, KP_KDF_SALT_SIZE);
+	} else {
+		if ((ret = kp_cfg_load(ctx, sub)) != KP_SUCCESS) {
+			kp_warn(ret, "cannot load kickpass config");
+			goto out;
+		}
+
+		journal.kdf = ctx->cfg.kdf;
+		journal.opslimit = ctx->cfg.opslimit;
+		journal.memlimit = ctx->cfg.memlimit;
+		journal.parallelism = ctx->cfg.parallelism;
+		memcpy(journal.salt, ctx->cfg.salt, KP_KDF_SALT_SIZE);
+		randombytes_buf(journal.new_salt, KP_KDF_SALT_SIZE);
+	}
+
+	/* Old master key stays in ctx cache for the whole rewrap */
+	if ((ret = passwd_check(ctx, check)) != KP_SUCCESS) {
+		kp_warn(ret, "cannot derive master key");
+		goto out;
+	}
+
+	if (resume && sodium_memcmp(check, journal.check,
+	                            PASSWD_CHECK_SIZE) != 0) {
+		ret = KP_EDECRYPT;
+		kp_warnx(ret, "wrong master password");
+		goto out;
+	}
+	memcpy(journal.check, check, PASSWD_CHECK_SIZE);
+
+	memcpy(old_password, ctx->password, KP_PASSWORD_MAX_LEN);
+	if ((ret = kp_password_prompt(ctx, true, (char *)ctx->password,
+	                              "new master")) != KP_SUCCESS) {
+		kp_warn(ret, "cannot prompt password");
+		goto out;
+	}
+
+	memcpy(ctx->cfg.salt, journal.new_salt, KP_KDF_SALT_SIZE);
+	if ((ret = passwd_check(ctx, check)) != KP_SUCCESS) {
+		kp_warn(ret, "cannot derive new master key");
+		goto out;
+	}
+
+	if (resume) {
+		if (sodium_memcmp(check, journal.new_check,
+		                  PASSWD_CHECK_SIZE) != 0) {
+			ret = KP_EINPUT;
+			kp_warnx(ret, "new master password differs from the "
+			         "one of interrupted passwd");
+			goto out;
+		}
+	} else {
+		memcpy(journal.new_check, check, PASSWD_CHECK_SIZE);
+		if ((ret = journal_write(ctx, sub, &journal)) != KP_SUCCESS) {
+			kp_warn(ret, "cannot write passwd journal");
+			goto out;
+		}
+	}
+
+	/* Safes are synced together, before config tells they are done */
+	if ((ret = kp_storage_batch_begin(ctx, &batch, rewrap_done,
+	                                  &rewrap.failed)) != KP_SUCCESS) {
+		kp_warn(ret, "cannot rewrap safes");
+		goto out;
+	}
+
+	rewrap.old_password = old_password;
+	rewrap.old = old;
+	if ((ret = kp_workspace_walk(ctx, sub, false, rewrap_safe, &rewrap))
+	    != KP_SUCCESS) {
+		kp_warn(ret, "cannot rewrap safes");
+	}
+	/* Safes failing to sync are counted as failed by rewrap_done */
+	err = kp_storage_batch_commit(ctx);
+	if (ret == KP_SUCCESS && err != KP_SUCCESS && rewrap.failed == 0) {
+		ret = err;
+		kp_warn(ret, "cannot sync rewrapped safes");
+	}
+	if (ret != KP_SUCCESS) {
+		goto out;
+	}
+
+	if (rewrap.failed > 0) {
+		ret = KP_EINPUT;
+		kp_warnx(ret, "%d safes left with old master password, "
+		         "run passwd again to resume", rewrap.failed);
+		goto out;
+	}
+
+	/* Config holds workspace salt, update it last */
+	if ((ret = kp_cfg_save(ctx, sub)) != KP_SUCCESS) {
+		kp_warn(ret, "cannot save kickpass config");
+		goto out;
+	}
+
+	if ((ret = path_join(sub, PASSWD_JOURNAL, path)) != KP_SUCCESS) {
+		goto out;
+	}
+
+	if (unlinkat(ctx->ws_fd, path, 0) != 0) {
+		ret = KP_ERRNO;
+		kp_warn(ret, "cannot remove passwd journal");
+		goto out;
+	}
+
+out:
+	sodium_free(old);
+	sodium_free(old_password);
+
+	return ret;
+}
+
+/*
+ * Check value of the master key derived with current password and config.
+ */
+static kp_error_t
+passwd_check(struct kp_ctx *ctx, unsigned char *check)
+{
+	kp_error_t ret;
+	unsigned char master[KP_MASTER_KEY_SIZE];
+
+	if ((ret = kp_kdf_cache_derive(ctx, ctx->cfg.kdf, ctx->cfg.salt,
+	                               ctx->cfg.opslimit, ctx->cfg.memlimit,
+	                               ctx->cfg.parallelism, master))
+	    != KP_SUCCESS) {
+		return ret;
+	}
+
+	if (crypto_generichash(check, PASSWD_CHECK_SIZE,
+	                       (const unsigned char *)PASSWD_CHECK_MSG,
+	                       strlen(PASSWD_CHECK_MSG),
+	                       master, KP_MASTER_KEY_SIZE) != 0) {
+		ret = KP_EINTERNAL;
+	}
+
+	sodium_memzero(master, sizeof(master));
+
+	return ret;
+}
+
+static kp_error_t
+path_join(const char *sub, const char *name, char *path)
+{
+	if (snprintf(path, PATH_MAX, "%s%s%s", sub,
+	             strlen(sub) == 0 ? "" : "/", name) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return KP_ERRNO;
+	}
+
+	return KP_SUCCESS;
+}
+
+static kp_error_t
+journal_read(struct kp_ctx *ctx, const char *sub, struct journal *journal)
+{
+	kp_error_t ret = KP_SUCCESS;
+	char path[PATH_MAX];
+	char buf[1024];
+	char *line = NULL, *save_line = NULL;
+	ssize_t len;
+	int fd, seen = 0;
+
+	if ((ret = path_join(sub, PASSWD_JOURNAL, path)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((fd = openat(ctx->ws_fd, path, O_RDONLY)) < 0) {
+		return KP_ERRNO;
+	}
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0) {
+		return KP_ERRNO;
+	}
+	buf[len] = '\0';
+
+	line = strtok_r(buf, "\n", &save_line);
+	while (line != NULL) {
+		char *key, *value;
+
+		key = strtok(line, ":");
+		value = strtok(NULL, ":");
+		if (key == NULL || value == NULL) {
+			return KP_INVALID_STORAGE;
+		}
+		value += strspn(value, " ");
+
+		if (strcmp(key, "kdf") == 0) {
+			ret = kp_kdf_from_name(value, &journal->kdf);
+		} else if (strcmp(key, "opslimit") == 0) {
+			journal->opslimit = strtoull(value, NULL, 10);
+		} else if (strcmp(key, "memlimit") == 0) {
+			journal->memlimit = strtoull(value, NULL, 10);
+		} else if (strcmp(key, "parallelism") == 0) {
+			journal->parallelism = strtoul(value, NULL, 10);
+		} else if (strcmp(key, "salt") == 0) {
+			ret = journal_hex(value, journal->salt,
+			                  KP_KDF_SALT_SIZE);
+		} else if (strcmp(key, "check") == 0) {
+			ret = journal_hex(value, journal->check,
+			                  PASSWD_CHECK_SIZE);
+		} else if (strcmp(key, "new_salt") == 0) {
+			ret = journal_hex(value, journal->new_salt,
+			                  KP_KDF_SALT_SIZE);
+		} else if (strcmp(key, "new_check") == 0) {
+			ret = journal_hex(value, journal->new_check,
+			                  PASSWD_CHECK_SIZE);
+		} else {
+			return KP_INVALID_STORAGE;
+		}
+
+		if (ret != KP_SUCCESS) {
+			return KP_INVALID_STORAGE;
+		}
+
+		seen++;
+		line = strtok_r(NULL, "\n", &save_line);
+	}
+
+	if (seen != 8) {
+		return KP_INVALID_STORAGE;
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Journal is written aside then renamed, so it is either complete or absent.
+ */
+static kp_error_t
+journal_write(struct kp_ctx *ctx, const char *sub,
+              const struct journal *journal)
+{
+	kp_error_t ret = KP_SUCCESS;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	char salt[KP_KDF_SALT_SIZE * 2 + 1], new_salt[KP_KDF_SALT_SIZE * 2 + 1];
+	char check[PASSWD_CHECK_SIZE * 2 + 1];
+	char new_check[PASSWD_CHECK_SIZE * 2 + 1];
+	int fd;
+
+	if ((ret = path_join(sub, PASSWD_JOURNAL, path)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = path_join(sub, PASSWD_JOURNAL ".tmp", tmp))
+	    != KP_SUCCESS) {
+		return ret;
+	}
+
+	sodium_bin2hex(salt, sizeof(salt), journal->salt, KP_KDF_SALT_SIZE);
+	sodium_bin2hex(check, sizeof(check), journal->check,
+	               PASSWD_CHECK_SIZE);
+	sodium_bin2hex(new_salt, sizeof(new_salt), journal->new_salt,
+	               KP_KDF_SALT_SIZE);
+	sodium_bin2hex(new_check, sizeof(new_check), journal->new_check,
+	               PASSWD_CHECK_SIZE);
+
+	fd = openat(ctx->ws_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC,
+	            S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		return KP_ERRNO;
+	}
+
+	if (dprintf(fd, "kdf: %s\n"
+	                "opslimit: %llu\n"
+	                "memlimit: %zu\n"
+	                "parallelism: %u\n"
+	                "salt: %s\n"
+	                "check: %s\n"
+	                "new_salt: %s\n"
+	                "new_check: %s\n",
+	            kp_kdf_name(journal->kdf), journal->opslimit,
+	            journal->memlimit, journal->parallelism,
+	            salt, check, new_salt, new_check) < 0) {
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	if (fsync(fd) != 0) {
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+	if (renameat(ctx->ws_fd, tmp, ctx->ws_fd, path) != 0) {
+		ret = KP_ERRNO;
+		goto out;
+	}
+
+out:
+	close(fd);
+
+	return ret;
+}
+
+static kp_error_t
+journal_hex(const char *hex, unsigned char *bin, size_t size)
+{
+	size_t len;
+
+	if (sodium_hex2bin(bin, size, hex, strlen(hex), NULL, &len, NULL) != 0
+	    || len != size) {
+		return KP_INVALID_STORAGE;
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Workspace walk callback, rewrap safe at path with new master password.
+ */
+static kp_error_t
+rewrap_safe(const char *path, void *arg)
+{
+	struct rewrap *rewrap = arg;
+	struct kp_safe safe;
+	kp_error_t ret;
+
+	if ((ret = kp_safe_init(rewrap->ctx, &safe, path)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = kp_safe_rewrap(rewrap->ctx, &safe, rewrap->old_password,
+	                          rewrap->old)) != KP_SUCCESS) {
+		kp_warn(ret, "cannot rewrap %s", path);
+		rewrap->failed++;
+	}
+
+	return KP_SUCCESS;
+}
+
+/*
+ * Batch callback, count safes left with old master password.
+ */
+static void
+rewrap_done(const char *name, kp_error_t ret, void *arg)
+{
+	int *failed = arg;
+
+	if (ret != KP_SUCCESS) {
+		kp_warn(ret, "cannot sync %s", name);
+		(*failed)++;
+	}
+}
@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kickpass.h"
+
+#include "command.h"
+#include "config.h"
+#include "kdf.h"
+#include "log.h"
+#include "safe.h"
+#include "stat.h"
+
+/* Number of safes a worker reads before picking next ones */
+#define STAT_BATCH 64
+
+struct entry {
+	char *name;
+	kp_error_t ret;
+	struct kp_safe_stat stat;
+};
+
+/* Safes of a workspace, sub workspaces included */
+struct list {
+	struct entry *entries;
+	size_t n;
+};
+
+struct scan {
+	struct kp_ctx *ctx;
+	struct entry *entries;
+	size_t n;
+	size_t next;        /* first entry not picked by a worker */
+	pthread_mutex_t lock;
+};
+
+/* Safes sharing the same kdf parameters */
+struct bucket {
+	unsigned int version;
+	enum kp_kdf kdf;
+	long long unsigned opslimit;
+	size_t memlimit;
+	unsigned int parallelism;
+	size_t count;
+};
+
+static kp_error_t stats(struct kp_ctx *, int, char **);
+static kp_error_t parse_opt(struct kp_ctx *, int, char **);
+static void       usage(void);
+static kp_error_t scan(struct kp_ctx *, struct entry *, size_t);
+static void      *scan_worker(void *);
+static kp_error_t list_add(const char *, void *);
+static void       print_entry(const struct entry *);
+static void       print_summary(const struct entry *, size_t);
+static const char *kdf_name(enum kp_kdf);
+static int        entry_sort(const void *, const void *);
+static int        bucket_sort(const void *, const void *);
+
+struct kp_cmd kp_cmd_stat = {
+	.main  = stats,
+	.usage = usage,
+	.opts  = "stat [-s] [-j jobs] [path]",
+	.desc  = "Report kdf parameters, sizes and dates of safes without "
+	         "opening them",
+};
+
+static bool summary = false;
+static unsigned int jobs = 0;
+
+kp_error_t
+stats(struct kp_ctx *ctx, int argc, char **argv)
+{
+	kp_error_t ret = KP_SUCCESS;
+	char sub[PATH_MAX] = "";
+	struct list list = { NULL, 0 };
+	struct entry *entries;
+	size_t n, i;
+
+	if ((ret = parse_opt(ctx, argc, argv)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if (optind < argc) {
+		if (strlcpy(sub, argv[optind++], PATH_MAX) >= PATH_MAX) {
+			errno = ENOMEM;
+			return KP_ERRNO;
+		}
+	}
+
+	ret = kp_workspace_walk(ctx, sub, true, list_add, &list);
+	entries = list.entries;
+	n = list.n;
+	if (ret != KP_SUCCESS) {
+		kp_warn(ret, "cannot list safes");
+		goto out;
+	}
+
+	qsort(entries, n, sizeof(struct entry), entry_sort);
+
+	if ((ret = scan(ctx, entries, n)) != KP_SUCCESS) {
+		kp_warn(ret, "cannot read safes");
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (entries[i].ret != KP_SUCCESS) {
+			kp_warn(entries[i].ret, "cannot stat %s",
+			        entries[i].name);
+			continue;
+		}
+
+		if (!summary) {
+			print_entry(&entries[i]);
+		}
+	}
+
+	print_summary(entries, n);
+
+out:
+	for (i = 0; i < n; i++) {
+		free(entries[i].name);
+	}
+	free(entries);
+
+	return ret;
+}
+
+static kp_error_t
+parse_opt(struct kp_ctx *ctx, int argc, char **argv)
+{
+	int opt;
+	kp_error_t ret = KP_SUCCESS;
+	long cpus;
+	static struct option longopts[] = {
+		{ "summary", no_argument,       NULL, 's' },
+		{ "jobs",    required_argument, NULL, 'j' },
+		{ NULL,      0,                 NULL, 0   },
+	};
+
+	while ((opt = getopt_long(argc, argv, "sj:", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			summary = true;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		default:
+			ret = KP_EINPUT;
+			kp_warn(ret, "unknown option %c", opt);
+		}
+	}
+
+	if (jobs == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = cpus > 0 ? cpus : 1;
+	}
+
+	return ret;
+}
+
+void
+usage(void)
+{
+	printf("options:\n");
+	printf("    -s, --summary        Only print aggregated report\n");
+	printf("    -j, --jobs=jobs      Number of threads reading safes. Default to one per cpu\n");
+}
+
+/*
+ * Read safes headers on a pool of threads, each one picking a batch of safes
+ * at a time.
+ */
+static kp_error_t
+scan(struct kp_ctx *ctx, struct entry *entries, size_t n)
+{
+	struct scan scan;
+	pthread_t *workers;
+	unsigned int i, nworkers = 0, threads;
+
+	scan.ctx = ctx;
+	scan.entries = entries;
+	scan.n = n;
+	scan.next = 0;
+
+	threads = (n + STAT_BATCH - 1) / STAT_BATCH;
+	if (threads > jobs) {
+		threads = jobs;
+	}
+
+	if ((errno = pthread_mutex_init(&scan.lock, NULL)) != 0) {
+		return KP_ERRNO;
+	}
+
+	if ((workers = calloc(threads, sizeof(pthread_t))) == NULL) {
+		pthread_mutex_destroy(&scan.lock);
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&workers[i], NULL, scan_worker, &scan)
+		    != 0) {
+			break;
+		}
+		nworkers++;
+	}
+
+	/* Whatever is left, including everything when no thread started */
+	scan_worker(&scan);
+
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	free(workers);
+	pthread_mutex_destroy(&scan.lock);
+
+	return KP_SUCCESS;
+}
+
+static void *
+scan_worker(void *arg)
+{
+	struct scan *scan = arg;
+	size_t first, last, i;
+
+	for (;;) {
+		pthread_mutex_lock(&scan->lock);
+		first = scan->next;
+		last = first + STAT_BATCH < scan->n ? first + STAT_BATCH
+		                                    : scan->n;
+		scan->next = last;
+		pthread_mutex_unlock(&scan->lock);
+
+		if (first == last) {
+			break;
+		}
+
+		for (i = first; i < last; i++) {
+			struct kp_safe safe;
+			struct entry *entry = &scan->entries[i];
+
+			if ((entry->ret = kp_safe_init(scan->ctx, &safe,
+			                               entry->name))
+			    != KP_SUCCESS) {
+				continue;
+			}
+
+			entry->ret = kp_safe_stat(scan->ctx, &safe,
+			                          &entry->stat);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Workspace walk callback, add safe at path to list.
+ */
+static kp_error_t
+list_add(const char *path, void *arg)
+{
+	struct list *list = arg;
+	struct entry *tmp;
+
+	tmp = reallocarray(list->entries, list->n + 1, sizeof(struct entry));
+	if (tmp == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+	list->entries = tmp;
+
+	if ((tmp[list->n].name = strdup(path)) == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+	tmp[list->n].ret = KP_SUCCESS;
+	list->n++;
+
+	return KP_SUCCESS;
+}
+
+static void
+print_entry(const struct entry *entry)
+{
+	char mtime[32];
+
+	strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M",
+	         localtime(&entry->stat.mtime));
+
+	printf("%s: v%u %s opslimit %llu memlimit %zu parallelism %u, "
+	       "%zu bytes, %s\n", entry->name, entry->stat.version,
+	       kdf_name(entry->stat.kdf), entry->stat.opslimit,
+	       entry->stat.memlimit, entry->stat.parallelism,
+	       entry->stat.size, mtime);
+}
+
+/*
+ * Print safes count per version and per kdf parameters, weakest parameters
+ * first, then sizes and dates range.
+ */
+static void
+print_summary(const struct entry *entries, size_t n)
+{
+	struct bucket *buckets = NULL, *tmp;
+	size_t nbuckets = 0, count = 0, failed = 0, size = 0;
+	size_t min_size = 0, max_size = 0;
+	time_t oldest = 0, newest = 0;
+	size_t i, j;
+
+	for (i = 0; i < n; i++) {
+		const struct kp_safe_stat *stat = &entries[i].stat;
+
+		if (entries[i].ret != KP_SUCCESS) {
+			failed++;
+			continue;
+		}
+
+		for (j = 0; j < nbuckets; j++) {
+			if (buckets[j].version == stat->version
+			    && buckets[j].kdf == stat->kdf
+			    && buckets[j].opslimit == stat->opslimit
+			    && buckets[j].memlimit == stat->memlimit
+			    && buckets[j].parallelism == stat->parallelism) {
+				break;
+			}
+		}
+
+		if (j == nbuckets) {
+			tmp = reallocarray(buckets, nbuckets + 1,
+			                   sizeof(struct bucket));
+			if (tmp == NULL) {
+				errno = ENOMEM;
+				kp_warn(KP_ERRNO, "memory error");
+				free(buckets);
+				return;
+			}
+			buckets = tmp;
+			buckets[j].version = stat->version;
+			buckets[j].kdf = stat->kdf;
+			buckets[j].opslimit = stat->opslimit;
+			buckets[j].memlimit = stat->memlimit;
+			buckets[j].parallelism = stat->parallelism;
+			buckets[j].count = 0;
+			nbuckets++;
+		}
+		buckets[j].count++;
+
+		if (count == 0 || stat->size < min_size) {
+			min_size = stat->size;
+		}
+		if (count == 0 || stat->size > max_size) {
+			max_size = stat->size;
+		}
+		if (count == 0 || stat->mtime < oldest) {
+			oldest = stat->mtime;
+		}
+		if (count == 0 || stat->mtime > newest) {
+			newest = stat->mtime;
+		}
+		size += stat->size;
+		count++;
+	}
+
+	qsort(buckets, nbuckets, sizeof(struct bucket), bucket_sort);
+
+	printf("%zu safes, %zu unreadable\n", count, failed);
+
+	/* Buckets are sorted by version first */
+	for (i = 0; i < nbuckets; i = j) {
+		size_t versions = 0;
+
+		for (j = i; j < nbuckets
+		     && buckets[j].version == buckets[i].version; j++) {
+			versions += buckets[j].count;
+		}
+		printf("version %u: %zu\n", buckets[i].version, versions);
+	}
+
+	for (i = 0; i < nbuckets; i++) {
+		printf("%zu: v%u %s opslimit %llu memlimit %zu parallelism %u\n",
+		       buckets[i].count, buckets[i].version,
+		       kdf_name(buckets[i].kdf), buckets[i].opslimit,
+		       buckets[i].memlimit, buckets[i].parallelism);
+	}
+
+	if (count > 0) {
+		char from[32], to[32];
+
+		strftime(from, sizeof(from), "%Y-%m-%d %H:%M",
+		         localtime(&oldest));
+		strftime(to, sizeof(to), "%Y-%m-%d %H:%M", localtime(&newest));
+		printf("size: %zu to %zu bytes, %zu total\n", min_size,
+		       max_size, size);
+		printf("mtime: %s to %s\n", from, to);
+	}
+
+	free(buckets);
+}
+
+static const char *
+kdf_name(enum kp_kdf kdf)
+{
+	const char *name = kp_kdf_name(kdf);
+
+	return name == NULL ? "unknown" : name;
+}
+
+static int
+entry_sort(const void *a, const void *b)
+{
+	return strcmp(((const struct entry *)a)->name,
+	              ((const struct entry *)b)->name);
+}
+
+/*
+ * Order by version, kdf, then cost, weakest first.
+ */
+static int
+bucket_sort(const void *a, const void *b)
+{
+	const struct bucket *x = a, *y = b;
+
+	if (x->version != y->version) {
+		return x->version < y->version ? -1 : 1;
+	}
+	if (x->kdf != y->kdf) {
+		return x->kdf < y->kdf ? -1 : 1;
+	}
+	if (x->memlimit != y->memlimit) {
+		return x->memlimit < y->memlimit ? -1 : 1;
+	}
+	if (x->opslimit != y->opslimit) {
+		return x->opslimit < y->opslimit ? -1 : 1;
+	}
+	if (x->parallelism != y->parallelism) {
+		return x->parallelism < y->parallelism ? -1 : 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kickpass.h"
+
+#include "command.h"
+#include "unlock.h"
+#include "prompt.h"
+#include "log.h"
+#include "kpagent.h"
+
+static kp_error_t unlock(struct kp_ctx *ctx, int argc, char **argv);
+
+struct kp_cmd kp_cmd_unlock = {
+	.main  = unlock,
+	.usage = NULL,
+	.opts  = "unlock",
+	.desc  = "Give master password to kickpass agent, so it can open and "
+	         "save safes on its own",
+};
+
+kp_error_t
+unlock(struct kp_ctx *ctx, int argc, char **argv)
+{
+	kp_error_t ret;
+
+	if (!ctx->agent.connected) {
+		ret = KP_EINPUT;
+		kp_warn(ret, "not connected to any agent");
+		return ret;
+	}
+
+	if ((ret = kp_password_prompt(ctx, false, (char *)ctx->password,
+	                              "master")) != KP_SUCCESS) {
+		kp_warn(ret, "cannot prompt password");
+		return ret;
+	}
+
+	if ((ret = kp_agent_unlock(&ctx->agent, ctx->password))
+	    != KP_SUCCESS) {
+		kp_warn(ret, "cannot unlock agent");
+		return ret;
+	}
+
+	return KP_SUCCESS;
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kickpass.h"
+
+#include "command.h"
+#include "config.h"
+#include "kdf.h"
+#include "kpagent.h"
+#include "kpupgrade.h"
+#include "log.h"
+#include "prompt.h"
+#include "upgrade.h"
+
+/* List of safes to upgrade */
+struct names {
+	char **names;
+	size_t n;
+};
+
+static kp_error_t upgrade(struct kp_ctx *, int, char **);
+static kp_error_t parse_opt(struct kp_ctx *, int, char **);
+static void       usage(void);
+static kp_error_t list_add(const char *, void *);
+static void       progress(const struct kp_upgrade_progress *, const char *,
+                           kp_error_t, void *);
+
+struct kp_cmd kp_cmd_upgrade = {
+	.main  = upgrade,
+	.usage = usage,
+	.opts  = "upgrade [-j jobs] [--max-mem bytes] [path]",
+	.desc  = "Bring safes of a workspace to its current kdf config",
+};
+
+static unsigned int jobs = 0;
+static size_t max_mem = 0;
+static bool tty = false;
+
+kp_error_t
+upgrade(struct kp_ctx *ctx, int argc, char **argv)
+{
+	kp_error_t ret = KP_SUCCESS;
+	char sub[PATH_MAX] = "";
+	struct names names = { NULL, 0 };
+	struct kp_upgrade_progress last;
+	size_t i;
+
+	if ((ret = parse_opt(ctx, argc, argv)) != KP_SUCCESS) {
+		return ret;
+	}
+
+	if (optind < argc) {
+		if (strlcpy(sub, argv[optind++], PATH_MAX) >= PATH_MAX) {
+			errno = ENOMEM;
+			return KP_ERRNO;
+		}
+	}
+
+	/* Safes are rewritten here, never by an agent */
+	if (ctx->agent.connected) {
+		kp_agent_close(&ctx->agent);
+		ctx->agent.connected = false;
+	}
+
+	if ((ret = kp_password_prompt(ctx, false, (char *)ctx->password,
+	                              "master")) != KP_SUCCESS) {
+		kp_warn(ret, "cannot prompt password");
+		return ret;
+	}
+
+	if ((ret = kp_cfg_load(ctx, sub)) != KP_SUCCESS) {
+		kp_warn(ret, "cannot load kickpass config");
+		return ret;
+	}
+
+	if ((ret = kp_workspace_walk(ctx, sub, false, list_add, &names))
+	    != KP_SUCCESS) {
+		kp_warn(ret, "cannot list safes");
+		goto out;
+	}
+
+	memset(&last, 0, sizeof(last));
+	tty = isatty(STDOUT_FILENO);
+	ret = kp_upgrade(ctx, names.names, names.n, jobs, max_mem, progress,
+	                 &last);
+	if (tty && last.total > 0) {
+		printf("\n");
+	}
+
+	printf("%zu safes upgraded, %zu failed in %.1f s (%.1f safes/s)\n",
+	       last.done, last.failed, last.elapsed,
+	       last.elapsed > 0 ? last.done / last.elapsed : 0.0);
+
+	if (ret != KP_SUCCESS) {
+		kp_warnx(ret, "some safes are not upgraded, "
+		         "run upgrade again to resume");
+	}
+
+out:
+	for (i = 0; i < names.n; i++) {
+		free(names.names[i]);
+	}
+	free(names.names);
+
+	return ret;
+}
+
+static kp_error_t
+parse_opt(struct kp_ctx *ctx, int argc, char **argv)
+{
+	int opt;
+	kp_error_t ret = KP_SUCCESS;
+	long cpus;
+	static struct option longopts[] = {
+		{ "jobs",    required_argument, NULL, 'j' },
+		{ "max-mem", required_argument, NULL, 'x' },
+		{ NULL,      0,                 NULL, 0   },
+	};
+
+	while ((opt = getopt_long(argc, argv, "j:", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'x':
+			max_mem = atol(optarg);
+			break;
+		default:
+			ret = KP_EINPUT;
+			kp_warn(ret, "unknown option %c", opt);
+		}
+	}
+
+	if (jobs == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = cpus > 0 ? cpus : 1;
+	}
+
+	if (max_mem == 0) {
+		max_mem = kp_kdf_default_max_mem();
+	}
+
+	return ret;
+}
+
+void
+usage(void)
+{
+	printf("options:\n");
+	printf("    -j, --jobs=jobs      Number of safes upgraded at once. Default to one per cpu\n");
+	printf("    --max-mem=bytes      Memory ceiling of concurrent key derivations. Default to %zu\n", kp_kdf_default_max_mem());
+}
+
+/*
+ * Progress is written by upgrade workers, under upgrade lock.
+ */
+static void
+progress(const struct kp_upgrade_progress *progress, const char *name,
+         kp_error_t ret, void *arg)
+{
+	struct kp_upgrade_progress *last = arg;
+
+	if (ret != KP_SUCCESS) {
+		kp_warn(ret, "cannot upgrade %s", name);
+	}
+
+	memcpy(last, progress, sizeof(struct kp_upgrade_progress));
+
+	if (!tty) {
+		return;
+	}
+
+	printf("\r%zu/%zu safes upgraded (%.1f safes/s)", progress->done,
+	       progress->total, progress->elapsed > 0
+	       ? progress->done / progress->elapsed : 0.0);
+	fflush(stdout);
+}
+
+/*
+ * Workspace walk callback, add safe at path to names.
+ */
+static kp_error_t
+list_add(const char *path, void *arg)
+{
+	struct names *names = arg;
+	char **tmp;
+
+	tmp = reallocarray(names->names, names->n + 1, sizeof(char *));
+	if (tmp == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+	names->names = tmp;
+
+	if ((names->names[names->n] = strdup(path)) == NULL) {
+		errno = ENOMEM;
+		return KP_ERRNO;
+	}
+	names->n++;
+
+	return KP_SUCCESS;
+}
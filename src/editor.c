@@ -14,12 +14,14 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <sodium.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,6 +46,8 @@ kp_edit(struct kp_ctx *ctx, struct kp_safe *safe)
 	const char *editor;
 	char path[PATH_MAX];
 	pid_t pid;
+	struct stat stats;
+	char *metadata = NULL;
 	size_t metadata_len;
 
 	assert(safe->open);
@@ -72,26 +76,48 @@ kp_edit(struct kp_ctx *ctx, struct kp_safe *safe)
 		goto clean;
 	}
 
-	clearerr(fd);
-	metadata_len = fread(safe->metadata, 1, KP_METADATA_MAX_LEN, fd);
-	safe->metadata[metadata_len] = '\0';
+	if (fstat(fileno(fd), &stats) < 0) {
+		ret = KP_ERRNO;
+		kp_warn(ret, "cannot stat temporary clear text file %s", path);
+		goto clean;
+	}
 
-	if ((errno = ferror(fd)) != 0) {
+	/* Safe plain is password + '\0' + metadata + '\0' */
+	metadata_len = stats.st_size;
+	if (metadata_len + strlen(safe->password) + 2 > ctx->plain_max_size) {
+		errno = EFBIG;
 		ret = KP_ERRNO;
-		kp_warn(ret, "error while reading temporary clear text file %s", path);
+		kp_warn(ret, "safe too long, %s allows %zu bytes",
+		        KP_PLAIN_MAX_SIZE_ENV, ctx->plain_max_size);
 		goto clean;
 	}
-	if (!feof(fd)) {
+
+	if ((metadata = sodium_malloc(metadata_len + 1)) == NULL) {
 		errno = ENOMEM;
 		ret = KP_ERRNO;
-		kp_warn(ret, "safe too long, storing only %lu bytes", metadata_len);
+		kp_warn(ret, "memory error");
+		goto clean;
+	}
+
+	clearerr(fd);
+	metadata_len = fread(metadata, 1, metadata_len, fd);
+	metadata[metadata_len] = '\0';
+
+	if ((errno = ferror(fd)) != 0) {
+		ret = KP_ERRNO;
+		kp_warn(ret, "error while reading temporary clear text file %s", path);
 		goto clean;
 	}
 
-	ret = KP_SUCCESS;
+	ret = kp_safe_set_metadata(safe, metadata);
 
 clean:
-	fclose(fd);
+	if (metadata != NULL) {
+		sodium_free(metadata);
+	}
+	if (fd != NULL) {
+		fclose(fd);
+	}
 	if (unlink(path) < 0) {
 		kp_warn(KP_ERRNO, "cannot delete temporary clear text file %s"
 			"ensure to delete it manually to avoid metadata leak",
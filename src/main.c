@@ -41,8 +41,12 @@
 #include "command/list.h"
 #include "command/cat.h"
 #include "command/rename.h"
+#include "command/stat.h"
 #include "command/agent.h"
 #include "command/open.h"
+#include "command/passwd.h"
+#include "command/unlock.h"
+#include "command/upgrade.h"
 
 static int        cmd_search(const void *, const void *);
 static int        cmd_sort(const void *, const void *);
@@ -110,6 +114,18 @@ static struct cmd cmds[] = {
 
 	/* kp_cmd_open */
 	{ "open",   &kp_cmd_open },
+
+	/* kp_cmd_unlock */
+	{ "unlock", &kp_cmd_unlock },
+
+	/* kp_cmd_passwd */
+	{ "passwd", &kp_cmd_passwd },
+
+	/* kp_cmd_upgrade */
+	{ "upgrade", &kp_cmd_upgrade },
+
+	/* kp_cmd_stat */
+	{ "stat",    &kp_cmd_stat },
 };
 
 /*
@@ -237,7 +253,10 @@ command(struct kp_ctx *ctx, int argc, char **argv)
 		cmd = find_command(argv[optind]);
 	}
 
-	ret = kp_init(ctx);
+	if ((ret = kp_init(ctx)) != KP_SUCCESS) {
+		kp_err(ret, "cannot initialize kickpass");
+	}
+
 	if (cmd != &kp_cmd_init) {
 		ret = kp_open(ctx);
 		if (ret == KP_ERRNO && errno == ENOENT) {
@@ -0,0 +1,274 @@
+#
+# Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+import errno
+import os
+import socket
+import struct
+import time
+import unittest
+import kptest
+
+KP_MSG_SEARCH = 1
+KP_MSG_DISCARD = 2
+KP_MSG_OPEN = 4
+KP_MSG_ERROR = 6
+KP_ERRNO = 5
+KP_ATTR_DATA = 0
+KP_ATTR_NAME = 1
+
+# Agents hand large safes over in sealed memory files only
+large = unittest.skipUnless(hasattr(os, 'memfd_create'), "no memory files")
+
+class TestAgentCommand(kptest.KPTestCase):
+
+    def request(self, type, name):
+        data = name.encode() + b'\0'
+        payload = struct.pack('=HH', KP_ATTR_DATA, len(data)) + data
+        return struct.pack('=IHHII', type, 16 + len(payload), 0, 0, 0) + payload
+
+    def search(self, name):
+        return self.request(KP_MSG_SEARCH, name)
+
+    def receive(self, sock):
+        data = b''
+        while len(data) < 16:
+            data += sock.recv(16 - len(data))
+        type, length = struct.unpack('=IH', data[:6])
+        while len(data) < length:
+            data += sock.recv(length - len(data))
+        attrs = {}
+        off = 16
+        while off < length:
+            attr, size = struct.unpack('=HH', data[off:off + 4])
+            attrs[attr] = data[off + 4:off + 4 + size]
+            off += 4 + size
+        return type, attrs
+
+    def partial(self, type, name):
+        # Request short of its last bytes, agent keeps it in read buffer
+        request = self.request(type, name)
+        return request[:4] + struct.pack('=H', len(request) + 64) + request[6:]
+
+    def find(self, pid, data):
+        # Addresses of data in process writable memory
+        found = []
+        with open('/proc/{}/maps'.format(pid)) as maps, \
+             open('/proc/{}/mem'.format(pid), 'rb', 0) as mem:
+            for line in maps:
+                fields = line.split()
+                start, end = (int(addr, 16) for addr in fields[0].split('-'))
+                if not fields[1].startswith('rw') or end - start > 64 * 1024 * 1024:
+                    continue
+                try:
+                    mem.seek(start)
+                    chunk = mem.read(end - start)
+                except OSError:
+                    continue
+                off = chunk.find(data)
+                while off >= 0:
+                    found.append(start + off)
+                    off = chunk.find(data, off + 1)
+        return found
+
+    def wait_found(self, pid, data, count):
+        for i in range(50):
+            found = self.find(pid, data)
+            if len(found) == count:
+                return found
+            time.sleep(0.1)
+        return found
+
+    def hold(self, marker):
+        # Client with a partial request, and where agent buffers it
+        client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        client.connect(os.environ['KP_AGENT_SOCK'])
+        client.sendall(self.partial(KP_MSG_SEARCH, marker))
+        return client, self.wait_found(self.agent.pid, marker.encode(), 1)
+
+    @kptest.with_agent
+    def test_agent_reuses_peer_without_former_request(self):
+        # Given
+        markers = ["Turtles.{}".format(os.urandom(8).hex()) for i in range(8)]
+        held = [self.hold(marker) for marker in markers[:4]]
+        buffers = [buffer for client, buffer in held]
+        self.assertTrue(all(len(buffer) == 1 for buffer in buffers))
+
+        # When
+        left = []
+        for marker, (client, buffer) in zip(markers, held):
+            client.close()
+            left += self.wait_found(self.agent.pid, marker.encode(), 0)
+        held = [self.hold(marker) for marker in markers[4:]]
+
+        # Then
+        self.assertEqual(left, [])
+        self.assertEqual([buffer for client, buffer in held], buffers[::-1])
+        for marker, (client, buffer) in zip(markers[4:], held):
+            client.close()
+            self.assertEqual(self.wait_found(self.agent.pid, marker.encode(), 0), [])
+
+    @kptest.with_agent
+    def test_agent_answers_while_another_client_does_not_read(self):
+        # Given
+        self.editor('env', env="Turtles.")
+        self.create("test")
+        self.open("test")
+        stuck = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        stuck.connect(os.environ['KP_AGENT_SOCK'])
+        stuck.settimeout(1)
+        requests = self.search("missing") * 1000
+        try:
+            # Until agent stops reading
+            for i in range(1000):
+                stuck.sendall(requests)
+        except socket.timeout:
+            pass
+
+        # When
+        self.cat("test", master=None)
+
+        # Then
+        self.assertStdoutEquals("Turtles.")
+        stuck.close()
+
+    def test_agent_answers_pipelined_opens_in_order(self):
+        # Given
+        self.editor('env', env="Turtles.")
+        names = ["a", "b", "c", "d"]
+        for name in names:
+            self.create(name)
+        self.start_agent(options=['-j', '4'])
+        self.unlock()
+        client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        client.connect(os.environ['KP_AGENT_SOCK'])
+
+        # When
+        client.sendall(b''.join(self.request(KP_MSG_OPEN, name) for name in names * 4))
+
+        # Then
+        for name in names * 4:
+            type, attrs = self.receive(client)
+            self.assertEqual(type, KP_MSG_OPEN)
+            self.assertEqual(attrs[KP_ATTR_NAME], name.encode())
+        client.close()
+        self.stop_agent()
+
+    def test_agent_takeover_keeps_safes_and_unlock(self):
+        # Given
+        self.editor('env', env="Turtles.")
+        self.create("test")
+        self.create("other")
+        self.start_agent()
+        self.unlock()
+        self.open("test", master=None)
+        old = self.agent
+
+        # When
+        self.agent = kptest.KPAgent(self.kp, ['--takeover'])
+
+        # Then
+        self.assertEqual(self.agent.env, old.env)
+        self.assertEqual(old.wait(timeout=5), 0)
+        old.stdout.close()
+        self.cat("test", master=None)
+        self.assertStdoutEquals("Turtles.")
+        self.cat("other", master=None)
+        self.assertStdoutEquals("Turtles.")
+        self.stop_agent()
+
+    def test_agent_refuses_changes_once_taken_over(self):
+        # Given
+        self.editor('env', env="Turtles.")
+        self.create("test")
+        self.start_agent()
+        self.open("test")
+        client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        client.connect(os.environ['KP_AGENT_SOCK'])
+        old = self.agent
+
+        # When
+        self.agent = kptest.KPAgent(self.kp, ['--takeover'])
+        client.sendall(self.request(KP_MSG_DISCARD, "test") + self.search("test"))
+
+        # Then
+        type, attrs = self.receive(client)
+        self.assertEqual(type, KP_MSG_ERROR)
+        self.assertEqual(struct.unpack('=ii', attrs[KP_ATTR_DATA]), (KP_ERRNO, errno.ESHUTDOWN))
+        type, attrs = self.receive(client)
+        self.assertEqual(type, KP_MSG_SEARCH)
+        client.close()
+        self.assertEqual(old.wait(timeout=5), 0)
+        old.stdout.close()
+        self.cat("test", master=None)
+        self.assertStdoutEquals("Turtles.")
+        self.stop_agent()
+
+    @large
+    def test_agent_keeps_safe_larger_than_a_message(self):
+        # Given
+        metadata = "Turtles." * 4096
+        self.editor('env', env=metadata)
+        self.create("test")
+        self.start_agent()
+        self.open("test")
+
+        # When
+        self.cat("test", master=None)
+
+        # Then
+        self.assertStdoutEquals(metadata)
+        self.agent = kptest.KPAgent(self.kp, ['--takeover'])
+        self.cat("test", master=None)
+        self.assertStdoutEquals(metadata)
+        self.stop_agent()
+
+    @large
+    def test_agent_opens_safe_larger_than_a_message(self):
+        # Given
+        metadata = "Turtles." * 4096
+        self.editor('env', env=metadata)
+        self.create("test")
+        self.start_agent()
+        self.unlock()
+
+        # When
+        self.cat("test", master=None)
+
+        # Then
+        self.assertStdoutEquals(metadata)
+        self.stop_agent()
+
+    @large
+    def test_encrypting_agent_hands_over_large_safe(self):
+        # Given
+        metadata = "Turtles." * 4096
+        self.editor('env', env=metadata)
+        self.create("test")
+        self.start_agent(options=['--encrypt'])
+        self.open("test")
+        self.cat("test", master=None)
+        self.assertStdoutEquals(metadata)
+
+        # When
+        self.agent = kptest.KPAgent(self.kp, ['--encrypt', '--takeover'])
+
+        # Then
+        self.cat("test", master=None)
+        self.assertStdoutEquals(metadata)
+        self.stop_agent()
+
+if __name__ == '__main__':
+        unittest.main()
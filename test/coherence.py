@@ -0,0 +1,135 @@
+#
+# Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+import unittest
+import os
+import shutil
+import unittest
+import kptest
+
+class TestAgentCoherence(kptest.KPTestCase):
+    """Safes change on disk behind the back of a running agent"""
+
+    def safe(self, name):
+        return os.path.join(self.kp_ws, name)
+
+    def without_agent(self, command, *args, **kwargs):
+        # Like a client of another host, workspace being synced
+        sock = os.environ.pop('KP_AGENT_SOCK')
+        try:
+            command(*args, **kwargs)
+        finally:
+            os.environ['KP_AGENT_SOCK'] = sock
+
+    @kptest.with_agent
+    def test_agent_drops_safe_edited_elsewhere(self):
+        # Given
+        self.editor('env', env="Turtles.")
+        self.create("test")
+        self.open("test", options=['-t', '0'])
+        self.editor('env', env="Tortoises.")
+
+        # When
+        self.without_agent(self.edit, "test", password=None, options=["-m"])
+
+        # Then cat asks for master password
+        self.cat("test")
+        self.assertStdoutEquals("Tortoises.")
+
+    @kptest.with_agent
+    def test_agent_drops_safe_restored_from_backup(self):
+        # Given
+        backup = os.path.join(self.home.name, "test.bak")
+        self.editor('env', env="Turtles.")
+        self.create("test")
+        shutil.copy2(self.safe("test"), backup)
+        self.editor('env', env="Turtlez.")
+        self.without_agent(self.edit, "test", password=None, options=["-m"])
+        self.open("test", options=['-t', '0'])
+
+        # When restored in place, with the same size and mtime
+        shutil.copyfile(backup, self.safe("test"))
+        shutil.copystat(backup, self.safe("test"))
+
+        # Then cat asks for master password
+        self.cat("test")
+        self.assertStdoutEquals("Turtles.")
+
+    @kptest.with_agent
+    def test_agent_drops_safe_replaced_by_another(self):
+        # Given
+        self.editor('env', env="Turtles.")
+        self.create("test")
+        self.editor('env', env="Tortoises.")
+        self.create("other")
+        self.open("test", options=['-t', '0'])
+
+        # When
+        os.replace(self.safe("other"), self.safe("test"))
+
+        # Then cat asks for master password
+        self.cat("test")
+        self.assertStdoutEquals("Tortoises.")
+
+    @kptest.with_agent
+    def test_agent_drops_safes_removed_along_their_directory(self):
+        # Given
+        self.editor('env', env="Turtles.")
+        self.create("dir/test")
+        self.open("dir/test", options=['-t', '0'])
+        self.editor('env', env="Turtlez.")
+
+        # When
+        shutil.rmtree(self.safe("dir"))
+        self.without_agent(self.create, "dir/test")
+
+        # Then cat asks for master password
+        self.cat("dir/test")
+        self.assertStdoutEquals("Turtlez.")
+
+    @kptest.with_agent
+    def test_agent_keeps_safe_while_others_change(self):
+        # Given
+        self.editor('env', env="Turtles.")
+        self.create("test")
+        self.create("other")
+        self.open("test", options=['-t', '0'])
+        self.editor('env', env="Tortoises.")
+
+        # When
+        self.without_agent(self.edit, "other", password=None, options=["-m"])
+        self.rename("other", "renamed")
+
+        # Then
+        self.cat("test", master=None)
+        self.assertStdoutEquals("Turtles.")
+
+    @kptest.with_agent
+    def test_agent_keeps_safe_it_saved(self):
+        # Given
+        self.editor('env', env="Turtles.")
+        self.create("test", options=["-o", "-t", "0"])
+        self.editor('env', env="Tortoises.")
+
+        # When
+        self.edit("test", password=None, options=["-m"])
+        self.rename("test", "renamed")
+
+        # Then
+        self.cat("renamed", master=None)
+        self.assertStdoutEquals("Tortoises.")
+
+if __name__ == '__main__':
+        unittest.main()
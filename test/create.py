@@ -13,6 +13,7 @@
 # ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
 # OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #
+import os
 import unittest
 import kptest
 
@@ -52,6 +53,30 @@ class TestCreateCommand(kptest.KPTestCase):
         passwd = self.stdout.splitlines()[1]
         self.assertEqual(len(passwd), 42)
 
+    def test_create_with_password_longer_than_typed_is_successful(self):
+        # Given
+        self.editor('save')
+
+        # When
+        self.create("test", options=["-g", "-l", "8192"], password=None)
+
+        # Then
+        self.cat("test", options=["-p"])
+        passwd = self.stdout.splitlines()[1]
+        self.assertEqual(len(passwd), 8192)
+
+    def test_create_with_password_larger_than_max_size_fails(self):
+        # Given
+        self.editor('save')
+        os.environ['KP_SAFE_MAX_SIZE'] = "4096"
+        self.addCleanup(os.environ.pop, 'KP_SAFE_MAX_SIZE')
+
+        # When
+        self.create("test", options=["-g", "-l", "4096"], password=None, rc=5)
+
+        # Then
+        self.assertSafeDoesntExists("test")
+
     @kptest.with_agent
     def test_create_with_agent_is_successful(self):
         # Given
@@ -89,5 +114,34 @@ class TestCreateCommand(kptest.KPTestCase):
         # Then
         self.assertStdoutEquals("Watch out for turtles. They'll bite you if you put your fingers in their mouths.")
 
+    def test_create_with_each_sync_policy_is_successful(self):
+        # Given
+        self.editor('env', env="Turtles.")
+        self.addCleanup(os.environ.pop, 'KP_SYNC')
+
+        for policy in ["none", "file", "file+dir"]:
+            # When
+            os.environ['KP_SYNC'] = policy
+            self.create("sync/" + policy)
+
+            # Then
+            self.cat("sync/" + policy)
+            self.assertStdoutEquals("Turtles.")
+        # No temporary file is left behind
+        hidden = [n for n in os.listdir(os.path.join(self.kp_ws, "sync")) if n.startswith('.')]
+        self.assertEqual(hidden, [])
+
+    def test_create_with_unknown_sync_policy_fails(self):
+        # Given
+        self.editor('date')
+        os.environ['KP_SYNC'] = "always"
+        self.addCleanup(os.environ.pop, 'KP_SYNC')
+
+        # When
+        self.create("test", master=None, password=None, rc=5)
+
+        # Then
+        self.assertSafeDoesntExists("test")
+
 if __name__ == '__main__':
         unittest.main()
@@ -13,6 +13,7 @@
 # ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
 # OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #
+import os
 import unittest
 import kptest
 
@@ -117,6 +118,36 @@ class TestEditCommand(kptest.KPTestCase):
         self.assertStdoutEquals("42",
                                 "But a RocknRolla, oh, he's different. Why? Because a real RocknRolla wants the fucking lot.")
 
+    def test_edit_metadata_larger_than_agent_message_is_successful(self):
+        # Given
+        metadata = " ".join(["RocknRolla"] * 1024)
+        self.start_agent()
+        self.editor('date')
+        self.create("test", password="RocknRolla", options=["-o"])
+        self.editor('env', env=metadata)
+
+        # When
+        self.edit("test", password="42")
+
+        # Then agent serves the new copy, not its stale one
+        self.cat("test", options=["-pm"], master=None)
+        self.assertStdoutEquals("42", metadata)
+
+    def test_edit_metadata_larger_than_max_size_fails(self):
+        # Given
+        self.editor('date')
+        self.create("test", password="RocknRolla")
+        self.editor('env', env="RocknRolla " * 16)
+        os.environ['KP_SAFE_MAX_SIZE'] = "128"
+        self.addCleanup(os.environ.pop, 'KP_SAFE_MAX_SIZE')
+
+        # When
+        self.edit("test", password=None, options=["-m"], rc=5)
+
+        # Then
+        self.cat("test", options=["-p"])
+        self.assertStdoutEquals("RocknRolla")
+
     def test_edit_in_sub_workspace_is_successful(self):
         # Given
         self.init("sub", master="sub master password")
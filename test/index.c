@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+
+#include "check_compat.h"
+
+#include "../lib/index.c"
+
+#define COUNT 1000
+
+struct walked {
+	const char *names[8];
+	size_t count;
+	size_t max;
+};
+
+static int
+walk(struct kp_index_entry *entry, void *arg)
+{
+	struct walked *walked = arg;
+
+	walked->names[walked->count++] = entry->name;
+
+	return walked->max > 0 && walked->count == walked->max;
+}
+
+START_TEST(test_index_should_find_after_removals)
+{
+	/* Given */
+	struct kp_index index;
+	static struct kp_index_entry entries[COUNT];
+	static char names[COUNT][32];
+	size_t i;
+
+	kp_index_init(&index);
+	for (i = 0; i < COUNT; i++) {
+		snprintf(names[i], sizeof(names[i]), "dir%zu/safe%zu", i % 7, i);
+		entries[i].name = names[i];
+		ck_assert_int_eq(kp_index_insert(&index, &entries[i]),
+		                 KP_SUCCESS);
+	}
+
+	/* When */
+	for (i = 0; i < COUNT; i += 2) {
+		kp_index_remove(&index, &entries[i]);
+	}
+
+	/* Then */
+	ck_assert_int_eq(index.count, COUNT / 2);
+	for (i = 0; i < COUNT; i++) {
+		if (i % 2) {
+			ck_assert_ptr_eq(kp_index_find(&index, names[i]),
+			                 &entries[i]);
+		} else {
+			ck_assert_ptr_eq(kp_index_find(&index, names[i]), NULL);
+		}
+	}
+
+	kp_index_fini(&index);
+}
+END_TEST
+
+START_TEST(test_index_insert_existing_should_fail)
+{
+	/* Given */
+	struct kp_index index;
+	struct kp_index_entry entry = { .name = "test" };
+	struct kp_index_entry again = { .name = "test" };
+
+	kp_index_init(&index);
+	ck_assert_int_eq(kp_index_insert(&index, &entry), KP_SUCCESS);
+
+	/* When */
+	kp_error_t ret = kp_index_insert(&index, &again);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_ERRNO);
+	ck_assert_int_eq(errno, EEXIST);
+	ck_assert_ptr_eq(kp_index_find(&index, "test"), &entry);
+
+	kp_index_fini(&index);
+}
+END_TEST
+
+START_TEST(test_index_walk_should_visit_subtree_in_order)
+{
+	/* Given */
+	struct kp_index index;
+	struct kp_index_entry entries[5] = {
+		{ .name = "web/b" }, { .name = "web-mail" }, { .name = "web" },
+		{ .name = "web/a/x" }, { .name = "bank" },
+	};
+	struct walked walked = { .count = 0 };
+	size_t i;
+
+	kp_index_init(&index);
+	for (i = 0; i < 5; i++) {
+		ck_assert_int_eq(kp_index_insert(&index, &entries[i]),
+		                 KP_SUCCESS);
+	}
+
+	/* When */
+	kp_index_walk(&index, "web/", NULL, walk, &walked);
+
+	/* Then */
+	ck_assert_int_eq(walked.count, 3);
+	ck_assert_str_eq(walked.names[0], "web");
+	ck_assert_str_eq(walked.names[1], "web/a/x");
+	ck_assert_str_eq(walked.names[2], "web/b");
+
+	kp_index_fini(&index);
+}
+END_TEST
+
+START_TEST(test_index_walk_should_match_partial_component)
+{
+	/* Given */
+	struct kp_index index;
+	struct kp_index_entry entries[5] = {
+		{ .name = "web/b" }, { .name = "web-mail" }, { .name = "web" },
+		{ .name = "bank/web" }, { .name = "we" },
+	};
+	struct walked walked = { .count = 0 };
+	size_t i;
+
+	kp_index_init(&index);
+	for (i = 0; i < 5; i++) {
+		ck_assert_int_eq(kp_index_insert(&index, &entries[i]),
+		                 KP_SUCCESS);
+	}
+
+	/* When */
+	kp_index_walk(&index, "web", NULL, walk, &walked);
+
+	/* Then */
+	ck_assert_int_eq(walked.count, 3);
+	ck_assert_str_eq(walked.names[0], "web");
+	ck_assert_str_eq(walked.names[1], "web/b");
+	ck_assert_str_eq(walked.names[2], "web-mail");
+
+	kp_index_fini(&index);
+}
+END_TEST
+
+START_TEST(test_index_walk_should_resume_after_name)
+{
+	/* Given */
+	struct kp_index index;
+	struct kp_index_entry entries[6] = {
+		{ .name = "web/b" }, { .name = "web-mail" }, { .name = "web" },
+		{ .name = "web/a/x" }, { .name = "bank" }, { .name = "web/a/y" },
+	};
+	struct walked walked = { .count = 0, .max = 2 };
+	size_t i;
+
+	kp_index_init(&index);
+	for (i = 0; i < 6; i++) {
+		ck_assert_int_eq(kp_index_insert(&index, &entries[i]),
+		                 KP_SUCCESS);
+	}
+
+	/* When */
+	kp_index_walk(&index, "", "web", walk, &walked);
+	walked.max = 4;
+	kp_index_walk(&index, "web", walked.names[1], walk, &walked);
+	walked.max = 0;
+	kp_index_walk(&index, "we", "web/a", walk, &walked);
+
+	/* Then */
+	ck_assert_int_eq(walked.count, 8);
+	ck_assert_str_eq(walked.names[0], "web/a/x");
+	ck_assert_str_eq(walked.names[1], "web/a/y");
+	ck_assert_str_eq(walked.names[2], "web/b");
+	ck_assert_str_eq(walked.names[3], "web-mail");
+	ck_assert_str_eq(walked.names[4], "web/a/x");
+	ck_assert_str_eq(walked.names[5], "web/a/y");
+	ck_assert_str_eq(walked.names[6], "web/b");
+	ck_assert_str_eq(walked.names[7], "web-mail");
+
+	kp_index_fini(&index);
+}
+END_TEST
+
+START_TEST(test_index_remove_should_prune_prefix_tree)
+{
+	/* Given */
+	struct kp_index index;
+	struct kp_index_entry entry = { .name = "a/b/c" };
+
+	kp_index_init(&index);
+	ck_assert_int_eq(kp_index_insert(&index, &entry), KP_SUCCESS);
+
+	/* When */
+	kp_index_remove(&index, &entry);
+
+	/* Then */
+	ck_assert_ptr_eq(index.root, NULL);
+	ck_assert_int_eq(index.count, 0);
+
+	kp_index_fini(&index);
+}
+END_TEST
+
+int
+main(int argc, char **argv)
+{
+	int number_failed;
+
+	if (sodium_init() < 0) {
+		return 1;
+	}
+
+	Suite *suite = suite_create("index_test_suite");
+	TCase *tcase = tcase_create("case");
+	tcase_add_test(tcase, test_index_should_find_after_removals);
+	tcase_add_test(tcase, test_index_insert_existing_should_fail);
+	tcase_add_test(tcase, test_index_walk_should_visit_subtree_in_order);
+	tcase_add_test(tcase, test_index_walk_should_match_partial_component);
+	tcase_add_test(tcase, test_index_walk_should_resume_after_name);
+	tcase_add_test(tcase, test_index_remove_should_prune_prefix_tree);
+	suite_add_tcase(suite, tcase);
+
+	SRunner *runner = srunner_create(suite);
+	srunner_set_fork_status(runner, CK_NOFORK);
+	srunner_run_all(runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return number_failed;
+}
@@ -38,5 +38,31 @@ class TestInitCommand(kptest.KPTestCase):
         self.assertWsExists()
         self.assertWsExists("work/")
 
+    def test_init_calibrate_is_successful(self):
+        # Given
+        self.editor('env', env="comment")
+
+        # When
+        self.init("work/", options=['--calibrate', '--target-ms', '50', '--max-mem', '33554432'])
+        self.create("work/test")
+        self.cat("work/test", options=["-p"])
+
+        # Then
+        self.assertWsExists("work/")
+        self.assertStdoutEquals("test password")
+
+    def test_init_argon2id_is_successful(self):
+        # Given
+        self.editor('env', env="comment")
+
+        # When
+        self.init("work/", options=['--kdf', 'argon2id', '--memlimit', '8388608', '--opslimit', '1', '--parallelism', '4'])
+        self.create("work/test")
+        self.cat("work/test", options=["-p"])
+
+        # Then
+        self.assertWsExists("work/")
+        self.assertStdoutEquals("test password")
+
 if __name__ == '__main__':
         unittest.main()
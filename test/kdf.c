@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <check.h>
+
+#include "check_compat.h"
+
+#include "../lib/kdf.c"
+
+#define TEST_OPSLIMIT crypto_pwhash_argon2id_OPSLIMIT_MIN
+#define TEST_MEMLIMIT (1024 * 1024)
+
+START_TEST(test_kdf_argon2id_single_lane_should_be_successful)
+{
+	/* Given */
+	int ret = KP_SUCCESS;
+	unsigned char salt[KP_KDF_SALT_SIZE] = { 0 };
+	unsigned char lane_salt[crypto_pwhash_argon2id_SALTBYTES];
+	unsigned char index[4] = { 0 };
+	unsigned char lane_key[KP_KDF_LANE_KEY_SIZE];
+	unsigned char key[KP_MASTER_KEY_SIZE];
+	unsigned char ref[KP_MASTER_KEY_SIZE];
+	crypto_generichash_state state;
+
+	/* When */
+	ret = kp_kdf_derive(KP_KDF_ARGON2ID, key, sizeof(key), "test", salt,
+	                    TEST_OPSLIMIT, TEST_MEMLIMIT, 1);
+
+	/* Then */
+	crypto_generichash_init(&state, NULL, 0, sizeof(lane_salt));
+	crypto_generichash_update(&state, salt, sizeof(salt));
+	crypto_generichash_update(&state, index, sizeof(index));
+	crypto_generichash_final(&state, lane_salt, sizeof(lane_salt));
+	crypto_pwhash_argon2id(lane_key, sizeof(lane_key), "test", 4,
+	                       lane_salt, TEST_OPSLIMIT, TEST_MEMLIMIT,
+	                       crypto_pwhash_argon2id_ALG_ARGON2ID13);
+	crypto_generichash(ref, sizeof(ref), lane_key, sizeof(lane_key),
+	                   NULL, 0);
+
+	ck_assert_int_eq(ret, KP_SUCCESS);
+	ck_assert_int_eq(memcmp(key, ref, sizeof(ref)), 0);
+}
+END_TEST
+
+START_TEST(test_kdf_argon2id_lanes_should_be_deterministic)
+{
+	/* Given */
+	int ret = KP_SUCCESS;
+	unsigned char salt[KP_KDF_SALT_SIZE];
+	unsigned char key1[KP_MASTER_KEY_SIZE];
+	unsigned char key2[KP_MASTER_KEY_SIZE];
+	unsigned char key3[KP_MASTER_KEY_SIZE];
+
+	randombytes_buf(salt, sizeof(salt));
+
+	/* When */
+	ret |= kp_kdf_derive(KP_KDF_ARGON2ID, key1, sizeof(key1), "test",
+	                     salt, TEST_OPSLIMIT, TEST_MEMLIMIT, 4);
+	ret |= kp_kdf_derive(KP_KDF_ARGON2ID, key2, sizeof(key2), "test",
+	                     salt, TEST_OPSLIMIT, TEST_MEMLIMIT, 4);
+	ret |= kp_kdf_derive(KP_KDF_ARGON2ID, key3, sizeof(key3), "test",
+	                     salt, TEST_OPSLIMIT, TEST_MEMLIMIT, 2);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_SUCCESS);
+	ck_assert_int_eq(memcmp(key1, key2, sizeof(key1)), 0);
+	ck_assert_int_ne(memcmp(key1, key3, sizeof(key1)), 0);
+}
+END_TEST
+
+START_TEST(test_kdf_argon2id_lanes_should_use_whole_memlimit)
+{
+	/* Given */
+	int ret = KP_SUCCESS;
+	unsigned char salt[KP_KDF_SALT_SIZE];
+	unsigned char lane_salt[crypto_pwhash_argon2id_SALTBYTES];
+	unsigned char index[4] = { 0 };
+	unsigned char lane_keys[2 * KP_KDF_LANE_KEY_SIZE];
+	unsigned char key[KP_MASTER_KEY_SIZE];
+	unsigned char ref[KP_MASTER_KEY_SIZE];
+	crypto_generichash_state state;
+	unsigned int i;
+
+	randombytes_buf(salt, sizeof(salt));
+
+	/* When */
+	ret = kp_kdf_derive(KP_KDF_ARGON2ID, key, sizeof(key), "test", salt,
+	                    TEST_OPSLIMIT, TEST_MEMLIMIT, 2);
+
+	/* Then */
+	for (i = 0; i < 2; i++) {
+		index[3] = i;
+		crypto_generichash_init(&state, NULL, 0, sizeof(lane_salt));
+		crypto_generichash_update(&state, salt, sizeof(salt));
+		crypto_generichash_update(&state, index, sizeof(index));
+		crypto_generichash_final(&state, lane_salt, sizeof(lane_salt));
+		crypto_pwhash_argon2id(&lane_keys[i * KP_KDF_LANE_KEY_SIZE],
+		                       KP_KDF_LANE_KEY_SIZE, "test", 4,
+		                       lane_salt, TEST_OPSLIMIT, TEST_MEMLIMIT,
+		                       crypto_pwhash_argon2id_ALG_ARGON2ID13);
+	}
+	crypto_generichash(ref, sizeof(ref), lane_keys, sizeof(lane_keys),
+	                   NULL, 0);
+
+	ck_assert_int_eq(ret, KP_SUCCESS);
+	ck_assert_int_eq(memcmp(key, ref, sizeof(ref)), 0);
+	ck_assert_uint_eq(kp_kdf_mem(KP_KDF_ARGON2ID, TEST_MEMLIMIT, 2),
+	                  2 * TEST_MEMLIMIT);
+	ck_assert_uint_eq(kp_kdf_mem(KP_KDF_SCRYPT, TEST_MEMLIMIT, 1),
+	                  TEST_MEMLIMIT);
+}
+END_TEST
+
+START_TEST(test_kdf_invalid_parallelism_should_fail)
+{
+	/* Given */
+	unsigned char salt[KP_KDF_SALT_SIZE] = { 0 };
+	unsigned char key[KP_MASTER_KEY_SIZE];
+
+	/* When */
+	/* Then */
+	ck_assert_int_eq(kp_kdf_derive(KP_KDF_ARGON2ID, key, sizeof(key),
+	                               "test", salt, TEST_OPSLIMIT,
+	                               TEST_MEMLIMIT, 0), KP_EINPUT);
+	ck_assert_int_eq(kp_kdf_derive(KP_KDF_ARGON2ID, key, sizeof(key),
+	                               "test", salt, TEST_OPSLIMIT,
+	                               TEST_MEMLIMIT,
+	                               KP_KDF_MAX_PARALLELISM + 1), KP_EINPUT);
+	ck_assert_int_eq(kp_kdf_derive(KP_KDF_ARGON2ID, key, sizeof(key),
+	                               "test", salt, TEST_OPSLIMIT,
+	                               crypto_pwhash_argon2id_MEMLIMIT_MIN - 1,
+	                               2),
+	                 KP_EINPUT);
+	ck_assert_int_eq(kp_kdf_derive(KP_KDF_SCRYPT, key, sizeof(key),
+	                               "test", salt,
+	                               crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_MIN,
+	                               crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_MIN,
+	                               2), KP_EINPUT);
+}
+END_TEST
+
+START_TEST(test_kdf_name_should_be_successful)
+{
+	/* Given */
+	enum kp_kdf kdf = 0;
+
+	/* When */
+	/* Then */
+	ck_assert_int_eq(kp_kdf_from_name("argon2id", &kdf), KP_SUCCESS);
+	ck_assert_int_eq(kdf, KP_KDF_ARGON2ID);
+	ck_assert_str_eq(kp_kdf_name(KP_KDF_SCRYPT), "scrypt");
+	ck_assert_int_eq(kp_kdf_from_name("bcrypt", &kdf), KP_EINPUT);
+	ck_assert_ptr_eq((void *)kp_kdf_name(0), NULL);
+}
+END_TEST
+
+int
+main(int argc, char **argv)
+{
+	int number_failed;
+
+	if (sodium_init() < 0) {
+		return 1;
+	}
+
+	Suite *suite = suite_create("kdf_test_suite");
+	TCase *tcase = tcase_create("case");
+	tcase_add_test(tcase, test_kdf_argon2id_single_lane_should_be_successful);
+	tcase_add_test(tcase, test_kdf_argon2id_lanes_should_be_deterministic);
+	tcase_add_test(tcase, test_kdf_argon2id_lanes_should_use_whole_memlimit);
+	tcase_add_test(tcase, test_kdf_invalid_parallelism_should_fail);
+	tcase_add_test(tcase, test_kdf_name_should_be_successful);
+	suite_add_tcase(suite, tcase);
+
+	SRunner *runner = srunner_create(suite);
+	srunner_set_fork_status(runner, CK_NOFORK);
+	srunner_run_all(runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return number_failed;
+}
@@ -0,0 +1,719 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+#include <ftw.h>
+
+#include "check_compat.h"
+
+#include "../lib/kpagent.c"
+
+static void
+pair(struct kp_agent *client, struct kp_agent *server)
+{
+	int fds[2];
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	memset(client, 0, sizeof(struct kp_agent));
+	memset(server, 0, sizeof(struct kp_agent));
+	client->sock = fds[0];
+	server->sock = fds[1];
+	imsg_init(&client->ibuf, client->sock);
+	imsg_init(&server->ibuf, server->sock);
+}
+
+START_TEST(test_agent_unsafe_should_go_through_at_its_size)
+{
+	/* Given */
+	struct kp_agent client, server;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT, received = KP_UNSAFE_INIT;
+	struct imsg imsg;
+
+	pair(&client, &server);
+	strlcpy(unsafe.name, "test", PATH_MAX);
+	strlcpy(unsafe.password, "hunter2", KP_PASSWORD_MAX_LEN);
+	strlcpy(unsafe.metadata, "turtles", KP_METADATA_MAX_LEN);
+	unsafe.timeout = 42;
+	unsafe.idle = true;
+
+	/* When */
+	ck_assert_int_eq(kp_agent_send_unsafe(&client, KP_MSG_STORE, &unsafe),
+	                 KP_SUCCESS);
+	ck_assert_int_gt(imsg_read(&server.ibuf), 0);
+	ck_assert_int_gt(imsg_get(&server.ibuf, &imsg), 0);
+
+	/* Then */
+	ck_assert_int_eq(imsg.hdr.type, KP_MSG_STORE);
+	ck_assert_int_eq(imsg.hdr.len, IMSG_HEADER_SIZE
+	                 + 5 * sizeof(struct kp_agent_attr)
+	                 + 4 + 7 + 7 + sizeof(int64_t) + sizeof(uint8_t));
+	ck_assert_int_eq(kp_agent_msg_unsafe(&imsg, &received), KP_SUCCESS);
+	ck_assert_str_eq(received.name, "test");
+	ck_assert_str_eq(received.password, "hunter2");
+	ck_assert_str_eq(received.metadata, "turtles");
+	ck_assert_int_eq(received.timeout, 42);
+	ck_assert(received.idle);
+
+	imsg_free(&imsg);
+	kp_agent_close(&client);
+	kp_agent_close(&server);
+}
+END_TEST
+
+START_TEST(test_agent_truncated_message_should_fail)
+{
+	/* Given */
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+	struct kp_agent_attr attr = { .type = KP_ATTR_NAME, .len = 10 };
+	unsigned char data[sizeof(struct kp_agent_attr) + 4];
+	struct imsg imsg;
+
+	memcpy(data, &attr, sizeof(attr));
+	memcpy(data + sizeof(attr), "test", 4);
+	imsg.hdr.len = IMSG_HEADER_SIZE + sizeof(data);
+	imsg.data = data;
+
+	/* When */
+	kp_error_t ret = kp_agent_msg_unsafe(&imsg, &unsafe);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_ERRNO);
+	ck_assert_int_eq(errno, EPROTO);
+	ck_assert_str_eq(unsafe.name, "");
+}
+END_TEST
+
+START_TEST(test_agent_string_without_terminator_should_fail)
+{
+	/* Given */
+	struct kp_agent client, server;
+	struct imsg imsg;
+	char *string;
+
+	pair(&client, &server);
+	ck_assert_int_eq(kp_agent_send(&client, KP_MSG_SEARCH, "test", 4),
+	                 KP_SUCCESS);
+	ck_assert_int_gt(imsg_read(&server.ibuf), 0);
+	ck_assert_int_gt(imsg_get(&server.ibuf, &imsg), 0);
+
+	/* When */
+	kp_error_t ret = kp_agent_msg_string(&imsg, &string, PATH_MAX);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_ERRNO);
+	ck_assert_int_eq(errno, EPROTO);
+
+	imsg_free(&imsg);
+	kp_agent_close(&client);
+	kp_agent_close(&server);
+}
+END_TEST
+
+START_TEST(test_agent_large_metadata_should_go_through_sealed)
+{
+	/* Given */
+	struct kp_agent client, server;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT, received = KP_UNSAFE_INIT;
+	struct imsg imsg;
+	char *metadata;
+
+	pair(&client, &server);
+	client.caps = KP_AGENT_CAP_SEALED;
+	metadata = malloc(20 * 1024 + 1);
+	memset(metadata, 'x', 20 * 1024);
+	metadata[20 * 1024] = '\0';
+	strlcpy(unsafe.name, "test", PATH_MAX);
+	strlcpy(unsafe.password, "hunter2", KP_PASSWORD_MAX_LEN);
+	kp_agent_unsafe_set_metadata(&unsafe, metadata);
+
+	/* When */
+	ck_assert_int_eq(kp_agent_send_unsafe(&client, KP_MSG_STORE, &unsafe),
+	                 KP_SUCCESS);
+	ck_assert_int_gt(imsg_read(&server.ibuf), 0);
+	ck_assert_int_gt(imsg_get(&server.ibuf, &imsg), 0);
+
+	/* Then */
+	ck_assert_int_ge(imsg.fd, 0);
+	ck_assert_int_eq(kp_agent_msg_unsafe(&imsg, &received), KP_SUCCESS);
+	ck_assert_int_eq(imsg.fd, -1);
+	ck_assert_str_eq(received.name, "test");
+	ck_assert_str_eq(received.password, "hunter2");
+	ck_assert_str_eq(received.metadata, "");
+	ck_assert_str_eq(kp_agent_unsafe_metadata(&received), metadata);
+
+	kp_agent_unsafe_clear(&received);
+	ck_assert(received.large == NULL);
+	imsg_free(&imsg);
+	free(metadata);
+	kp_agent_close(&client);
+	kp_agent_close(&server);
+}
+END_TEST
+
+START_TEST(test_agent_large_metadata_in_unsealed_file_should_fail)
+{
+	/* Given */
+	struct kp_agent client, server;
+	struct kp_unsafe received = KP_UNSAFE_INIT;
+	struct imsg imsg;
+	char path[] = "/tmp/kickpass-test-XXXXXX";
+	char metadata[KP_METADATA_MAX_LEN + 1];
+	int fd;
+
+	pair(&client, &server);
+	client.caps = KP_AGENT_CAP_SEALED;
+	memset(metadata, 'x', KP_METADATA_MAX_LEN);
+	metadata[KP_METADATA_MAX_LEN] = '\0';
+	ck_assert_int_ge(fd = mkstemp(path), 0);
+	unlink(path);
+	ck_assert_int_eq(kp_agent_write(fd, metadata, sizeof(metadata)),
+	                 KP_SUCCESS);
+	ck_assert_int_eq(kp_agent_queue_safe(&client, KP_MSG_STORE, "test",
+	                                     "hunter2", metadata,
+	                                     KP_METADATA_MAX_LEN, fd, 0, false,
+	                                     &received.id), KP_SUCCESS);
+	ck_assert_int_eq(kp_agent_flush(&client), KP_SUCCESS);
+	ck_assert_int_gt(imsg_read(&server.ibuf), 0);
+	ck_assert_int_gt(imsg_get(&server.ibuf, &imsg), 0);
+	ck_assert_int_ge(imsg.fd, 0);
+
+	/* When */
+	kp_error_t ret = kp_agent_msg_unsafe(&imsg, &received);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_ERRNO);
+	ck_assert_int_eq(errno, EPERM);
+	ck_assert(received.large == NULL);
+
+	imsg_free(&imsg);
+	close(fd);
+	kp_agent_close(&client);
+	kp_agent_close(&server);
+}
+END_TEST
+
+START_TEST(test_agent_large_metadata_without_sealed_cap_should_fail)
+{
+	/* Given */
+	struct kp_agent client, server;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+	char metadata[KP_METADATA_MAX_LEN + 1];
+
+	pair(&client, &server);
+	memset(metadata, 'x', KP_METADATA_MAX_LEN);
+	metadata[KP_METADATA_MAX_LEN] = '\0';
+	strlcpy(unsafe.name, "test", PATH_MAX);
+	kp_agent_unsafe_set_metadata(&unsafe, metadata);
+
+	/* When */
+	kp_error_t ret = kp_agent_send_unsafe(&client, KP_MSG_STORE, &unsafe);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_ERRNO);
+	ck_assert_int_eq(errno, EMSGSIZE);
+	ck_assert_int_eq(client.ibuf.w.queued, 0);
+
+	kp_agent_close(&client);
+	kp_agent_close(&server);
+}
+END_TEST
+
+START_TEST(test_agent_search_batch_should_answer_each_name_in_order)
+{
+	/* Given */
+	struct kp_agent client, server;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT, results[3];
+	struct kp_msg_error errors[3];
+	struct ibuf *wbuf;
+	struct imsg imsg;
+	const char *names[] = { "batch/a", "batch/missing", "batch/b" };
+	size_t i;
+
+	pair(&client, &server);
+	strlcpy(unsafe.name, "batch/a", PATH_MAX);
+	strlcpy(unsafe.password, "alpha", KP_PASSWORD_MAX_LEN);
+	ck_assert_int_eq(kp_agent_store(&server, &unsafe), KP_SUCCESS);
+	strlcpy(unsafe.name, "batch/b", PATH_MAX);
+	strlcpy(unsafe.password, "bravo", KP_PASSWORD_MAX_LEN);
+	ck_assert_int_eq(kp_agent_store(&server, &unsafe), KP_SUCCESS);
+
+	wbuf = imsg_create(&client.ibuf, KP_MSG_SEARCH_MANY, 1, 0, 64);
+	ck_assert_ptr_ne(wbuf, NULL);
+	for (i = 0; i < 3; i++) {
+		ck_assert_int_eq(kp_agent_add(wbuf, KP_ATTR_NAME, names[i],
+		                              strlen(names[i])), 0);
+	}
+	imsg_close(&client.ibuf, wbuf);
+	ck_assert_int_eq(kp_agent_flush(&client), KP_SUCCESS);
+	ck_assert_int_gt(imsg_read(&server.ibuf), 0);
+	ck_assert_int_gt(imsg_get(&server.ibuf, &imsg), 0);
+
+	/* When */
+	kp_error_t ret = kp_agent_search_batch(&server, &imsg);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_SUCCESS);
+	for (i = 0; i < 3; i++) {
+		ck_assert_int_eq(kp_agent_collect(&client, KP_MSG_SEARCH,
+		                                  &results[i], &errors[i]),
+		                 KP_SUCCESS);
+	}
+	ck_assert_int_eq(errors[0].err, KP_SUCCESS);
+	ck_assert_str_eq(results[0].password, "alpha");
+	ck_assert_int_eq(errors[1].err, KP_ERRNO);
+	ck_assert_int_eq(errors[1].err_no, ENOENT);
+	ck_assert_int_eq(errors[2].err, KP_SUCCESS);
+	ck_assert_str_eq(results[2].password, "bravo");
+
+	imsg_free(&imsg);
+	kp_agent_discard(&server, "batch/a", false);
+	kp_agent_discard(&server, "batch/b", false);
+	kp_agent_close(&client);
+	kp_agent_close(&server);
+}
+END_TEST
+
+START_TEST(test_agent_encrypted_store_should_hold_no_locked_memory)
+{
+	/* Given */
+	struct kp_agent client, server;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT, result = KP_UNSAFE_INIT;
+	struct kp_msg_error error;
+	struct kp_store *store;
+	size_t before, i;
+
+	pair(&client, &server);
+	before = kp_agent_locked(&server);
+	ck_assert_int_eq(kp_agent_encrypt(&server), KP_SUCCESS);
+
+	/* When */
+	for (i = 0; i < 1000; i++) {
+		snprintf(unsafe.name, PATH_MAX, "encrypted/%zu", i);
+		snprintf(unsafe.password, KP_PASSWORD_MAX_LEN, "hunter%zu", i);
+		snprintf(unsafe.metadata, KP_METADATA_MAX_LEN, "turtles %zu", i);
+		ck_assert_int_eq(kp_agent_store(&server, &unsafe), KP_SUCCESS);
+	}
+
+	/* Then */
+	ck_assert_int_eq(kp_agent_locked(&server), before);
+	store = kp_agent_find("encrypted/42");
+	ck_assert_ptr_ne(store, NULL);
+	ck_assert_ptr_ne(store->cipher, NULL);
+	ck_assert_ptr_eq(memmem(store->cipher, store->plain
+	                        + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES
+	                        + crypto_aead_xchacha20poly1305_ietf_ABYTES,
+	                        "hunter42", 8), NULL);
+	ck_assert_int_eq(kp_agent_search(&server, "encrypted/42"), KP_SUCCESS);
+	ck_assert_int_eq(kp_agent_collect(&client, KP_MSG_SEARCH, &result,
+	                                  &error), KP_SUCCESS);
+	ck_assert_int_eq(error.err, KP_SUCCESS);
+	ck_assert_str_eq(result.password, "hunter42");
+	ck_assert_str_eq(result.metadata, "turtles 42");
+
+	for (i = 0; i < 1000; i++) {
+		snprintf(unsafe.name, PATH_MAX, "encrypted/%zu", i);
+		kp_agent_discard(&server, unsafe.name, true);
+	}
+	sodium_free(cache_key);
+	cache_key = NULL;
+	kp_agent_close(&client);
+	kp_agent_close(&server);
+}
+END_TEST
+
+START_TEST(test_agent_encrypted_store_should_not_move_between_safes)
+{
+	/* Given */
+	struct kp_agent agent;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+	struct kp_store *a, *b;
+	unsigned char *cipher;
+
+	memset(&agent, 0, sizeof(struct kp_agent));
+	agent.sock = -1;
+	ck_assert_int_eq(kp_agent_encrypt(&agent), KP_SUCCESS);
+	strlcpy(unsafe.name, "encrypted/a", PATH_MAX);
+	strlcpy(unsafe.password, "alpha", KP_PASSWORD_MAX_LEN);
+	ck_assert_int_eq(kp_agent_store(&agent, &unsafe), KP_SUCCESS);
+	strlcpy(unsafe.name, "encrypted/b", PATH_MAX);
+	strlcpy(unsafe.password, "bravo", KP_PASSWORD_MAX_LEN);
+	ck_assert_int_eq(kp_agent_store(&agent, &unsafe), KP_SUCCESS);
+	a = kp_agent_find("encrypted/a");
+	b = kp_agent_find("encrypted/b");
+
+	/* When */
+	cipher = a->cipher;
+	a->cipher = b->cipher;
+	b->cipher = cipher;
+
+	/* Then */
+	ck_assert_ptr_eq(kp_agent_store_open(a), NULL);
+	ck_assert_int_eq(errno, EBADMSG);
+
+	kp_agent_discard(&agent, "encrypted/a", true);
+	kp_agent_discard(&agent, "encrypted/b", true);
+	sodium_free(cache_key);
+	cache_key = NULL;
+}
+END_TEST
+
+START_TEST(test_agent_next_unsafe_should_split_safes_on_name)
+{
+	/* Given */
+	struct kp_agent client, server;
+	struct kp_unsafe unsafes[2] = { KP_UNSAFE_INIT, KP_UNSAFE_INIT };
+	struct kp_unsafe received;
+	struct ibuf *wbuf;
+	struct imsg imsg;
+	size_t off = 0;
+
+	pair(&client, &server);
+	strlcpy(unsafes[0].name, "first", PATH_MAX);
+	strlcpy(unsafes[0].password, "one", KP_PASSWORD_MAX_LEN);
+	unsafes[0].timeout = 42;
+	strlcpy(unsafes[1].name, "second", PATH_MAX);
+	strlcpy(unsafes[1].metadata, "two", KP_METADATA_MAX_LEN);
+
+	wbuf = imsg_create(&client.ibuf, KP_MSG_STORE_MANY, 1, 0,
+	                   kp_agent_safe_size(&unsafes[0])
+	                   + kp_agent_safe_size(&unsafes[1]));
+	ck_assert_ptr_ne(wbuf, NULL);
+	ck_assert_int_eq(kp_agent_add_safe(wbuf, &unsafes[0]), 0);
+	ck_assert_int_eq(kp_agent_add_safe(wbuf, &unsafes[1]), 0);
+	imsg_close(&client.ibuf, wbuf);
+	ck_assert_int_eq(kp_agent_flush(&client), KP_SUCCESS);
+	ck_assert_int_gt(imsg_read(&server.ibuf), 0);
+	ck_assert_int_gt(imsg_get(&server.ibuf, &imsg), 0);
+
+	/* When */
+	ck_assert_int_eq(kp_agent_msg_next_unsafe(&imsg, &off, &received),
+	                 KP_SUCCESS);
+
+	/* Then */
+	ck_assert_str_eq(received.name, "first");
+	ck_assert_str_eq(received.password, "one");
+	ck_assert_int_eq(received.timeout, 42);
+
+	/* When */
+	ck_assert_int_eq(kp_agent_msg_next_unsafe(&imsg, &off, &received),
+	                 KP_SUCCESS);
+
+	/* Then */
+	ck_assert_str_eq(received.name, "second");
+	ck_assert_str_eq(received.password, "");
+	ck_assert_str_eq(received.metadata, "two");
+	ck_assert_int_eq(received.timeout, -1);
+
+	/* When */
+	kp_error_t ret = kp_agent_msg_next_unsafe(&imsg, &off, &received);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_ERRNO);
+	ck_assert_int_eq(errno, ENOENT);
+
+	imsg_free(&imsg);
+	kp_agent_close(&client);
+	kp_agent_close(&server);
+}
+END_TEST
+
+#ifdef HAS_INOTIFY
+static int
+rm(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/* Header nonce is past version, sodium version, opslimit, memlimit and salt */
+#define SAFE_NONCE_OFFSET \
+	(2 + 2 + 8 + 8 + crypto_pwhash_scryptsalsa208sha256_SALTBYTES)
+
+/*
+ * Write a version 2 safe header at path, whose nonce starts with n. Safe
+ * already there is overwritten in place.
+ */
+static void
+safe_file(const char *path, unsigned char n)
+{
+	unsigned char header[512] = { 0 };
+	int fd;
+
+	header[1] = 2;
+	header[SAFE_NONCE_OFFSET] = n;
+	ck_assert_int_ge(fd = open(path, O_WRONLY | O_CREAT, 0600), 0);
+	ck_assert_int_eq(pwrite(fd, header, sizeof(header), 0),
+	                 sizeof(header));
+	close(fd);
+}
+
+/*
+ * Store safe name of workspace root as it is on disk.
+ */
+static void
+safe_store(struct kp_agent *server, const char *root, const char *name)
+{
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+	char path[PATH_MAX];
+
+	snprintf(path, PATH_MAX, "%s/%s", root, name);
+	strlcpy(unsafe.name, name, PATH_MAX);
+	strlcpy(unsafe.password, "hunter2", KP_PASSWORD_MAX_LEN);
+	ck_assert_int_eq(kp_storage_id(AT_FDCWD, path, &unsafe.id), KP_SUCCESS);
+	ck_assert_int_eq(kp_agent_store(server, &unsafe), KP_SUCCESS);
+}
+
+/*
+ * Ask for a page of names and read it whole, return how many names it held.
+ */
+static size_t
+list_page(struct kp_agent *client, struct kp_agent *server,
+          const char *prefix, char *after, bool *more)
+{
+	struct kp_agent_attr attrs[2], attr;
+	struct iovec iov[4];
+	struct imsg imsg;
+	size_t count = 0, off;
+	bool last = false;
+	void *value;
+	int iovcnt;
+
+	iovcnt = kp_agent_attr(iov, &attrs[0], KP_ATTR_NAME, prefix,
+	                       strlen(prefix));
+	if (after[0] != '\0') {
+		iovcnt += kp_agent_attr(&iov[iovcnt], &attrs[1], KP_ATTR_AFTER,
+		                        after, strlen(after));
+	}
+	ck_assert_int_eq(kp_agent_sendv(client, KP_MSG_LIST, iov, iovcnt),
+	                 KP_SUCCESS);
+	ck_assert_int_gt(imsg_read(&server->ibuf), 0);
+	ck_assert_int_gt(imsg_get(&server->ibuf, &imsg), 0);
+	ck_assert_int_eq(kp_agent_list_names(server, &imsg), KP_SUCCESS);
+	imsg_free(&imsg);
+
+	while (!last) {
+		ck_assert_int_eq(kp_agent_get(client, KP_MSG_LIST, &imsg),
+		                 KP_SUCCESS);
+		ck_assert_int_le(imsg.hdr.len, MAX_IMSGSIZE);
+		off = 0;
+		while (kp_agent_attr_next(&imsg, &off, &attr, &value) > 0) {
+			if (attr.type == KP_ATTR_MORE) {
+				*more = *(uint8_t *)value != 0;
+				last = true;
+			} else if (attr.type == KP_ATTR_NAME) {
+				ck_assert_int_eq(kp_agent_attr_string(after,
+				                 PATH_MAX, value, attr.len), 0);
+				ck_assert_int_eq(strncmp(after, prefix,
+				                         strlen(prefix)), 0);
+				count++;
+			}
+		}
+		imsg_free(&imsg);
+	}
+
+	return count;
+}
+
+START_TEST(test_agent_list_should_page_watched_safes)
+{
+	/* Given */
+	struct kp_agent client, server;
+	char root[] = "/tmp/kickpass-test-XXXXXX", path[PATH_MAX];
+	char after[PATH_MAX] = "";
+	bool more;
+	int fd, i;
+
+	pair(&client, &server);
+	ck_assert_ptr_ne(mkdtemp(root), NULL);
+	snprintf(path, PATH_MAX, "%s/safe", root);
+	ck_assert_int_eq(mkdir(path, 0700), 0);
+	ck_assert_int_eq(kp_agent_watch(&server, root, &fd), KP_SUCCESS);
+	for (i = 0; i < KP_AGENT_LIST_MAX + 4; i++) {
+		snprintf(path, PATH_MAX, "%s/safe/%04d", root, i);
+		ck_assert_int_ge(fd = open(path, O_WRONLY | O_CREAT, 0600), 0);
+		close(fd);
+	}
+	snprintf(path, PATH_MAX, "%s/safer", root);
+	ck_assert_int_ge(fd = open(path, O_WRONLY | O_CREAT, 0600), 0);
+	close(fd);
+
+	/* When */
+	size_t count = list_page(&client, &server, "safe/", after, &more);
+
+	/* Then */
+	ck_assert_int_eq(count, KP_AGENT_LIST_MAX);
+	ck_assert(more);
+	ck_assert_str_eq(after, "safe/4095");
+
+	/* When */
+	count = list_page(&client, &server, "safe/", after, &more);
+
+	/* Then */
+	ck_assert_int_eq(count, 4);
+	ck_assert(!more);
+	ck_assert_str_eq(after, "safe/4099");
+
+	/* When */
+	after[0] = '\0';
+	count = list_page(&client, &server, "saf", after, &more);
+
+	/* Then */
+	ck_assert_int_eq(count, KP_AGENT_LIST_MAX);
+	ck_assert(more);
+
+	kp_agent_unwatch(&server);
+	nftw(root, rm, 16, FTW_DEPTH | FTW_PHYS);
+	kp_agent_close(&client);
+	kp_agent_close(&server);
+}
+END_TEST
+START_TEST(test_agent_store_should_drop_safe_changed_on_disk)
+{
+	/* Given */
+	struct kp_agent server;
+	struct timespec times[2];
+	struct stat sb;
+	char root[] = "/tmp/kickpass-test-XXXXXX", path[PATH_MAX];
+	int fd;
+
+	memset(&server, 0, sizeof(struct kp_agent));
+	ck_assert_ptr_ne(mkdtemp(root), NULL);
+	snprintf(path, PATH_MAX, "%s/other", root);
+	safe_file(path, 1);
+	snprintf(path, PATH_MAX, "%s/safe", root);
+	safe_file(path, 1);
+	ck_assert_int_eq(kp_agent_watch(&server, root, &fd), KP_SUCCESS);
+	safe_store(&server, root, "safe");
+	safe_store(&server, root, "other");
+	ck_assert_int_eq(stat(path, &sb), 0);
+
+	/* When */
+	safe_file(path, 2);
+	times[0] = sb.st_atim;
+	times[1] = sb.st_mtim;
+	ck_assert_int_eq(utimensat(AT_FDCWD, path, times, 0), 0);
+	ck_assert_int_eq(kp_agent_watch_read(&server), KP_SUCCESS);
+
+	/* Then */
+	ck_assert_ptr_eq(kp_agent_find("safe"), NULL);
+	ck_assert_ptr_ne(kp_agent_find("other"), NULL);
+
+	kp_agent_discard(&server, "other", true);
+	kp_agent_unwatch(&server);
+	nftw(root, rm, 16, FTW_DEPTH | FTW_PHYS);
+}
+END_TEST
+
+START_TEST(test_agent_store_should_refuse_stale_safe)
+{
+	/* Given */
+	struct kp_agent server;
+	struct kp_unsafe unsafe = KP_UNSAFE_INIT;
+	char root[] = "/tmp/kickpass-test-XXXXXX", path[PATH_MAX];
+	int fd;
+
+	memset(&server, 0, sizeof(struct kp_agent));
+	ck_assert_ptr_ne(mkdtemp(root), NULL);
+	snprintf(path, PATH_MAX, "%s/safe", root);
+	safe_file(path, 1);
+	ck_assert_int_eq(kp_agent_watch(&server, root, &fd), KP_SUCCESS);
+	strlcpy(unsafe.name, "safe", PATH_MAX);
+	ck_assert_int_eq(kp_storage_id(AT_FDCWD, path, &unsafe.id), KP_SUCCESS);
+	safe_file(path, 2);
+
+	/* When */
+	kp_error_t ret = kp_agent_store(&server, &unsafe);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_ERRNO);
+	ck_assert_int_eq(errno, ESTALE);
+	ck_assert_ptr_eq(kp_agent_find("safe"), NULL);
+
+	kp_agent_unwatch(&server);
+	nftw(root, rm, 16, FTW_DEPTH | FTW_PHYS);
+}
+END_TEST
+
+START_TEST(test_agent_store_should_drop_safes_moved_away)
+{
+	/* Given */
+	struct kp_agent server;
+	char root[] = "/tmp/kickpass-test-XXXXXX", path[PATH_MAX];
+	char moved[PATH_MAX];
+	int fd;
+
+	memset(&server, 0, sizeof(struct kp_agent));
+	ck_assert_ptr_ne(mkdtemp(root), NULL);
+	snprintf(path, PATH_MAX, "%s/dir", root);
+	ck_assert_int_eq(mkdir(path, 0700), 0);
+	snprintf(path, PATH_MAX, "%s/dir/safe", root);
+	safe_file(path, 1);
+	ck_assert_int_eq(kp_agent_watch(&server, root, &fd), KP_SUCCESS);
+	safe_store(&server, root, "dir/safe");
+
+	/* When */
+	snprintf(path, PATH_MAX, "%s/dir", root);
+	snprintf(moved, PATH_MAX, "%s/moved", root);
+	ck_assert_int_eq(rename(path, moved), 0);
+	ck_assert_int_eq(kp_agent_watch_read(&server), KP_SUCCESS);
+
+	/* Then */
+	ck_assert_ptr_eq(kp_agent_find("dir/safe"), NULL);
+
+	kp_agent_unwatch(&server);
+	nftw(root, rm, 16, FTW_DEPTH | FTW_PHYS);
+}
+END_TEST
+#endif /* HAS_INOTIFY */
+
+int
+main(int argc, char **argv)
+{
+	int number_failed;
+
+	if (sodium_init() < 0) {
+		return 1;
+	}
+
+	Suite *suite = suite_create("kpagent_test_suite");
+	TCase *tcase = tcase_create("case");
+	tcase_add_test(tcase, test_agent_unsafe_should_go_through_at_its_size);
+	tcase_add_test(tcase, test_agent_truncated_message_should_fail);
+	tcase_add_test(tcase, test_agent_string_without_terminator_should_fail);
+	tcase_add_test(tcase, test_agent_search_batch_should_answer_each_name_in_order);
+	tcase_add_test(tcase, test_agent_next_unsafe_should_split_safes_on_name);
+	tcase_add_test(tcase, test_agent_encrypted_store_should_hold_no_locked_memory);
+	tcase_add_test(tcase, test_agent_encrypted_store_should_not_move_between_safes);
+#ifdef HAS_MEMFD_CREATE
+	tcase_add_test(tcase, test_agent_large_metadata_should_go_through_sealed);
+#endif
+	tcase_add_test(tcase, test_agent_large_metadata_in_unsealed_file_should_fail);
+	tcase_add_test(tcase, test_agent_large_metadata_without_sealed_cap_should_fail);
+#ifdef HAS_INOTIFY
+	tcase_add_test(tcase, test_agent_list_should_page_watched_safes);
+	tcase_add_test(tcase, test_agent_store_should_drop_safe_changed_on_disk);
+	tcase_add_test(tcase, test_agent_store_should_refuse_stale_safe);
+	tcase_add_test(tcase, test_agent_store_should_drop_safes_moved_away);
+#endif
+	suite_add_tcase(suite, tcase);
+
+	SRunner *runner = srunner_create(suite);
+	srunner_set_fork_status(runner, CK_NOFORK);
+	srunner_run_all(runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return number_failed;
+}
@@ -25,9 +25,10 @@ import unittest
 import tempfile
 
 class KPAgent(subprocess.Popen):
-    def __init__(self, kp):
-        super(KPAgent, self).__init__([kp, 'agent', '-d'], stdout=subprocess.PIPE, universal_newlines=True)
-        logging.info(" ".join([kp, 'agent', '-d']) + " [pid={}]".format(self.pid))
+    def __init__(self, kp, options=None):
+        args = [kp, 'agent', '-d'] + (options or [])
+        super(KPAgent, self).__init__(args, stdout=subprocess.PIPE, universal_newlines=True)
+        logging.info(" ".join(args) + " [pid={}]".format(self.pid))
         env, value = self.stdout.readline().strip().split(';')[0].split('=')
         self.env = {env: value}
         os.environ.update(self.env)
@@ -153,8 +154,8 @@ class KPTestCase(unittest.TestCase):
         self.child.wait()
         self.assertEqual(self.child.exitstatus, rc)
 
-    def start_agent(self):
-        self.agent = KPAgent(self.kp)
+    def start_agent(self, options=None):
+        self.agent = KPAgent(self.kp, options)
 
     def stop_agent(self):
         res = self.agent.poll()
@@ -167,8 +168,12 @@ class KPTestCase(unittest.TestCase):
             del os.environ[env]
         self.agent = None
 
-    def init(self, path=None, master="test master password", rc=0):
-        cmd = ['init', '--memlimit', '16777216', '--opslimit', '32768']
+    def init(self, path=None, options=None, master="test master password", rc=0):
+        cmd = ['init']
+        if options:
+            cmd = cmd + options
+        else:
+            cmd = cmd + ['--memlimit', '16777216', '--opslimit', '32768']
         if path is not None:
             cmd.append(path)
         self.cmd(cmd, master=master, confirm_master=True, rc=rc)
@@ -203,8 +208,33 @@ class KPTestCase(unittest.TestCase):
             cmd = cmd + options
         self.cmd(cmd + [name], master=master, confirm_master=False, rc=rc)
 
+    def unlock(self, master="test master password", rc=0):
+        self.cmd(['unlock'], master=master, confirm_master=False, rc=rc)
+
     def open(self, name, options=None, master="test master password", rc=0):
         cmd = ['open']
         if options:
             cmd = cmd + options
         self.cmd(cmd + [name], master=master, confirm_master=False, rc=rc)
+
+    def passwd(self, path=None, master="test master password", new_master="new master password", rc=0):
+        cmd = ['passwd']
+        if path is not None:
+            cmd.append(path)
+        self.cmd(cmd, master=master, confirm_master=False, password=new_master, confirm_password=True, rc=rc)
+
+    def stat(self, path=None, options=None, rc=0):
+        cmd = ['stat']
+        if options:
+            cmd = cmd + options
+        if path is not None:
+            cmd.append(path)
+        self.cmd(cmd, master=None, rc=rc)
+
+    def upgrade(self, path=None, options=None, master="test master password", rc=0):
+        cmd = ['upgrade']
+        if options:
+            cmd = cmd + options
+        if path is not None:
+            cmd.append(path)
+        self.cmd(cmd, master=master, confirm_master=False, rc=rc)
@@ -13,6 +13,8 @@
 # ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
 # OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #
+import os
+import shutil
 import unittest
 import kptest
 
@@ -64,5 +66,57 @@ class TestListCommand(kptest.KPTestCase):
                                 "  doh",
                                 "  lastone")
 
+    @kptest.with_agent
+    def test_list_with_agent_is_sorted(self):
+        # Given
+        self.editor('date')
+        self.create("subdir/test")
+        self.create("subdir/other")
+        self.create("subdir.old")
+
+        # When
+        self.cmd(["ls"])
+
+        # Then
+        self.assertStdoutEquals("subdir.old", "subdir/other", "subdir/test")
+
+    @kptest.with_agent
+    def test_list_with_agent_subpath(self):
+        # Given
+        self.editor('date')
+        self.create("withoutdir")
+        self.create("subdir/test")
+        self.create("subdir/other")
+        self.create("important/doh")
+        self.create("importantly")
+
+        # When
+        self.cmd(["ls", "subdir", "important//"])
+
+        # Then
+        self.assertStdoutEquals("subdir/",
+                                "  other",
+                                "  test",
+                                "important///",
+                                "  doh")
+
+    @kptest.with_agent
+    def test_list_with_agent_follows_workspace_changes(self):
+        # Given
+        self.editor('date')
+        self.create("subdir/test")
+        self.create("subdir/other")
+        self.create("gone/stuff")
+        os.rename(os.path.join(self.kp_ws, "subdir"),
+                  os.path.join(self.kp_ws, "moved"))
+        shutil.rmtree(os.path.join(self.kp_ws, "gone"))
+        open(os.path.join(self.kp_ws, "moved", ".hidden"), "w").close()
+
+        # When
+        self.cmd(["ls"])
+
+        # Then
+        self.assertStdoutEquals("moved/other", "moved/test")
+
 if __name__ == '__main__':
         unittest.main()
@@ -34,5 +34,63 @@ class TestOpenCommand(kptest.KPTestCase):
         # Then
         self.assertStdoutEquals("Watch out for turtles. They'll bite you if you put your fingers in their mouths.")
 
+    @kptest.with_agent
+    def test_open_idle_timeout_restarts_on_access(self):
+        # Given
+        self.editor('env', env="Turtles.")
+        self.create("test")
+        self.open("test", options=['-i', '-t', '4'])
+        time.sleep(2)
+        self.cat("test", master=None)
+
+        # When
+        time.sleep(2)
+
+        # Then
+        self.cat("test", master=None)
+        self.assertStdoutEquals("Turtles.")
+
+    def test_open_beyond_agent_budget_evicts_least_recently_used(self):
+        # Given
+        self.editor('env', env="Turtles.")
+        for name in ["a", "b", "c"]:
+            self.create(name)
+        self.start_agent(options=['--max-mem', '128'])
+        self.open("a")
+        self.open("b")
+        self.cat("a", master=None)
+
+        # When
+        self.open("c")
+
+        # Then
+        self.cat("a", master=None)
+        self.assertStdoutEquals("Turtles.")
+        self.cat("c", master=None)
+        self.assertStdoutEquals("Turtles.")
+        # b was least recently used, cat asks for master password
+        self.cat("b")
+        self.assertStdoutEquals("Turtles.")
+        self.stop_agent()
+
+    def test_open_with_encrypting_agent_keeps_safes_beyond_budget(self):
+        # Given
+        self.editor('env', env="Turtles.")
+        for name in ["a", "b", "c"]:
+            self.create(name)
+        self.start_agent(options=['--encrypt', '--max-mem', '128'])
+        self.open("a")
+        self.open("b")
+
+        # When
+        self.open("c")
+
+        # Then
+        # Encrypted safes hold no locked memory, none is evicted
+        for name in ["a", "b", "c"]:
+            self.cat(name, master=None)
+            self.assertStdoutEquals("Turtles.")
+        self.stop_agent()
+
 if __name__ == '__main__':
         unittest.main()
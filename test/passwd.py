@@ -0,0 +1,99 @@
+#
+# Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+import os
+import unittest
+
+import kptest
+
+class TestPasswdCommand(kptest.KPTestCase):
+
+    def test_passwd_changes_master_password(self):
+        # Given
+        self.editor('env', env="Watch out for turtles. They'll bite you if you put your fingers in their mouths.")
+        self.create("test")
+        self.create("sub/test")
+
+        # When
+        self.passwd()
+
+        # Then
+        self.cat("test", master="new master password")
+        self.assertStdoutEquals("Watch out for turtles. They'll bite you if you put your fingers in their mouths.")
+        self.cat("sub/test", options=["-p"], master="new master password")
+        self.assertStdoutEquals("test password")
+        self.cat("test", rc=7)
+
+    def test_passwd_resumes_when_interrupted(self):
+        # Given
+        self.create("test")
+        garbage = os.path.join(self.kp_ws, "garbage")
+        with open(garbage, "w") as f:
+            f.write("not a safe")
+        self.passwd(rc=2)
+        os.remove(garbage)
+
+        # When
+        self.passwd()
+
+        # Then
+        self.cat("test", options=["-p"], master="new master password")
+        self.assertStdoutEquals("test password")
+        self.assertFalse(os.path.exists(os.path.join(self.kp_ws, ".passwd")))
+
+    def test_passwd_resume_with_other_new_password_fails(self):
+        # Given
+        self.create("test")
+        garbage = os.path.join(self.kp_ws, "garbage")
+        with open(garbage, "w") as f:
+            f.write("not a safe")
+        self.passwd(rc=2)
+        os.remove(garbage)
+
+        # When
+        self.passwd(new_master="other master password", rc=2)
+
+        # Then
+        self.passwd()
+        self.cat("test", options=["-p"], master="new master password")
+        self.assertStdoutEquals("test password")
+
+    def config(self, memlimit, opslimit):
+        self.cat(".config")
+        salt = [l for l in self.stdout.splitlines() if l.startswith("salt:")][0]
+        self.editor('env', env="kdf: scrypt\nmemlimit: {}\nopslimit: {}\nparallelism: 1\n{}".format(memlimit, opslimit, salt))
+        self.edit(".config", password=None, options=["-m"])
+
+    def test_passwd_rewraps_safes_on_other_kdf_params(self):
+        # Given
+        self.editor('env', env="comment")
+        self.create("test")
+        # Neither config nor .config itself are on test params anymore
+        self.config(33554432, 65536)
+        self.config(16777216, 65536)
+        self.create("other")
+
+        # When
+        self.passwd()
+
+        # Then
+        self.cat("test", options=["-p"], master="new master password")
+        self.assertStdoutEquals("test password")
+        self.cat("other", options=["-p"], master="new master password")
+        self.assertStdoutEquals("test password")
+        self.assertFalse(os.path.exists(os.path.join(self.kp_ws, ".passwd")))
+
+if __name__ == '__main__':
+        unittest.main()
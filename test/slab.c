@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#include <check.h>
+
+#include "check_compat.h"
+
+#include "../lib/slab.c"
+
+START_TEST(test_slab_free_should_zero)
+{
+	/* Given */
+	unsigned char *ptr, *again;
+	size_t i;
+
+	ptr = kp_slab_alloc(100);
+	ck_assert_ptr_ne(ptr, NULL);
+	memset(ptr, 0x42, 100);
+
+	/* When */
+	kp_slab_free(ptr);
+	again = kp_slab_alloc(100);
+
+	/* Then */
+	ck_assert_ptr_eq(again, ptr);
+	for (i = 0; i < 100; i++) {
+		ck_assert_int_eq(again[i], 0);
+	}
+
+	kp_slab_free(again);
+}
+END_TEST
+
+START_TEST(test_slab_should_share_regions)
+{
+	/* Given */
+	void *ptrs[1000];
+	struct kp_slab_region *region;
+	size_t i, regions = 0;
+	int class;
+
+	/* When */
+	for (i = 0; i < 1000; i++) {
+		ptrs[i] = kp_slab_alloc(100);
+		ck_assert_ptr_ne(ptrs[i], NULL);
+		memset(ptrs[i], 0x42, 100);
+	}
+
+	/* Then */
+	class = kp_slab_class(100 + KP_SLAB_CANARY_SIZE);
+	for (region = slab.regions[class]; region != NULL;
+	     region = region->next) {
+		regions++;
+	}
+	ck_assert_int_eq(regions, 1000 / (KP_SLAB_REGION_SIZE / 128) + 1);
+
+	for (i = 0; i < 1000; i++) {
+		kp_slab_free(ptrs[i]);
+	}
+
+	/* Empty regions are given back, but one */
+	ck_assert_ptr_ne(slab.regions[class], NULL);
+	ck_assert_ptr_eq(slab.regions[class]->next, NULL);
+}
+END_TEST
+
+START_TEST(test_slab_large_should_use_sodium)
+{
+	/* Given */
+	unsigned char *ptr;
+	int class;
+
+	/* When */
+	ptr = kp_slab_alloc(KP_SLAB_MAX_SIZE);
+
+	/* Then */
+	ck_assert_ptr_ne(ptr, NULL);
+	ck_assert_ptr_eq(kp_slab_region_find(ptr, &class), NULL);
+	memset(ptr, 0x42, KP_SLAB_MAX_SIZE);
+
+	kp_slab_free(ptr);
+}
+END_TEST
+
+int
+main(int argc, char **argv)
+{
+	int number_failed;
+
+	if (sodium_init() < 0) {
+		return 1;
+	}
+
+	Suite *suite = suite_create("slab_test_suite");
+	TCase *tcase = tcase_create("case");
+	tcase_add_test(tcase, test_slab_free_should_zero);
+	tcase_add_test(tcase, test_slab_should_share_regions);
+	tcase_add_test(tcase, test_slab_large_should_use_sodium);
+	suite_add_tcase(suite, tcase);
+
+	SRunner *runner = srunner_create(suite);
+	srunner_set_fork_status(runner, CK_NOFORK);
+	srunner_run_all(runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return number_failed;
+}
@@ -0,0 +1,70 @@
+#
+# Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+import os
+import unittest
+
+import kptest
+
+class TestStatCommand(kptest.KPTestCase):
+
+    def test_stat_reports_safes_without_master(self):
+        # Given
+        self.editor('env', env="comment")
+        self.create("test")
+        self.create("sub/test")
+
+        # When
+        self.stat()
+
+        # Then
+        lines = self.stdout.splitlines()
+        self.assertTrue(lines[0].startswith(".config: v2 scrypt opslimit 32768 memlimit 16777216 parallelism 1, "))
+        self.assertTrue(lines[1].startswith("sub/test: v2 scrypt opslimit 32768 memlimit 16777216 parallelism 1, "))
+        self.assertTrue(lines[2].startswith("test: v2 scrypt opslimit 32768 memlimit 16777216 parallelism 1, "))
+        self.assertEqual(lines[3], "3 safes, 0 unreadable")
+        self.assertEqual(lines[4], "version 2: 3")
+        self.assertEqual(lines[5], "3: v2 scrypt opslimit 32768 memlimit 16777216 parallelism 1")
+
+    def test_stat_summary_groups_kdf_parameters(self):
+        # Given
+        self.editor('env', env="comment")
+        self.create("test")
+        self.init("work/", options=['--kdf', 'argon2id', '--memlimit', '8388608', '--opslimit', '1', '--parallelism', '2'])
+        self.create("work/test")
+
+        # When
+        self.stat(options=["-s", "-j", "2"])
+
+        # Then
+        lines = self.stdout.splitlines()
+        self.assertEqual(lines[0], "4 safes, 0 unreadable")
+        self.assertEqual(lines[1], "version 2: 4")
+        self.assertEqual(lines[2], "2: v2 scrypt opslimit 32768 memlimit 16777216 parallelism 1")
+        self.assertEqual(lines[3], "2: v2 argon2id opslimit 1 memlimit 8388608 parallelism 2")
+
+    def test_stat_counts_unreadable_safes(self):
+        # Given
+        with open(os.path.join(self.kp_ws, "garbage"), "w") as f:
+            f.write("not a safe")
+
+        # When
+        self.stat(options=["-s"])
+
+        # Then
+        self.assertIn("1 safes, 1 unreadable", self.stdout.splitlines())
+
+if __name__ == '__main__':
+        unittest.main()
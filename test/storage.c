@@ -15,12 +15,114 @@
  */
 
 #include <check.h>
+#include <dirent.h>
+#include <ftw.h>
 
 #include "check_compat.h"
 
 #include "../lib/safe.c"
 #include "../lib/storage.c"
 
+static int
+rm(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/*
+ * Workspace in a new temporary directory root, with light kdf parameters.
+ */
+static void
+workspace(struct kp_ctx *ctx, char *root)
+{
+	char **password;
+
+	memset(ctx, 0, sizeof(struct kp_ctx));
+	ck_assert_ptr_ne(mkdtemp(root), NULL);
+	ctx->ws_fd = open(root, O_DIRECTORY);
+	ck_assert_int_ge(ctx->ws_fd, 0);
+	password = (char **)&ctx->password;
+	*password = "test";
+	kp_kdf_cache_init(ctx);
+	ctx->plain_max_size = KP_PLAIN_MAX_SIZE;
+	ctx->sync = KP_SYNC_DIR;
+	ctx->cfg.kdf = KP_KDF_SCRYPT;
+	ctx->cfg.parallelism = 1;
+	ctx->cfg.opslimit = crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_INTERACTIVE;
+	ctx->cfg.memlimit = crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_INTERACTIVE;
+}
+
+static void
+safe_set(struct kp_safe *safe, const char *name, char *password,
+         char *metadata)
+{
+	memset(safe, 0, sizeof(struct kp_safe));
+	strlcpy(safe->name, name, PATH_MAX);
+	*(char **)&safe->password = password;
+	*(char **)&safe->metadata = metadata;
+	safe->open = true;
+}
+
+/*
+ * Number of hidden files left in dir of workspace.
+ */
+static int
+hidden(struct kp_ctx *ctx, const char *dir)
+{
+	DIR *dirp;
+	struct dirent *dirent;
+	int n = 0;
+
+	dirp = fdopendir(openat(ctx->ws_fd, dir, O_RDONLY | O_DIRECTORY));
+	ck_assert_ptr_ne(dirp, NULL);
+	while ((dirent = readdir(dirp)) != NULL) {
+		if (dirent->d_name[0] == '.'
+		    && strcmp(dirent->d_name, ".") != 0
+		    && strcmp(dirent->d_name, "..") != 0) {
+			n++;
+		}
+	}
+	closedir(dirp);
+
+	return n;
+}
+
+/*
+ * Write content to fd then replace safe name with it.
+ */
+static void
+publish(struct kp_ctx *ctx, int fd, const char *name, char *suffix,
+        const char *content)
+{
+	ck_assert_int_eq(write(fd, content, strlen(content)),
+	                 strlen(content));
+	ck_assert_int_eq(kp_storage_publish(ctx, fd, name, suffix),
+	                 KP_SUCCESS);
+	close(fd);
+}
+
+/*
+ * Batch callback counting outcomes, keeping last failed safe name.
+ */
+struct outcomes {
+	int done;
+	int failed;
+	char name[PATH_MAX];
+};
+
+static void
+outcome(const char *name, kp_error_t ret, void *arg)
+{
+	struct outcomes *outcomes = arg;
+
+	if (ret == KP_SUCCESS) {
+		outcomes->done++;
+	} else {
+		outcomes->failed++;
+		strlcpy(outcomes->name, name, PATH_MAX);
+	}
+}
+
 START_TEST(test_storage_header_pack_should_be_successful)
 {
 	/* Given */
@@ -106,12 +208,11 @@ START_TEST(test_storage_encrypt_should_be_successful)
 	struct kp_ctx ctx;
 	char **password;
 	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
-	unsigned char packed_header[KP_STORAGE_HEADER_SIZE] = { 0 };
 	unsigned char plain[] = "the quick brown fox jumps over the lobster dog";
 	unsigned char cipher[sizeof(plain)+crypto_aead_chacha20poly1305_ABYTES] = { 0 };
 	unsigned long long cipher_size;
 
-	header.version = 0xde;
+	header.version = 0x0001;
 	header.sodium_version = 0xad;
 	header.opslimit = crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_INTERACTIVE;
 	header.memlimit = crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_INTERACTIVE;
@@ -120,10 +221,11 @@ START_TEST(test_storage_encrypt_should_be_successful)
 
 	password = (char **)&ctx.password;
 	*password = "test";
+	kp_kdf_cache_init(&ctx);
 
 	/* When */
 	ret |= kp_storage_encrypt(&ctx,
-			&header, packed_header, KP_STORAGE_HEADER_SIZE,
+			&header, NULL,
 			plain, sizeof(plain),
 			cipher, &cipher_size);
 
@@ -134,13 +236,15 @@ START_TEST(test_storage_encrypt_should_be_successful)
 		0x2d, 0x2a, 0x36, 0xf7, 0x94, 0x95, 0x53, 0x47,
 		0x8a, 0x2f, 0x3f, 0xfc, 0xda, 0x88, 0x0e, 0xf1,
 		0x04, 0x64, 0xe3, 0xb0, 0xf2, 0xbf, 0xee, 0x20,
-		0x3a, 0x79, 0x88, 0x6e, 0x1a, 0x8c, 0xa7, 0xd8,
-		0x04, 0x8c, 0x66, 0x60, 0x32, 0xec, 0xc8, 0xa0,
-		0xe9, 0x7c, 0x21, 0xd5, 0xf3, 0xfe, 0x44,
+		0x3a, 0x79, 0x88, 0x6e, 0x1a, 0x8c, 0xa7, 0x7f,
+		0xaf, 0x03, 0xcc, 0xe0, 0xfa, 0xb8, 0x51, 0xcf,
+		0xae, 0xc3, 0x25, 0x5d, 0x9a, 0x22, 0x47,
 	};
 	ck_assert_int_eq(ret, KP_SUCCESS);
 	ck_assert_int_eq(cipher_size, sizeof(ref));
 	ck_assert_int_eq(memcmp(cipher, ref, sizeof(ref)), 0);
+
+	kp_kdf_cache_fini(&ctx);
 }
 END_TEST
 
@@ -151,21 +255,20 @@ START_TEST(test_storage_decrypt_should_be_successful)
 	struct kp_ctx ctx;
 	char **password;
 	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
-	unsigned char packed_header[KP_STORAGE_HEADER_SIZE] = { 0 };
 	unsigned char cipher[] = {
 		0x01, 0x82, 0xbf, 0x1f, 0x22, 0x57, 0x3a, 0x63,
 		0xa3, 0x22, 0x03, 0x3e, 0x85, 0x73, 0xcd, 0x18,
 		0x2d, 0x2a, 0x36, 0xf7, 0x94, 0x95, 0x53, 0x47,
 		0x8a, 0x2f, 0x3f, 0xfc, 0xda, 0x88, 0x0e, 0xf1,
 		0x04, 0x64, 0xe3, 0xb0, 0xf2, 0xbf, 0xee, 0x20,
-		0x3a, 0x79, 0x88, 0x6e, 0x1a, 0x8c, 0xa7, 0xd8,
-		0x04, 0x8c, 0x66, 0x60, 0x32, 0xec, 0xc8, 0xa0,
-		0xe9, 0x7c, 0x21, 0xd5, 0xf3, 0xfe, 0x44,
+		0x3a, 0x79, 0x88, 0x6e, 0x1a, 0x8c, 0xa7, 0x7f,
+		0xaf, 0x03, 0xcc, 0xe0, 0xfa, 0xb8, 0x51, 0xcf,
+		0xae, 0xc3, 0x25, 0x5d, 0x9a, 0x22, 0x47,
 	};
 	unsigned char plain[sizeof(cipher)-crypto_aead_chacha20poly1305_ABYTES] = { 0 };
 	unsigned long long plain_size;
 
-	header.version = 0xde;
+	header.version = 0x0001;
 	header.sodium_version = 0xad;
 	header.opslimit = crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_INTERACTIVE;
 	header.memlimit = crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_INTERACTIVE;
@@ -174,10 +277,11 @@ START_TEST(test_storage_decrypt_should_be_successful)
 
 	password = (char **)&ctx.password;
 	*password = "test";
+	kp_kdf_cache_init(&ctx);
 
 	/* When */
 	ret |= kp_storage_decrypt(&ctx,
-			&header, packed_header, KP_STORAGE_HEADER_SIZE,
+			&header,
 			plain, &plain_size,
 			cipher, sizeof(cipher));
 
@@ -186,6 +290,577 @@ START_TEST(test_storage_decrypt_should_be_successful)
 	ck_assert_int_eq(ret, KP_SUCCESS);
 	ck_assert_int_eq(plain_size, sizeof(ref));
 	ck_assert_str_eq((char *)plain, (char *)ref);
+	ck_assert(ctx.cache.keys[0].used);
+
+	kp_kdf_cache_fini(&ctx);
+}
+END_TEST
+
+START_TEST(test_storage_header_pack_v2_should_be_successful)
+{
+	/* Given */
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+	struct kp_storage_header unpacked = KP_STORAGE_HEADER_INIT;
+	unsigned char packed_header[KP_STORAGE_HEADER_SIZE] = { 0 };
+
+	header.version = KP_STORAGE_V2;
+	header.sodium_version = 0xbaad;
+	header.opslimit = 0x71f97b79931b97d8LL;
+	header.memlimit = 0x50b77cc354846208LL;
+	randombytes_buf(header.salt, KP_STORAGE_SALT_SIZE);
+	randombytes_buf(header.nonce, KP_STORAGE_NONCE_SIZE_V2);
+	randombytes_buf(header.subkey_salt, KP_STORAGE_SALT_SIZE);
+	header.kdf = KP_KDF_ARGON2ID;
+	header.parallelism = 0x0104;
+	header.cipher = KP_STORAGE_AES256GCM;
+	header.plain_size = 0x0badcafe;
+	randombytes_buf(header.wrapped_key, KP_STORAGE_WRAPPED_KEY_SIZE);
+
+	/* When */
+	kp_storage_header_pack(&header, packed_header);
+	kp_storage_header_unpack(&unpacked, packed_header);
+
+	/* Then */
+	ck_assert_int_eq(kp_storage_header_size(KP_STORAGE_V2),
+	                 KP_STORAGE_HEADER_SIZE_V2);
+	ck_assert_int_eq(unpacked.version, KP_STORAGE_V2);
+	ck_assert(unpacked.opslimit == header.opslimit);
+	ck_assert(unpacked.memlimit == header.memlimit);
+	ck_assert_int_eq(memcmp(unpacked.salt, header.salt,
+	                        KP_STORAGE_SALT_SIZE), 0);
+	ck_assert_int_eq(memcmp(unpacked.nonce, header.nonce,
+	                        KP_STORAGE_NONCE_SIZE_V2), 0);
+	ck_assert_int_eq(memcmp(unpacked.subkey_salt, header.subkey_salt,
+	                        KP_STORAGE_SALT_SIZE), 0);
+	ck_assert_int_eq(unpacked.kdf, KP_KDF_ARGON2ID);
+	ck_assert_int_eq(unpacked.parallelism, 0x0104);
+	ck_assert_int_eq(unpacked.cipher, KP_STORAGE_AES256GCM);
+	ck_assert_int_eq(unpacked.plain_size, 0x0badcafe);
+	ck_assert_int_eq(memcmp(unpacked.wrapped_key, header.wrapped_key,
+	                        KP_STORAGE_WRAPPED_KEY_SIZE), 0);
+}
+END_TEST
+
+START_TEST(test_storage_v2_should_derive_master_key_once)
+{
+	/* Given */
+	int ret = KP_SUCCESS;
+	struct kp_ctx ctx;
+	char **password;
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+	unsigned char plain[] = "the quick brown fox jumps over the lobster dog";
+	unsigned char cipher[sizeof(plain)+crypto_aead_chacha20poly1305_ABYTES] = { 0 };
+	unsigned char decrypted[sizeof(plain)] = { 0 };
+	unsigned long long cipher_size, plain_size;
+
+	password = (char **)&ctx.password;
+	*password = "test";
+	kp_kdf_cache_init(&ctx);
+
+	header.version = KP_STORAGE_V2;
+	header.kdf = KP_KDF_SCRYPT;
+	header.parallelism = 1;
+	header.cipher = KP_STORAGE_XCHACHA20POLY1305;
+	header.opslimit = crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_INTERACTIVE;
+	header.memlimit = crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_INTERACTIVE;
+	randombytes_buf(header.subkey_salt, KP_STORAGE_SALT_SIZE);
+
+	ret |= kp_storage_encrypt(&ctx,
+			&header, NULL,
+			plain, sizeof(plain),
+			cipher, &cipher_size);
+
+	/* When */
+	/* a wrong password prove that the master key is not derived again */
+	*password = "wrong";
+	ret |= kp_storage_decrypt(&ctx,
+			&header,
+			decrypted, &plain_size,
+			cipher, cipher_size);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_SUCCESS);
+	ck_assert(ctx.cache.keys[0].used);
+	ck_assert_int_eq(plain_size, sizeof(plain));
+	ck_assert_str_eq((char *)decrypted, (char *)plain);
+
+	kp_kdf_cache_fini(&ctx);
+}
+END_TEST
+
+START_TEST(test_storage_v2_subkey_should_depend_on_salt)
+{
+	/* Given */
+	struct kp_ctx ctx;
+	char **password;
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+	unsigned char key1[crypto_aead_chacha20poly1305_KEYBYTES];
+	unsigned char key2[crypto_aead_chacha20poly1305_KEYBYTES];
+
+	password = (char **)&ctx.password;
+	*password = "test";
+	kp_kdf_cache_init(&ctx);
+
+	header.version = KP_STORAGE_V2;
+	header.kdf = KP_KDF_SCRYPT;
+	header.parallelism = 1;
+	header.opslimit = crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_INTERACTIVE;
+	header.memlimit = crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_INTERACTIVE;
+
+	/* When */
+	kp_storage_kek(&ctx, &header, NULL, NULL, key1);
+	header.subkey_salt[0] ^= 1;
+	kp_storage_kek(&ctx, &header, NULL, NULL, key2);
+
+	/* Then */
+	ck_assert_int_ne(memcmp(key1, key2, sizeof(key1)), 0);
+
+	kp_kdf_cache_fini(&ctx);
+}
+END_TEST
+
+START_TEST(test_storage_v2_argon2id_should_be_successful)
+{
+	/* Given */
+	int ret = KP_SUCCESS;
+	struct kp_ctx ctx;
+	char **password;
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+	unsigned char plain[] = "the quick brown fox jumps over the lobster dog";
+	unsigned char cipher[sizeof(plain)+crypto_aead_chacha20poly1305_ABYTES] = { 0 };
+	unsigned char decrypted[sizeof(plain)] = { 0 };
+	unsigned long long cipher_size, plain_size;
+
+	password = (char **)&ctx.password;
+	*password = "test";
+	kp_kdf_cache_init(&ctx);
+
+	header.version = KP_STORAGE_V2;
+	header.kdf = KP_KDF_ARGON2ID;
+	header.parallelism = 4;
+	header.cipher = KP_STORAGE_XCHACHA20POLY1305;
+	header.opslimit = crypto_pwhash_argon2id_OPSLIMIT_INTERACTIVE;
+	header.memlimit = 4 * 1024 * 1024;
+	randombytes_buf(header.salt, KP_STORAGE_SALT_SIZE);
+	randombytes_buf(header.subkey_salt, KP_STORAGE_SALT_SIZE);
+
+	ret |= kp_storage_encrypt(&ctx,
+			&header, NULL,
+			plain, sizeof(plain),
+			cipher, &cipher_size);
+
+	/* When */
+	kp_kdf_cache_clear(&ctx);
+	ret |= kp_storage_decrypt(&ctx,
+			&header,
+			decrypted, &plain_size,
+			cipher, cipher_size);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_SUCCESS);
+	ck_assert_int_eq(ctx.cache.keys[0].kdf, KP_KDF_ARGON2ID);
+	ck_assert_int_eq(ctx.cache.keys[0].parallelism, 4);
+	ck_assert_str_eq((char *)decrypted, (char *)plain);
+
+	kp_kdf_cache_fini(&ctx);
+}
+END_TEST
+
+START_TEST(test_storage_v2_rewrap_should_keep_payload)
+{
+	/* Given */
+	int ret = KP_SUCCESS;
+	struct kp_ctx ctx;
+	char **password;
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+	unsigned char plain[] = "the quick brown fox jumps over the lobster dog";
+	unsigned char cipher[sizeof(plain)+crypto_aead_chacha20poly1305_ABYTES] = { 0 };
+	unsigned char decrypted[sizeof(plain)] = { 0 };
+	unsigned char key[KP_STORAGE_KEY_SIZE];
+	unsigned long long cipher_size, plain_size;
+
+	password = (char **)&ctx.password;
+	*password = "test";
+	kp_kdf_cache_init(&ctx);
+
+	header.version = KP_STORAGE_V2;
+	header.kdf = KP_KDF_SCRYPT;
+	header.parallelism = 1;
+	header.opslimit = crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_INTERACTIVE;
+	header.memlimit = crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_INTERACTIVE;
+	header.cipher = KP_STORAGE_XCHACHA20POLY1305;
+	randombytes_buf(header.salt, KP_STORAGE_SALT_SIZE);
+	randombytes_buf(header.subkey_salt, KP_STORAGE_SALT_SIZE);
+
+	ret |= kp_storage_encrypt(&ctx,
+			&header, NULL,
+			plain, sizeof(plain),
+			cipher, &cipher_size);
+
+	/* When */
+	ret |= kp_storage_unwrap(&ctx, &header, NULL, NULL, key);
+	*password = "new";
+	randombytes_buf(header.salt, KP_STORAGE_SALT_SIZE);
+	randombytes_buf(header.subkey_salt, KP_STORAGE_SALT_SIZE);
+	ret |= kp_storage_wrap(&ctx, &header, NULL, key);
+
+	/* Then */
+	kp_kdf_cache_clear(&ctx);
+	ret |= kp_storage_decrypt(&ctx,
+			&header,
+			decrypted, &plain_size,
+			cipher, cipher_size);
+	ck_assert_int_eq(ret, KP_SUCCESS);
+	ck_assert_str_eq((char *)decrypted, (char *)plain);
+
+	*password = "test";
+	kp_kdf_cache_clear(&ctx);
+	ret = kp_storage_decrypt(&ctx,
+			&header,
+			decrypted, &plain_size,
+			cipher, cipher_size);
+	ck_assert_int_eq(ret, KP_EDECRYPT);
+
+	kp_kdf_cache_fini(&ctx);
+}
+END_TEST
+
+START_TEST(test_storage_v2_unwrap_should_derive_old_password_on_miss)
+{
+	/* Given */
+	int ret = KP_SUCCESS;
+	struct kp_ctx ctx;
+	char **password;
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+	struct kp_key old = { 0 };
+	unsigned char plain[] = "the quick brown fox jumps over the lobster dog";
+	unsigned char cipher[sizeof(plain)+crypto_aead_chacha20poly1305_ABYTES] = { 0 };
+	unsigned char key[KP_STORAGE_KEY_SIZE];
+	unsigned char master[KP_MASTER_KEY_SIZE];
+	unsigned long long cipher_size;
+
+	password = (char **)&ctx.password;
+	*password = "test";
+	kp_kdf_cache_init(&ctx);
+
+	header.version = KP_STORAGE_V2;
+	header.kdf = KP_KDF_SCRYPT;
+	header.parallelism = 1;
+	header.opslimit = crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_INTERACTIVE;
+	header.memlimit = crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_INTERACTIVE;
+	header.cipher = KP_STORAGE_XCHACHA20POLY1305;
+	randombytes_buf(header.salt, KP_STORAGE_SALT_SIZE);
+	randombytes_buf(header.subkey_salt, KP_STORAGE_SALT_SIZE);
+
+	ret |= kp_storage_encrypt(&ctx,
+			&header, NULL,
+			plain, sizeof(plain),
+			cipher, &cipher_size);
+	kp_kdf_cache_clear(&ctx);
+	*password = "new";
+
+	/* When */
+	ret |= kp_storage_unwrap(&ctx, &header, "test", &old, key);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_SUCCESS);
+	ck_assert(kp_kdf_key_match(&old, header.kdf, header.salt,
+	                           header.opslimit, header.memlimit,
+	                           header.parallelism));
+	ck_assert(!kp_kdf_cache_lookup(&ctx, header.kdf, header.salt,
+	                               header.opslimit, header.memlimit,
+	                               header.parallelism, master));
+
+	kp_kdf_cache_fini(&ctx);
+}
+END_TEST
+
+START_TEST(test_storage_v2_ciphers_should_be_successful)
+{
+	/* Given */
+	int ret = KP_SUCCESS;
+	struct kp_ctx ctx;
+	char **password;
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+	unsigned char plain[] = "the quick brown fox jumps over the lobster dog";
+	unsigned char cipher[sizeof(plain)+crypto_aead_xchacha20poly1305_ietf_ABYTES] = { 0 };
+	unsigned char decrypted[sizeof(plain)] = { 0 };
+	unsigned long long cipher_size, plain_size;
+	uint16_t ciphers[] = {
+		KP_STORAGE_AES256GCM,
+		KP_STORAGE_XCHACHA20POLY1305,
+	};
+	size_t i;
+
+	password = (char **)&ctx.password;
+	*password = "test";
+	kp_kdf_cache_init(&ctx);
+
+	header.version = KP_STORAGE_V2;
+	header.kdf = KP_KDF_SCRYPT;
+	header.parallelism = 1;
+	header.opslimit = crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_INTERACTIVE;
+	header.memlimit = crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_INTERACTIVE;
+	randombytes_buf(header.salt, KP_STORAGE_SALT_SIZE);
+
+	for (i = 0; i < sizeof(ciphers)/sizeof(ciphers[0]); i++) {
+		if (ciphers[i] == KP_STORAGE_AES256GCM
+		    && !crypto_aead_aes256gcm_is_available()) {
+			continue;
+		}
+
+		header.cipher = ciphers[i];
+		randombytes_buf(header.nonce, KP_STORAGE_NONCE_SIZE_V2);
+		randombytes_buf(header.subkey_salt, KP_STORAGE_SALT_SIZE);
+
+		/* When */
+		ret |= kp_storage_encrypt(&ctx,
+				&header, NULL,
+				plain, sizeof(plain),
+				cipher, &cipher_size);
+		ret |= kp_storage_decrypt(&ctx,
+				&header,
+				decrypted, &plain_size,
+				cipher, cipher_size);
+
+		/* Then */
+		ck_assert_int_eq(ret, KP_SUCCESS);
+		ck_assert_str_eq((char *)decrypted, (char *)plain);
+
+		/* cipher id is authenticated */
+		header.cipher = KP_STORAGE_XCHACHA20POLY1305
+		              + KP_STORAGE_AES256GCM - ciphers[i];
+		ret = kp_storage_decrypt(&ctx,
+				&header,
+				decrypted, &plain_size,
+				cipher, cipher_size);
+		ck_assert_int_ne(ret, KP_SUCCESS);
+		ret = KP_SUCCESS;
+	}
+
+	header.cipher = 0xbeef;
+	ret = kp_storage_decrypt(&ctx,
+			&header,
+			decrypted, &plain_size,
+			cipher, cipher_size);
+	ck_assert_int_eq(ret, KP_INVALID_STORAGE);
+
+	kp_kdf_cache_fini(&ctx);
+}
+END_TEST
+
+START_TEST(test_storage_v2_unknown_kdf_should_fail)
+{
+	/* Given */
+	int ret = KP_SUCCESS;
+	struct kp_ctx ctx;
+	struct kp_storage_header header = KP_STORAGE_HEADER_INIT;
+	unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES];
+
+	header.version = KP_STORAGE_V2;
+	header.kdf = 0xbeef;
+	header.parallelism = 1;
+
+	/* When */
+	ret = kp_storage_kek(&ctx, &header, NULL, NULL, key);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_INVALID_STORAGE);
+}
+END_TEST
+
+START_TEST(test_storage_save_should_replace_safe_at_once)
+{
+	/* Given */
+	struct kp_ctx ctx;
+	struct kp_safe safe;
+	struct stat before, after;
+	char root[] = "/tmp/kp-storage-XXXXXX";
+	char old[4] = { 0 };
+	int fd;
+
+	workspace(&ctx, root);
+	fd = openat(ctx.ws_fd, "test", O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	ck_assert_int_eq(write(fd, "old", 3), 3);
+	ck_assert_int_eq(fstat(fd, &before), 0);
+	safe_set(&safe, "test", "hunter2", "turtles");
+
+	/* When */
+	kp_error_t ret = kp_storage_save(&ctx, &safe);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_SUCCESS);
+	/* Previous version is replaced, never written over */
+	ck_assert_int_eq(pread(fd, old, 3, 0), 3);
+	ck_assert_str_eq(old, "old");
+	ck_assert_int_eq(fstatat(ctx.ws_fd, "test", &after, 0), 0);
+	ck_assert_int_ne(after.st_ino, before.st_ino);
+	ck_assert_int_eq(after.st_ino, safe.id.ino);
+	ck_assert_int_eq(hidden(&ctx, "."), 0);
+
+	close(fd);
+	close(ctx.ws_fd);
+	kp_kdf_cache_fini(&ctx);
+	nftw(root, rm, 16, FTW_DEPTH | FTW_PHYS);
+}
+END_TEST
+
+START_TEST(test_storage_concurrent_writers_should_not_share_temporary_name)
+{
+	/* Given */
+	struct kp_ctx ctx;
+	struct stat a_stat, b_stat;
+	char root[] = "/tmp/kp-storage-XXXXXX";
+	char a[KP_STORAGE_SUFFIX_SIZE], b[KP_STORAGE_SUFFIX_SIZE];
+	char tmp[PATH_MAX];
+	char content[4] = { 0 };
+	const char *last = "one";
+	int a_fd, b_fd, fd;
+
+	workspace(&ctx, root);
+
+	/* When */
+	ck_assert_int_eq(kp_storage_mktemp(&ctx, "test", &a_fd, a),
+	                 KP_SUCCESS);
+	ck_assert_int_eq(kp_storage_mktemp(&ctx, "test", &b_fd, b),
+	                 KP_SUCCESS);
+
+	/* Then */
+	ck_assert_str_ne(a, b);
+	ck_assert_int_eq(fstat(a_fd, &a_stat), 0);
+	ck_assert_int_eq(fstat(b_fd, &b_stat), 0);
+	ck_assert_int_ne(a_stat.st_ino, b_stat.st_ino);
+	publish(&ctx, b_fd, "test", b, "two");
+	publish(&ctx, a_fd, "test", a, "one");
+
+#ifdef O_TMPFILE
+	/* Anonymous files linked before either replaces safe */
+	ck_assert_int_eq(kp_storage_create(&ctx, "test", &a_fd, a),
+	                 KP_SUCCESS);
+	ck_assert_int_eq(kp_storage_create(&ctx, "test", &b_fd, b),
+	                 KP_SUCCESS);
+	if (a[0] == '\0') {
+		ck_assert_int_eq(kp_storage_link(&ctx, a_fd, "test", a),
+		                 KP_SUCCESS);
+		ck_assert_int_eq(kp_storage_link(&ctx, b_fd, "test", b),
+		                 KP_SUCCESS);
+		ck_assert_str_ne(a, b);
+		ck_assert_int_eq(kp_storage_tmpname("test", a, tmp, PATH_MAX),
+		                 KP_SUCCESS);
+		ck_assert_int_eq(fstatat(ctx.ws_fd, tmp, &a_stat, 0), 0);
+		ck_assert_int_eq(fstat(a_fd, &b_stat), 0);
+		ck_assert_int_eq(a_stat.st_ino, b_stat.st_ino);
+	}
+	publish(&ctx, b_fd, "test", b, "six");
+	publish(&ctx, a_fd, "test", a, "ten");
+	last = "ten";
+#endif
+
+	fd = openat(ctx.ws_fd, "test", O_RDONLY);
+	ck_assert_int_eq(read(fd, content, 3), 3);
+	ck_assert_str_eq(content, last);
+	ck_assert_int_eq(hidden(&ctx, "."), 0);
+
+	close(fd);
+	close(ctx.ws_fd);
+	kp_kdf_cache_fini(&ctx);
+	nftw(root, rm, 16, FTW_DEPTH | FTW_PHYS);
+}
+END_TEST
+
+START_TEST(test_storage_batch_should_replace_safes_on_commit)
+{
+	/* Given */
+	struct kp_ctx ctx;
+	struct kp_safe safe;
+	struct kp_storage_batch batch;
+	struct outcomes outcomes = { 0 };
+	struct stat stats;
+	char root[] = "/tmp/kp-storage-XXXXXX";
+	char name[PATH_MAX];
+	DIR *dir;
+	struct dirent *dirent;
+	int i, n = KP_STORAGE_BATCH_MAX + 6;
+
+	workspace(&ctx, root);
+	ck_assert_int_eq(mkdirat(ctx.ws_fd, "dir", 0700), 0);
+	ck_assert_int_eq(kp_storage_batch_begin(&ctx, &batch, outcome,
+	                                        &outcomes), KP_SUCCESS);
+
+	/* When */
+	for (i = 0; i < n; i++) {
+		snprintf(name, PATH_MAX, "dir/safe%d", i);
+		safe_set(&safe, name, "hunter2", "turtles");
+		ck_assert_int_eq(kp_storage_save(&ctx, &safe), KP_SUCCESS);
+	}
+
+	/* Then */
+	/* A full batch is synced at once, the rest waits for commit */
+	ck_assert_int_eq(fstatat(ctx.ws_fd, "dir/safe0", &stats, 0), 0);
+	snprintf(name, PATH_MAX, "dir/safe%d", n - 1);
+	ck_assert_int_ne(fstatat(ctx.ws_fd, name, &stats, 0), 0);
+	ck_assert_int_eq(outcomes.done, KP_STORAGE_BATCH_MAX);
+	ck_assert_int_eq(kp_storage_batch_commit(&ctx), KP_SUCCESS);
+	ck_assert_ptr_eq(ctx.batch, NULL);
+	ck_assert_int_eq(outcomes.done, n);
+	ck_assert_int_eq(outcomes.failed, 0);
+	for (i = 0; i < n; i++) {
+		snprintf(name, PATH_MAX, "dir/safe%d", i);
+		ck_assert_int_eq(fstatat(ctx.ws_fd, name, &stats, 0), 0);
+	}
+	dir = fdopendir(openat(ctx.ws_fd, "dir", O_RDONLY | O_DIRECTORY));
+	ck_assert_ptr_ne(dir, NULL);
+	while ((dirent = readdir(dir)) != NULL) {
+		ck_assert(strcmp(dirent->d_name, ".") == 0
+		          || strcmp(dirent->d_name, "..") == 0
+		          || dirent->d_name[0] != '.');
+	}
+
+	closedir(dir);
+	close(ctx.ws_fd);
+	kp_kdf_cache_fini(&ctx);
+	nftw(root, rm, 16, FTW_DEPTH | FTW_PHYS);
+}
+END_TEST
+
+START_TEST(test_storage_batch_should_report_safes_failing_on_commit)
+{
+	/* Given */
+	struct kp_ctx ctx;
+	struct kp_safe safe;
+	struct kp_storage_batch batch;
+	struct outcomes outcomes = { 0 };
+	struct stat stats;
+	char root[] = "/tmp/kp-storage-XXXXXX";
+	int fd;
+
+	workspace(&ctx, root);
+	ck_assert_int_eq(kp_storage_batch_begin(&ctx, &batch, outcome,
+	                                        &outcomes), KP_SUCCESS);
+	safe_set(&safe, "ok", "hunter2", "turtles");
+	ck_assert_int_eq(kp_storage_save(&ctx, &safe), KP_SUCCESS);
+	safe_set(&safe, "bad", "hunter2", "turtles");
+	ck_assert_int_eq(kp_storage_save(&ctx, &safe), KP_SUCCESS);
+
+	/* A non empty directory cannot be replaced */
+	ck_assert_int_eq(mkdirat(ctx.ws_fd, "bad", 0700), 0);
+	fd = openat(ctx.ws_fd, "bad/file", O_CREAT | O_WRONLY, 0600);
+	ck_assert_int_ge(fd, 0);
+	close(fd);
+
+	/* When */
+	ck_assert_int_ne(kp_storage_batch_commit(&ctx), KP_SUCCESS);
+
+	/* Then */
+	ck_assert_int_eq(outcomes.done, 1);
+	ck_assert_int_eq(outcomes.failed, 1);
+	ck_assert_str_eq(outcomes.name, "bad");
+	ck_assert_int_eq(fstatat(ctx.ws_fd, "ok", &stats, 0), 0);
+	ck_assert(S_ISREG(stats.st_mode));
+
+	close(ctx.ws_fd);
+	kp_kdf_cache_fini(&ctx);
+	nftw(root, rm, 16, FTW_DEPTH | FTW_PHYS);
 }
 END_TEST
 
@@ -194,12 +869,28 @@ main(int argc, char **argv)
 {
 	int number_failed;
 
+	if (sodium_init() < 0) {
+		return 1;
+	}
+
 	Suite *suite = suite_create("storage_test_suite");
 	TCase *tcase = tcase_create("case");
 	tcase_add_test(tcase, test_storage_header_pack_should_be_successful);
 	tcase_add_test(tcase, test_storage_header_unpack_should_be_successful);
 	tcase_add_test(tcase, test_storage_encrypt_should_be_successful);
 	tcase_add_test(tcase, test_storage_decrypt_should_be_successful);
+	tcase_add_test(tcase, test_storage_header_pack_v2_should_be_successful);
+	tcase_add_test(tcase, test_storage_v2_should_derive_master_key_once);
+	tcase_add_test(tcase, test_storage_v2_subkey_should_depend_on_salt);
+	tcase_add_test(tcase, test_storage_v2_argon2id_should_be_successful);
+	tcase_add_test(tcase, test_storage_v2_rewrap_should_keep_payload);
+	tcase_add_test(tcase, test_storage_v2_unwrap_should_derive_old_password_on_miss);
+	tcase_add_test(tcase, test_storage_v2_ciphers_should_be_successful);
+	tcase_add_test(tcase, test_storage_v2_unknown_kdf_should_fail);
+	tcase_add_test(tcase, test_storage_save_should_replace_safe_at_once);
+	tcase_add_test(tcase, test_storage_concurrent_writers_should_not_share_temporary_name);
+	tcase_add_test(tcase, test_storage_batch_should_replace_safes_on_commit);
+	tcase_add_test(tcase, test_storage_batch_should_report_safes_failing_on_commit);
 	suite_add_tcase(suite, tcase);
 
 	SRunner *runner = srunner_create(suite);
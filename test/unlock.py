@@ -0,0 +1,74 @@
+#
+# Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+import unittest
+import kptest
+
+class TestUnlockCommand(kptest.KPTestCase):
+
+    @kptest.with_agent
+    def test_unlock_let_agent_open_safe(self):
+        # Given
+        self.editor('env', env="Watch out for turtles. They'll bite you if you put your fingers in their mouths.")
+        self.create("test")
+
+        # When
+        self.unlock()
+        self.cat("test", master=None)
+
+        # Then
+        self.assertStdoutEquals("Watch out for turtles. They'll bite you if you put your fingers in their mouths.")
+
+    @kptest.with_agent
+    def test_unlock_let_agent_save_safe(self):
+        # Given
+        self.editor('env', env="Watch out for turtles. They'll bite you if you put your fingers in their mouths.")
+        self.unlock()
+
+        # When
+        self.create("sub/test", master=None)
+
+        # Then
+        self.cat("sub/test", master=None, options=["-p"])
+        self.assertStdoutEquals("test password")
+
+    @kptest.with_agent
+    def test_unlock_with_wrong_password_fails(self):
+        # Given
+        self.create("test")
+
+        # When
+        self.unlock(master="wrong password", rc=7)
+
+        # Then
+        # cat should ask for password, thus master param is not set to None
+        self.cat("test")
+
+    @kptest.with_agent
+    def test_unlock_with_wrong_password_keeps_agent_unlocked(self):
+        # Given
+        self.editor('env', env="Watch out for turtles.")
+        self.create("test")
+        self.unlock()
+
+        # When
+        self.unlock(master="wrong password", rc=7)
+
+        # Then
+        self.cat("test", master=None)
+        self.assertStdoutEquals("Watch out for turtles.")
+
+if __name__ == '__main__':
+        unittest.main()
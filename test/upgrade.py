@@ -0,0 +1,97 @@
+#
+# Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+import os
+import struct
+import unittest
+
+import kptest
+
+class TestUpgradeCommand(kptest.KPTestCase):
+
+    def config(self, memlimit, opslimit):
+        self.cat(".config")
+        salt = [l for l in self.stdout.splitlines() if l.startswith("salt:")][0]
+        self.editor('env', env="kdf: scrypt\nmemlimit: {}\nopslimit: {}\nparallelism: 1\n{}".format(memlimit, opslimit, salt))
+        self.edit(".config", password=None, options=["-m"])
+
+    def assertSummary(self, summary):
+        # Progress lines are only rewritten on a tty, keep the last one
+        self.assertTrue(self.stdout.splitlines()[-1].startswith(summary))
+
+    def memlimit(self, safe):
+        with open(os.path.join(self.kp_ws, safe), "rb") as f:
+            return struct.unpack(">Q", f.read(20)[12:20])[0]
+
+    def test_upgrade_rewraps_stale_safes(self):
+        # Given
+        self.editor('env', env="Don't be afraid to fail. Be afraid not to try.")
+        self.create("test")
+        self.create("sub/test")
+        self.config(33554432, 65536)
+
+        # When
+        self.upgrade(options=["-j", "2"])
+
+        # Then
+        self.assertSummary("3 safes upgraded, 0 failed")
+        self.assertEqual(self.memlimit("test"), 33554432)
+        self.assertEqual(self.memlimit("sub/test"), 33554432)
+        self.cat("test")
+        self.assertStdoutEquals("Don't be afraid to fail. Be afraid not to try.")
+        self.cat("sub/test", options=["-p"])
+        self.assertStdoutEquals("test password")
+
+    def test_upgrade_skips_current_safes(self):
+        # Given
+        self.editor('env', env="comment")
+        self.create("test")
+        self.config(33554432, 65536)
+        self.upgrade()
+
+        # When
+        self.upgrade()
+
+        # Then
+        self.assertSummary("0 safes upgraded, 0 failed")
+
+    def test_upgrade_leaves_other_workspaces(self):
+        # Given
+        self.editor('env', env="comment")
+        self.init("work/")
+        self.create("work/test")
+        self.config(33554432, 65536)
+
+        # When
+        self.upgrade()
+
+        # Then
+        self.assertSummary("1 safes upgraded, 0 failed")
+        self.assertEqual(self.memlimit("work/test"), 16777216)
+
+    def test_upgrade_with_wrong_master_fails(self):
+        # Given
+        self.editor('env', env="comment")
+        self.create("test")
+        self.config(33554432, 65536)
+
+        # When
+        self.upgrade(master="wrong master password", rc=7)
+
+        # Then
+        self.assertEqual(self.memlimit("test"), 16777216)
+
+if __name__ == '__main__':
+        unittest.main()
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <check.h>
+#include <ftw.h>
+
+#include "check_compat.h"
+
+#include "../lib/watch.c"
+
+#define SEEN_MAX 16
+
+struct seen {
+	enum kp_watch_event events[SEEN_MAX];
+	char names[SEEN_MAX][PATH_MAX];
+	size_t count;
+};
+
+static kp_error_t
+record(enum kp_watch_event event, const char *name, void *arg)
+{
+	struct seen *seen = arg;
+
+	ck_assert_int_lt(seen->count, SEEN_MAX);
+	seen->events[seen->count] = event;
+	strlcpy(seen->names[seen->count], name, PATH_MAX);
+	seen->count++;
+
+	return KP_SUCCESS;
+}
+
+static bool
+has_seen(struct seen *seen, enum kp_watch_event event, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < seen->count; i++) {
+		if (seen->events[i] == event
+		    && strcmp(seen->names[i], name) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void
+touch(const char *root, const char *name)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, PATH_MAX, "%s/%s", root, name);
+	ck_assert_int_ge(fd = open(path, O_WRONLY | O_CREAT, 0600), 0);
+	close(fd);
+}
+
+static void
+mkdir_in(const char *root, const char *name)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, PATH_MAX, "%s/%s", root, name);
+	ck_assert_int_eq(mkdir(path, 0700), 0);
+}
+
+static int
+rm(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+START_TEST(test_watch_should_add_existing_safes_only)
+{
+	/* Given */
+	struct kp_watch watch;
+	struct seen seen = { .count = 0 };
+	char root[] = "/tmp/kickpass-test-XXXXXX", path[PATH_MAX];
+
+	ck_assert_ptr_ne(mkdtemp(root), NULL);
+	touch(root, "a");
+	mkdir_in(root, "dir");
+	touch(root, "dir/b");
+	touch(root, ".hidden");
+	touch(root, "dir/.b.tmp");
+	mkdir_in(root, ".git");
+	touch(root, ".git/c");
+	snprintf(path, PATH_MAX, "%s/link", root);
+	ck_assert_int_eq(symlink("a", path), 0);
+
+	/* When */
+	kp_error_t ret = kp_watch_init(&watch, root, record, &seen);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_SUCCESS);
+	ck_assert_int_eq(seen.count, 2);
+	ck_assert(has_seen(&seen, KP_WATCH_ADD, "a"));
+	ck_assert(has_seen(&seen, KP_WATCH_ADD, "dir/b"));
+
+	kp_watch_fini(&watch);
+	nftw(root, rm, 16, FTW_DEPTH | FTW_PHYS);
+}
+END_TEST
+
+START_TEST(test_watch_should_follow_moved_directory)
+{
+	/* Given */
+	struct kp_watch watch;
+	struct seen seen = { .count = 0 };
+	char root[] = "/tmp/kickpass-test-XXXXXX", from[PATH_MAX], to[PATH_MAX];
+
+	ck_assert_ptr_ne(mkdtemp(root), NULL);
+	ck_assert_int_eq(kp_watch_init(&watch, root, record, &seen),
+	                 KP_SUCCESS);
+	mkdir_in(root, "dir");
+	touch(root, "dir/a");
+	ck_assert_int_eq(kp_watch_read(&watch), KP_SUCCESS);
+	ck_assert(has_seen(&seen, KP_WATCH_ADD, "dir/a"));
+	seen.count = 0;
+
+	/* When */
+	snprintf(from, PATH_MAX, "%s/dir", root);
+	snprintf(to, PATH_MAX, "%s/moved", root);
+	ck_assert_int_eq(rename(from, to), 0);
+	touch(root, "moved/b");
+	kp_error_t ret = kp_watch_read(&watch);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_SUCCESS);
+	ck_assert(has_seen(&seen, KP_WATCH_REMOVE, "dir"));
+	ck_assert(has_seen(&seen, KP_WATCH_ADD, "moved/a"));
+	ck_assert(has_seen(&seen, KP_WATCH_ADD, "moved/b"));
+	ck_assert(!has_seen(&seen, KP_WATCH_ADD, "dir/b"));
+
+	/* When */
+	seen.count = 0;
+	nftw(to, rm, 16, FTW_DEPTH | FTW_PHYS);
+	ret = kp_watch_read(&watch);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_SUCCESS);
+	ck_assert(has_seen(&seen, KP_WATCH_REMOVE, "moved"));
+
+	kp_watch_fini(&watch);
+	nftw(root, rm, 16, FTW_DEPTH | FTW_PHYS);
+}
+END_TEST
+
+START_TEST(test_watch_should_fail_once_root_is_gone)
+{
+	/* Given */
+	struct kp_watch watch;
+	struct seen seen = { .count = 0 };
+	char root[] = "/tmp/kickpass-test-XXXXXX";
+
+	ck_assert_ptr_ne(mkdtemp(root), NULL);
+	ck_assert_int_eq(kp_watch_init(&watch, root, record, &seen),
+	                 KP_SUCCESS);
+
+	/* When */
+	ck_assert_int_eq(rmdir(root), 0);
+	kp_error_t ret = kp_watch_read(&watch);
+
+	/* Then */
+	ck_assert_int_eq(ret, KP_ERRNO);
+	ck_assert_int_eq(errno, ENOENT);
+
+	kp_watch_fini(&watch);
+}
+END_TEST
+
+int
+main(int argc, char **argv)
+{
+	int number_failed;
+
+	Suite *suite = suite_create("watch_test_suite");
+	TCase *tcase = tcase_create("case");
+	tcase_add_test(tcase, test_watch_should_add_existing_safes_only);
+	tcase_add_test(tcase, test_watch_should_follow_moved_directory);
+	tcase_add_test(tcase, test_watch_should_fail_once_root_is_gone);
+	suite_add_tcase(suite, tcase);
+
+	SRunner *runner = srunner_create(suite);
+	srunner_set_fork_status(runner, CK_NOFORK);
+	srunner_run_all(runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return number_failed;
+}
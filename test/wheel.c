@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2015 Paul Fariello <paul@fariello.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+
+#include "check_compat.h"
+
+#include "../lib/wheel.c"
+
+struct fired {
+	uint64_t at[16];
+	size_t count;
+};
+
+static void
+fire(struct kp_timer *timer, void *arg)
+{
+	struct fired *fired = arg;
+	struct kp_wheel *wheel = timer->data;
+
+	fired->at[fired->count++] = wheel->now;
+}
+
+START_TEST(test_wheel_should_fire_on_time_at_every_level)
+{
+	/* Given */
+	struct kp_wheel wheel;
+	struct kp_timer timers[5];
+	struct fired fired = { .count = 0 };
+	/* Last one is beyond highest level turn */
+	uint64_t expire[5] = { 1000 + 5, 1000 + 100, 1000 + 5000,
+	                       1000 + 300000, 1000 + (1 << 25) };
+	int i;
+
+	kp_wheel_init(&wheel, 1000);
+	for (i = 0; i < 5; i++) {
+		timers[i].armed = false;
+		timers[i].data = &wheel;
+		kp_wheel_arm(&wheel, &timers[i], expire[i]);
+	}
+
+	/* When */
+	kp_wheel_advance(&wheel, 1000 + (1 << 26), fire, &fired);
+
+	/* Then */
+	ck_assert_int_eq(fired.count, 5);
+	for (i = 0; i < 5; i++) {
+		ck_assert_int_eq(fired.at[i], expire[i]);
+	}
+	ck_assert_int_eq(wheel.count, 0);
+}
+END_TEST
+
+START_TEST(test_wheel_cancel_should_not_fire)
+{
+	/* Given */
+	struct kp_wheel wheel;
+	struct kp_timer timer = { .armed = false };
+	struct fired fired = { .count = 0 };
+
+	kp_wheel_init(&wheel, 0);
+	timer.data = &wheel;
+	kp_wheel_arm(&wheel, &timer, 10);
+
+	/* When */
+	kp_wheel_cancel(&wheel, &timer);
+	kp_wheel_advance(&wheel, 20, fire, &fired);
+
+	/* Then */
+	ck_assert_int_eq(fired.count, 0);
+	ck_assert_int_eq(timer.armed, false);
+	ck_assert_int_eq(wheel.count, 0);
+}
+END_TEST
+
+START_TEST(test_wheel_rearm_should_postpone)
+{
+	/* Given */
+	struct kp_wheel wheel;
+	struct kp_timer timer = { .armed = false };
+	struct fired fired = { .count = 0 };
+
+	kp_wheel_init(&wheel, 0);
+	timer.data = &wheel;
+	kp_wheel_arm(&wheel, &timer, 10);
+	kp_wheel_advance(&wheel, 8, fire, &fired);
+
+	/* When */
+	kp_wheel_arm(&wheel, &timer, 18);
+	kp_wheel_advance(&wheel, 30, fire, &fired);
+
+	/* Then */
+	ck_assert_int_eq(fired.count, 1);
+	ck_assert_int_eq(fired.at[0], 18);
+}
+END_TEST
+
+START_TEST(test_wheel_past_expiry_should_fire_next_tick)
+{
+	/* Given */
+	struct kp_wheel wheel;
+	struct kp_timer timer = { .armed = false };
+	struct fired fired = { .count = 0 };
+
+	kp_wheel_init(&wheel, 100);
+	timer.data = &wheel;
+
+	/* When */
+	kp_wheel_arm(&wheel, &timer, 50);
+	kp_wheel_advance(&wheel, 101, fire, &fired);
+
+	/* Then */
+	ck_assert_int_eq(fired.count, 1);
+	ck_assert_int_eq(fired.at[0], 101);
+}
+END_TEST
+
+int
+main(int argc, char **argv)
+{
+	int number_failed;
+
+	Suite *suite = suite_create("wheel_test_suite");
+	TCase *tcase = tcase_create("case");
+	tcase_add_test(tcase, test_wheel_should_fire_on_time_at_every_level);
+	tcase_add_test(tcase, test_wheel_cancel_should_not_fire);
+	tcase_add_test(tcase, test_wheel_rearm_should_postpone);
+	tcase_add_test(tcase, test_wheel_past_expiry_should_fire_next_tick);
+	suite_add_tcase(suite, tcase);
+
+	SRunner *runner = srunner_create(suite);
+	srunner_set_fork_status(runner, CK_NOFORK);
+	srunner_run_all(runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return number_failed;
+}